@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# Licensed to the Apache Software Foundation (ASF) under one
+# or more contributor license agreements.  See the NOTICE file
+# distributed with this work for additional information
+# regarding copyright ownership.  The ASF licenses this file
+# to you under the Apache License, Version 2.0 (the
+# "License"); you may not use this file except in compliance
+# with the License.  You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Run every bench scenario against a local stand-in server and print one
+# JSON line per scenario. Usage: run-bench.sh <webhdfs-bench> [threads]
+# FAKE_ARGS is passed to tools/fake-webhdfs (e.g. "-l 2 -L 5 -b 100000000").
+
+BENCH=${1:-./webhdfs-bench}
+THREADS=${2:-4}
+FAKE=${FAKE:-$(dirname "$BENCH")/../tools/fake-webhdfs}
+PORT=50070
+
+"$FAKE" -n $PORT $FAKE_ARGS >/dev/null 2>&1 &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null' EXIT INT TERM
+sleep 1
+
+"$BENCH" -P $PORT -t $THREADS -n 2000 -f 1000 stat
+"$BENCH" -P $PORT -t $THREADS -n 5 -f 100000 list
+"$BENCH" -P $PORT -t 1 -n 256 -b 1048576 -s 268435456 seqread
+"$BENCH" -P $PORT -t $THREADS -n 2000 -b 4096 -s 268435456 -x pread
+"$BENCH" -P $PORT -t $THREADS -n 1000 -b 1024 create
+"$BENCH" -P $PORT -t 1 -n 64 -b 8388608 -x append
@@ -0,0 +1,521 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <webhdfs/webhdfs.h>
+
+/* ============================================================================
+ *  bench options/results
+ */
+struct bench_opts {
+    const char *scenario;
+    const char *host;
+    const char *user;
+    const char *root;
+    int         port;
+    int         threads;
+    size_t      ops;            /* operations per thread */
+    size_t      io_size;        /* bytes per read/write op */
+    size_t      file_size;      /* fixture size for read scenarios */
+    size_t      files;          /* fixture entries for stat/list */
+    size_t      readahead;      /* readahead window cap for seqread */
+    unsigned    hedge_ms;       /* hedged read threshold floor, 0 = off */
+    unsigned    max_inflight;   /* admission control per endpoint, 0 = off */
+    unsigned    seed;
+    int         setup;
+};
+
+struct bench_thread {
+    const struct bench_opts *opts;
+    webhdfs_t *fs;
+    pthread_t  thread;
+    int        id;
+    webhdfs_file_t *file;       /* streaming handle for seqread */
+    void      *payload;         /* io_size bytes of scratch data */
+    uint64_t  *latencies;       /* usec, one per op */
+    size_t     nlatencies;
+    uint64_t   bytes;
+    uint64_t   items;
+    size_t     errors;
+    unsigned   seed;
+};
+
+typedef int (*bench_op_t) (struct bench_thread *bt, size_t i);
+
+struct bench_scenario {
+    const char *name;
+    int        (*setup) (webhdfs_t *fs, const struct bench_opts *opts);
+    bench_op_t   op;
+};
+
+static uint64_t __now_usec (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t)ts.tv_sec * 1000000U + ts.tv_nsec / 1000U);
+}
+
+/* ============================================================================
+ *  data generator
+ */
+struct bench_upload {
+    size_t remaining;
+    size_t offset;
+};
+
+static size_t __bench_upload (void *ptr, size_t size, void *data) {
+    struct bench_upload *up = (struct bench_upload *)data;
+    unsigned char *p = (unsigned char *)ptr;
+    size_t i;
+
+    if (size > up->remaining)
+        size = up->remaining;
+
+    /* Deterministic content, so reads can be checked if needed */
+    for (i = 0; i < size; ++i)
+        p[i] = (unsigned char)((up->offset + i) * 31);
+
+    up->offset += size;
+    up->remaining -= size;
+    return(size);
+}
+
+static int __bench_create (webhdfs_t *fs, const char *path, size_t size) {
+    struct bench_upload up;
+
+    up.remaining = size;
+    up.offset = 0;
+    return(webhdfs_file_create(fs, path, 1, __bench_upload, &up));
+}
+
+/* ============================================================================
+ *  scenarios
+ */
+static int __setup_files (webhdfs_t *fs, const struct bench_opts *opts) {
+    char path[512];
+    size_t i;
+
+    snprintf(path, sizeof(path), "%s/files", opts->root);
+    webhdfs_mkdir(fs, path, 0755);
+    for (i = 0; i < opts->files; ++i) {
+        snprintf(path, sizeof(path), "%s/files/f%08zu", opts->root, i);
+        if (__bench_create(fs, path, 0))
+            return(1);
+    }
+    return(0);
+}
+
+static int __setup_data (webhdfs_t *fs, const struct bench_opts *opts) {
+    char path[512];
+
+    webhdfs_mkdir(fs, opts->root, 0755);
+    snprintf(path, sizeof(path), "%s/data", opts->root);
+    return(__bench_create(fs, path, opts->file_size));
+}
+
+static int __setup_dirs (webhdfs_t *fs, const struct bench_opts *opts) {
+    char path[512];
+    int i;
+
+    snprintf(path, sizeof(path), "%s/create", opts->root);
+    webhdfs_mkdir(fs, path, 0755);
+    for (i = 0; i < opts->threads; ++i) {
+        snprintf(path, sizeof(path), "%s/create/t%d", opts->root, i);
+        webhdfs_mkdir(fs, path, 0755);
+    }
+    return(0);
+}
+
+static int __op_stat (struct bench_thread *bt, size_t i) {
+    webhdfs_fstat_t *stat;
+    char *error = NULL;
+    char path[512];
+
+    snprintf(path, sizeof(path), "%s/files/f%08zu", bt->opts->root,
+             (i * bt->opts->threads + bt->id) % (bt->opts->files ? bt->opts->files : 1));
+    if ((stat = webhdfs_stat(bt->fs, path, &error)) == NULL) {
+        free(error);
+        return(1);
+    }
+
+    bt->items++;
+    webhdfs_fstat_free(stat);
+    return(0);
+}
+
+static int __op_list (struct bench_thread *bt, size_t i) {
+    const webhdfs_fstat_t *stat;
+    webhdfs_dir_t *dir;
+    char path[512];
+
+    (void)i;
+    snprintf(path, sizeof(path), "%s/files", bt->opts->root);
+    if ((dir = webhdfs_dir_open(bt->fs, path)) == NULL)
+        return(1);
+
+    while ((stat = webhdfs_dir_read(dir)) != NULL)
+        bt->items++;
+
+    webhdfs_dir_close(dir);
+    return(0);
+}
+
+static int __op_seqread (struct bench_thread *bt, size_t i) {
+    const struct bench_opts *opts = bt->opts;
+    char path[512];
+    size_t rd;
+
+    (void)i;
+
+    /* Each thread streams through the file from its own starting point */
+    if (bt->file == NULL) {
+        snprintf(path, sizeof(path), "%s/data", opts->root);
+        if ((bt->file = webhdfs_file_open(bt->fs, path)) == NULL)
+            return(1);
+        webhdfs_file_seek(bt->file, (opts->file_size / opts->threads) * bt->id);
+    }
+
+    if ((rd = webhdfs_file_read(bt->file, bt->payload, opts->io_size)) == 0) {
+        /* EOF, wrap around */
+        webhdfs_file_seek(bt->file, 0);
+        rd = webhdfs_file_read(bt->file, bt->payload, opts->io_size);
+    }
+
+    bt->bytes += rd;
+    return(rd == 0);
+}
+
+static int __op_pread (struct bench_thread *bt, size_t i) {
+    const struct bench_opts *opts = bt->opts;
+    webhdfs_file_t *file;
+    char path[512];
+    size_t offset;
+    size_t rd;
+    void *buf;
+
+    (void)i;
+    if ((buf = malloc(opts->io_size)) == NULL)
+        return(1);
+
+    offset = 0;
+    if (opts->file_size > opts->io_size)
+        offset = (((uint64_t)rand_r(&(bt->seed)) << 31) | rand_r(&(bt->seed)))
+               % (opts->file_size - opts->io_size);
+
+    snprintf(path, sizeof(path), "%s/data", opts->root);
+    if ((file = webhdfs_file_open(bt->fs, path)) == NULL) {
+        free(buf);
+        return(1);
+    }
+
+    rd = webhdfs_file_pread(file, buf, opts->io_size, offset);
+    webhdfs_file_close(file);
+    free(buf);
+
+    bt->bytes += rd;
+    return(rd == 0);
+}
+
+static int __op_create (struct bench_thread *bt, size_t i) {
+    char path[512];
+
+    snprintf(path, sizeof(path), "%s/create/t%d/f%08zu", bt->opts->root, bt->id, i);
+    if (__bench_create(bt->fs, path, bt->opts->io_size))
+        return(1);
+
+    bt->bytes += bt->opts->io_size;
+    return(0);
+}
+
+static int __op_append (struct bench_thread *bt, size_t i) {
+    webhdfs_file_t *file;
+    char path[512];
+    int wr;
+
+    snprintf(path, sizeof(path), "%s/create/t%d/append", bt->opts->root, bt->id);
+    if (i == 0 && __bench_create(bt->fs, path, 0))
+        return(1);
+
+    if ((file = webhdfs_file_open(bt->fs, path)) == NULL)
+        return(1);
+
+    wr = webhdfs_file_append_buffer(file, bt->payload, bt->opts->io_size);
+    webhdfs_file_close(file);
+
+    if (wr <= 0)
+        return(1);
+
+    bt->bytes += wr;
+    return(0);
+}
+
+static const struct bench_scenario __scenarios[] = {
+    { "stat",    __setup_files, __op_stat    },
+    { "list",    __setup_files, __op_list    },
+    { "seqread", __setup_data,  __op_seqread },
+    { "pread",   __setup_data,  __op_pread   },
+    { "create",  __setup_dirs,  __op_create  },
+    { "append",  __setup_dirs,  __op_append  },
+    { NULL, NULL, NULL },
+};
+
+/* ============================================================================
+ *  runner
+ */
+static const struct bench_scenario *__bench_scenario;
+
+static void *__bench_thread (void *data) {
+    struct bench_thread *bt = (struct bench_thread *)data;
+    uint64_t start;
+    size_t i;
+
+    for (i = 0; i < bt->opts->ops; ++i) {
+        start = __now_usec();
+        if (__bench_scenario->op(bt, i))
+            bt->errors++;
+        bt->latencies[bt->nlatencies++] = __now_usec() - start;
+    }
+
+    return(NULL);
+}
+
+static int __u64_cmp (const void *a, const void *b) {
+    uint64_t va = *(const uint64_t *)a;
+    uint64_t vb = *(const uint64_t *)b;
+    return((va > vb) - (va < vb));
+}
+
+static uint64_t __percentile (const uint64_t *sorted, size_t n, double p) {
+    size_t i;
+
+    if (n == 0)
+        return(0);
+
+    i = (size_t)(p * (n - 1) + 0.5);
+    return(sorted[i < n ? i : n - 1]);
+}
+
+static void __bench_report (const struct bench_opts *opts,
+                            struct bench_thread *threads,
+                            uint64_t elapsed)
+{
+    uint64_t bytes = 0, items = 0;
+    size_t errors = 0, n = 0;
+    uint64_t *lat;
+    double secs;
+    int i;
+
+    for (i = 0; i < opts->threads; ++i)
+        n += threads[i].nlatencies;
+
+    if ((lat = (uint64_t *) malloc((n + 1) * sizeof(uint64_t))) == NULL)
+        return;
+
+    n = 0;
+    for (i = 0; i < opts->threads; ++i) {
+        memcpy(lat + n, threads[i].latencies, threads[i].nlatencies * sizeof(uint64_t));
+        n += threads[i].nlatencies;
+        bytes += threads[i].bytes;
+        items += threads[i].items;
+        errors += threads[i].errors;
+    }
+
+    qsort(lat, n, sizeof(uint64_t), __u64_cmp);
+    secs = elapsed / 1000000.0;
+
+    printf("{\"scenario\":\"%s\",\"threads\":%d,\"ops\":%zu,\"errors\":%zu,"
+           "\"io_size\":%zu,\"file_size\":%zu,\"files\":%zu,"
+           "\"seconds\":%.6f,\"ops_per_sec\":%.2f,\"mb_per_sec\":%.3f,"
+           "\"items\":%llu,\"lat_us\":{\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}\n",
+           opts->scenario, opts->threads, n, errors,
+           opts->io_size, opts->file_size, opts->files,
+           secs, secs > 0 ? n / secs : 0.0,
+           secs > 0 ? bytes / secs / (1024.0 * 1024.0) : 0.0,
+           (unsigned long long)items,
+           (unsigned long long)__percentile(lat, n, 0.50),
+           (unsigned long long)__percentile(lat, n, 0.99),
+           (unsigned long long)__percentile(lat, n, 0.999),
+           (unsigned long long)(n > 0 ? lat[n - 1] : 0));
+    fflush(stdout);
+
+    free(lat);
+}
+
+static void __bench_threads_free (struct bench_thread *threads, int n) {
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        if (threads[i].file != NULL)
+            webhdfs_file_close(threads[i].file);
+        free(threads[i].latencies);
+        free(threads[i].payload);
+    }
+    free(threads);
+}
+
+static int __bench_run (webhdfs_t *fs, const struct bench_opts *opts) {
+    struct bench_thread *threads;
+    uint64_t start;
+    int started;
+    int i;
+
+    if ((threads = (struct bench_thread *) calloc(opts->threads, sizeof(struct bench_thread))) == NULL)
+        return(1);
+
+    for (i = 0; i < opts->threads; ++i) {
+        threads[i].opts = opts;
+        threads[i].fs = fs;
+        threads[i].id = i;
+        threads[i].seed = opts->seed + i;
+        threads[i].latencies = (uint64_t *) calloc(opts->ops + 1, sizeof(uint64_t));
+        threads[i].payload = calloc(1, opts->io_size);
+        if (threads[i].latencies == NULL || threads[i].payload == NULL) {
+            __bench_threads_free(threads, i + 1);
+            return(1);
+        }
+    }
+
+    start = __now_usec();
+    for (started = 0; started < opts->threads; ++started) {
+        if (pthread_create(&(threads[started].thread), NULL, __bench_thread, &(threads[started])))
+            break;
+    }
+    for (i = 0; i < started; ++i)
+        pthread_join(threads[i].thread, NULL);
+
+    /* A partial run is not comparable with anything: no report */
+    if (started == opts->threads)
+        __bench_report(opts, threads, __now_usec() - start);
+
+    __bench_threads_free(threads, opts->threads);
+    return(started != opts->threads);
+}
+
+static void __usage (const char *program) {
+    const struct bench_scenario *s;
+
+    fprintf(stderr, "usage: %s [options] <scenario>\n", program);
+    fprintf(stderr, "  -H host       server host (default: localhost)\n");
+    fprintf(stderr, "  -P port       server port (default: 50070)\n");
+    fprintf(stderr, "  -u user       hdfs user (default: bench)\n");
+    fprintf(stderr, "  -r root       bench directory (default: /bench)\n");
+    fprintf(stderr, "  -t threads    concurrency (default: 1)\n");
+    fprintf(stderr, "  -n ops        operations per thread (default: 1000)\n");
+    fprintf(stderr, "  -b bytes      bytes per read/write op (default: 65536)\n");
+    fprintf(stderr, "  -s bytes      data file size for read scenarios (default: 64M)\n");
+    fprintf(stderr, "  -f files      entries for stat/list scenarios (default: 1000)\n");
+    fprintf(stderr, "  -S seed       random seed (default: 1)\n");
+    fprintf(stderr, "  -R bytes      readahead window cap (default: 0, off)\n");
+    fprintf(stderr, "  -E msec       hedge reads slower than max(p95, msec) (default: off)\n");
+    fprintf(stderr, "  -A requests   admission control: in flight per endpoint (default: off)\n");
+    fprintf(stderr, "  -x            skip fixture setup\n");
+    fprintf(stderr, "scenarios:");
+    for (s = __scenarios; s->name != NULL; ++s)
+        fprintf(stderr, " %s", s->name);
+    fprintf(stderr, "\n");
+}
+
+int main (int argc, char **argv) {
+    struct bench_opts opts;
+    webhdfs_conf_t *conf;
+    webhdfs_t *fs;
+    int c;
+
+    memset(&opts, 0, sizeof(struct bench_opts));
+    opts.host = "localhost";
+    opts.port = 50070;
+    opts.user = "bench";
+    opts.root = "/bench";
+    opts.threads = 1;
+    opts.ops = 1000;
+    opts.io_size = 64 << 10;
+    opts.file_size = 64 << 20;
+    opts.files = 1000;
+    opts.seed = 1;
+    opts.setup = 1;
+
+    while ((c = getopt(argc, argv, "H:P:u:r:t:n:b:s:f:S:R:E:A:xh")) != -1) {
+        switch (c) {
+            case 'H': opts.host = optarg; break;
+            case 'P': opts.port = atoi(optarg); break;
+            case 'u': opts.user = optarg; break;
+            case 'r': opts.root = optarg; break;
+            case 't': opts.threads = atoi(optarg); break;
+            case 'n': opts.ops = strtoul(optarg, NULL, 10); break;
+            case 'b': opts.io_size = strtoul(optarg, NULL, 10); break;
+            case 's': opts.file_size = strtoul(optarg, NULL, 10); break;
+            case 'f': opts.files = strtoul(optarg, NULL, 10); break;
+            case 'S': opts.seed = strtoul(optarg, NULL, 10); break;
+            case 'R': opts.readahead = strtoul(optarg, NULL, 10); break;
+            case 'E': opts.hedge_ms = strtoul(optarg, NULL, 10); break;
+            case 'A': opts.max_inflight = strtoul(optarg, NULL, 10); break;
+            case 'x': opts.setup = 0; break;
+            default:
+                __usage(argv[0]);
+                return(EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc || opts.threads < 1 || opts.io_size == 0) {
+        __usage(argv[0]);
+        return(EXIT_FAILURE);
+    }
+
+    opts.scenario = argv[optind];
+    for (__bench_scenario = __scenarios; __bench_scenario->name != NULL; ++__bench_scenario) {
+        if (!strcmp(__bench_scenario->name, opts.scenario))
+            break;
+    }
+
+    if (__bench_scenario->name == NULL) {
+        __usage(argv[0]);
+        return(EXIT_FAILURE);
+    }
+
+    if ((conf = webhdfs_conf_alloc()) == NULL)
+        return(EXIT_FAILURE);
+
+    webhdfs_conf_set_server(conf, opts.host, opts.port, 0);
+    webhdfs_conf_set_user(conf, opts.user);
+    webhdfs_conf_set_readahead(conf, opts.readahead);
+    webhdfs_conf_set_hedged_reads(conf, opts.hedge_ms);
+    webhdfs_conf_set_admission(conf, opts.max_inflight, 0);
+
+    if ((fs = webhdfs_connect(conf)) == NULL) {
+        webhdfs_conf_free(conf);
+        return(EXIT_FAILURE);
+    }
+
+    if (opts.setup) {
+        webhdfs_mkdir(fs, opts.root, 0755);
+        if (__bench_scenario->setup(fs, &opts))
+            fprintf(stderr, "%s: fixture setup failed\n", opts.scenario);
+    }
+
+    c = __bench_run(fs, &opts);
+
+    webhdfs_disconnect(fs);
+    webhdfs_conf_free(conf);
+    return(c ? EXIT_FAILURE : EXIT_SUCCESS);
+}
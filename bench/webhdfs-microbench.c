@@ -0,0 +1,333 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * CPU microbenchmarks for the client hot paths: the yajl tree decode
+ * behind webhdfs_dir_read()/webhdfs_stat(), URL building, the buffer
+ * append/format routines and the streaming checksum. No server is needed; payloads are synthetic.
+ * Each case prints one JSON line.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "webhdfs_p.h"
+#include "buffer.h"
+
+/* ============================================================================
+ *  allocation counting
+ */
+static uint64_t __mallocs = 0;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+/* Interpose the allocator so yajl's allocations are counted too */
+void *malloc (size_t size) {
+    __mallocs++;
+    return(__libc_malloc(size));
+}
+
+void *calloc (size_t nmemb, size_t size) {
+    __mallocs++;
+    return(__libc_calloc(nmemb, size));
+}
+
+void *realloc (void *ptr, size_t size) {
+    __mallocs++;
+    return(__libc_realloc(ptr, size));
+}
+#endif
+
+static uint64_t __now_nsec (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec);
+}
+
+static void __report (const char *name, size_t items, size_t n,
+                      uint64_t nsec, uint64_t mallocs, uint64_t bytes)
+{
+    printf("{\"bench\":\"%s\",\"items\":%zu,\"iterations\":%zu,"
+           "\"ns_per_item\":%.2f,\"allocs_per_item\":%.3f,\"mb_per_sec\":%.2f}\n",
+           name, items, n,
+           (double)nsec / ((double)items * n),
+           (double)mallocs / ((double)items * n),
+           nsec > 0 ? (bytes / (1024.0 * 1024.0)) / (nsec / 1e9) : 0.0);
+    fflush(stdout);
+}
+
+/* ============================================================================
+ *  synthetic payloads
+ */
+static void __append_file_status (buffer_t *buf, size_t i) {
+    buffer_append_format(buf,
+        "{\"accessTime\":%ld,\"blockSize\":134217728,\"childrenNum\":0,"
+        "\"fileId\":%ld,\"group\":\"supergroup\",\"length\":%ld,"
+        "\"modificationTime\":%ld,\"owner\":\"hdfs\",\"pathSuffix\":\"part-%d.parquet\","
+        "\"permission\":\"644\",\"replication\":3,\"storagePolicy\":0,\"type\":\"FILE\"}",
+        (size_t)1322596581499U + i, (size_t)16386 + i, (size_t)(i * 4099) % 134217728,
+        (size_t)1322596581499U + i, (int)i);
+}
+
+static void __liststatus_payload (buffer_t *buf, size_t entries) {
+    size_t i;
+
+    buffer_clear(buf);
+    buffer_append_format(buf, "{\"FileStatuses\":{\"FileStatus\":[");
+    for (i = 0; i < entries; ++i) {
+        if (i > 0)
+            buffer_append(buf, ",", 1);
+        __append_file_status(buf, i);
+    }
+    buffer_append_format(buf, "]}}");
+}
+
+static void __filestatus_payload (buffer_t *buf) {
+    buffer_clear(buf);
+    buffer_append_format(buf, "{\"FileStatus\":");
+    __append_file_status(buf, 7);
+    buffer_append_format(buf, "}");
+}
+
+/* ============================================================================
+ *  benchmarks
+ */
+static void bench_liststatus (size_t entries) {
+    const webhdfs_fstat_t *stat;
+    uint64_t t0, t1, t2, m0, m1, m2;
+    webhdfs_dir_t *dir;
+    char err[256];
+    yajl_val root;
+    buffer_t buf;
+    size_t n = 0;
+
+    buffer_open(&buf);
+    __liststatus_payload(&buf, entries);
+
+    m0 = __mallocs;
+    t0 = __now_nsec();
+    if ((root = yajl_tree_parse((const char *)buf.blob, err, sizeof(err))) == NULL) {
+        fprintf(stderr, "liststatus: %s\n", err);
+        buffer_close(&buf);
+        return;
+    }
+
+    t1 = __now_nsec();
+    m1 = __mallocs;
+    if ((dir = webhdfs_dir_from_response(root)) != NULL) {
+        while ((stat = webhdfs_dir_read(dir)) != NULL)
+            n += stat->length & 1;
+    }
+    t2 = __now_nsec();
+    m2 = __mallocs;
+
+    __report("liststatus_parse", entries, 1, t1 - t0, m1 - m0, buf.size);
+    __report("liststatus_decode", entries, 1, t2 - t1, m2 - m1, 0);
+
+    t0 = __now_nsec();
+    if (dir != NULL)
+        webhdfs_dir_close(dir);
+    __report("liststatus_free", entries, 1, __now_nsec() - t0, 0, 0);
+
+    buffer_close(&buf);
+}
+
+static void bench_filestatus (size_t iterations) {
+    webhdfs_fstat_t stat;
+    uint64_t t0, m0;
+    yajl_val root;
+    buffer_t buf;
+    size_t i;
+
+    buffer_open(&buf);
+    __filestatus_payload(&buf);
+
+    m0 = __mallocs;
+    t0 = __now_nsec();
+    for (i = 0; i < iterations; ++i) {
+        root = yajl_tree_parse((const char *)buf.blob, NULL, 0);
+        memset(&stat, 0, sizeof(webhdfs_fstat_t));
+        webhdfs_fstat_decode(&stat, webhdfs_response_file_status(root), 1);
+        yajl_tree_free(root);
+        free(stat.path);
+        free(stat.owner);
+        free(stat.group);
+        free(stat.type);
+    }
+    __report("filestatus_parse_decode", 1, iterations,
+             __now_nsec() - t0, __mallocs - m0, buf.size * iterations);
+
+    buffer_close(&buf);
+}
+
+static void bench_url_build (size_t iterations) {
+    webhdfs_conf_t *conf;
+    webhdfs_req_t req;
+    uint64_t t0, m0;
+    uint64_t bytes = 0;
+    webhdfs_t *fs;
+    size_t i;
+
+    conf = webhdfs_conf_alloc();
+    webhdfs_conf_set_server(conf, "namenode.example.com", 50070, 0);
+    webhdfs_conf_set_user(conf, "hdfs");
+    fs = webhdfs_connect(conf);
+
+    m0 = __mallocs;
+    t0 = __now_nsec();
+    for (i = 0; i < iterations; ++i) {
+        webhdfs_req_open(&req, fs, "/user/hdfs/warehouse/table/part-00000.parquet");
+        webhdfs_req_set_args(&req, "op=OPEN&offset=%ld&length=%ld", i * 4096, (size_t)4096);
+        bytes += req.buffer.size;
+        webhdfs_req_close(&req);
+    }
+    __report("url_build", 1, iterations, __now_nsec() - t0, __mallocs - m0, bytes);
+
+    webhdfs_disconnect(fs);
+    webhdfs_conf_free(conf);
+}
+
+static void bench_buffer_append (size_t chunk, size_t total) {
+    uint64_t t0, m0;
+    buffer_t buf;
+    size_t done;
+    char *data;
+
+    if ((data = (char *) malloc(chunk)) == NULL)
+        return;
+    memset(data, 'x', chunk);
+
+    buffer_open(&buf);
+    m0 = __mallocs;
+    t0 = __now_nsec();
+    for (done = 0; done < total; done += chunk)
+        buffer_append(&buf, data, chunk);
+
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "buffer_append_%zu", chunk);
+        __report(name, total / chunk, 1, __now_nsec() - t0, __mallocs - m0, total);
+    }
+
+    buffer_close(&buf);
+    free(data);
+}
+
+static void bench_buffer_vformat (size_t iterations) {
+    uint64_t t0, m0;
+    buffer_t buf;
+    size_t i;
+
+    buffer_open(&buf);
+    buffer_reserve(&buf, 4096);
+
+    m0 = __mallocs;
+    t0 = __now_nsec();
+    for (i = 0; i < iterations; ++i) {
+        buffer_clear(&buf);
+        buffer_append_format(&buf, "%s://%s:%d/webhdfs/v1/%s?user.name=%s&op=%s&offset=%ld&length=%ld",
+                             "http", "namenode.example.com", 50070,
+                             "user/hdfs/warehouse/table/part-00000.parquet",
+                             "hdfs", "OPEN", i * 4096, (size_t)4096);
+    }
+    __report("buffer_append_format", 1, iterations,
+             __now_nsec() - t0, __mallocs - m0, buf.size * iterations);
+
+    buffer_close(&buf);
+}
+
+/* What checksumming costs per byte moved, fed in transfer-sized pieces */
+static void bench_crc (size_t chunk, size_t total) {
+    webhdfs_crc_t *crc;
+    uint64_t t0, m0;
+    size_t done;
+    char *data;
+
+    if ((data = (char *) malloc(chunk)) == NULL)
+        return;
+    for (done = 0; done < chunk; ++done)
+        data[done] = (char)(done * 31);
+
+    if ((crc = webhdfs_crc_alloc()) == NULL) {
+        free(data);
+        return;
+    }
+
+    m0 = __mallocs;
+    t0 = __now_nsec();
+    for (done = 0; done < total; done += chunk)
+        webhdfs_crc_update(crc, data, chunk);
+
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "crc32c_%s_%zu", webhdfs_crc32c_impl(), chunk);
+        __report(name, total / chunk, 1, __now_nsec() - t0, __mallocs - m0, total);
+    }
+
+    webhdfs_crc_free(crc);
+    free(data);
+}
+
+static void __usage (const char *program) {
+    fprintf(stderr, "usage: %s [options]\n", program);
+    fprintf(stderr, "  -e list       LISTSTATUS entries, comma separated\n");
+    fprintf(stderr, "                (default: 1000,10000,100000,1000000)\n");
+    fprintf(stderr, "  -n count      iterations for per-call benchmarks (default: 200000)\n");
+}
+
+int main (int argc, char **argv) {
+    const char *entries = "1000,10000,100000,1000000";
+    size_t iterations = 200000;
+    char *list, *p, *save;
+    int c;
+
+    while ((c = getopt(argc, argv, "e:n:h")) != -1) {
+        switch (c) {
+            case 'e': entries = optarg; break;
+            case 'n': iterations = strtoul(optarg, NULL, 10); break;
+            default:
+                __usage(argv[0]);
+                return(EXIT_FAILURE);
+        }
+    }
+
+    list = strdup(entries);
+    for (p = strtok_r(list, ",", &save); p != NULL; p = strtok_r(NULL, ",", &save))
+        bench_liststatus(strtoul(p, NULL, 10));
+    free(list);
+
+    bench_filestatus(iterations);
+    bench_url_build(iterations);
+    bench_buffer_vformat(iterations);
+
+    bench_buffer_append(1, 16 << 20);
+    bench_buffer_append(64, 64 << 20);
+    bench_buffer_append(16 << 10, 256 << 20);
+
+    bench_crc(16 << 10, 1U << 30);
+    bench_crc(1000, 256 << 20);
+
+    return(EXIT_SUCCESS);
+}
@@ -0,0 +1,368 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Concurrency stress for a single shared webhdfs_t, the way the
+ * multi-threaded FUSE loop uses it. Run against a server (tools/fake-webhdfs
+ * is fine); exits non-zero on the first inconsistency found.
+ *
+ *  - shared-read: all threads webhdfs_file_read() one shared handle; every
+ *    chunk must be read exactly once and carry its own offset.
+ *  - pread: random aligned webhdfs_file_pread() on the same shared handle.
+ *  - metadata: per-thread mkdir/create/append/stat/list/rename/unlink.
+ *
+ * The data file is a sequence of little-endian 64-bit words, each holding
+ * its own byte offset, so any chunk can be checked in isolation.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <webhdfs/webhdfs.h>
+
+struct stress_opts {
+    const char *host;
+    const char *user;
+    const char *root;
+    int         port;
+    int         threads;
+    size_t      iterations;
+    size_t      file_size;
+    size_t      chunk;
+};
+
+struct stress_thread {
+    const struct stress_opts *opts;
+    webhdfs_t *     fs;
+    webhdfs_file_t *file;
+    pthread_t       thread;
+    int             id;
+    unsigned        seed;
+    size_t          errors;
+};
+
+static const struct stress_opts *__opts;
+static volatile uint64_t __shared_bytes = 0;
+static unsigned char *__chunks_seen = NULL;
+
+#define __stress_fail(st, format, ...)                                  \
+    do {                                                                \
+        fprintf(stderr, "thread %d: " format "\n", (st)->id, ##__VA_ARGS__); \
+        (st)->errors++;                                                 \
+    } while (0)
+
+/* ============================================================================
+ *  data file
+ */
+struct stress_upload {
+    size_t offset;
+    size_t remaining;
+};
+
+static size_t __stress_upload (void *ptr, size_t size, void *data) {
+    struct stress_upload *up = (struct stress_upload *)data;
+    unsigned char *p = (unsigned char *)ptr;
+    size_t i;
+
+    if (size > up->remaining)
+        size = up->remaining;
+
+    for (i = 0; i < size; ++i) {
+        uint64_t pos = up->offset + i;
+        p[i] = (unsigned char)((pos & ~(uint64_t)7) >> (8 * (pos & 7)));
+    }
+
+    up->offset += size;
+    up->remaining -= size;
+    return(size);
+}
+
+static uint64_t __stress_word (const unsigned char *p) {
+    uint64_t v = 0;
+    int i;
+
+    for (i = 7; i >= 0; --i)
+        v = (v << 8) | p[i];
+    return(v);
+}
+
+/* Returns the offset the chunk claims to start at, or -1 if inconsistent */
+static int64_t __stress_check (const unsigned char *buf, size_t size) {
+    uint64_t first;
+    size_t i;
+
+    if (size < 8 || (size & 7) != 0)
+        return(-1);
+
+    first = __stress_word(buf);
+    for (i = 8; i < size; i += 8) {
+        if (__stress_word(buf + i) != first + i)
+            return(-1);
+    }
+    return((int64_t)first);
+}
+
+/* ============================================================================
+ *  phases
+ */
+static void *__stress_shared_read (void *data) {
+    struct stress_thread *st = (struct stress_thread *)data;
+    size_t chunk = st->opts->chunk;
+    unsigned char *buf;
+    int64_t offset;
+    size_t rd;
+
+    if ((buf = (unsigned char *) malloc(chunk)) == NULL)
+        return(NULL);
+
+    while ((rd = webhdfs_file_read(st->file, buf, chunk)) > 0) {
+        if ((offset = __stress_check(buf, rd)) < 0 || (offset % chunk) != 0) {
+            __stress_fail(st, "shared-read: corrupted chunk (%zu bytes)", rd);
+            continue;
+        }
+
+        if (__sync_fetch_and_add(&(__chunks_seen[offset / chunk]), 1) != 0)
+            __stress_fail(st, "shared-read: offset %lld read twice", (long long)offset);
+        __sync_fetch_and_add(&__shared_bytes, rd);
+    }
+
+    free(buf);
+    return(NULL);
+}
+
+static void *__stress_pread (void *data) {
+    struct stress_thread *st = (struct stress_thread *)data;
+    size_t chunk = st->opts->chunk;
+    size_t nchunks = st->opts->file_size / chunk;
+    unsigned char *buf;
+    size_t i, rd, off;
+
+    if ((buf = (unsigned char *) malloc(chunk)) == NULL)
+        return(NULL);
+
+    for (i = 0; i < st->opts->iterations; ++i) {
+        off = (rand_r(&(st->seed)) % nchunks) * chunk;
+        rd = webhdfs_file_pread(st->file, buf, chunk, off);
+        if (rd != chunk || __stress_check(buf, rd) != (int64_t)off)
+            __stress_fail(st, "pread: bad data at %zu (%zu bytes)", off, rd);
+    }
+
+    free(buf);
+    return(NULL);
+}
+
+static void *__stress_metadata (void *data) {
+    struct stress_thread *st = (struct stress_thread *)data;
+    const struct stress_opts *opts = st->opts;
+    char dir[256], path[512], newpath[512];
+    const webhdfs_fstat_t *entry;
+    struct stress_upload up;
+    webhdfs_fstat_t *stat;
+    webhdfs_file_t *file;
+    webhdfs_dir_t *list;
+    size_t i, n;
+
+    snprintf(dir, sizeof(dir), "%s/meta/t%d", opts->root, st->id);
+    if (webhdfs_mkdir(st->fs, dir, 0755)) {
+        __stress_fail(st, "mkdir %s failed", dir);
+        return(NULL);
+    }
+
+    for (i = 0; i < opts->iterations; ++i) {
+        snprintf(path, sizeof(path), "%s/f%zu", dir, i);
+        snprintf(newpath, sizeof(newpath), "%s/r%zu", dir, i);
+
+        up.offset = 0;
+        up.remaining = 64;
+        if (webhdfs_file_create(st->fs, path, 1, __stress_upload, &up)) {
+            __stress_fail(st, "create %s failed", path);
+            continue;
+        }
+
+        if ((file = webhdfs_file_open(st->fs, path)) != NULL) {
+            up.offset = 64;
+            up.remaining = 64;
+            if (webhdfs_file_append(file, __stress_upload, &up))
+                __stress_fail(st, "append %s failed", path);
+            webhdfs_file_close(file);
+        }
+
+        if ((stat = webhdfs_stat(st->fs, path, NULL)) == NULL) {
+            __stress_fail(st, "stat %s failed", path);
+        } else {
+            if (stat->length != 128)
+                __stress_fail(st, "stat %s: length %zu != 128", path, stat->length);
+            webhdfs_fstat_free(stat);
+        }
+
+        if (webhdfs_rename(st->fs, path, newpath))
+            __stress_fail(st, "rename %s failed", path);
+
+        n = 0;
+        if ((list = webhdfs_dir_open(st->fs, dir)) != NULL) {
+            while ((entry = webhdfs_dir_read(list)) != NULL)
+                n++;
+            webhdfs_dir_close(list);
+        }
+        if (n != 1)
+            __stress_fail(st, "list %s: %zu entries != 1", dir, n);
+
+        if (webhdfs_unlink(st->fs, newpath))
+            __stress_fail(st, "unlink %s failed", newpath);
+    }
+
+    webhdfs_rmdir(st->fs, dir, 1);
+    return(NULL);
+}
+
+static size_t __stress_run (const char *name,
+                            void *(*func) (void *),
+                            webhdfs_t *fs,
+                            webhdfs_file_t *file)
+{
+    struct stress_thread *threads;
+    size_t errors = 0;
+    int i;
+
+    threads = (struct stress_thread *) calloc(__opts->threads, sizeof(struct stress_thread));
+    if (threads == NULL)
+        return(1);
+
+    for (i = 0; i < __opts->threads; ++i) {
+        threads[i].opts = __opts;
+        threads[i].fs = fs;
+        threads[i].file = file;
+        threads[i].id = i;
+        threads[i].seed = 0x5eed + i;
+        pthread_create(&(threads[i].thread), NULL, func, &(threads[i]));
+    }
+
+    for (i = 0; i < __opts->threads; ++i) {
+        pthread_join(threads[i].thread, NULL);
+        errors += threads[i].errors;
+    }
+
+    printf("%-12s %s (%zu errors)\n", name, errors ? "FAIL" : "ok", errors);
+    fflush(stdout);
+    free(threads);
+    return(errors);
+}
+
+static void __usage (const char *program) {
+    fprintf(stderr, "usage: %s [options]\n", program);
+    fprintf(stderr, "  -H host       server host (default: localhost)\n");
+    fprintf(stderr, "  -P port       server port (default: 50070)\n");
+    fprintf(stderr, "  -u user       hdfs user (default: stress)\n");
+    fprintf(stderr, "  -r root       stress directory (default: /stress)\n");
+    fprintf(stderr, "  -t threads    concurrency (default: 16)\n");
+    fprintf(stderr, "  -n count      iterations per thread (default: 100)\n");
+    fprintf(stderr, "  -s bytes      shared file size (default: 4M)\n");
+    fprintf(stderr, "  -b bytes      read size, multiple of 8 (default: 16384)\n");
+}
+
+int main (int argc, char **argv) {
+    struct stress_opts opts;
+    struct stress_upload up;
+    webhdfs_conf_t *conf;
+    webhdfs_file_t *file;
+    size_t errors = 0;
+    char path[512];
+    webhdfs_t *fs;
+    int c;
+
+    opts.host = "localhost";
+    opts.port = 50070;
+    opts.user = "stress";
+    opts.root = "/stress";
+    opts.threads = 16;
+    opts.iterations = 100;
+    opts.file_size = 4 << 20;
+    opts.chunk = 16384;
+
+    while ((c = getopt(argc, argv, "H:P:u:r:t:n:s:b:h")) != -1) {
+        switch (c) {
+            case 'H': opts.host = optarg; break;
+            case 'P': opts.port = atoi(optarg); break;
+            case 'u': opts.user = optarg; break;
+            case 'r': opts.root = optarg; break;
+            case 't': opts.threads = atoi(optarg); break;
+            case 'n': opts.iterations = strtoul(optarg, NULL, 10); break;
+            case 's': opts.file_size = strtoul(optarg, NULL, 10); break;
+            case 'b': opts.chunk = strtoul(optarg, NULL, 10); break;
+            default:
+                __usage(argv[0]);
+                return(EXIT_FAILURE);
+        }
+    }
+
+    if (opts.threads < 1 || opts.chunk == 0 || (opts.chunk & 7) != 0 ||
+        opts.file_size < opts.chunk || (opts.file_size % opts.chunk) != 0)
+    {
+        __usage(argv[0]);
+        return(EXIT_FAILURE);
+    }
+    __opts = &opts;
+
+    conf = webhdfs_conf_alloc();
+    webhdfs_conf_set_server(conf, opts.host, opts.port, 0);
+    webhdfs_conf_set_user(conf, opts.user);
+
+    if ((fs = webhdfs_connect(conf)) == NULL) {
+        webhdfs_conf_free(conf);
+        return(EXIT_FAILURE);
+    }
+
+    webhdfs_mkdir(fs, opts.root, 0755);
+    snprintf(path, sizeof(path), "%s/meta", opts.root);
+    webhdfs_mkdir(fs, path, 0755);
+
+    snprintf(path, sizeof(path), "%s/data", opts.root);
+    up.offset = 0;
+    up.remaining = opts.file_size;
+    if (webhdfs_file_create(fs, path, 1, __stress_upload, &up) ||
+        (file = webhdfs_file_open(fs, path)) == NULL)
+    {
+        fprintf(stderr, "setup: unable to create %s\n", path);
+        webhdfs_disconnect(fs);
+        webhdfs_conf_free(conf);
+        return(EXIT_FAILURE);
+    }
+
+    __chunks_seen = (unsigned char *) calloc(opts.file_size / opts.chunk, 1);
+    errors += __stress_run("shared-read", __stress_shared_read, fs, file);
+    if (__shared_bytes != opts.file_size) {
+        fprintf(stderr, "shared-read: %llu bytes read, expected %zu\n",
+                (unsigned long long)__shared_bytes, opts.file_size);
+        errors++;
+    }
+    free(__chunks_seen);
+
+    errors += __stress_run("pread", __stress_pread, fs, file);
+    errors += __stress_run("metadata", __stress_metadata, fs, NULL);
+
+    webhdfs_file_close(file);
+    webhdfs_rmdir(fs, opts.root, 1);
+    webhdfs_disconnect(fs);
+    webhdfs_conf_free(conf);
+
+    return(errors ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -18,23 +18,37 @@
 
 #define _FILE_OFFSET_BITS   64
 #define FUSE_USE_VERSION    28
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 
 #include <webhdfs/webhdfs.h>
 
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <execinfo.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <signal.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
 #include <pwd.h>
 #include <grp.h>
 
+struct webhdfs_fuse_opts {
+    char * conf;                /* -o conf=path, default server.conf */
+    double entry_timeout;       /* -o entry_timeout=sec */
+    double attr_timeout;        /* -o attr_timeout=sec */
+    double negative_timeout;    /* -o negative_timeout=sec */
+};
+
 struct webhdfs_fuse {
     webhdfs_t *webhdfs;
     FILE *flog;
+    struct fuse_chan *chan;
+    struct webhdfs_fuse_opts opts;
 };
 
 static struct webhdfs_fuse __webhdfs_fuse;
@@ -49,9 +63,38 @@ static struct webhdfs_fuse __webhdfs_fuse;
     } while (0)
 
 #define __WEBHDFS                   (__webhdfs_fuse.webhdfs)
+#define __OPTS                      (__webhdfs_fuse.opts)
 
 #define __ceil_div(a, b)            (((a) + (b) - 1) / (b))
 
+static char *__path_join (const char *parent, const char *name) {
+    size_t plen = strlen(parent);
+    size_t nlen = strlen(name);
+    char *path;
+
+    /* "/" + "name" must not become "//name" */
+    if (plen > 0 && parent[plen - 1] == '/')
+        plen--;
+
+    if ((path = (char *) malloc(plen + nlen + 2)) == NULL)
+        return(NULL);
+
+    memcpy(path, parent, plen);
+    path[plen] = '/';
+    memcpy(path + plen + 1, name, nlen + 1);
+    return(path);
+}
+
+static int __path_is_under (const char *path, const char *prefix, size_t n) {
+    return(!strncmp(path, prefix, n) && (path[n] == '\0' || path[n] == '/'));
+}
+
+static uint64_t __now_usec (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t)ts.tv_sec * 1000000U + ts.tv_nsec / 1000U);
+}
+
 /* ============================================================================
  *  user/group utils
  */
@@ -63,7 +106,7 @@ static int __hdfs_user_uid (const char *name, uid_t *uid) {
     struct passwd *tmp;
     struct passwd pwd;
 
-    if (getpwnam_r(name, &pwd, buffer, USER_SIZE_MAX, &tmp))
+    if (getpwnam_r(name, &pwd, buffer, USER_SIZE_MAX, &tmp) || tmp == NULL)
         return(1);
 
     *uid = pwd.pw_uid;
@@ -75,7 +118,7 @@ static char *__hdfs_user_name (uid_t uid) {
     struct passwd *tmp;
     struct passwd pwd;
 
-    if (getpwuid_r(uid, &pwd, buffer, USER_SIZE_MAX, &tmp))
+    if (getpwuid_r(uid, &pwd, buffer, USER_SIZE_MAX, &tmp) || tmp == NULL)
         return(NULL);
 
     return(pwd.pw_name ? strdup(pwd.pw_name) : NULL);
@@ -86,7 +129,7 @@ static int __hdfs_group_gid (const char *name, gid_t *gid) {
     struct group *tmp;
     struct group grp;
 
-    if (getgrnam_r(name, &grp, buffer, GROUP_SIZE_MAX, &tmp))
+    if (getgrnam_r(name, &grp, buffer, GROUP_SIZE_MAX, &tmp) || tmp == NULL)
         return(1);
 
     *gid = grp.gr_gid;
@@ -98,7 +141,7 @@ static char *__hdfs_group_name (gid_t gid) {
     struct group *tmp;
     struct group grp;
 
-    if (getgrgid_r(gid, &grp, buffer, GROUP_SIZE_MAX, &tmp))
+    if (getgrgid_r(gid, &grp, buffer, GROUP_SIZE_MAX, &tmp) || tmp == NULL)
         return(NULL);
 
     return(grp.gr_name ? strdup(grp.gr_name) : NULL);
@@ -113,9 +156,13 @@ static char *__hdfs_group_name (gid_t gid) {
 #define __hdfs_is_dir(stat)         (!strcmp((stat)->type, "DIRECTORY"))
 #define __hdfs_is_file(stat)        (!strcmp((stat)->type, "FILE"))
 
-static void __hdfs_stat (const webhdfs_fstat_t *hdfs_stat, struct stat *stat) {
+static void __hdfs_stat (fuse_ino_t ino,
+                         const webhdfs_fstat_t *hdfs_stat,
+                         struct stat *stat)
+{
     memset(stat, 0, sizeof(struct stat));
 
+    stat->st_ino = ino;
     if (__hdfs_user_uid(hdfs_stat->owner, &(stat->st_uid)))
         stat->st_uid = HDFS_DEFAULT_UID;
     if (__hdfs_group_gid(hdfs_stat->group, &(stat->st_gid)))
@@ -133,23 +180,532 @@ static void __hdfs_stat (const webhdfs_fstat_t *hdfs_stat, struct stat *stat) {
         stat->st_blksize = hdfs_stat->block;
     }
 
+    /* HDFS times are in milliseconds */
     stat->st_blocks  = __ceil_div(stat->st_size, stat->st_blksize);
-    stat->st_atime   = hdfs_stat->atime;
-    stat->st_mtime   = hdfs_stat->mtime;
-    stat->st_ctime   = hdfs_stat->mtime;
+    stat->st_atime   = hdfs_stat->atime / 1000;
+    stat->st_mtime   = hdfs_stat->mtime / 1000;
+    stat->st_ctime   = hdfs_stat->mtime / 1000;
+}
+
+/* ============================================================================
+ *  inode table
+ *
+ *  The kernel addresses everything by nodeid. Each nodeid maps to the HDFS
+ *  path it was looked up by, plus the length/mtime last seen for it so a
+ *  remote change can be detected and pushed out of the kernel caches. An
+ *  inode lives until the kernel forgets every lookup of it; an unlinked or
+ *  replaced inode stays addressable but loses its path.
+ *
+ *  The length/mtime seen at the last open are kept apart: they describe
+ *  what the kernel page cache holds, which is what open compares against.
+ */
+#define INODE_TABLE_MIN_SIZE        (1024)
+
+struct inode {
+    struct inode *ino_next;
+    struct inode *path_next;
+    fuse_ino_t    ino;
+    uint64_t      nlookup;
+    char *        path;         /* NULL once unlinked */
+    size_t        length;
+    size_t        mtime;        /* HDFS modificationTime, msec */
+    uint64_t      seen_us;      /* when length/mtime were fetched */
+    size_t        cache_length; /* length/mtime at the last open */
+    size_t        cache_mtime;
+    int           cached;
+};
+
+struct inode_table {
+    pthread_mutex_t lock;
+    struct inode ** by_ino;
+    struct inode ** by_path;
+    size_t          size;       /* buckets, power of two */
+    size_t          count;
+    fuse_ino_t      next_ino;
+};
+
+static struct inode_table __inodes;
+
+static uint32_t __path_hash (const char *path) {
+    uint32_t hash = 2166136261U;
+    while (*path != '\0')
+        hash = (hash ^ (unsigned char)*path++) * 16777619U;
+    return(hash);
+}
+
+#define __ino_bucket(ino)           ((ino) & (__inodes.size - 1))
+#define __path_bucket(path)         (__path_hash(path) & (__inodes.size - 1))
+
+static void __inode_link_path (struct inode *inode) {
+    size_t bucket = __path_bucket(inode->path);
+    inode->path_next = __inodes.by_path[bucket];
+    __inodes.by_path[bucket] = inode;
+}
+
+static void __inode_unlink_path (struct inode *inode) {
+    struct inode **p;
+
+    for (p = &(__inodes.by_path[__path_bucket(inode->path)]); *p != NULL; p = &((*p)->path_next)) {
+        if (*p == inode) {
+            *p = inode->path_next;
+            break;
+        }
+    }
+    inode->path_next = NULL;
+}
+
+static struct inode *__inode_by_ino (fuse_ino_t ino) {
+    struct inode *inode;
+
+    for (inode = __inodes.by_ino[__ino_bucket(ino)]; inode != NULL; inode = inode->ino_next) {
+        if (inode->ino == ino)
+            return(inode);
+    }
+    return(NULL);
+}
+
+static struct inode *__inode_by_path (const char *path) {
+    struct inode *inode;
+
+    for (inode = __inodes.by_path[__path_bucket(path)]; inode != NULL; inode = inode->path_next) {
+        if (!strcmp(inode->path, path))
+            return(inode);
+    }
+    return(NULL);
+}
+
+static int __inode_table_resize (size_t size) {
+    struct inode **by_ino, **by_path;
+    struct inode *inode, *next;
+    size_t i, old_size;
+
+    by_ino = (struct inode **) calloc(size, sizeof(struct inode *));
+    by_path = (struct inode **) calloc(size, sizeof(struct inode *));
+    if (by_ino == NULL || by_path == NULL) {
+        free(by_ino);
+        free(by_path);
+        return(1);
+    }
+
+    old_size = __inodes.size;
+    __inodes.size = size;
+    for (i = 0; i < old_size; ++i) {
+        for (inode = __inodes.by_ino[i]; inode != NULL; inode = next) {
+            next = inode->ino_next;
+            inode->ino_next = by_ino[__ino_bucket(inode->ino)];
+            by_ino[__ino_bucket(inode->ino)] = inode;
+            if (inode->path != NULL) {
+                inode->path_next = by_path[__path_bucket(inode->path)];
+                by_path[__path_bucket(inode->path)] = inode;
+            }
+        }
+    }
+
+    free(__inodes.by_ino);
+    free(__inodes.by_path);
+    __inodes.by_ino = by_ino;
+    __inodes.by_path = by_path;
+    return(0);
+}
+
+static struct inode *__inode_alloc (const char *path) {
+    struct inode *inode;
+
+    if (__inodes.count >= __inodes.size && __inode_table_resize(__inodes.size << 1))
+        return(NULL);
+
+    if ((inode = (struct inode *) calloc(1, sizeof(struct inode))) == NULL)
+        return(NULL);
+
+    if ((inode->path = strdup(path)) == NULL) {
+        free(inode);
+        return(NULL);
+    }
+
+    inode->ino = __inodes.next_ino++;
+    inode->ino_next = __inodes.by_ino[__ino_bucket(inode->ino)];
+    __inodes.by_ino[__ino_bucket(inode->ino)] = inode;
+    __inode_link_path(inode);
+    __inodes.count++;
+    return(inode);
+}
+
+static int __inode_table_init (void) {
+    struct inode *root;
+
+    memset(&__inodes, 0, sizeof(struct inode_table));
+    pthread_mutex_init(&(__inodes.lock), NULL);
+    if (__inode_table_resize(INODE_TABLE_MIN_SIZE))
+        return(1);
+
+    /* The root is pinned: the kernel never forgets it */
+    __inodes.next_ino = FUSE_ROOT_ID;
+    if ((root = __inode_alloc("/")) == NULL)
+        return(1);
+    root->nlookup = 1;
+    return(0);
+}
+
+static void __inode_table_free (void) {
+    struct inode *inode, *next;
+    size_t i;
+
+    for (i = 0; i < __inodes.size; ++i) {
+        for (inode = __inodes.by_ino[i]; inode != NULL; inode = next) {
+            next = inode->ino_next;
+            free(inode->path);
+            free(inode);
+        }
+    }
+
+    free(__inodes.by_ino);
+    free(__inodes.by_path);
+    pthread_mutex_destroy(&(__inodes.lock));
+}
+
+/* Returns a copy of the inode path, NULL if unknown or unlinked */
+static char *__inode_path (fuse_ino_t ino) {
+    struct inode *inode;
+    char *path = NULL;
+
+    pthread_mutex_lock(&(__inodes.lock));
+    if ((inode = __inode_by_ino(ino)) != NULL && inode->path != NULL)
+        path = strdup(inode->path);
+    pthread_mutex_unlock(&(__inodes.lock));
+
+    return(path);
+}
+
+static char *__inode_child_path (fuse_ino_t parent, const char *name) {
+    char *ppath, *path;
+
+    if ((ppath = __inode_path(parent)) == NULL)
+        return(NULL);
+
+    path = __path_join(ppath, name);
+    free(ppath);
+    return(path);
+}
+
+/*
+ * Record the attributes just fetched for path. With lookup set, a missing
+ * inode is created and its lookup count taken (the caller replies with an
+ * entry); otherwise only an existing inode is refreshed. *changed is set
+ * when the length or mtime moved since we last saw the inode.
+ */
+static fuse_ino_t __inode_get (const char *path,
+                               const webhdfs_fstat_t *stat,
+                               int lookup,
+                               int *changed)
+{
+    struct inode *inode;
+    fuse_ino_t ino = 0;
+
+    *changed = 0;
+    pthread_mutex_lock(&(__inodes.lock));
+    if ((inode = __inode_by_path(path)) != NULL) {
+        *changed = inode->length != stat->length || inode->mtime != stat->mtime;
+    } else if (lookup) {
+        inode = __inode_alloc(path);
+    }
+
+    if (inode != NULL) {
+        inode->length = stat->length;
+        inode->mtime = stat->mtime;
+        inode->seen_us = __now_usec();
+        inode->nlookup += (lookup != 0);
+        ino = inode->ino;
+    }
+    pthread_mutex_unlock(&(__inodes.lock));
+
+    return(ino);
+}
+
+static int __inode_update (fuse_ino_t ino, const webhdfs_fstat_t *stat) {
+    struct inode *inode;
+    int changed = 0;
+
+    pthread_mutex_lock(&(__inodes.lock));
+    if ((inode = __inode_by_ino(ino)) != NULL) {
+        changed = inode->length != stat->length || inode->mtime != stat->mtime;
+        inode->length = stat->length;
+        inode->mtime = stat->mtime;
+        inode->seen_us = __now_usec();
+    }
+    pthread_mutex_unlock(&(__inodes.lock));
+
+    return(changed);
+}
+
+/* We changed the file ourselves: forget what the page cache holds */
+static void __inode_stale (fuse_ino_t ino) {
+    struct inode *inode;
+
+    pthread_mutex_lock(&(__inodes.lock));
+    if ((inode = __inode_by_ino(ino)) != NULL) {
+        inode->seen_us = 0;
+        inode->cached = 0;
+    }
+    pthread_mutex_unlock(&(__inodes.lock));
+}
+
+/*
+ * Decide keep_cache for an open of ino: the pages cached by the kernel are
+ * still good if length and mtime match what the previous open saw; they
+ * are copied to stat for a sized handle. Returns -1 when the inode is gone
+ * or its attributes are older than max_age seconds (refresh and call
+ * again with max_age < 0 to skip the age check).
+ */
+static int __inode_keep_cache (fuse_ino_t ino, double max_age, webhdfs_fstat_t *stat) {
+    struct inode *inode;
+    int keep = -1;
+
+    pthread_mutex_lock(&(__inodes.lock));
+    if ((inode = __inode_by_ino(ino)) != NULL) {
+        if (max_age >= 0.0 && __now_usec() - inode->seen_us > (uint64_t)(max_age * 1000000.0)) {
+            keep = -1;
+        } else {
+            memset(stat, 0, sizeof(webhdfs_fstat_t));
+            stat->length = inode->length;
+            stat->mtime = inode->mtime;
+            keep = inode->cached &&
+                   inode->cache_length == inode->length &&
+                   inode->cache_mtime == inode->mtime;
+            inode->cache_length = inode->length;
+            inode->cache_mtime = inode->mtime;
+            inode->cached = 1;
+        }
+    }
+    pthread_mutex_unlock(&(__inodes.lock));
+
+    return(keep);
+}
+
+static fuse_ino_t __inode_ino (const char *path) {
+    struct inode *inode;
+    fuse_ino_t ino = 0;
+
+    pthread_mutex_lock(&(__inodes.lock));
+    if ((inode = __inode_by_path(path)) != NULL)
+        ino = inode->ino;
+    pthread_mutex_unlock(&(__inodes.lock));
+
+    return(ino);
+}
+
+static void __inode_forget (fuse_ino_t ino, uint64_t nlookup) {
+    struct inode *inode, **p;
+
+    pthread_mutex_lock(&(__inodes.lock));
+    for (p = &(__inodes.by_ino[__ino_bucket(ino)]); (inode = *p) != NULL; p = &(inode->ino_next)) {
+        if (inode->ino != ino)
+            continue;
+
+        inode->nlookup -= (nlookup < inode->nlookup) ? nlookup : inode->nlookup;
+        if (inode->nlookup == 0 && ino != FUSE_ROOT_ID) {
+            *p = inode->ino_next;
+            if (inode->path != NULL)
+                __inode_unlink_path(inode);
+            free(inode->path);
+            free(inode);
+            __inodes.count--;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&(__inodes.lock));
+}
+
+/* Drop the path of every inode at or below path (unlinked/overwritten) */
+static void __inode_detach_locked (const char *path) {
+    size_t n = strlen(path);
+    struct inode *inode;
+    size_t i;
+
+    for (i = 0; i < __inodes.size; ++i) {
+        for (inode = __inodes.by_ino[i]; inode != NULL; inode = inode->ino_next) {
+            if (inode->path == NULL || inode->ino == FUSE_ROOT_ID ||
+                !__path_is_under(inode->path, path, n))
+            {
+                continue;
+            }
+
+            __inode_unlink_path(inode);
+            free(inode->path);
+            inode->path = NULL;
+        }
+    }
+}
+
+static void __inode_detach (const char *path) {
+    pthread_mutex_lock(&(__inodes.lock));
+    __inode_detach_locked(path);
+    pthread_mutex_unlock(&(__inodes.lock));
+}
+
+static void __inode_rename (const char *oldpath, const char *newpath) {
+    size_t olen = strlen(oldpath);
+    size_t nlen = strlen(newpath);
+    struct inode *inode;
+    char *path;
+    size_t i;
+
+    pthread_mutex_lock(&(__inodes.lock));
+    __inode_detach_locked(newpath);
+    for (i = 0; i < __inodes.size; ++i) {
+        for (inode = __inodes.by_ino[i]; inode != NULL; inode = inode->ino_next) {
+            if (inode->path == NULL || !__path_is_under(inode->path, oldpath, olen))
+                continue;
+
+            if ((path = (char *) malloc(nlen + strlen(inode->path + olen) + 1)) == NULL)
+                continue;
+            memcpy(path, newpath, nlen);
+            strcpy(path + nlen, inode->path + olen);
+
+            __inode_unlink_path(inode);
+            free(inode->path);
+            inode->path = path;
+            __inode_link_path(inode);
+        }
+    }
+    pthread_mutex_unlock(&(__inodes.lock));
+}
+
+/* ============================================================================
+ *  kernel cache invalidation
+ *
+ *  The kernel may hold the parent directory lock while it waits for our
+ *  reply, so notifications are queued and sent from their own thread
+ *  instead of from inside the request handler. The queue is bounded; a
+ *  dropped notification only means waiting for the cache timeout.
+ */
+#define NOTIFY_QUEUE_SIZE           (1024)
+#define NOTIFY_INODE                (1)
+#define NOTIFY_ENTRY                (2)
+
+struct notify {
+    int        type;
+    fuse_ino_t ino;             /* the inode, or the parent for NOTIFY_ENTRY */
+    char       name[256];
+};
+
+struct notify_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    pthread_t       thread;
+    struct notify   queue[NOTIFY_QUEUE_SIZE];
+    size_t          head;
+    size_t          tail;
+    int             running;
+};
+
+static struct notify_queue __notify;
+
+static void __notify_push (int type, fuse_ino_t ino, const char *name) {
+    struct notify *n;
+
+    if (ino == 0)
+        return;
+
+    pthread_mutex_lock(&(__notify.lock));
+    if (__notify.running && __notify.tail - __notify.head < NOTIFY_QUEUE_SIZE) {
+        n = &(__notify.queue[__notify.tail++ % NOTIFY_QUEUE_SIZE]);
+        n->type = type;
+        n->ino = ino;
+        n->name[0] = '\0';
+        if (name != NULL) {
+            strncpy(n->name, name, sizeof(n->name) - 1);
+            n->name[sizeof(n->name) - 1] = '\0';
+        }
+        pthread_cond_signal(&(__notify.cond));
+    }
+    pthread_mutex_unlock(&(__notify.lock));
+}
+
+/* The entry for path went away remotely: drop it from the parent dentry */
+static void __notify_entry_gone (const char *path) {
+    const char *name = strrchr(path, '/');
+    char *parent;
+
+    if (name == NULL || name == path + strlen(path) - 1)
+        return;
+
+    if ((parent = strndup(path, name == path ? 1 : name - path)) == NULL)
+        return;
+
+    __notify_push(NOTIFY_ENTRY, __inode_ino(parent), name + 1);
+    free(parent);
+}
+
+static void *__notify_thread (void *data) {
+    struct notify n;
+
+    pthread_mutex_lock(&(__notify.lock));
+    for (;;) {
+        while (__notify.running && __notify.head == __notify.tail)
+            pthread_cond_wait(&(__notify.cond), &(__notify.lock));
+
+        if (__notify.head == __notify.tail)
+            break;
+
+        n = __notify.queue[__notify.head++ % NOTIFY_QUEUE_SIZE];
+        pthread_mutex_unlock(&(__notify.lock));
+
+        /* -ENOENT just means the kernel no longer caches it */
+        if (n.type == NOTIFY_INODE)
+            fuse_lowlevel_notify_inval_inode(__webhdfs_fuse.chan, n.ino, 0, 0);
+        else
+            fuse_lowlevel_notify_inval_entry(__webhdfs_fuse.chan, n.ino, n.name, strlen(n.name));
+
+        pthread_mutex_lock(&(__notify.lock));
+    }
+    pthread_mutex_unlock(&(__notify.lock));
+
+    return(NULL);
+}
+
+static int __notify_start (void) {
+    memset(&__notify, 0, sizeof(struct notify_queue));
+    pthread_mutex_init(&(__notify.lock), NULL);
+    pthread_cond_init(&(__notify.cond), NULL);
+    __notify.running = 1;
+
+    if (pthread_create(&(__notify.thread), NULL, __notify_thread, NULL)) {
+        __notify.running = 0;
+        return(1);
+    }
+    return(0);
+}
+
+static void __notify_stop (void) {
+    pthread_mutex_lock(&(__notify.lock));
+    __notify.running = 0;
+    pthread_cond_signal(&(__notify.cond));
+    pthread_mutex_unlock(&(__notify.lock));
+
+    pthread_join(__notify.thread, NULL);
+    pthread_cond_destroy(&(__notify.cond));
+    pthread_mutex_destroy(&(__notify.lock));
 }
 
 /* ============================================================================
  *  webhdfs Fuse
  */
-static int webhdfs_fuse_connect (const webhdfs_conf_t *config) {
+/* Before fuse_daemonize(), which moves to / */
+static int webhdfs_fuse_open_log (void) {
     if ((__webhdfs_fuse.flog = fopen("webhdfs-fuse.log", "a")) == NULL) {
         perror("fopen() log file:");
         return(-1);
     }
+    return(0);
+}
 
+/*
+ * After fuse_daemonize(): webhdfs_connect() starts the token renewer
+ * and the HA monitor, and threads do not survive the fork.
+ */
+static int webhdfs_fuse_connect (const webhdfs_conf_t *config) {
     if ((__webhdfs_fuse.webhdfs = webhdfs_connect(config)) == NULL) {
-        fclose(__webhdfs_fuse.flog);
+        webhdfs_fuse_log("webhdfs_connect() failed\n");
         return(-2);
     }
 
@@ -157,226 +713,674 @@ static int webhdfs_fuse_connect (const webhdfs_conf_t *config) {
 }
 
 static void webhdfs_fuse_disconnect (void) {
-    webhdfs_disconnect(__webhdfs_fuse.webhdfs);
+    if (__webhdfs_fuse.webhdfs != NULL)
+        webhdfs_disconnect(__webhdfs_fuse.webhdfs);
     fclose(__webhdfs_fuse.flog);
 }
 
+static webhdfs_fstat_t *__webhdfs_fuse_stat (const char *path) {
+    webhdfs_fstat_t *stat;
+    char *error = NULL;
+
+    if ((stat = webhdfs_stat(__WEBHDFS, path, &error)) == NULL)
+        free(error);
+    return(stat);
+}
+
+/* Reply with the entry for path, taking a lookup reference on its inode */
+static void __webhdfs_fuse_entry (fuse_req_t req,
+                                  const char *path,
+                                  const webhdfs_fstat_t *hdfs_stat,
+                                  struct fuse_file_info *ffi)
+{
+    struct fuse_entry_param e;
+    int changed;
+
+    memset(&e, 0, sizeof(struct fuse_entry_param));
+    if ((e.ino = __inode_get(path, hdfs_stat, 1, &changed)) == 0) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    if (changed)
+        __notify_push(NOTIFY_INODE, e.ino, NULL);
+
+    __hdfs_stat(e.ino, hdfs_stat, &(e.attr));
+    e.attr_timeout = __OPTS.attr_timeout;
+    e.entry_timeout = __OPTS.entry_timeout;
+
+    if (ffi != NULL)
+        fuse_reply_create(req, &e, ffi);
+    else
+        fuse_reply_entry(req, &e);
+}
+
 /* ============================================================================
  * Metadata related functions
  */
-static int webhdfs_fuse_statfs (const char *path, struct statvfs *stat) {
-    if (0) {
-        stat->f_bsize   = 0x0000;       /* file system block size */
-        stat->f_frsize  = 0x0000;       /* fragment size */
-        stat->f_blocks  = 0x0000;       /* size of fs in f_frsize units */
-        stat->f_bfree   = 0x0000;       /* # free blocks */
-        stat->f_bavail  = 0x0000;       /* # free blocks for unprivileged users */
-        stat->f_files   = 0x0000;       /* # inodes */
-        stat->f_ffree   = 0x0000;       /* # free inodes */
-        stat->f_favail  = 0x0000;       /* # free inodes for unprivileged users */
-        stat->f_fsid    = 0x0000;       /* file system ID */
-        stat->f_flag    = 0x0000;       /* mount flags */
-        stat->f_namemax = 0x0000;       /* maximum filename length */
+static void webhdfs_fuse_lookup (fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse_entry_param e;
+    webhdfs_fstat_t *hdfs_stat;
+    char *path;
+
+    if ((path = __inode_child_path(parent, name)) == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
     }
 
-    return(-1);
-}
+    if ((hdfs_stat = __webhdfs_fuse_stat(path)) == NULL) {
+        free(path);
 
-static int webhdfs_fuse_getattr (const char *path, struct stat *stat) {
-    webhdfs_fstat_t *hdfs_stat;
+        /* Let the kernel cache the miss, if allowed */
+        if (__OPTS.negative_timeout <= 0.0) {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
 
-    if ((hdfs_stat = webhdfs_stat(__WEBHDFS, path)) != NULL) {
-        __hdfs_stat(hdfs_stat, stat);
-        webhdfs_fstat_free(hdfs_stat);
-        return(0);
+        memset(&e, 0, sizeof(struct fuse_entry_param));
+        e.entry_timeout = __OPTS.negative_timeout;
+        fuse_reply_entry(req, &e);
+        return;
     }
 
-    return(-ENOENT);
+    __webhdfs_fuse_entry(req, path, hdfs_stat, NULL);
+    webhdfs_fstat_free(hdfs_stat);
+    free(path);
 }
 
-static int webhdfs_fuse_chmod (const char *path, mode_t mode) {
-    if (webhdfs_chmod(__WEBHDFS, path, mode))
-        return(-ENOENT);
-    return(0);
+static void webhdfs_fuse_forget (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    __inode_forget(ino, nlookup);
+    fuse_reply_none(req);
 }
 
-static int webhdfs_fuse_chown (const char *path, uid_t uid, gid_t gid) {
-    char *group;
-    char *user;
-    int ret;
+static void webhdfs_fuse_getattr (fuse_req_t req,
+                                  fuse_ino_t ino,
+                                  struct fuse_file_info *ffi)
+{
+    webhdfs_fstat_t *hdfs_stat;
+    struct stat stat;
+    char *path;
 
-    if ((user = __hdfs_user_name(uid)) == NULL) {
-        return(-EIO);
+    if ((path = __inode_path(ino)) == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
     }
 
-    if ((group = __hdfs_group_name(gid)) == NULL) {
-        free(user);
-        return(-EIO);
+    if ((hdfs_stat = __webhdfs_fuse_stat(path)) == NULL) {
+        /* Removed behind our back */
+        __notify_entry_gone(path);
+        __inode_detach(path);
+        fuse_reply_err(req, ENOENT);
+        free(path);
+        return;
+    }
+
+    if (__inode_update(ino, hdfs_stat))
+        __notify_push(NOTIFY_INODE, ino, NULL);
+
+    __hdfs_stat(ino, hdfs_stat, &stat);
+    fuse_reply_attr(req, &stat, __OPTS.attr_timeout);
+    webhdfs_fstat_free(hdfs_stat);
+    free(path);
+}
+
+static int __webhdfs_fuse_chown (const char *path,
+                                 const struct stat *attr,
+                                 int to_set)
+{
+    webhdfs_fstat_t *hdfs_stat = NULL;
+    char *group = NULL;
+    char *user = NULL;
+    int ret = 0;
+
+    /* SETOWNER wants both names: keep the current one for the unset half */
+    if ((to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) != (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        if ((hdfs_stat = __webhdfs_fuse_stat(path)) == NULL)
+            return(ENOENT);
     }
 
-    ret = 0;
-    if (webhdfs_chown(__WEBHDFS, path, user, group))
-        ret = -EIO;
+    if (to_set & FUSE_SET_ATTR_UID)
+        user = __hdfs_user_name(attr->st_uid);
+    else
+        user = strdup(hdfs_stat->owner);
+
+    if (to_set & FUSE_SET_ATTR_GID)
+        group = __hdfs_group_name(attr->st_gid);
+    else
+        group = strdup(hdfs_stat->group);
+
+    if (user == NULL || group == NULL)
+        ret = EIO;
+    else if (webhdfs_chown(__WEBHDFS, path, user, group))
+        ret = EIO;
 
+    if (hdfs_stat != NULL)
+        webhdfs_fstat_free(hdfs_stat);
     free(group);
     free(user);
     return(ret);
 }
 
-static int webhdfs_fuse_utime (const char *path, struct utimbuf *time) {
-    return 0;
-}
+static void webhdfs_fuse_setattr (fuse_req_t req,
+                                  fuse_ino_t ino,
+                                  struct stat *attr,
+                                  int to_set,
+                                  struct fuse_file_info *ffi)
+{
+    webhdfs_fstat_t *hdfs_stat;
+    struct stat stat;
+    char *path;
+    int err = 0;
 
-static int webhdfs_fuse_utimens (const char *path,
-                                 const struct timespec tv[2]) {
-  return 0;
-}
+    if ((path = __inode_path(ino)) == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
 
-static int webhdfs_fuse_truncate (const char *path, off_t offset) {
-  return 0;
-}
+    if (to_set & FUSE_SET_ATTR_MODE) {
+        if (webhdfs_chmod(__WEBHDFS, path, attr->st_mode & 07777))
+            err = ENOENT;
+    }
+
+    if (!err && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)))
+        err = __webhdfs_fuse_chown(path, attr, to_set);
+
+    /* truncate and times are accepted and ignored, as before */
+    if (!err && (hdfs_stat = __webhdfs_fuse_stat(path)) != NULL) {
+        __inode_update(ino, hdfs_stat);
+        __hdfs_stat(ino, hdfs_stat, &stat);
+        fuse_reply_attr(req, &stat, __OPTS.attr_timeout);
+        webhdfs_fstat_free(hdfs_stat);
+    } else {
+        fuse_reply_err(req, err ? err : ENOENT);
+    }
 
-static int webhdfs_fuse_ftruncate (const char *path, off_t offset, struct fuse_file_info * finfo) {
-  return 0;
+    free(path);
 }
 
 /* ============================================================================
  * Namespace related functions
  */
-static int webhdfs_fuse_create (const char *path,
-                                mode_t mode,
-                                struct fuse_file_info *ffi)
+static void webhdfs_fuse_create (fuse_req_t req,
+                                 fuse_ino_t parent,
+                                 const char *name,
+                                 mode_t mode,
+                                 struct fuse_file_info *ffi)
 {
+    webhdfs_fstat_t *hdfs_stat;
     webhdfs_file_t *file;
+    char *path;
 
-    if (webhdfs_file_create(__WEBHDFS, path, 0, NULL, NULL))
-        return(-EIO);
+    if ((path = __inode_child_path(parent, name)) == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
 
-    if ((file = webhdfs_file_open(__WEBHDFS, path)) == NULL)
-        return(-EIO);
+    if (webhdfs_file_create(__WEBHDFS, path, 0, NULL, NULL)) {
+        fuse_reply_err(req, EIO);
+        free(path);
+        return;
+    }
 
-    ffi->fh = (uint64_t)file;
-    webhdfs_chmod(__WEBHDFS, path, mode);
+    webhdfs_chmod(__WEBHDFS, path, mode & 07777);
+    if ((hdfs_stat = __webhdfs_fuse_stat(path)) == NULL) {
+        fuse_reply_err(req, EIO);
+        free(path);
+        return;
+    }
 
-    return(0);
+    if ((file = webhdfs_file_open_sized(__WEBHDFS, path, hdfs_stat)) == NULL) {
+        webhdfs_fstat_free(hdfs_stat);
+        fuse_reply_err(req, EIO);
+        free(path);
+        return;
+    }
+
+    ffi->fh = (uint64_t)file;
+    __webhdfs_fuse_entry(req, path, hdfs_stat, ffi);
+    webhdfs_fstat_free(hdfs_stat);
+    free(path);
 }
 
-static int webhdfs_fuse_open (const char *path, struct fuse_file_info *ffi) {
+/*
+ * Without keep_cache the kernel drops the inode's pages on open, so an
+ * unchanged file keeps them and a changed one is invalidated for free.
+ * Attributes fetched within attr_timeout (typically by the lookup or
+ * getattr that preceded this open) are trusted as is.
+ */
+static void webhdfs_fuse_open (fuse_req_t req,
+                               fuse_ino_t ino,
+                               struct fuse_file_info *ffi)
+{
+    webhdfs_fstat_t *hdfs_stat;
     webhdfs_file_t *file;
+    webhdfs_fstat_t attr;
+    char *path;
+    int keep;
 
-    if ((file = webhdfs_file_open(__WEBHDFS, path)) == NULL)
-        return(-EIO);
+    if ((path = __inode_path(ino)) == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
 
-    ffi->fh = (uint64_t)file;
+    if ((keep = __inode_keep_cache(ino, __OPTS.attr_timeout, &attr)) < 0) {
+        if ((hdfs_stat = __webhdfs_fuse_stat(path)) == NULL) {
+            __notify_entry_gone(path);
+            __inode_detach(path);
+            fuse_reply_err(req, ENOENT);
+            free(path);
+            return;
+        }
 
-    return(0);
+        __inode_update(ino, hdfs_stat);
+        webhdfs_fstat_free(hdfs_stat);
+        if ((keep = __inode_keep_cache(ino, -1.0, &attr)) < 0) {
+            fuse_reply_err(req, ENOENT);
+            free(path);
+            return;
+        }
+    }
+
+    /* Sized from the attributes above: EOF reads never hit the network */
+    if ((file = webhdfs_file_open_sized(__WEBHDFS, path, &attr)) == NULL) {
+        fuse_reply_err(req, EIO);
+        free(path);
+        return;
+    }
+
+    /* Pages still cached by the kernel need no prefetch */
+    if (!keep)
+        webhdfs_file_prefetch_auto(file);
+
+    ffi->fh = (uint64_t)file;
+    ffi->keep_cache = (keep > 0);
+    fuse_reply_open(req, ffi);
+    free(path);
 }
 
-static int webhdfs_fuse_close (const char *path, struct fuse_file_info *ffi) {
+static void webhdfs_fuse_release (fuse_req_t req,
+                                  fuse_ino_t ino,
+                                  struct fuse_file_info *ffi)
+{
     webhdfs_file_t *file = (webhdfs_file_t *)ffi->fh;
     webhdfs_file_close(file);
-    return(0);
+    fuse_reply_err(req, 0);
 }
 
-static int webhdfs_fuse_mkdir (const char *path, mode_t mode) {
-    if (webhdfs_mkdir(__WEBHDFS, path, mode))
-        return(-EIO);
-    return(0);
-}
+static void webhdfs_fuse_mkdir (fuse_req_t req,
+                                fuse_ino_t parent,
+                                const char *name,
+                                mode_t mode)
+{
+    webhdfs_fstat_t *hdfs_stat;
+    char *path;
 
-static int webhdfs_fuse_rmdir (const char *path) {
-    if (webhdfs_rmdir(__WEBHDFS, path, 1))
-        return(-EIO);
-    return(0);
-}
+    if ((path = __inode_child_path(parent, name)) == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
 
-static int webhdfs_fuse_unlink (const char *path) {
-    if (webhdfs_unlink(__WEBHDFS, path))
-        return(-EIO);
-    return(0);
-}
+    if (webhdfs_mkdir(__WEBHDFS, path, mode & 07777) ||
+        (hdfs_stat = __webhdfs_fuse_stat(path)) == NULL)
+    {
+        fuse_reply_err(req, EIO);
+        free(path);
+        return;
+    }
 
-static int webhdfs_fuse_rename (const char *path, const char *newpath) {
-    if (webhdfs_rename(__WEBHDFS, path, newpath))
-        return(-EIO);
-    return(0);
+    __webhdfs_fuse_entry(req, path, hdfs_stat, NULL);
+    webhdfs_fstat_free(hdfs_stat);
+    free(path);
 }
 
-static int webhdfs_fuse_link (const char *path, const char *newpath) {
-    return(-1);
+static void webhdfs_fuse_rmdir (fuse_req_t req, fuse_ino_t parent, const char *name) {
+    char *path;
+
+    if ((path = __inode_child_path(parent, name)) == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    if (webhdfs_rmdir(__WEBHDFS, path, 1)) {
+        fuse_reply_err(req, EIO);
+    } else {
+        __inode_detach(path);
+        fuse_reply_err(req, 0);
+    }
+    free(path);
 }
 
-static int webhdfs_fuse_symlink (const char *path, const char *newpath) {
-    return(-1);
+static void webhdfs_fuse_unlink (fuse_req_t req, fuse_ino_t parent, const char *name) {
+    char *path;
+
+    if ((path = __inode_child_path(parent, name)) == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    if (webhdfs_unlink(__WEBHDFS, path)) {
+        fuse_reply_err(req, EIO);
+    } else {
+        __inode_detach(path);
+        fuse_reply_err(req, 0);
+    }
+    free(path);
 }
 
-static int webhdfs_fuse_readlink (const char *path, char *buffer, size_t size) {
-    return(-1);
+static void webhdfs_fuse_rename (fuse_req_t req,
+                                 fuse_ino_t parent,
+                                 const char *name,
+                                 fuse_ino_t newparent,
+                                 const char *newname)
+{
+    char *path, *newpath;
+
+    path = __inode_child_path(parent, name);
+    newpath = __inode_child_path(newparent, newname);
+
+    if (path == NULL || newpath == NULL) {
+        fuse_reply_err(req, ENOENT);
+    } else if (webhdfs_rename(__WEBHDFS, path, newpath)) {
+        fuse_reply_err(req, EIO);
+    } else {
+        __inode_rename(path, newpath);
+        fuse_reply_err(req, 0);
+    }
+
+    free(newpath);
+    free(path);
 }
 
 /* ============================================================================
  * Object related functions
  */
-static int webhdfs_fuse_read (const char *path,
-                              char *buffer,
-                              size_t size,
-                              off_t offset,
-                              struct fuse_file_info *ffi)
+static void webhdfs_fuse_read (fuse_req_t req,
+                               fuse_ino_t ino,
+                               size_t size,
+                               off_t offset,
+                               struct fuse_file_info *ffi)
 {
     webhdfs_file_t *file = (webhdfs_file_t *)ffi->fh;
+    size_t length;
+    char *buffer;
     size_t rd;
 
-    if (!(rd = webhdfs_file_pread(file, buffer, size, offset)))
-        return(-EIO);
+    /* The handle knows the length: 0 is EOF, a short read below it is not */
+    if (webhdfs_file_size(file, &length, NULL) == 0 && (size_t)offset >= length) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
 
-    return(rd);
+    if ((buffer = (char *) malloc(size)) == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    if ((rd = webhdfs_file_pread(file, buffer, size, offset)) == 0)
+        fuse_reply_err(req, EIO);
+    else
+        fuse_reply_buf(req, buffer, rd);
+    free(buffer);
 }
 
-static int webhdfs_fuse_write (const char *path,
-                               const char *buffer,
-                               size_t size,
-                               off_t offset,
-                               struct fuse_file_info *ffi)
+static void webhdfs_fuse_write (fuse_req_t req,
+                                fuse_ino_t ino,
+                                const char *buffer,
+                                size_t size,
+                                off_t offset,
+                                struct fuse_file_info *ffi)
 {
     webhdfs_file_t *file = (webhdfs_file_t *)ffi->fh;
     size_t wr;
 
     /* check is append only */
-    if (!(wr = webhdfs_file_append_buffer(file, buffer, size)))
-        return(-EIO);
+    if (!(wr = webhdfs_file_append_buffer(file, buffer, size))) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
 
-    return(wr);
+    __inode_stale(ino);
+    fuse_reply_write(req, wr);
 }
 
-static int webhdfs_fuse_fsync (const char *path,
-                               int data_sync,
-                               struct fuse_file_info *ffi)
+static void webhdfs_fuse_fsync (fuse_req_t req,
+                                fuse_ino_t ino,
+                                int data_sync,
+                                struct fuse_file_info *ffi)
 {
-    return(0);
+    fuse_reply_err(req, 0);
 }
 
-static int webhdfs_fuse_readdir (const char *path,
-                                 void *buf,
-                                 fuse_fill_dir_t filler,
-                                 off_t offset,
-                                 struct fuse_file_info *fi)
-{
+/* ============================================================================
+ * Filesystem related functions
+ *
+ * statfs answers from the content summary of the root whatever inode it
+ * is asked about, as df wants the whole filesystem; the library caches
+ * the summary for a moment, so repeated calls cost one request. Size and
+ * free space come from the root's space quota. Without one, WebHDFS has
+ * no capacity to report and free space is shown as a large fixed figure
+ * rather than as a full disk; the same goes for inodes and the name quota.
+ */
+#define STATFS_BLOCK_SIZE           (4096)
+#define STATFS_UNBOUNDED_BLOCKS     ((fsblkcnt_t)1 << 38)   /* 1PiB */
+#define STATFS_UNBOUNDED_FILES      ((fsfilcnt_t)1 << 32)
+
+static void webhdfs_fuse_statfs (fuse_req_t req, fuse_ino_t ino) {
+    webhdfs_content_summary_t summary;
+    struct statvfs st;
+    fsfilcnt_t names;
+    fsblkcnt_t used;
+
+    if (webhdfs_content_summary(__WEBHDFS, "/", &summary)) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+
+    memset(&st, 0, sizeof(struct statvfs));
+    st.f_bsize = STATFS_BLOCK_SIZE;
+    st.f_frsize = STATFS_BLOCK_SIZE;
+    st.f_namemax = 255;
+
+    used = (summary.space_consumed + STATFS_BLOCK_SIZE - 1) / STATFS_BLOCK_SIZE;
+    if (summary.space_quota >= 0) {
+        st.f_blocks = summary.space_quota / STATFS_BLOCK_SIZE;
+        st.f_bfree = (st.f_blocks > used) ? st.f_blocks - used : 0;
+    } else {
+        st.f_bfree = STATFS_UNBOUNDED_BLOCKS;
+        st.f_blocks = used + st.f_bfree;
+    }
+    st.f_bavail = st.f_bfree;
+
+    names = summary.file_count + summary.directory_count;
+    if (summary.quota >= 0) {
+        st.f_files = summary.quota;
+        st.f_ffree = (st.f_files > names) ? st.f_files - names : 0;
+    } else {
+        st.f_ffree = STATFS_UNBOUNDED_FILES;
+        st.f_files = names + st.f_ffree;
+    }
+    st.f_favail = st.f_ffree;
+
+    fuse_reply_statfs(req, &st);
+}
+
+/* ============================================================================
+ * Directory related functions
+ *
+ * opendir starts one server-side enumeration (a paged webhdfs_dir_t) and
+ * readdir streams it into the kernel buffer, so memory stays bounded by a
+ * listing page whatever the directory size. Offsets are entry ordinals:
+ * 0 and 1 are "." and "..", then one per entry. An entry that does not
+ * fit in the reply is held back for the next call. Seeking backwards
+ * (rewinddir) restarts the enumeration and skips forward.
+ */
+#define DIRENT_UNKNOWN_INO          (0xffffffff)
+
+struct dir_cursor {
+    pthread_mutex_t lock;
+    webhdfs_dir_t * dir;
+    char *          path;
+    fuse_ino_t      ino;
+    off_t           offset;         /* ordinal of the next entry to emit */
+    char *          pending;        /* read from the listing, not emitted */
+    fuse_ino_t      pending_ino;
+    mode_t          pending_mode;
+};
+
+static void __dir_cursor_drop_pending (struct dir_cursor *cursor) {
+    free(cursor->pending);
+    cursor->pending = NULL;
+}
+
+/* Read the next listing entry into pending. Returns 1 at the end */
+static int __dir_cursor_fetch (struct dir_cursor *cursor) {
     const webhdfs_fstat_t *stat;
-    webhdfs_dir_t *dir;
+    fuse_ino_t ino = 0;
+    char *child;
+    int changed;
 
-    if ((dir = webhdfs_dir_open(__WEBHDFS, path)) == NULL)
-        return(-EIO);
+    if (cursor->pending != NULL)
+        return(0);
+
+    if (cursor->dir == NULL || (stat = webhdfs_dir_read(cursor->dir)) == NULL)
+        return(1);
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+    /* A listing is a free change check for the inodes we know */
+    if ((child = __path_join(cursor->path, stat->path)) != NULL) {
+        ino = __inode_get(child, stat, 0, &changed);
+        if (changed)
+            __notify_push(NOTIFY_INODE, ino, NULL);
+        free(child);
+    }
 
-    while ((stat = webhdfs_dir_read(dir)) != NULL)
-        filler(buf, stat->path, NULL, 0);
+    if ((cursor->pending = strdup(stat->path)) == NULL)
+        return(1);
 
-    webhdfs_dir_close(dir);
+    cursor->pending_ino = ino ? ino : DIRENT_UNKNOWN_INO;
+    cursor->pending_mode = __hdfs_is_dir(stat) ? S_IFDIR : S_IFREG;
     return(0);
 }
 
+static int __dir_cursor_seek (struct dir_cursor *cursor, off_t offset) {
+    if (offset < cursor->offset) {
+        __dir_cursor_drop_pending(cursor);
+        if (cursor->dir != NULL)
+            webhdfs_dir_close(cursor->dir);
+        if ((cursor->dir = webhdfs_dir_open(__WEBHDFS, cursor->path)) == NULL)
+            return(1);
+        cursor->offset = 0;
+    }
+
+    while (cursor->offset < offset) {
+        if (cursor->offset >= 2 && __dir_cursor_fetch(cursor))
+            break;
+        __dir_cursor_drop_pending(cursor);
+        cursor->offset++;
+    }
+    return(0);
+}
+
+static void webhdfs_fuse_opendir (fuse_req_t req,
+                                  fuse_ino_t ino,
+                                  struct fuse_file_info *ffi)
+{
+    struct dir_cursor *cursor;
+
+    if ((cursor = (struct dir_cursor *) calloc(1, sizeof(struct dir_cursor))) == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    if ((cursor->path = __inode_path(ino)) == NULL) {
+        fuse_reply_err(req, ENOENT);
+        free(cursor);
+        return;
+    }
+
+    if ((cursor->dir = webhdfs_dir_open(__WEBHDFS, cursor->path)) == NULL) {
+        fuse_reply_err(req, EIO);
+        free(cursor->path);
+        free(cursor);
+        return;
+    }
+
+    pthread_mutex_init(&(cursor->lock), NULL);
+    cursor->ino = ino;
+    ffi->fh = (uint64_t)cursor;
+    fuse_reply_open(req, ffi);
+}
+
+static void webhdfs_fuse_readdir (fuse_req_t req,
+                                  fuse_ino_t ino,
+                                  size_t size,
+                                  off_t offset,
+                                  struct fuse_file_info *ffi)
+{
+    struct dir_cursor *cursor = (struct dir_cursor *)ffi->fh;
+    struct stat stat;
+    const char *name;
+    size_t used, n;
+    char *buffer;
+
+    if ((buffer = (char *) malloc(size)) == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    pthread_mutex_lock(&(cursor->lock));
+    if (offset != cursor->offset && __dir_cursor_seek(cursor, offset)) {
+        pthread_mutex_unlock(&(cursor->lock));
+        fuse_reply_err(req, EIO);
+        free(buffer);
+        return;
+    }
+
+    memset(&stat, 0, sizeof(struct stat));
+    for (used = 0; ; used += n) {
+        if (cursor->offset == 0) {
+            name = ".";
+            stat.st_ino = cursor->ino;
+            stat.st_mode = S_IFDIR;
+        } else if (cursor->offset == 1) {
+            name = "..";
+            stat.st_ino = DIRENT_UNKNOWN_INO;
+            stat.st_mode = S_IFDIR;
+        } else if (__dir_cursor_fetch(cursor)) {
+            break;
+        } else {
+            name = cursor->pending;
+            stat.st_ino = cursor->pending_ino;
+            stat.st_mode = cursor->pending_mode;
+        }
+
+        n = fuse_add_direntry(req, buffer + used, size - used, name, &stat, cursor->offset + 1);
+        if (n > size - used)
+            break;
+
+        __dir_cursor_drop_pending(cursor);
+        cursor->offset++;
+    }
+    pthread_mutex_unlock(&(cursor->lock));
+
+    fuse_reply_buf(req, buffer, used);
+    free(buffer);
+}
+
+static void webhdfs_fuse_releasedir (fuse_req_t req,
+                                     fuse_ino_t ino,
+                                     struct fuse_file_info *ffi)
+{
+    struct dir_cursor *cursor = (struct dir_cursor *)ffi->fh;
+
+    if (cursor->dir != NULL)
+        webhdfs_dir_close(cursor->dir);
+    pthread_mutex_destroy(&(cursor->lock));
+    free(cursor->pending);
+    free(cursor->path);
+    free(cursor);
+    fuse_reply_err(req, 0);
+}
+
 static void __signal_sigsegv (int signo) {
     void *buffer[10];
     char **symbols;
@@ -392,58 +1396,119 @@ static void __signal_sigsegv (int signo) {
     abort();
 }
 
-static struct fuse_operations webhdfs_fuse_ops = {
+static struct fuse_lowlevel_ops webhdfs_fuse_ops = {
     /* Metadata */
-    .statfs         = webhdfs_fuse_statfs,
+    .lookup         = webhdfs_fuse_lookup,
+    .forget         = webhdfs_fuse_forget,
     .getattr        = webhdfs_fuse_getattr,
-    .chmod          = webhdfs_fuse_chmod,
-    .chown          = webhdfs_fuse_chown,
-    .utime          = webhdfs_fuse_utime,
-    .utimens        = webhdfs_fuse_utimens,
+    .setattr        = webhdfs_fuse_setattr,
 
     /* Namespace */
     .create         = webhdfs_fuse_create,
     .open           = webhdfs_fuse_open,
-    .truncate       = webhdfs_fuse_truncate,
-    .ftruncate      = webhdfs_fuse_ftruncate,
-    .release        = webhdfs_fuse_close,
+    .release        = webhdfs_fuse_release,
     .mkdir          = webhdfs_fuse_mkdir,
     .rmdir          = webhdfs_fuse_rmdir,
     .unlink         = webhdfs_fuse_unlink,
     .rename         = webhdfs_fuse_rename,
-    .link           = webhdfs_fuse_link,
-    .symlink        = webhdfs_fuse_symlink,
-    .readlink       = webhdfs_fuse_readlink,
 
     /* Object */
     .read           = webhdfs_fuse_read,
     .write          = webhdfs_fuse_write,
     .fsync          = webhdfs_fuse_fsync,
+
+    /* Filesystem */
+    .statfs         = webhdfs_fuse_statfs,
+
+    /* Directory */
+    .opendir        = webhdfs_fuse_opendir,
     .readdir        = webhdfs_fuse_readdir,
-    .ioctl          = NULL,
-    .lock           = NULL,
+    .releasedir     = webhdfs_fuse_releasedir,
+};
+
+#define WEBHDFS_FUSE_OPT(templ, field)                                  \
+    { templ, offsetof(struct webhdfs_fuse_opts, field), 0 }
+
+static const struct fuse_opt __webhdfs_fuse_opt_spec[] = {
+    WEBHDFS_FUSE_OPT("conf=%s", conf),
+    WEBHDFS_FUSE_OPT("entry_timeout=%lf", entry_timeout),
+    WEBHDFS_FUSE_OPT("attr_timeout=%lf", attr_timeout),
+    WEBHDFS_FUSE_OPT("negative_timeout=%lf", negative_timeout),
+    FUSE_OPT_END
 };
 
+/*
+ * Low-level session: the multi-threaded loop runs unless -s is given, so
+ * callbacks run concurrently sharing one webhdfs_t (see webhdfs.h).
+ * Kernel cache lifetimes come from -o entry_timeout/attr_timeout/
+ * negative_timeout; remote changes seen by lookup, getattr or a listing
+ * are invalidated explicitly.
+ */
 int main (int argc, char **argv) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    int multithreaded, foreground;
+    struct fuse_session *se;
+    char *mountpoint = NULL;
     webhdfs_conf_t *conf;
-    int res;
+    char *error = NULL;
+    int res = 1;
 
     if (signal(SIGSEGV, __signal_sigsegv) == SIG_ERR) {
         fprintf(stderr, "Failed to initialize signals\n");
         return(EXIT_FAILURE);
     }
 
-    if ((conf = webhdfs_conf_load("server.conf")) == NULL)
+    __OPTS.conf = NULL;
+    __OPTS.entry_timeout = 1.0;
+    __OPTS.attr_timeout = 1.0;
+    __OPTS.negative_timeout = 0.0;
+
+    if (fuse_opt_parse(&args, &__OPTS, __webhdfs_fuse_opt_spec, NULL) == -1 ||
+        fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1 ||
+        mountpoint == NULL)
+    {
+        fprintf(stderr, "usage: %s mountpoint [-o conf=server.conf,entry_timeout=1,"
+                        "attr_timeout=1,negative_timeout=0] [fuse options]\n", argv[0]);
+        return(EXIT_FAILURE);
+    }
+
+    if ((conf = webhdfs_conf_load(__OPTS.conf ? __OPTS.conf : "server.conf", &error)) == NULL) {
+        fprintf(stderr, "%s: %s\n", __OPTS.conf ? __OPTS.conf : "server.conf",
+                error != NULL ? error : "load failed");
+        free(error);
         return(EXIT_FAILURE);
+    }
 
-    if (webhdfs_fuse_connect(conf) < 0)
+    if (__inode_table_init() || webhdfs_fuse_open_log() < 0)
         return(EXIT_FAILURE);
 
-    res = fuse_main(argc, argv, &webhdfs_fuse_ops, NULL);
+    if ((__webhdfs_fuse.chan = fuse_mount(mountpoint, &args)) != NULL) {
+        se = fuse_lowlevel_new(&args, &webhdfs_fuse_ops, sizeof(webhdfs_fuse_ops), NULL);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, __webhdfs_fuse.chan);
+                fuse_daemonize(foreground);
+
+                /* After fuse_daemonize(): threads do not survive the fork */
+                if (!webhdfs_fuse_connect(conf) && !__notify_start()) {
+                    res = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                    __notify_stop();
+                }
+
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(__webhdfs_fuse.chan);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, __webhdfs_fuse.chan);
+    }
 
     webhdfs_fuse_disconnect();
     webhdfs_conf_free(conf);
+    __inode_table_free();
+    fuse_opt_free_args(&args);
+    free(__OPTS.conf);
+    free(mountpoint);
 
-    return(res);
+    return(res ? EXIT_FAILURE : EXIT_SUCCESS);
 }
-
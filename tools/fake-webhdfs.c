@@ -0,0 +1,2266 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * In-memory WebHDFS stand-in. The namenode port serves metadata and
+ * redirects OPEN/CREATE/APPEND/GETFILECHECKSUM to the datanode port,
+ * which moves the bytes. Every connection gets its own thread and is
+ * kept alive across requests. Latency, bandwidth and error injection
+ * are configured from the command line.
+ */
+
+#include <netinet/tcp.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#define NODE_FILE           (1)
+#define NODE_DIR            (2)
+
+#define HASH_MIN_BUCKETS    (1024)
+#define IO_BUFFER_SIZE      (64 << 10)
+#define BLOCK_SIZE          (128 << 20)
+#define BYTES_PER_CRC       (512)
+
+/* ============================================================================
+ *  options
+ */
+struct fake_opts {
+    const char *host;               /* host advertised in redirects */
+    int         nn_port;
+    int         dn_port;
+    unsigned    nn_latency_ms;
+    unsigned    dn_latency_ms;
+    unsigned    jitter_ms;
+    uint64_t    bandwidth;          /* datanode bytes/s per connection, 0 = off */
+    double      error_rate;         /* fraction of requests failed with 500 */
+    double      stall_rate;         /* fraction of datanode requests stalled */
+    unsigned    stall_ms;           /* ...for this long (a sick datanode) */
+    size_t      ls_limit;           /* LISTSTATUS_BATCH page size (dfs.ls.limit) */
+    volatile int standby;           /* HA standby: reject every namenode op */
+    unsigned    capacity;           /* namenode requests served at once, 0 = unbounded */
+    unsigned    token_life_s;       /* delegation token renew interval */
+    size_t      block_size;         /* for stat and checksums */
+    unsigned    seed;               /* for jitter and injected faults */
+    int         verbose;
+};
+
+static struct fake_opts __opts;
+
+/* The namenode's handler pool: requests beyond capacity queue up */
+static pthread_mutex_t __busy_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t __busy_cond = PTHREAD_COND_INITIALIZER;
+static unsigned __busy;
+
+/* ============================================================================
+ *  growable byte buffer
+ */
+struct sbuf {
+    char  *data;
+    size_t size;
+    size_t capacity;
+};
+
+static int sbuf_reserve (struct sbuf *b, size_t size) {
+    char *data;
+    size_t cap;
+
+    if (size <= b->capacity)
+        return(0);
+
+    cap = b->capacity ? b->capacity : 256;
+    while (cap < size)
+        cap <<= 1;
+
+    if ((data = (char *) realloc(b->data, cap)) == NULL)
+        return(1);
+
+    b->data = data;
+    b->capacity = cap;
+    return(0);
+}
+
+static int sbuf_append (struct sbuf *b, const void *data, size_t size) {
+    if (sbuf_reserve(b, b->size + size + 1))
+        return(1);
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+    b->data[b->size] = '\0';
+    return(0);
+}
+
+static int sbuf_printf (struct sbuf *b, const char *frmt, ...) {
+    va_list ap;
+    int n;
+
+    va_start(ap, frmt);
+    n = vsnprintf(NULL, 0, frmt, ap);
+    va_end(ap);
+
+    if (sbuf_reserve(b, b->size + n + 1))
+        return(1);
+
+    va_start(ap, frmt);
+    vsnprintf(b->data + b->size, n + 1, frmt, ap);
+    va_end(ap);
+
+    b->size += n;
+    return(0);
+}
+
+static void sbuf_json_string (struct sbuf *b, const char *str) {
+    sbuf_append(b, "\"", 1);
+    for (; *str != '\0'; ++str) {
+        if (*str == '"' || *str == '\\')
+            sbuf_printf(b, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            sbuf_printf(b, "\\u%04x", *str);
+        else
+            sbuf_append(b, str, 1);
+    }
+    sbuf_append(b, "\"", 1);
+}
+
+static void sbuf_free (struct sbuf *b) {
+    free(b->data);
+    b->data = NULL;
+    b->size = b->capacity = 0;
+}
+
+/* ============================================================================
+ *  namespace
+ */
+struct node {
+    struct node  *hnext;
+    struct node  *parent;
+    char         *path;
+    const char   *name;             /* last component, inside path */
+    int           type;
+    int           hidden;           /* not listed by the parent (.snapshot) */
+    int           permission;
+    int           replication;
+    char          owner[64];
+    char          group[64];
+    uint64_t      mtime;
+    uint64_t      atime;
+    uint64_t      file_id;
+    uint64_t      origin_id;        /* snapshot copies: the live node's id */
+    unsigned char *data;
+    size_t        size;
+    size_t        capacity;
+    struct node **children;
+    size_t        nchildren;
+    size_t        cchildren;
+    int           sorted;
+};
+
+struct namespace {
+    pthread_rwlock_t lock;
+    struct node    **buckets;
+    size_t           nbuckets;
+    size_t           nnodes;
+    uint64_t         next_id;
+    struct node     *root;
+};
+
+static struct namespace __ns;
+
+static uint64_t __now_msec (void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return((uint64_t)tv.tv_sec * 1000U + tv.tv_usec / 1000U);
+}
+
+static uint32_t __hash (const char *str) {
+    uint32_t h = 2166136261U;
+    while (*str != '\0') {
+        h ^= (unsigned char)*str++;
+        h *= 16777619U;
+    }
+    return(h);
+}
+
+static void __ns_rehash (void) {
+    struct node **buckets;
+    size_t nbuckets;
+    size_t i;
+
+    nbuckets = __ns.nbuckets << 1;
+    if ((buckets = (struct node **) calloc(nbuckets, sizeof(struct node *))) == NULL)
+        return;
+
+    for (i = 0; i < __ns.nbuckets; ++i) {
+        struct node *node = __ns.buckets[i];
+        while (node != NULL) {
+            struct node *next = node->hnext;
+            uint32_t h = __hash(node->path) & (nbuckets - 1);
+            node->hnext = buckets[h];
+            buckets[h] = node;
+            node = next;
+        }
+    }
+
+    free(__ns.buckets);
+    __ns.buckets = buckets;
+    __ns.nbuckets = nbuckets;
+}
+
+static void __ns_hash_insert (struct node *node) {
+    uint32_t h;
+
+    if (__ns.nnodes >= __ns.nbuckets)
+        __ns_rehash();
+
+    h = __hash(node->path) & (__ns.nbuckets - 1);
+    node->hnext = __ns.buckets[h];
+    __ns.buckets[h] = node;
+    __ns.nnodes++;
+}
+
+static void __ns_hash_remove (struct node *node) {
+    struct node **p = &(__ns.buckets[__hash(node->path) & (__ns.nbuckets - 1)]);
+
+    for (; *p != NULL; p = &((*p)->hnext)) {
+        if (*p == node) {
+            *p = node->hnext;
+            __ns.nnodes--;
+            return;
+        }
+    }
+}
+
+static struct node *ns_lookup (const char *path) {
+    struct node *node = __ns.buckets[__hash(path) & (__ns.nbuckets - 1)];
+
+    for (; node != NULL; node = node->hnext) {
+        if (!strcmp(node->path, path))
+            return(node);
+    }
+    return(NULL);
+}
+
+static void __node_set_path (struct node *node, char *path) {
+    const char *p;
+
+    free(node->path);
+    node->path = path;
+    p = strrchr(path, '/');
+    node->name = (p != NULL && p[1] != '\0') ? p + 1 : path + strlen(path);
+}
+
+static void __node_add_child (struct node *parent, struct node *child) {
+    if (parent->nchildren == parent->cchildren) {
+        size_t n = parent->cchildren ? parent->cchildren << 1 : 8;
+        struct node **c = (struct node **) realloc(parent->children, n * sizeof(struct node *));
+        if (c == NULL)
+            return;
+        parent->children = c;
+        parent->cchildren = n;
+    }
+
+    child->parent = parent;
+    if (!child->hidden)
+        parent->children[parent->nchildren++] = child;
+    parent->sorted = 0;
+    parent->mtime = __now_msec();
+}
+
+static void __node_del_child (struct node *parent, struct node *child) {
+    size_t i;
+
+    for (i = 0; i < parent->nchildren; ++i) {
+        if (parent->children[i] == child) {
+            parent->children[i] = parent->children[--parent->nchildren];
+            parent->sorted = 0;
+            break;
+        }
+    }
+    parent->mtime = __now_msec();
+}
+
+static int __node_cmp (const void *a, const void *b) {
+    return(strcmp((*(struct node * const *)a)->name, (*(struct node * const *)b)->name));
+}
+
+static void ns_sort_children (struct node *dir) {
+    if (!dir->sorted) {
+        qsort(dir->children, dir->nchildren, sizeof(struct node *), __node_cmp);
+        dir->sorted = 1;
+    }
+}
+
+/* Parent path of an absolute, normalized path */
+static char *__parent_path (const char *path) {
+    const char *p = strrchr(path, '/');
+    if (p == NULL || p == path)
+        return(strdup("/"));
+    return(strndup(path, p - path));
+}
+
+static struct node *ns_create (const char *path, int type, const char *owner, int permission) {
+    struct node *parent;
+    struct node *node;
+    char *ppath;
+
+    ppath = __parent_path(path);
+    parent = ns_lookup(ppath);
+    free(ppath);
+
+    if (parent == NULL || parent->type != NODE_DIR)
+        return(NULL);
+
+    if ((node = (struct node *) calloc(1, sizeof(struct node))) == NULL)
+        return(NULL);
+
+    __node_set_path(node, strdup(path));
+    node->type = type;
+    node->hidden = !strcmp(node->name, ".snapshot");
+    node->permission = permission;
+    node->replication = (type == NODE_FILE) ? 3 : 0;
+    node->mtime = node->atime = __now_msec();
+    node->file_id = ++__ns.next_id;
+    snprintf(node->owner, sizeof(node->owner), "%s", owner);
+    snprintf(node->group, sizeof(node->group), "supergroup");
+    node->sorted = 1;
+
+    __ns_hash_insert(node);
+    __node_add_child(parent, node);
+    return(node);
+}
+
+static struct node *ns_mkdirs (const char *path, const char *owner, int permission) {
+    struct node *node;
+    char *ppath;
+
+    if ((node = ns_lookup(path)) != NULL)
+        return(node->type == NODE_DIR ? node : NULL);
+
+    ppath = __parent_path(path);
+    node = ns_mkdirs(ppath, owner, permission);
+    free(ppath);
+
+    if (node == NULL)
+        return(NULL);
+
+    return(ns_create(path, NODE_DIR, owner, permission));
+}
+
+/* Hidden children (.snapshot) are not in the list, look them up */
+static struct node *__node_snapshot_dir (const struct node *node) {
+    struct sbuf path = {NULL, 0, 0};
+    struct node *snap;
+
+    if (node->type != NODE_DIR)
+        return(NULL);
+
+    sbuf_printf(&path, "%s/.snapshot", strcmp(node->path, "/") ? node->path : "");
+    snap = ns_lookup(path.data);
+    sbuf_free(&path);
+    return(snap);
+}
+
+static void __ns_free_subtree (struct node *node) {
+    struct node *snap;
+    size_t i;
+
+    if ((snap = __node_snapshot_dir(node)) != NULL)
+        __ns_free_subtree(snap);
+
+    for (i = 0; i < node->nchildren; ++i)
+        __ns_free_subtree(node->children[i]);
+
+    __ns_hash_remove(node);
+    free(node->children);
+    free(node->data);
+    free(node->path);
+    free(node);
+}
+
+static void ns_delete (struct node *node) {
+    __node_del_child(node->parent, node);
+    __ns_free_subtree(node);
+}
+
+static void __ns_repath (struct node *node, const char *prefix, size_t old_len) {
+    struct node *snap = __node_snapshot_dir(node);
+    struct sbuf path = {NULL, 0, 0};
+    size_t i;
+
+    if (snap != NULL)
+        __ns_repath(snap, prefix, old_len);
+
+    __ns_hash_remove(node);
+    sbuf_printf(&path, "%s%s", prefix, node->path + old_len);
+    __node_set_path(node, path.data);
+    __ns_hash_insert(node);
+
+    for (i = 0; i < node->nchildren; ++i)
+        __ns_repath(node->children[i], prefix, old_len);
+}
+
+static int ns_rename (struct node *node, const char *dst) {
+    struct node *parent;
+    char *ppath;
+
+    ppath = __parent_path(dst);
+    parent = ns_lookup(ppath);
+    free(ppath);
+
+    if (parent == NULL || parent->type != NODE_DIR || ns_lookup(dst) != NULL)
+        return(1);
+
+    /* Can't move a directory under itself */
+    if (!strncmp(dst, node->path, strlen(node->path)) && dst[strlen(node->path)] == '/')
+        return(1);
+
+    __node_del_child(node->parent, node);
+    __ns_repath(node, dst, strlen(node->path));
+    __node_add_child(parent, node);
+    return(0);
+}
+
+static struct node *__ns_copy_subtree (struct node *src, const char *dst) {
+    struct sbuf cpath = {NULL, 0, 0};
+    struct node *node;
+    size_t i;
+
+    if ((node = ns_create(dst, src->type, src->owner, src->permission)) == NULL)
+        return(NULL);
+
+    node->origin_id = src->origin_id ? src->origin_id : src->file_id;
+    node->replication = src->replication;
+    node->mtime = src->mtime;
+    node->atime = src->atime;
+    snprintf(node->group, sizeof(node->group), "%s", src->group);
+    if (src->size > 0 && (node->data = (unsigned char *) malloc(src->size)) != NULL) {
+        memcpy(node->data, src->data, src->size);
+        node->size = node->capacity = src->size;
+    }
+
+    for (i = 0; i < src->nchildren; ++i) {
+        cpath.size = 0;
+        sbuf_printf(&cpath, "%s/%s", dst, src->children[i]->name);
+        __ns_copy_subtree(src->children[i], cpath.data);
+    }
+    sbuf_free(&cpath);
+    return(node);
+}
+
+static int ns_init (void) {
+    if (pthread_rwlock_init(&(__ns.lock), NULL))
+        return(1);
+
+    __ns.nbuckets = HASH_MIN_BUCKETS;
+    if ((__ns.buckets = (struct node **) calloc(__ns.nbuckets, sizeof(struct node *))) == NULL)
+        return(1);
+
+    if ((__ns.root = (struct node *) calloc(1, sizeof(struct node))) == NULL)
+        return(1);
+
+    __node_set_path(__ns.root, strdup("/"));
+    __ns.root->type = NODE_DIR;
+    __ns.root->permission = 0755;
+    __ns.root->mtime = __ns.root->atime = __now_msec();
+    __ns.root->file_id = ++__ns.next_id;
+    __ns.root->sorted = 1;
+    snprintf(__ns.root->owner, sizeof(__ns.root->owner), "hdfs");
+    snprintf(__ns.root->group, sizeof(__ns.root->group), "supergroup");
+    __ns_hash_insert(__ns.root);
+    return(0);
+}
+
+/* ============================================================================
+ *  http
+ */
+struct conn {
+    int          fd;
+    int          datanode;
+    struct sbuf  in;                /* received, not yet consumed bytes */
+};
+
+struct request {
+    char         method[16];
+    char        *path;              /* decoded fs path */
+    char        *query;
+    int          keep_alive;
+    int          expect_continue;
+    long         content_length;
+    int          chunked;
+    struct sbuf  body;
+};
+
+struct response {
+    int          code;
+    const char  *content_type;
+    struct sbuf  headers;
+    struct sbuf  body;
+};
+
+static const char *__http_reason (int code) {
+    switch (code) {
+        case 100: return("Continue");
+        case 200: return("OK");
+        case 201: return("Created");
+        case 307: return("Temporary Redirect");
+        case 400: return("Bad Request");
+        case 401: return("Unauthorized");
+        case 403: return("Forbidden");
+        case 404: return("Not Found");
+        case 500: return("Internal Server Error");
+        case 503: return("Service Unavailable");
+    }
+    return("Unknown");
+}
+
+static int __write_all (int fd, const void *data, size_t size) {
+    const char *p = (const char *)data;
+    ssize_t wr;
+
+    while (size > 0) {
+        if ((wr = send(fd, p, size, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return(1);
+        }
+        p += wr;
+        size -= wr;
+    }
+    return(0);
+}
+
+static void __sleep_usec (uint64_t usec) {
+    struct timespec ts;
+    ts.tv_sec = usec / 1000000U;
+    ts.tv_nsec = (usec % 1000000U) * 1000U;
+    while (nanosleep(&ts, &ts) && errno == EINTR);
+}
+
+static uint64_t __now_usec (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t)ts.tv_sec * 1000000U + ts.tv_nsec / 1000U);
+}
+
+/* Paced write: keep the connection at or below the configured bandwidth */
+static int __write_paced (struct conn *conn, const void *data, size_t size) {
+    const char *p = (const char *)data;
+    uint64_t start;
+    size_t sent = 0;
+
+    if (!conn->datanode || __opts.bandwidth == 0)
+        return(__write_all(conn->fd, data, size));
+
+    start = __now_usec();
+    while (sent < size) {
+        size_t n = size - sent;
+        uint64_t due;
+
+        if (n > IO_BUFFER_SIZE)
+            n = IO_BUFFER_SIZE;
+        if (__write_all(conn->fd, p + sent, n))
+            return(1);
+        sent += n;
+
+        due = start + (sent * 1000000U) / __opts.bandwidth;
+        if (due > __now_usec())
+            __sleep_usec(due - __now_usec());
+    }
+    return(0);
+}
+
+/* Fill conn->in until it holds at least `size` bytes */
+static int __conn_fill (struct conn *conn, size_t size) {
+    ssize_t rd;
+
+    while (conn->in.size < size) {
+        if (sbuf_reserve(&(conn->in), conn->in.size + IO_BUFFER_SIZE + 1))
+            return(1);
+
+        if ((rd = recv(conn->fd, conn->in.data + conn->in.size, IO_BUFFER_SIZE, 0)) <= 0) {
+            if (rd < 0 && errno == EINTR)
+                continue;
+            return(1);
+        }
+        conn->in.size += rd;
+        conn->in.data[conn->in.size] = '\0';
+    }
+    return(0);
+}
+
+static void __conn_consume (struct conn *conn, size_t size) {
+    memmove(conn->in.data, conn->in.data + size, conn->in.size - size);
+    conn->in.size -= size;
+    if (conn->in.data != NULL)
+        conn->in.data[conn->in.size] = '\0';
+}
+
+static int __conn_read_line (struct conn *conn, struct sbuf *line) {
+    char *eol;
+
+    while ((eol = (conn->in.data != NULL) ? strstr(conn->in.data, "\r\n") : NULL) == NULL) {
+        if (__conn_fill(conn, conn->in.size + 1))
+            return(1);
+    }
+
+    line->size = 0;
+    sbuf_append(line, conn->in.data, eol - conn->in.data);
+    __conn_consume(conn, (eol - conn->in.data) + 2);
+    return(0);
+}
+
+static int __hexval (int c) {
+    if (c >= '0' && c <= '9') return(c - '0');
+    if (c >= 'a' && c <= 'f') return(c - 'a' + 10);
+    if (c >= 'A' && c <= 'F') return(c - 'A' + 10);
+    return(-1);
+}
+
+static char *__url_decode (const char *src, size_t size) {
+    char *dst, *p;
+    size_t i;
+
+    if ((dst = p = (char *) malloc(size + 1)) == NULL)
+        return(NULL);
+
+    for (i = 0; i < size; ++i) {
+        if (src[i] == '%' && i + 2 < size &&
+            __hexval(src[i + 1]) >= 0 && __hexval(src[i + 2]) >= 0)
+        {
+            *p++ = (char)(__hexval(src[i + 1]) * 16 + __hexval(src[i + 2]));
+            i += 2;
+        } else if (src[i] == '+') {
+            *p++ = ' ';
+        } else {
+            *p++ = src[i];
+        }
+    }
+    *p = '\0';
+    return(dst);
+}
+
+/* Normalize to "/a/b": leading slash, no duplicate or trailing slashes */
+static char *__normalize_path (const char *path) {
+    char *norm, *p;
+
+    if ((norm = p = (char *) malloc(strlen(path) + 2)) == NULL)
+        return(NULL);
+
+    *p++ = '/';
+    for (; *path != '\0'; ++path) {
+        if (*path == '/' && p[-1] == '/')
+            continue;
+        *p++ = *path;
+    }
+    if (p > norm + 1 && p[-1] == '/')
+        p--;
+    *p = '\0';
+    return(norm);
+}
+
+static const char *query_get (const struct request *req, const char *key, char *value, size_t size) {
+    size_t klen = strlen(key);
+    const char *p = req->query;
+
+    while (p != NULL && *p != '\0') {
+        size_t n = strcspn(p, "&");
+        if (n > klen && p[klen] == '=' && !strncasecmp(p, key, klen)) {
+            char *v = __url_decode(p + klen + 1, n - klen - 1);
+            if (v == NULL)
+                return(NULL);
+            snprintf(value, size, "%s", v);
+            free(v);
+            return(value);
+        }
+        p += n;
+        if (*p == '&')
+            p++;
+    }
+    return(NULL);
+}
+
+static long long query_get_ll (const struct request *req, const char *key, long long def) {
+    char value[64];
+    if (query_get(req, key, value, sizeof(value)) == NULL)
+        return(def);
+    return(strtoll(value, NULL, 10));
+}
+
+static int query_get_octal (const struct request *req, const char *key, int def) {
+    char value[16];
+    if (query_get(req, key, value, sizeof(value)) == NULL)
+        return(def);
+    return(strtol(value, NULL, 8));
+}
+
+static int __read_body (struct conn *conn, struct request *req) {
+    struct sbuf line = {NULL, 0, 0};
+
+    if (req->expect_continue) {
+        static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        if (__write_all(conn->fd, cont, sizeof(cont) - 1))
+            return(1);
+    }
+
+    if (req->chunked) {
+        for (;;) {
+            size_t n;
+
+            if (__conn_read_line(conn, &line))
+                goto _fail;
+            if ((n = strtoul(line.data ? line.data : "0", NULL, 16)) == 0)
+                break;
+            if (__conn_fill(conn, n + 2))
+                goto _fail;
+            sbuf_append(&(req->body), conn->in.data, n);
+            __conn_consume(conn, n + 2);
+        }
+
+        /* trailers up to the empty line */
+        do {
+            if (__conn_read_line(conn, &line))
+                goto _fail;
+        } while (line.size > 0);
+    } else if (req->content_length > 0) {
+        if (__conn_fill(conn, req->content_length))
+            goto _fail;
+        sbuf_append(&(req->body), conn->in.data, req->content_length);
+        __conn_consume(conn, req->content_length);
+    }
+
+    sbuf_free(&line);
+    return(0);
+
+_fail:
+    sbuf_free(&line);
+    return(1);
+}
+
+static int __read_request (struct conn *conn, struct request *req) {
+    struct sbuf line = {NULL, 0, 0};
+    char *target, *version, *q;
+
+    memset(req, 0, sizeof(struct request));
+
+    if (__conn_read_line(conn, &line) || line.size == 0)
+        goto _fail;
+
+    /* METHOD TARGET VERSION */
+    if ((target = strchr(line.data, ' ')) == NULL)
+        goto _fail;
+    *target++ = '\0';
+    if ((version = strchr(target, ' ')) == NULL)
+        goto _fail;
+    *version++ = '\0';
+
+    snprintf(req->method, sizeof(req->method), "%s", line.data);
+    req->keep_alive = !strcmp(version, "HTTP/1.1");
+
+    if ((q = strchr(target, '?')) != NULL) {
+        req->query = strdup(q + 1);
+        *q = '\0';
+    }
+
+    if (!strncmp(target, "/webhdfs/v1", 11))
+        target += 11;
+
+    {
+        char *decoded = __url_decode(target, strlen(target));
+        req->path = __normalize_path(decoded ? decoded : "/");
+        free(decoded);
+    }
+
+    for (;;) {
+        if (__conn_read_line(conn, &line))
+            goto _fail;
+        if (line.size == 0)
+            break;
+
+        if (!strncasecmp(line.data, "Content-Length:", 15))
+            req->content_length = strtol(line.data + 15, NULL, 10);
+        else if (!strncasecmp(line.data, "Transfer-Encoding:", 18) && strstr(line.data, "chunked"))
+            req->chunked = 1;
+        else if (!strncasecmp(line.data, "Expect:", 7) && strstr(line.data, "100"))
+            req->expect_continue = 1;
+        else if (!strncasecmp(line.data, "Connection:", 11))
+            req->keep_alive = strstr(line.data, "close") == NULL;
+    }
+
+    sbuf_free(&line);
+    return(0);
+
+_fail:
+    sbuf_free(&line);
+    return(1);
+}
+
+static void __request_free (struct request *req) {
+    free(req->path);
+    free(req->query);
+    sbuf_free(&(req->body));
+}
+
+static int __send_response (struct conn *conn, struct request *req, struct response *res) {
+    struct sbuf head = {NULL, 0, 0};
+    int r;
+
+    sbuf_printf(&head, "HTTP/1.1 %d %s\r\n", res->code, __http_reason(res->code));
+    if (res->content_type != NULL)
+        sbuf_printf(&head, "Content-Type: %s\r\n", res->content_type);
+    sbuf_printf(&head, "Content-Length: %zu\r\n", res->body.size);
+    if (!req->keep_alive)
+        sbuf_printf(&head, "Connection: close\r\n");
+    if (res->headers.size > 0)
+        sbuf_append(&head, res->headers.data, res->headers.size);
+    sbuf_append(&head, "\r\n", 2);
+
+    r = __write_all(conn->fd, head.data, head.size);
+    if (!r && res->body.size > 0)
+        r = __write_paced(conn, res->body.data, res->body.size);
+
+    sbuf_free(&head);
+    return(r);
+}
+
+/* ============================================================================
+ *  responses
+ */
+#define JSON_TYPE       "application/json"
+
+static void res_exception (struct response *res, int code,
+                           const char *exception, const char *java_class,
+                           const char *frmt, ...)
+{
+    char message[1024];
+    va_list ap;
+
+    va_start(ap, frmt);
+    vsnprintf(message, sizeof(message), frmt, ap);
+    va_end(ap);
+
+    res->code = code;
+    res->content_type = JSON_TYPE;
+    res->body.size = 0;
+    sbuf_printf(&(res->body), "{\"RemoteException\":{\"exception\":\"%s\","
+                              "\"javaClassName\":\"%s\",\"message\":",
+                exception, java_class);
+    sbuf_json_string(&(res->body), message);
+    sbuf_printf(&(res->body), "}}");
+}
+
+#define res_not_found(res, path)                                            \
+    res_exception(res, 404, "FileNotFoundException",                        \
+                  "java.io.FileNotFoundException", "File does not exist: %s", path)
+
+static void res_json (struct response *res, const char *frmt, ...) {
+    va_list ap;
+    int n;
+
+    va_start(ap, frmt);
+    n = vsnprintf(NULL, 0, frmt, ap);
+    va_end(ap);
+
+    res->code = 200;
+    res->content_type = JSON_TYPE;
+    res->body.size = 0;
+    sbuf_reserve(&(res->body), n + 1);
+    va_start(ap, frmt);
+    vsnprintf(res->body.data, n + 1, frmt, ap);
+    va_end(ap);
+    res->body.size = n;
+}
+
+static void res_boolean (struct response *res, int value) {
+    res_json(res, "{\"boolean\":%s}", value ? "true" : "false");
+}
+
+static void res_empty (struct response *res, int code) {
+    res->code = code;
+    res->content_type = NULL;
+    res->body.size = 0;
+}
+
+static void __file_status (struct sbuf *b, const struct node *node, const char *suffix) {
+    sbuf_printf(b, "{\"accessTime\":%llu,\"blockSize\":%llu,\"childrenNum\":%zu,"
+                   "\"fileId\":%llu,\"group\":",
+                (unsigned long long)(node->type == NODE_FILE ? node->atime : 0),
+                (unsigned long long)(node->type == NODE_FILE ? __opts.block_size : 0),
+                node->nchildren, (unsigned long long)node->file_id);
+    sbuf_json_string(b, node->group);
+    sbuf_printf(b, ",\"length\":%zu,\"modificationTime\":%llu,\"owner\":",
+                node->type == NODE_FILE ? node->size : 0,
+                (unsigned long long)node->mtime);
+    sbuf_json_string(b, node->owner);
+    sbuf_printf(b, ",\"pathSuffix\":");
+    sbuf_json_string(b, suffix);
+    sbuf_printf(b, ",\"permission\":\"%o\",\"replication\":%d,\"storagePolicy\":0,"
+                   "\"type\":\"%s\"}",
+                node->permission, node->replication,
+                node->type == NODE_FILE ? "FILE" : "DIRECTORY");
+}
+
+static void __redirect (struct response *res, const struct request *req) {
+    res_empty(res, 307);
+    sbuf_printf(&(res->headers), "Location: http://%s:%d/webhdfs/v1%s?%s\r\n",
+                __opts.host, __opts.dn_port, req->path, req->query ? req->query : "");
+}
+
+/* ============================================================================
+ *  delegation tokens: valid for token_life_s per renewal, 7 times that in all
+ */
+#define TOKENS_MAX          (1024)
+
+struct token {
+    char        id[96];
+    char        owner[64];
+    uint64_t    expires;
+    uint64_t    max_date;
+};
+
+static pthread_mutex_t __tokens_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct token __tokens[TOKENS_MAX];
+
+static struct token *__token_find (const char *id) {
+    int i;
+    for (i = 0; i < TOKENS_MAX; ++i) {
+        if (__tokens[i].id[0] != '\0' && !strcmp(__tokens[i].id, id))
+            return(&(__tokens[i]));
+    }
+    return(NULL);
+}
+
+static void __invalid_token (struct response *res, const char *id, const char *why) {
+    res_exception(res, 403, "InvalidToken",
+                  "org.apache.hadoop.security.token.SecretManager$InvalidToken",
+                  "token (%s) %s", id, why);
+}
+
+/* A request carrying delegation=: 0 if the token is good, owner set */
+static int __token_check (const struct request *req, struct response *res,
+                          char *owner, size_t size)
+{
+    struct token *token;
+    char id[96];
+    int err = 0;
+
+    if (query_get(req, "delegation", id, sizeof(id)) == NULL)
+        return(0);
+
+    pthread_mutex_lock(&__tokens_lock);
+    if ((token = __token_find(id)) == NULL) {
+        __invalid_token(res, id, "can't be found in cache");
+        err = 1;
+    } else if (token->expires < __now_msec()) {
+        __invalid_token(res, id, "is expired");
+        err = 1;
+    } else if (owner != NULL) {
+        snprintf(owner, size, "%s", token->owner);
+    }
+    pthread_mutex_unlock(&__tokens_lock);
+    return(err);
+}
+
+static const char *__user (const struct request *req, char *user, size_t size) {
+    if (query_get(req, "user.name", user, size) == NULL) {
+        user[0] = '\0';
+        if (__token_check(req, NULL, user, size) || user[0] == '\0')
+            snprintf(user, size, "webhdfs");
+    }
+    return(user);
+}
+
+/* ============================================================================
+ *  namenode ops
+ */
+static void op_getfilestatus (struct request *req, struct response *res) {
+    struct node *node;
+
+    pthread_rwlock_rdlock(&(__ns.lock));
+    if ((node = ns_lookup(req->path)) == NULL) {
+        res_not_found(res, req->path);
+    } else {
+        res_json(res, "{\"FileStatus\":");
+        __file_status(&(res->body), node, "");
+        sbuf_append(&(res->body), "}", 1);
+    }
+    pthread_rwlock_unlock(&(__ns.lock));
+}
+
+static void op_liststatus (struct request *req, struct response *res) {
+    struct node *node;
+    size_t i;
+
+    /* Sorting mutates the directory, take the write lock */
+    pthread_rwlock_wrlock(&(__ns.lock));
+    if ((node = ns_lookup(req->path)) == NULL) {
+        res_not_found(res, req->path);
+    } else {
+        res_json(res, "{\"FileStatuses\":{\"FileStatus\":[");
+        if (node->type == NODE_FILE) {
+            __file_status(&(res->body), node, "");
+        } else {
+            ns_sort_children(node);
+            for (i = 0; i < node->nchildren; ++i) {
+                if (i > 0)
+                    sbuf_append(&(res->body), ",", 1);
+                __file_status(&(res->body), node->children[i], node->children[i]->name);
+            }
+        }
+        sbuf_printf(&(res->body), "]}}");
+    }
+    pthread_rwlock_unlock(&(__ns.lock));
+}
+
+/* Paged listing: entries strictly after startAfter, ls_limit at a time */
+static void op_liststatus_batch (struct request *req, struct response *res) {
+    char after[4096];
+    size_t lo, hi, mid, end, i;
+    struct node *node;
+
+    if (query_get(req, "startAfter", after, sizeof(after)) == NULL)
+        after[0] = '\0';
+
+    pthread_rwlock_wrlock(&(__ns.lock));
+    if ((node = ns_lookup(req->path)) == NULL) {
+        res_not_found(res, req->path);
+    } else if (node->type == NODE_FILE) {
+        res_json(res, "{\"DirectoryListing\":{\"partialListing\":{\"FileStatuses\":"
+                      "{\"FileStatus\":[");
+        __file_status(&(res->body), node, "");
+        sbuf_printf(&(res->body), "]}},\"remainingEntries\":0}}");
+    } else {
+        ns_sort_children(node);
+
+        lo = 0;
+        hi = node->nchildren;
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if (strcmp(node->children[mid]->name, after) <= 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        end = (node->nchildren - lo > __opts.ls_limit) ? lo + __opts.ls_limit : node->nchildren;
+        res_json(res, "{\"DirectoryListing\":{\"partialListing\":{\"FileStatuses\":"
+                      "{\"FileStatus\":[");
+        for (i = lo; i < end; ++i) {
+            if (i > lo)
+                sbuf_append(&(res->body), ",", 1);
+            __file_status(&(res->body), node->children[i], node->children[i]->name);
+        }
+        sbuf_printf(&(res->body), "]}},\"remainingEntries\":%zu}}", node->nchildren - end);
+    }
+    pthread_rwlock_unlock(&(__ns.lock));
+}
+
+static void __content_summary (const struct node *node, uint64_t *length,
+                               uint64_t *files, uint64_t *dirs)
+{
+    size_t i;
+
+    if (node->type == NODE_FILE) {
+        *length += node->size;
+        *files += 1;
+        return;
+    }
+
+    *dirs += 1;
+    for (i = 0; i < node->nchildren; ++i)
+        __content_summary(node->children[i], length, files, dirs);
+}
+
+static void op_getcontentsummary (struct request *req, struct response *res) {
+    uint64_t length = 0, files = 0, dirs = 0;
+    struct node *node;
+
+    pthread_rwlock_rdlock(&(__ns.lock));
+    if ((node = ns_lookup(req->path)) == NULL) {
+        res_not_found(res, req->path);
+    } else {
+        __content_summary(node, &length, &files, &dirs);
+        res_json(res, "{\"ContentSummary\":{\"directoryCount\":%llu,\"fileCount\":%llu,"
+                      "\"length\":%llu,\"quota\":-1,\"spaceConsumed\":%llu,"
+                      "\"spaceQuota\":-1}}",
+                 (unsigned long long)dirs, (unsigned long long)files,
+                 (unsigned long long)length, (unsigned long long)length * 3);
+    }
+    pthread_rwlock_unlock(&(__ns.lock));
+}
+
+static void op_gethomedirectory (struct request *req, struct response *res) {
+    char user[64];
+    res_json(res, "{\"Path\":\"/user/%s\"}", __user(req, user, sizeof(user)));
+}
+
+static void op_mkdirs (struct request *req, struct response *res) {
+    int perm = query_get_octal(req, "permission", 0755);
+    char user[64];
+
+    pthread_rwlock_wrlock(&(__ns.lock));
+    res_boolean(res, ns_mkdirs(req->path, __user(req, user, sizeof(user)), perm) != NULL);
+    pthread_rwlock_unlock(&(__ns.lock));
+}
+
+static void op_rename (struct request *req, struct response *res) {
+    char dst[4096];
+    struct node *node;
+    char *norm;
+
+    if (query_get(req, "destination", dst, sizeof(dst)) == NULL) {
+        res_exception(res, 400, "IllegalArgumentException",
+                      "java.lang.IllegalArgumentException", "Missing destination");
+        return;
+    }
+
+    norm = __normalize_path(dst);
+    pthread_rwlock_wrlock(&(__ns.lock));
+    if ((node = ns_lookup(req->path)) == NULL || node == __ns.root)
+        res_boolean(res, 0);
+    else
+        res_boolean(res, !ns_rename(node, norm));
+    pthread_rwlock_unlock(&(__ns.lock));
+    free(norm);
+}
+
+static void op_delete (struct request *req, struct response *res) {
+    char recursive[8] = "false";
+    struct node *node;
+
+    query_get(req, "recursive", recursive, sizeof(recursive));
+
+    pthread_rwlock_wrlock(&(__ns.lock));
+    if ((node = ns_lookup(req->path)) == NULL || node == __ns.root) {
+        res_boolean(res, 0);
+    } else if (node->type == NODE_DIR && node->nchildren > 0 && strcmp(recursive, "true")) {
+        res_exception(res, 403, "PathIsNotEmptyDirectoryException",
+                      "org.apache.hadoop.fs.PathIsNotEmptyDirectoryException",
+                      "`%s is non empty': Directory is not empty", req->path);
+    } else {
+        ns_delete(node);
+        res_boolean(res, 1);
+    }
+    pthread_rwlock_unlock(&(__ns.lock));
+}
+
+static void op_setpermission (struct request *req, struct response *res) {
+    struct node *node;
+
+    pthread_rwlock_wrlock(&(__ns.lock));
+    if ((node = ns_lookup(req->path)) == NULL) {
+        res_not_found(res, req->path);
+    } else {
+        node->permission = query_get_octal(req, "permission", 0755) & 01777;
+        res_empty(res, 200);
+    }
+    pthread_rwlock_unlock(&(__ns.lock));
+}
+
+static void op_setowner (struct request *req, struct response *res) {
+    char owner[64], group[64];
+    struct node *node;
+
+    pthread_rwlock_wrlock(&(__ns.lock));
+    if ((node = ns_lookup(req->path)) == NULL) {
+        res_not_found(res, req->path);
+    } else {
+        if (query_get(req, "owner", owner, sizeof(owner)) != NULL ||
+            query_get(req, "user", owner, sizeof(owner)) != NULL)
+        {
+            snprintf(node->owner, sizeof(node->owner), "%s", owner);
+        }
+        if (query_get(req, "group", group, sizeof(group)) != NULL)
+            snprintf(node->group, sizeof(node->group), "%s", group);
+        res_empty(res, 200);
+    }
+    pthread_rwlock_unlock(&(__ns.lock));
+}
+
+static void op_setreplication (struct request *req, struct response *res) {
+    struct node *node;
+
+    pthread_rwlock_wrlock(&(__ns.lock));
+    if ((node = ns_lookup(req->path)) == NULL || node->type != NODE_FILE) {
+        res_boolean(res, 0);
+    } else {
+        node->replication = query_get_ll(req, "replication", node->replication);
+        res_boolean(res, 1);
+    }
+    pthread_rwlock_unlock(&(__ns.lock));
+}
+
+static void op_settimes (struct request *req, struct response *res) {
+    struct node *node;
+    long long t;
+
+    pthread_rwlock_wrlock(&(__ns.lock));
+    if ((node = ns_lookup(req->path)) == NULL) {
+        res_not_found(res, req->path);
+    } else {
+        if ((t = query_get_ll(req, "modificationtime", -1)) >= 0)
+            node->mtime = t;
+        if ((t = query_get_ll(req, "accesstime", -1)) >= 0)
+            node->atime = t;
+        res_empty(res, 200);
+    }
+    pthread_rwlock_unlock(&(__ns.lock));
+}
+
+static void op_concat (struct request *req, struct response *res) {
+    char sources[8192];
+    struct node *target;
+    char *src, *save;
+
+    if (query_get(req, "sources", sources, sizeof(sources)) == NULL) {
+        res_exception(res, 400, "IllegalArgumentException",
+                      "java.lang.IllegalArgumentException", "Missing sources");
+        return;
+    }
+
+    pthread_rwlock_wrlock(&(__ns.lock));
+    if ((target = ns_lookup(req->path)) == NULL || target->type != NODE_FILE) {
+        res_not_found(res, req->path);
+        pthread_rwlock_unlock(&(__ns.lock));
+        return;
+    }
+
+    res_empty(res, 200);
+    for (src = strtok_r(sources, ",", &save); src != NULL; src = strtok_r(NULL, ",", &save)) {
+        char *norm = __normalize_path(src);
+        struct node *node = ns_lookup(norm);
+
+        if (node == NULL || node->type != NODE_FILE || node == target) {
+            res_not_found(res, norm);
+            free(norm);
+            break;
+        }
+
+        if (node->size > 0) {
+            unsigned char *data = (unsigned char *) realloc(target->data, target->size + node->size);
+            if (data == NULL) {
+                free(norm);
+                break;
+            }
+            memcpy(data + target->size, node->data, node->size);
+            target->data = data;
+            target->size += node->size;
+            target->capacity = target->size;
+        }
+
+        ns_delete(node);
+        free(norm);
+    }
+    target->mtime = __now_msec();
+    pthread_rwlock_unlock(&(__ns.lock));
+}
+
+static void op_truncate (struct request *req, struct response *res) {
+    long long length = query_get_ll(req, "newlength", -1);
+    struct node *node;
+
+    pthread_rwlock_wrlock(&(__ns.lock));
+    if ((node = ns_lookup(req->path)) == NULL || node->type != NODE_FILE) {
+        res_not_found(res, req->path);
+    } else if (length < 0 || (size_t)length > node->size) {
+        res_exception(res, 400, "HadoopIllegalArgumentException",
+                      "org.apache.hadoop.HadoopIllegalArgumentException",
+                      "Cannot truncate to a larger file size");
+    } else {
+        node->size = length;
+        node->mtime = __now_msec();
+        res_boolean(res, 1);
+    }
+    pthread_rwlock_unlock(&(__ns.lock));
+}
+
+/* ============================================================================
+ *  snapshots
+ */
+static void op_createsnapshot (struct request *req, struct response *res) {
+    struct sbuf path = {NULL, 0, 0};
+    char name[256];
+    struct node *dir;
+
+    if (query_get(req, "snapshotname", name, sizeof(name)) == NULL) {
+        struct tm tm;
+        time_t now = time(NULL);
+        gmtime_r(&now, &tm);
+        strftime(name, sizeof(name), "s%Y%m%d-%H%M%S", &tm);
+    }
+
+    pthread_rwlock_wrlock(&(__ns.lock));
+    if ((dir = ns_lookup(req->path)) == NULL || dir->type != NODE_DIR) {
+        res_not_found(res, req->path);
+    } else {
+        const char *base = strcmp(dir->path, "/") ? dir->path : "";
+        struct sbuf child = {NULL, 0, 0};
+        size_t i;
+
+        sbuf_printf(&path, "%s/.snapshot", base);
+        if (ns_lookup(path.data) == NULL)
+            ns_create(path.data, NODE_DIR, dir->owner, 0555);
+
+        sbuf_printf(&path, "/%s", name);
+        if (ns_lookup(path.data) != NULL) {
+            res_exception(res, 403, "SnapshotException",
+                          "org.apache.hadoop.hdfs.protocol.SnapshotException",
+                          "Snapshot %s already exists", name);
+        } else {
+            struct node *snap = ns_create(path.data, NODE_DIR, dir->owner, dir->permission);
+            for (i = 0; snap != NULL && i < dir->nchildren; ++i) {
+                child.size = 0;
+                sbuf_printf(&child, "%s/%s", path.data, dir->children[i]->name);
+                __ns_copy_subtree(dir->children[i], child.data);
+            }
+            res_json(res, "{\"Path\":");
+            sbuf_json_string(&(res->body), path.data);
+            sbuf_append(&(res->body), "}", 1);
+        }
+        sbuf_free(&child);
+    }
+    pthread_rwlock_unlock(&(__ns.lock));
+    sbuf_free(&path);
+}
+
+static struct node *__snapshot_lookup (const char *dir, const char *name) {
+    struct sbuf path = {NULL, 0, 0};
+    struct node *node;
+
+    sbuf_printf(&path, "%s/.snapshot/%s", strcmp(dir, "/") ? dir : "", name);
+    node = ns_lookup(path.data);
+    sbuf_free(&path);
+    return(node);
+}
+
+static void op_deletesnapshot (struct request *req, struct response *res) {
+    struct node *snap;
+    char name[256];
+
+    query_get(req, "snapshotname", name, sizeof(name));
+
+    pthread_rwlock_wrlock(&(__ns.lock));
+    if ((snap = __snapshot_lookup(req->path, name)) == NULL) {
+        res_exception(res, 403, "SnapshotException",
+                      "org.apache.hadoop.hdfs.protocol.SnapshotException",
+                      "Cannot delete snapshot %s from path %s", name, req->path);
+    } else {
+        ns_delete(snap);
+        res_empty(res, 200);
+    }
+    pthread_rwlock_unlock(&(__ns.lock));
+}
+
+static void op_renamesnapshot (struct request *req, struct response *res) {
+    char oldname[256], newname[256];
+    struct sbuf dst = {NULL, 0, 0};
+    struct node *snap;
+
+    query_get(req, "oldsnapshotname", oldname, sizeof(oldname));
+    query_get(req, "snapshotname", newname, sizeof(newname));
+
+    pthread_rwlock_wrlock(&(__ns.lock));
+    if ((snap = __snapshot_lookup(req->path, oldname)) == NULL) {
+        res_exception(res, 403, "SnapshotException",
+                      "org.apache.hadoop.hdfs.protocol.SnapshotException",
+                      "The snapshot %s does not exist for directory %s", oldname, req->path);
+    } else {
+        sbuf_printf(&dst, "%s/.snapshot/%s", strcmp(req->path, "/") ? req->path : "", newname);
+        if (ns_rename(snap, dst.data))
+            res_exception(res, 403, "SnapshotException",
+                          "org.apache.hadoop.hdfs.protocol.SnapshotException",
+                          "The snapshot %s already exists for directory %s", newname, req->path);
+        else
+            res_empty(res, 200);
+    }
+    pthread_rwlock_unlock(&(__ns.lock));
+    sbuf_free(&dst);
+}
+
+/*
+ * GETSNAPSHOTDIFF compares two trees node by node, matching nodes by
+ * the id of the live node they were copied from, so a rename is seen
+ * as one. Like HDFS, only the topmost created or deleted node of a
+ * subtree is reported, and the paths of created, modified and deleted
+ * nodes, and rename sources, are those of the earlier tree.
+ */
+struct diff_ident {
+    uint64_t     id;
+    struct node *node;
+};
+
+struct diff_index {
+    struct diff_ident *ids;         /* every node under a root, by id */
+    size_t             nids;
+    size_t             cids;
+};
+
+struct diff {
+    struct node       *from;
+    struct node       *to;
+    struct diff_index  earlier;
+    struct diff_index  later;
+    struct sbuf        list;
+    size_t             count;
+};
+
+static uint64_t __diff_ident (const struct diff *diff, const struct node *node) {
+    if (node == diff->from || node == diff->to)
+        return(0);
+    return(node->origin_id ? node->origin_id : node->file_id);
+}
+
+static const char *__diff_rel (const struct node *root, const struct node *node) {
+    return(node->path + strlen(root->path) + (strcmp(root->path, "/") != 0));
+}
+
+static int __diff_ident_cmp (const void *a, const void *b) {
+    uint64_t x = ((const struct diff_ident *)a)->id;
+    uint64_t y = ((const struct diff_ident *)b)->id;
+    return((x > y) - (x < y));
+}
+
+static void __diff_index_add (const struct diff *diff,
+                              struct diff_index *index,
+                              struct node *node)
+{
+    struct diff_ident *ids;
+    size_t i;
+
+    for (i = 0; i < node->nchildren; ++i) {
+        if (index->nids == index->cids) {
+            index->cids = index->cids ? index->cids * 2 : 64;
+            if ((ids = (struct diff_ident *) realloc(index->ids,
+                                                     index->cids * sizeof(struct diff_ident))) == NULL)
+                return;
+            index->ids = ids;
+        }
+        index->ids[index->nids].id = __diff_ident(diff, node->children[i]);
+        index->ids[index->nids].node = node->children[i];
+        index->nids++;
+        __diff_index_add(diff, index, node->children[i]);
+    }
+}
+
+static void __diff_index (const struct diff *diff, struct diff_index *index, struct node *root) {
+    __diff_index_add(diff, index, root);
+    qsort(index->ids, index->nids, sizeof(struct diff_ident), __diff_ident_cmp);
+}
+
+static struct node *__diff_find (const struct diff_index *index, uint64_t id) {
+    struct diff_ident key = {id, NULL}, *found;
+
+    found = (struct diff_ident *) bsearch(&key, index->ids, index->nids,
+                                          sizeof(struct diff_ident), __diff_ident_cmp);
+    return((found != NULL) ? found->node : NULL);
+}
+
+static void __diff_add (struct diff *diff, const char *type, const char *source, const char *target) {
+    if (diff->count++ > 0)
+        sbuf_append(&(diff->list), ",", 1);
+    sbuf_printf(&(diff->list), "{\"sourcePath\":");
+    sbuf_json_string(&(diff->list), source);
+    if (target != NULL) {
+        sbuf_printf(&(diff->list), ",\"targetPath\":");
+        sbuf_json_string(&(diff->list), target);
+    }
+    sbuf_printf(&(diff->list), ",\"type\":\"%s\"}", type);
+}
+
+/*
+ * dir is a directory of the later tree, at from_path in the earlier one;
+ * created directories are still searched for what was moved into them
+ */
+static void __diff_later (struct diff *diff, struct node *dir, const char *from_path, int created) {
+    struct sbuf path = {NULL, 0, 0};
+    struct node *node, *old;
+    size_t i;
+
+    for (i = 0; i < dir->nchildren; ++i) {
+        node = dir->children[i];
+        if ((old = __diff_find(&(diff->earlier), __diff_ident(diff, node))) == NULL) {
+            if (!created) {
+                path.size = 0;
+                sbuf_printf(&path, "%s%s%s", from_path, *from_path ? "/" : "", node->name);
+                __diff_add(diff, "CREATE", path.data, NULL);
+            }
+            if (node->type == NODE_DIR)
+                __diff_later(diff, node, "", 1);
+            continue;
+        }
+
+        if (__diff_ident(diff, old->parent) != __diff_ident(diff, dir) ||
+            strcmp(old->name, node->name) != 0)
+        {
+            __diff_add(diff, "RENAME", __diff_rel(diff->from, old), __diff_rel(diff->to, node));
+        }
+
+        if (node->type == NODE_DIR)
+            __diff_later(diff, node, __diff_rel(diff->from, old), 0);
+        else if (node->size != old->size || node->mtime != old->mtime)
+            __diff_add(diff, "MODIFY", __diff_rel(diff->from, old), NULL);
+    }
+    sbuf_free(&path);
+}
+
+static void __diff_earlier (struct diff *diff, struct node *dir) {
+    struct node *node;
+    size_t i;
+
+    for (i = 0; i < dir->nchildren; ++i) {
+        node = dir->children[i];
+        if (__diff_find(&(diff->later), __diff_ident(diff, node)) == NULL)
+            __diff_add(diff, "DELETE", __diff_rel(diff->from, node), NULL);
+        else
+            __diff_earlier(diff, node);
+    }
+}
+
+static void op_getsnapshotdiff (struct request *req, struct response *res) {
+    char oldname[256], newname[256] = "";
+    struct diff diff;
+
+    query_get(req, "oldsnapshotname", oldname, sizeof(oldname));
+    query_get(req, "snapshotname", newname, sizeof(newname));
+
+    memset(&diff, 0, sizeof(struct diff));
+    pthread_rwlock_rdlock(&(__ns.lock));
+    diff.from = __snapshot_lookup(req->path, oldname);
+    diff.to = (newname[0] != '\0') ? __snapshot_lookup(req->path, newname) : ns_lookup(req->path);
+    if (diff.from == NULL || diff.to == NULL) {
+        res_exception(res, 403, "SnapshotException",
+                      "org.apache.hadoop.hdfs.protocol.SnapshotException",
+                      "Cannot find the snapshot of directory %s with name %s",
+                      req->path, (diff.from == NULL) ? oldname : newname);
+    } else {
+        __diff_index(&diff, &(diff.earlier), diff.from);
+        __diff_index(&diff, &(diff.later), diff.to);
+        __diff_later(&diff, diff.to, "", 0);
+        __diff_earlier(&diff, diff.from);
+
+        /* HDFS lists the root as modified whenever anything changed */
+        res_json(res, "{\"SnapshotDiffReport\":{\"diffList\":[%s%s",
+                 diff.count ? "{\"sourcePath\":\"\",\"type\":\"MODIFY\"}," : "",
+                 diff.count ? diff.list.data : "");
+        sbuf_printf(&(res->body), "],\"fromSnapshot\":");
+        sbuf_json_string(&(res->body), oldname);
+        sbuf_printf(&(res->body), ",\"snapshotRoot\":");
+        sbuf_json_string(&(res->body), req->path);
+        sbuf_printf(&(res->body), ",\"toSnapshot\":");
+        sbuf_json_string(&(res->body), newname);
+        sbuf_append(&(res->body), "}}", 2);
+    }
+    pthread_rwlock_unlock(&(__ns.lock));
+    free(diff.earlier.ids);
+    free(diff.later.ids);
+    sbuf_free(&(diff.list));
+}
+
+/* ============================================================================
+ *  delegation tokens
+ */
+static void op_getdelegationtoken (struct request *req, struct response *res) {
+    static volatile unsigned long counter = 0;
+    uint64_t now = __now_msec();
+    struct token *token = NULL;
+    char user[64];
+    int i;
+
+    __user(req, user, sizeof(user));
+    pthread_mutex_lock(&__tokens_lock);
+    for (i = 0; i < TOKENS_MAX; ++i) {
+        /* Reuse free or expired slots */
+        if (__tokens[i].id[0] == '\0' || __tokens[i].expires < now) {
+            token = &(__tokens[i]);
+            break;
+        }
+    }
+
+    if (token == NULL) {
+        pthread_mutex_unlock(&__tokens_lock);
+        res_exception(res, 500, "IOException", "java.io.IOException", "too many tokens");
+        return;
+    }
+
+    snprintf(token->id, sizeof(token->id), "%s-%lx-%lx", user,
+             (unsigned long)time(NULL), __sync_add_and_fetch(&counter, 1));
+    snprintf(token->owner, sizeof(token->owner), "%s", user);
+    token->expires = now + __opts.token_life_s * 1000ULL;
+    token->max_date = now + 7 * __opts.token_life_s * 1000ULL;
+
+    res_json(res, "{\"Token\":{\"urlString\":\"%s\"}}", token->id);
+    pthread_mutex_unlock(&__tokens_lock);
+}
+
+static void op_renewdelegationtoken (struct request *req, struct response *res) {
+    uint64_t now = __now_msec();
+    struct token *token;
+    char id[96] = "";
+
+    query_get(req, "token", id, sizeof(id));
+    pthread_mutex_lock(&__tokens_lock);
+    if ((token = __token_find(id)) == NULL) {
+        __invalid_token(res, id, "can't be found in cache");
+    } else if (token->expires < now || token->max_date < now) {
+        __invalid_token(res, id, "tried to renew an expired token");
+    } else {
+        token->expires = now + __opts.token_life_s * 1000ULL;
+        if (token->expires > token->max_date)
+            token->expires = token->max_date;
+        res_json(res, "{\"long\":%llu}", (unsigned long long)token->expires);
+    }
+    pthread_mutex_unlock(&__tokens_lock);
+}
+
+static void op_canceldelegationtoken (struct request *req, struct response *res) {
+    struct token *token;
+    char id[96] = "";
+
+    query_get(req, "token", id, sizeof(id));
+    pthread_mutex_lock(&__tokens_lock);
+    if ((token = __token_find(id)) == NULL) {
+        __invalid_token(res, id, "can't be found in cache");
+    } else {
+        token->id[0] = '\0';
+        res_empty(res, 200);
+    }
+    pthread_mutex_unlock(&__tokens_lock);
+}
+
+/* ============================================================================
+ *  datanode ops
+ */
+static void dn_open (struct request *req, struct response *res) {
+    long long offset = query_get_ll(req, "offset", 0);
+    long long length = query_get_ll(req, "length", -1);
+    struct node *node;
+
+    pthread_rwlock_rdlock(&(__ns.lock));
+    if ((node = ns_lookup(req->path)) == NULL) {
+        res_not_found(res, req->path);
+    } else if (node->type != NODE_FILE) {
+        res_exception(res, 404, "FileNotFoundException", "java.io.FileNotFoundException",
+                      "Path is not a file: %s", req->path);
+    } else if (offset < 0 || (size_t)offset > node->size) {
+        res_exception(res, 403, "IOException", "java.io.IOException",
+                      "Offset=%lld out of the range [0, %zu); OPEN, path=%s",
+                      offset, node->size, req->path);
+    } else {
+        size_t avail = node->size - offset;
+        if (length < 0 || (size_t)length > avail)
+            length = avail;
+
+        res->code = 200;
+        res->content_type = "application/octet-stream";
+        res->body.size = 0;
+        sbuf_append(&(res->body), node->data + offset, length);
+    }
+    pthread_rwlock_unlock(&(__ns.lock));
+}
+
+static void dn_write (struct request *req, struct response *res, int append) {
+    char overwrite[8] = "false";
+    struct node *node;
+    char *ppath;
+    char user[64];
+
+    query_get(req, "overwrite", overwrite, sizeof(overwrite));
+
+    pthread_rwlock_wrlock(&(__ns.lock));
+    node = ns_lookup(req->path);
+    if (append) {
+        if (node == NULL || node->type != NODE_FILE) {
+            res_not_found(res, req->path);
+            goto _unlock;
+        }
+    } else {
+        if (node != NULL && (node->type != NODE_FILE || strcmp(overwrite, "true"))) {
+            res_exception(res, 403, "FileAlreadyExistsException",
+                          "org.apache.hadoop.fs.FileAlreadyExistsException",
+                          "%s already exists", req->path);
+            goto _unlock;
+        }
+
+        if (node == NULL) {
+            ppath = __parent_path(req->path);
+            ns_mkdirs(ppath, __user(req, user, sizeof(user)), 0755);
+            free(ppath);
+
+            node = ns_create(req->path, NODE_FILE, __user(req, user, sizeof(user)),
+                             query_get_octal(req, "permission", 0644));
+            if (node == NULL) {
+                res_exception(res, 403, "ParentNotDirectoryException",
+                              "org.apache.hadoop.fs.ParentNotDirectoryException",
+                              "Parent path is not a directory: %s", req->path);
+                goto _unlock;
+            }
+        }
+        node->size = 0;
+        if ((node->replication = query_get_ll(req, "replication", 3)) <= 0)
+            node->replication = 3;
+    }
+
+    if (req->body.size > 0) {
+        if (node->size + req->body.size > node->capacity) {
+            size_t cap = node->capacity ? node->capacity : 4096;
+            unsigned char *data;
+
+            while (cap < node->size + req->body.size)
+                cap <<= 1;
+            if ((data = (unsigned char *) realloc(node->data, cap)) == NULL) {
+                res_exception(res, 500, "IOException", "java.io.IOException", "Out of memory");
+                goto _unlock;
+            }
+            node->data = data;
+            node->capacity = cap;
+        }
+        memcpy(node->data + node->size, req->body.data, req->body.size);
+        node->size += req->body.size;
+    }
+
+    node->mtime = __now_msec();
+    res_empty(res, append ? 200 : 201);
+    if (!append) {
+        sbuf_printf(&(res->headers), "Location: hdfs://%s:%d%s\r\n",
+                    __opts.host, __opts.nn_port, req->path);
+    }
+
+_unlock:
+    pthread_rwlock_unlock(&(__ns.lock));
+}
+
+/* ============================================================================
+ *  file checksum: MD5 of the blocks' MD5 of their CRC32C per 512 bytes
+ */
+struct md5 {
+    uint32_t      state[4];
+    uint64_t      bytes;
+    unsigned char buffer[64];
+};
+
+static void __md5_block (uint32_t state[4], const unsigned char *p) {
+    static const uint32_t k[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+    };
+    static const int r[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t x[16], f, t;
+    int i, g;
+
+    for (i = 0; i < 16; ++i) {
+        x[i] = (uint32_t)p[i * 4] | ((uint32_t)p[i * 4 + 1] << 8) |
+               ((uint32_t)p[i * 4 + 2] << 16) | ((uint32_t)p[i * 4 + 3] << 24);
+    }
+
+    for (i = 0; i < 64; ++i) {
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+        t = a + f + k[i] + x[g];
+        a = d;
+        d = c;
+        c = b;
+        b += (t << r[(i / 16) * 4 + i % 4]) | (t >> (32 - r[(i / 16) * 4 + i % 4]));
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+static void md5_init (struct md5 *md5) {
+    md5->state[0] = 0x67452301;
+    md5->state[1] = 0xefcdab89;
+    md5->state[2] = 0x98badcfe;
+    md5->state[3] = 0x10325476;
+    md5->bytes = 0;
+}
+
+static void md5_update (struct md5 *md5, const void *data, size_t n) {
+    const unsigned char *p = (const unsigned char *)data;
+
+    while (n-- > 0) {
+        md5->buffer[md5->bytes++ & 63] = *p++;
+        if ((md5->bytes & 63) == 0)
+            __md5_block(md5->state, md5->buffer);
+    }
+}
+
+static void md5_final (struct md5 *md5, unsigned char digest[16]) {
+    uint64_t nbits = md5->bytes * 8;
+    unsigned char c = 0x80;
+    int i;
+
+    md5_update(md5, &c, 1);
+    c = 0;
+    while ((md5->bytes & 63) != 56)
+        md5_update(md5, &c, 1);
+    for (i = 0; i < 8; ++i) {
+        c = (unsigned char)(nbits >> (i * 8));
+        md5_update(md5, &c, 1);
+    }
+
+    for (i = 0; i < 16; ++i)
+        digest[i] = (unsigned char)(md5->state[i / 4] >> ((i % 4) * 8));
+}
+
+static pthread_once_t __crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t __crc32c_table[256];
+
+static void __crc32c_init (void) {
+    uint32_t crc;
+    int i, k;
+
+    for (i = 0; i < 256; ++i) {
+        crc = i;
+        for (k = 0; k < 8; ++k)
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78U : crc >> 1;
+        __crc32c_table[i] = crc;
+    }
+}
+
+static uint32_t __crc32c (const unsigned char *p, size_t n) {
+    uint32_t crc;
+
+    pthread_once(&__crc32c_once, __crc32c_init);
+    crc = ~0U;
+    while (n-- > 0)
+        crc = __crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return(~crc);
+}
+
+static void dn_getfilechecksum (struct request *req, struct response *res) {
+    unsigned char digest[16], be[4];
+    struct md5 file_md5, block_md5;
+    uint64_t crc_per_block;
+    struct node *node;
+    size_t off, end, n, capacity = 32;
+    uint32_t crc;
+    char hex[33];
+    int i;
+
+    pthread_rwlock_rdlock(&(__ns.lock));
+    if ((node = ns_lookup(req->path)) == NULL || node->type != NODE_FILE) {
+        res_not_found(res, req->path);
+        pthread_rwlock_unlock(&(__ns.lock));
+        return;
+    }
+
+    md5_init(&file_md5);
+    for (off = 0; off < node->size; off = end) {
+        end = (node->size - off > __opts.block_size) ? off + __opts.block_size : node->size;
+
+        md5_init(&block_md5);
+        for (; off < end; off += n) {
+            n = (end - off > BYTES_PER_CRC) ? BYTES_PER_CRC : end - off;
+            crc = __crc32c((const unsigned char *)node->data + off, n);
+            be[0] = crc >> 24;
+            be[1] = crc >> 16;
+            be[2] = crc >> 8;
+            be[3] = crc;
+            md5_update(&block_md5, be, 4);
+        }
+        md5_final(&block_md5, digest);
+        md5_update(&file_md5, digest, 16);
+    }
+
+    /* The block MD5s are hashed with the rest of their buffer: zeros */
+    while (capacity < file_md5.bytes)
+        capacity *= 2;
+    memset(digest, 0, sizeof(digest));
+    while (file_md5.bytes < capacity)
+        md5_update(&file_md5, digest, 16);
+    md5_final(&file_md5, digest);
+
+    /* Like the namenode: CRCs per block are only told for several blocks */
+    crc_per_block = (node->size > __opts.block_size) ? __opts.block_size / BYTES_PER_CRC : 0;
+    pthread_rwlock_unlock(&(__ns.lock));
+
+    for (i = 0; i < 16; ++i)
+        sprintf(hex + i * 2, "%02x", digest[i]);
+    res_json(res, "{\"FileChecksum\":{\"algorithm\":\"MD5-of-%lluMD5-of-%dCRC32C\","
+                  "\"bytes\":\"%08x%016llx%s\",\"length\":28}}",
+             (unsigned long long)crc_per_block, BYTES_PER_CRC,
+             BYTES_PER_CRC, (unsigned long long)crc_per_block, hex);
+}
+
+/* ============================================================================
+ *  dispatch
+ */
+typedef void (*op_func_t) (struct request *req, struct response *res);
+
+struct op_entry {
+    const char *method;
+    const char *op;
+    op_func_t   nn;                 /* NULL: redirect to the datanode */
+};
+
+static const struct op_entry __ops[] = {
+    { "GET",    "GETFILESTATUS",          op_getfilestatus },
+    { "GET",    "LISTSTATUS",             op_liststatus },
+    { "GET",    "LISTSTATUS_BATCH",       op_liststatus_batch },
+    { "GET",    "GETCONTENTSUMMARY",      op_getcontentsummary },
+    { "GET",    "GETHOMEDIRECTORY",       op_gethomedirectory },
+    { "GET",    "GETDELEGATIONTOKEN",     op_getdelegationtoken },
+    { "GET",    "GETSNAPSHOTDIFF",        op_getsnapshotdiff },
+    { "GET",    "OPEN",                   NULL },
+    { "GET",    "GETFILECHECKSUM",        NULL },
+    { "PUT",    "CREATE",                 NULL },
+    { "PUT",    "MKDIRS",                 op_mkdirs },
+    { "PUT",    "RENAME",                 op_rename },
+    { "PUT",    "SETPERMISSION",          op_setpermission },
+    { "PUT",    "SETOWNER",               op_setowner },
+    { "PUT",    "SETREPLICATION",         op_setreplication },
+    { "PUT",    "SETTIMES",               op_settimes },
+    { "PUT",    "RENEWDELEGATIONTOKEN",   op_renewdelegationtoken },
+    { "PUT",    "CANCELDELEGATIONTOKEN",  op_canceldelegationtoken },
+    { "PUT",    "CREATESNAPSHOT",         op_createsnapshot },
+    { "PUT",    "RENAMESNAPSHOT",         op_renamesnapshot },
+    { "POST",   "APPEND",                 NULL },
+    { "POST",   "CONCAT",                 op_concat },
+    { "POST",   "TRUNCATE",               op_truncate },
+    { "DELETE", "DELETE",                 op_delete },
+    { "DELETE", "DELETESNAPSHOT",         op_deletesnapshot },
+    { NULL, NULL, NULL },
+};
+
+static void __dispatch_datanode (struct request *req, struct response *res, const char *op) {
+    if (!strcmp(op, "OPEN"))
+        dn_open(req, res);
+    else if (!strcmp(op, "CREATE"))
+        dn_write(req, res, 0);
+    else if (!strcmp(op, "APPEND"))
+        dn_write(req, res, 1);
+    else if (!strcmp(op, "GETFILECHECKSUM"))
+        dn_getfilechecksum(req, res);
+    else
+        res_exception(res, 400, "IllegalArgumentException",
+                      "java.lang.IllegalArgumentException",
+                      "Invalid operation %s on the datanode", op);
+}
+
+/* rand() is not thread-safe: each connection thread has its own sequence */
+static __thread unsigned int __rand_seed = 0;
+
+static double __random (void) {
+    static unsigned int threads = 0;
+
+    if (__rand_seed == 0)
+        __rand_seed = __opts.seed * 2654435761U + __sync_add_and_fetch(&threads, 1);
+    return(rand_r(&__rand_seed) / (RAND_MAX + 1.0));
+}
+
+static void __dispatch (struct conn *conn, struct request *req, struct response *res) {
+    const struct op_entry *entry;
+    char op[64] = "";
+    unsigned latency;
+
+    query_get(req, "op", op, sizeof(op));
+    for (entry = __ops; entry->op != NULL; ++entry) {
+        if (!strcasecmp(entry->op, op) && !strcmp(entry->method, req->method))
+            break;
+    }
+
+    /* Injected faults and latency */
+    latency = conn->datanode ? __opts.dn_latency_ms : __opts.nn_latency_ms;
+    if (__opts.jitter_ms > 0)
+        latency += (unsigned)(__random() * (__opts.jitter_ms + 1));
+    if (conn->datanode && __opts.stall_rate > 0 && __random() < __opts.stall_rate)
+        latency += __opts.stall_ms;
+    if (latency > 0)
+        __sleep_usec((uint64_t)latency * 1000U);
+
+    if (!conn->datanode && __opts.standby) {
+        res_exception(res, 403, "StandbyException", "org.apache.hadoop.ipc.StandbyException",
+                      "Operation category READ is not supported in state standby");
+        return;
+    }
+
+    if (__opts.error_rate > 0 && __random() < __opts.error_rate) {
+        res_exception(res, 500, "IOException", "java.io.IOException",
+                      "Injected failure for %s %s", op, req->path);
+        return;
+    }
+
+    if (__token_check(req, res, NULL, 0))
+        return;
+
+    if (entry->op == NULL) {
+        res_exception(res, 400, "UnsupportedOperationException",
+                      "java.lang.UnsupportedOperationException",
+                      "Invalid value for webhdfs parameter \"op\": %s", op);
+    } else if (conn->datanode) {
+        __dispatch_datanode(req, res, entry->op);
+    } else if (entry->nn == NULL) {
+        __redirect(res, req);
+    } else {
+        entry->nn(req, res);
+    }
+}
+
+static void __capacity_acquire (const struct conn *conn) {
+    if (__opts.capacity == 0 || conn->datanode)
+        return;
+
+    pthread_mutex_lock(&__busy_lock);
+    while (__busy >= __opts.capacity)
+        pthread_cond_wait(&__busy_cond, &__busy_lock);
+    __busy++;
+    pthread_mutex_unlock(&__busy_lock);
+}
+
+static void __capacity_release (const struct conn *conn) {
+    if (__opts.capacity == 0 || conn->datanode)
+        return;
+
+    pthread_mutex_lock(&__busy_lock);
+    __busy--;
+    pthread_cond_signal(&__busy_cond);
+    pthread_mutex_unlock(&__busy_lock);
+}
+
+static void *__conn_thread (void *data) {
+    struct conn *conn = (struct conn *)data;
+    struct response res;
+    struct request req;
+
+    memset(&res, 0, sizeof(struct response));
+    for (;;) {
+        if (__read_request(conn, &req))
+            break;
+
+        if (__read_body(conn, &req)) {
+            __request_free(&req);
+            break;
+        }
+
+        res.code = 500;
+        res.content_type = NULL;
+        res.headers.size = 0;
+        res.body.size = 0;
+        __capacity_acquire(conn);
+        __dispatch(conn, &req, &res);
+        __capacity_release(conn);
+
+        if (__opts.verbose) {
+            fprintf(stderr, "%s %d %s %s?%s -> %d (%zu bytes)\n",
+                    conn->datanode ? "DN" : "NN", conn->fd, req.method,
+                    req.path, req.query ? req.query : "", res.code, res.body.size);
+        }
+
+        if (__send_response(conn, &req, &res) || !req.keep_alive) {
+            __request_free(&req);
+            break;
+        }
+        __request_free(&req);
+    }
+
+    sbuf_free(&(res.headers));
+    sbuf_free(&(res.body));
+    sbuf_free(&(conn->in));
+    close(conn->fd);
+    free(conn);
+    return(NULL);
+}
+
+/* ============================================================================
+ *  listeners
+ */
+struct listener {
+    int fd;
+    int datanode;
+};
+
+static int __listen (int port) {
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket()");
+        return(-1);
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 1024)) {
+        perror("bind()/listen()");
+        close(fd);
+        return(-1);
+    }
+    return(fd);
+}
+
+static void *__accept_thread (void *data) {
+    struct listener *listener = (struct listener *)data;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int one = 1;
+    int fd;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 256 << 10);
+
+    for (;;) {
+        struct conn *conn;
+
+        if ((fd = accept(listener->fd, NULL, NULL)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept()");
+            break;
+        }
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if ((conn = (struct conn *) calloc(1, sizeof(struct conn))) == NULL) {
+            close(fd);
+            continue;
+        }
+
+        conn->fd = fd;
+        conn->datanode = listener->datanode;
+        if (pthread_create(&thread, &attr, __conn_thread, conn)) {
+            close(fd);
+            free(conn);
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+    return(NULL);
+}
+
+/* Simulates an HA transition */
+static void __toggle_standby (int signum) {
+    (void)signum;
+    __opts.standby = !__opts.standby;
+}
+
+static void __usage (const char *program) {
+    fprintf(stderr, "usage: %s [options]\n", program);
+    fprintf(stderr, "  -H host       host advertised in redirects (default: localhost)\n");
+    fprintf(stderr, "  -n port       namenode port (default: 50070)\n");
+    fprintf(stderr, "  -d port       datanode port (default: 50075)\n");
+    fprintf(stderr, "  -l msec       namenode latency per request\n");
+    fprintf(stderr, "  -L msec       datanode latency per request\n");
+    fprintf(stderr, "  -j msec       random extra latency (jitter)\n");
+    fprintf(stderr, "  -b bytes/s    datanode bandwidth cap per connection\n");
+    fprintf(stderr, "  -e rate       fraction of requests failed with 500 (0..1)\n");
+    fprintf(stderr, "  -w rate       fraction of datanode requests stalled (0..1)\n");
+    fprintf(stderr, "  -W msec       stall length (default: 2000)\n");
+    fprintf(stderr, "  -s seed       random seed for jitter/errors (default: 1)\n");
+    fprintf(stderr, "  -p entries    LISTSTATUS_BATCH page size (default: 1000)\n");
+    fprintf(stderr, "  -S            start as HA standby (SIGUSR1 toggles active/standby)\n");
+    fprintf(stderr, "  -c requests   namenode serves at most this many at once, queues the rest\n");
+    fprintf(stderr, "  -T sec        delegation token renew interval (default: 86400)\n");
+    fprintf(stderr, "  -B bytes      block size (default: 128M)\n");
+    fprintf(stderr, "  -v            log every request to stderr\n");
+}
+
+int main (int argc, char **argv) {
+    struct listener nn, dn;
+    pthread_t thread;
+    int c;
+
+    memset(&__opts, 0, sizeof(struct fake_opts));
+    __opts.host = "localhost";
+    __opts.nn_port = 50070;
+    __opts.dn_port = 50075;
+    __opts.ls_limit = 1000;
+    __opts.seed = 1;
+    __opts.stall_ms = 2000;
+    __opts.token_life_s = 86400;
+    __opts.block_size = BLOCK_SIZE;
+
+    while ((c = getopt(argc, argv, "H:n:d:l:L:j:b:e:w:W:s:p:c:T:B:Svh")) != -1) {
+        switch (c) {
+            case 'H': __opts.host = optarg; break;
+            case 'n': __opts.nn_port = atoi(optarg); break;
+            case 'd': __opts.dn_port = atoi(optarg); break;
+            case 'l': __opts.nn_latency_ms = strtoul(optarg, NULL, 10); break;
+            case 'L': __opts.dn_latency_ms = strtoul(optarg, NULL, 10); break;
+            case 'j': __opts.jitter_ms = strtoul(optarg, NULL, 10); break;
+            case 'b': __opts.bandwidth = strtoull(optarg, NULL, 10); break;
+            case 'e': __opts.error_rate = strtod(optarg, NULL); break;
+            case 'w': __opts.stall_rate = strtod(optarg, NULL); break;
+            case 'W': __opts.stall_ms = strtoul(optarg, NULL, 10); break;
+            case 's': __opts.seed = strtoul(optarg, NULL, 10); break;
+            case 'p': __opts.ls_limit = strtoul(optarg, NULL, 10); break;
+            case 'S': __opts.standby = 1; break;
+            case 'c': __opts.capacity = strtoul(optarg, NULL, 10); break;
+            case 'T': __opts.token_life_s = strtoul(optarg, NULL, 10); break;
+            case 'B': __opts.block_size = strtoull(optarg, NULL, 10); break;
+            case 'v': __opts.verbose = 1; break;
+            default:
+                __usage(argv[0]);
+                return(EXIT_FAILURE);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, __toggle_standby);
+
+    if (ns_init()) {
+        fprintf(stderr, "namespace init failed\n");
+        return(EXIT_FAILURE);
+    }
+
+    nn.datanode = 0;
+    dn.datanode = 1;
+    if ((nn.fd = __listen(__opts.nn_port)) < 0 || (dn.fd = __listen(__opts.dn_port)) < 0)
+        return(EXIT_FAILURE);
+
+    fprintf(stderr, "fake-webhdfs: namenode :%d, datanode :%d\n",
+            __opts.nn_port, __opts.dn_port);
+
+    pthread_create(&thread, NULL, __accept_thread, &dn);
+    __accept_thread(&nn);
+    return(EXIT_SUCCESS);
+}
@@ -0,0 +1,164 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Incremental copy of a tree, within a cluster or between two:
+ *
+ *     webhdfs-sync -c src.conf -C dst.conf /data/2024 /backup/data/2024
+ *
+ * Only files missing on the destination, or different from the source,
+ * are copied; see webhdfs_sync(). With two snapshots of the source, only
+ * what changed between them is applied, to a destination that holds the
+ * first one; see webhdfs_snapshot_sync():
+ *
+ *     webhdfs-sync -s mon:tue -c src.conf -C dst.conf /data /backup/data
+ */
+
+#include <sys/time.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <webhdfs/webhdfs.h>
+
+static void __report (void *data, const char *path, webhdfs_sync_action_t action) {
+    static const char *names[] = {"copy", "skip", "FAILED", "delete", "rename"};
+    int *verbose = (int *)data;
+
+    if (*verbose || action == WEBHDFS_SYNC_FAILED)
+        printf("%-6s %s\n", names[action], path);
+}
+
+static webhdfs_conf_t *__conf_load (const char *filename) {
+    webhdfs_conf_t *conf;
+    char *error = NULL;
+
+    if ((conf = webhdfs_conf_load(filename, &error)) == NULL) {
+        fprintf(stderr, "%s: %s\n", filename, error != NULL ? error : "load failed");
+        free(error);
+    }
+    return(conf);
+}
+
+static void __usage (const char *program) {
+    fprintf(stderr, "usage: %s [options] <src path> <dst path>\n", program);
+    fprintf(stderr, "  -c conf       source cluster (default: server.conf)\n");
+    fprintf(stderr, "  -C conf       destination cluster (default: the source)\n");
+    fprintf(stderr, "  -j threads    requests at once (default: 16)\n");
+    fprintf(stderr, "  -k            compare checksums even if mtimes match\n");
+    fprintf(stderr, "  -n            dry run, change nothing\n");
+    fprintf(stderr, "  -s from:to    apply the diff between two snapshots of the source\n");
+    fprintf(stderr, "  -v            print every file\n");
+}
+
+int main (int argc, char **argv) {
+    const char *src_conf = "server.conf";
+    const char *dst_conf = NULL;
+    webhdfs_conf_t *sconf, *dconf = NULL;
+    webhdfs_t *src, *dst = NULL;
+    webhdfs_sync_stats_t stats;
+    webhdfs_sync_opts_t opts;
+    struct timeval begin, end;
+    char *from = NULL, *to = NULL;
+    int c, r, verbose = 0;
+
+    memset(&opts, 0, sizeof(webhdfs_sync_opts_t));
+    opts.report = __report;
+    opts.data = &verbose;
+
+    while ((c = getopt(argc, argv, "c:C:j:kns:vh")) != -1) {
+        switch (c) {
+            case 'c': src_conf = optarg; break;
+            case 'C': dst_conf = optarg; break;
+            case 'j': opts.threads = strtoul(optarg, NULL, 10); break;
+            case 'k': opts.checksum = 1; break;
+            case 'n': opts.dry_run = 1; break;
+            case 's':
+                from = optarg;
+                if ((to = strchr(optarg, ':')) != NULL)
+                    *to++ = '\0';
+                break;
+            case 'v': verbose = 1; break;
+            default:
+                __usage(argv[0]);
+                return(EXIT_FAILURE);
+        }
+    }
+
+    if (optind + 2 != argc || (from != NULL && (to == NULL || *from == '\0'))) {
+        __usage(argv[0]);
+        return(EXIT_FAILURE);
+    }
+
+    if ((sconf = __conf_load(src_conf)) == NULL)
+        return(EXIT_FAILURE);
+    if ((src = webhdfs_connect(sconf)) == NULL) {
+        webhdfs_conf_free(sconf);
+        return(EXIT_FAILURE);
+    }
+
+    if (dst_conf != NULL) {
+        if ((dconf = __conf_load(dst_conf)) == NULL || (dst = webhdfs_connect(dconf)) == NULL) {
+            if (dconf != NULL)
+                webhdfs_conf_free(dconf);
+            webhdfs_disconnect(src);
+            webhdfs_conf_free(sconf);
+            return(EXIT_FAILURE);
+        }
+    }
+
+    gettimeofday(&begin, NULL);
+    if (from != NULL) {
+        r = webhdfs_snapshot_sync(src, argv[optind], from, to,
+                                  (dst != NULL) ? dst : src, argv[optind + 1], &opts, &stats);
+    } else {
+        r = webhdfs_sync(src, argv[optind], (dst != NULL) ? dst : src, argv[optind + 1],
+                         &opts, &stats);
+    }
+    gettimeofday(&end, NULL);
+
+    if (r < 0 && from != NULL)
+        fprintf(stderr, "%s: no snapshot diff, or %s changed since snapshot %s\n",
+                argv[optind], argv[optind + 1], from);
+    else if (r < 0)
+        fprintf(stderr, "%s: walk incomplete\n", argv[optind]);
+
+    printf("%s%llu files, %llu directories: %llu copied (%llu bytes), "
+           "%llu up to date, %llu deleted, %llu renamed, %llu failed, "
+           "%llu checksummed in %.2fs\n",
+           opts.dry_run ? "dry run: " : "",
+           (unsigned long long)stats.files,
+           (unsigned long long)stats.directories,
+           (unsigned long long)stats.copied,
+           (unsigned long long)stats.copied_bytes,
+           (unsigned long long)stats.skipped,
+           (unsigned long long)stats.deleted,
+           (unsigned long long)stats.renamed,
+           (unsigned long long)stats.failed,
+           (unsigned long long)stats.checksummed,
+           (end.tv_sec - begin.tv_sec) + (end.tv_usec - begin.tv_usec) / 1e6);
+
+    if (dst != NULL) {
+        webhdfs_disconnect(dst);
+        webhdfs_conf_free(dconf);
+    }
+    webhdfs_disconnect(src);
+    webhdfs_conf_free(sconf);
+    return((r == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
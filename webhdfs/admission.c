@@ -0,0 +1,160 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "webhdfs_p.h"
+#include "webhdfs.h"
+
+/*
+ * Admission control. With conf->max_inflight set, at most that many
+ * requests are on the wire to an endpoint at once; the others wait in
+ * one lane per class, and a freed slot goes to a waiting lane by stride
+ * scheduling: each admission advances the lane's pass by STRIDE/weight
+ * and the lowest pass goes next, so busy lanes share slots in the ratio
+ * of their weights. A lane that was idle restarts at the current pass
+ * rather than cashing in the turns it did not use. Within a lane,
+ * requests go in arrival order (tickets).
+ *
+ * A slot is held until the endpoint answers: a transfer redirected to a
+ * datanode goes on without it, so bulk reads and writes only count while
+ * the namenode works on them (a gateway, which does not redirect, counts
+ * for the whole transfer). Retry backoffs hold none.
+ *
+ * A lane holding conf->max_queued requests turns new ones away: the
+ * caller gets an error at once instead of joining a queue that only
+ * grows.
+ */
+#define WEBHDFS_STRIDE          (1U << 20)
+
+static const unsigned int __default_weights[WEBHDFS_CLASSES] = {
+    8,      /* WEBHDFS_CLASS_INTERACTIVE */
+    4,      /* WEBHDFS_CLASS_READ */
+    1,      /* WEBHDFS_CLASS_PREFETCH */
+    2,      /* WEBHDFS_CLASS_BULK */
+};
+
+void webhdfs_admission_open (webhdfs_t *fs) {
+    int i, c;
+
+    for (i = 0; i < fs->nendpoints; ++i) {
+        for (c = 0; c < WEBHDFS_CLASSES; ++c)
+            pthread_cond_init(&(fs->endpoints[i].lanes[c].cond), NULL);
+    }
+}
+
+void webhdfs_admission_close (webhdfs_t *fs) {
+    int i, c;
+
+    for (i = 0; fs->endpoints != NULL && i < fs->nendpoints; ++i) {
+        for (c = 0; c < WEBHDFS_CLASSES; ++c)
+            pthread_cond_destroy(&(fs->endpoints[i].lanes[c].cond));
+    }
+}
+
+static unsigned int __webhdfs_admission_weight (const webhdfs_conf_t *conf, int klass) {
+    unsigned int weight = conf->class_weights[klass];
+    return((weight > 0) ? weight : __default_weights[klass]);
+}
+
+/* Hand free slots to waiting lanes, lowest pass first. admit_lock held */
+static void __webhdfs_admission_grant (webhdfs_t *fs, webhdfs_endpoint_t *ep) {
+    const webhdfs_conf_t *conf = fs->conf;
+    webhdfs_lane_t *lane;
+    int best, c;
+
+    while (ep->admitted < conf->max_inflight) {
+        best = -1;
+        for (c = 0; c < WEBHDFS_CLASSES; ++c) {
+            lane = &(ep->lanes[c]);
+            if (lane->granted != lane->tickets &&
+                (best < 0 || lane->pass < ep->lanes[best].pass))
+            {
+                best = c;
+            }
+        }
+
+        if (best < 0)
+            break;
+
+        lane = &(ep->lanes[best]);
+        ep->vtime = lane->pass;
+        lane->pass += WEBHDFS_STRIDE / __webhdfs_admission_weight(conf, best);
+        lane->granted++;
+        ep->admitted++;
+
+        /* Every waiter checks its own ticket */
+        pthread_cond_broadcast(&(lane->cond));
+    }
+}
+
+/* Wait for a slot on the endpoint; 0 when admitted, 1 if turned away */
+int webhdfs_admission_enter (webhdfs_t *fs, int endpoint, int klass) {
+    const webhdfs_conf_t *conf = fs->conf;
+    webhdfs_endpoint_t *ep = &(fs->endpoints[endpoint]);
+    webhdfs_lane_t *lane = &(ep->lanes[klass]);
+    uint64_t ticket;
+    int c;
+
+    if (conf->max_inflight == 0)
+        return(0);
+
+    pthread_mutex_lock(&(fs->admit_lock));
+
+    /* Nobody waiting and room: straight through */
+    for (c = 0; c < WEBHDFS_CLASSES; ++c) {
+        if (ep->lanes[c].granted != ep->lanes[c].tickets)
+            break;
+    }
+    if (c == WEBHDFS_CLASSES && ep->admitted < conf->max_inflight) {
+        ep->admitted++;
+        pthread_mutex_unlock(&(fs->admit_lock));
+        return(0);
+    }
+
+    if (conf->max_queued > 0 && lane->tickets - lane->granted >= conf->max_queued) {
+        pthread_mutex_unlock(&(fs->admit_lock));
+        return(1);
+    }
+
+    /* An idle lane rejoins at the current pass */
+    if (lane->granted == lane->tickets && lane->pass < ep->vtime)
+        lane->pass = ep->vtime;
+
+    ticket = lane->tickets++;
+    __webhdfs_admission_grant(fs, ep);
+    while (ticket >= lane->granted)
+        pthread_cond_wait(&(lane->cond), &(fs->admit_lock));
+
+    pthread_mutex_unlock(&(fs->admit_lock));
+    return(0);
+}
+
+void webhdfs_admission_leave (webhdfs_t *fs, int endpoint) {
+    webhdfs_endpoint_t *ep = &(fs->endpoints[endpoint]);
+
+    if (fs->conf->max_inflight == 0)
+        return;
+
+    pthread_mutex_lock(&(fs->admit_lock));
+    ep->admitted--;
+    __webhdfs_admission_grant(fs, ep);
+    pthread_mutex_unlock(&(fs->admit_lock));
+}
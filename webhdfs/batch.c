@@ -0,0 +1,343 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "webhdfs_p.h"
+#include "webhdfs.h"
+
+/*
+ * webhdfs_parallel() runs func(data, i) for every i below count on up to
+ * `threads' threads of its own, and returns once all of them are done.
+ * Threads claim the next index with an atomic add, so a slow request
+ * only holds up its own thread. Each thread is an ordinary caller with
+ * its own curl handle (and keep-alive connections), released when it
+ * exits. Their requests are admitted as WEBHDFS_CLASS_BULK: a batch of
+ * thousands does not crowd out the interactive callers of the same fs.
+ */
+struct webhdfs_parallel {
+    webhdfs_t *fs;
+    webhdfs_parallel_func_t func;
+    void *data;
+    size_t count;
+    size_t next;
+};
+
+static __thread int __webhdfs_parallel_self;
+
+int webhdfs_parallel_self (void) {
+    return(__webhdfs_parallel_self);
+}
+
+static void __webhdfs_parallel_run (struct webhdfs_parallel *job) {
+    size_t i;
+
+    while ((i = __sync_fetch_and_add(&(job->next), 1)) < job->count)
+        job->func(job->data, i);
+}
+
+static void *__webhdfs_parallel_thread (void *data) {
+    struct webhdfs_parallel *job = (struct webhdfs_parallel *)data;
+
+    __webhdfs_parallel_self = 1;
+    __webhdfs_parallel_run(job);
+    webhdfs_curl_release(job->fs);
+    return(NULL);
+}
+
+int webhdfs_parallel (webhdfs_t *fs,
+                      size_t count,
+                      unsigned int threads,
+                      webhdfs_parallel_func_t func,
+                      void *data)
+{
+    struct webhdfs_parallel job;
+    pthread_t *tids;
+    unsigned int i, n;
+    int self;
+
+    job.fs = fs;
+    job.func = func;
+    job.data = data;
+    job.count = count;
+    job.next = 0;
+
+    if (threads == 0)
+        threads = WEBHDFS_PARALLEL_THREADS;
+    if (threads > count)
+        threads = count;
+
+    n = 0;
+    tids = NULL;
+    if (threads > 1 && (tids = (pthread_t *) malloc(threads * sizeof(pthread_t))) != NULL) {
+        for (n = 0; n < threads; ++n) {
+            if (pthread_create(&(tids[n]), NULL, __webhdfs_parallel_thread, &job))
+                break;
+        }
+    }
+
+    /* One item, or no threads to be had: the caller does the work */
+    if (n == 0) {
+        self = __webhdfs_parallel_self;
+        __webhdfs_parallel_self = 1;
+        __webhdfs_parallel_run(&job);
+        __webhdfs_parallel_self = self;
+    }
+
+    for (i = 0; i < n; ++i)
+        pthread_join(tids[i], NULL);
+
+    free(tids);
+    return(0);
+}
+
+/*
+ * Batch of metadata operations: queued by the caller, run concurrently
+ * by webhdfs_batch_exec(), each with its own result. Items keep the
+ * order they were queued in, whatever order they complete in.
+ */
+enum webhdfs_batch_op {
+    WEBHDFS_BATCH_STAT,
+    WEBHDFS_BATCH_MKDIR,
+    WEBHDFS_BATCH_CHMOD,
+    WEBHDFS_BATCH_CHOWN,
+    WEBHDFS_BATCH_SET_REPLICATION,
+    WEBHDFS_BATCH_SET_TIMES,
+    WEBHDFS_BATCH_RENAME,
+    WEBHDFS_BATCH_DELETE,
+};
+
+typedef struct webhdfs_batch_item {
+    int     op;
+    char *  path;
+    char *  arg1;               /* rename destination, chown user */
+    char *  arg2;               /* chown group */
+    int64_t iarg1;              /* permission, replication, mtime... */
+    int64_t iarg2;
+    int     status;             /* -1 until run */
+    char *  error;              /* stat only, as from webhdfs_stat() */
+    webhdfs_fstat_t *stat;
+} webhdfs_batch_item_t;
+
+struct webhdfs_batch {
+    webhdfs_t *fs;
+    webhdfs_batch_item_t *items;
+    size_t nitems;
+    size_t size;
+    size_t done;                /* items before this have been run */
+};
+
+webhdfs_batch_t *webhdfs_batch_alloc (webhdfs_t *fs) {
+    webhdfs_batch_t *batch;
+
+    if ((batch = (webhdfs_batch_t *) calloc(1, sizeof(webhdfs_batch_t))) == NULL)
+        return(NULL);
+
+    batch->fs = fs;
+    return(batch);
+}
+
+void webhdfs_batch_free (webhdfs_batch_t *batch) {
+    webhdfs_batch_item_t *item;
+    size_t i;
+
+    for (i = 0; i < batch->nitems; ++i) {
+        item = &(batch->items[i]);
+        free(item->path);
+        free(item->arg1);
+        free(item->arg2);
+        free(item->error);
+        if (item->stat != NULL)
+            webhdfs_fstat_free(item->stat);
+    }
+    free(batch->items);
+    free(batch);
+}
+
+static char *__webhdfs_batch_strdup (const char *s) {
+    return((s != NULL) ? strdup(s) : NULL);
+}
+
+static int __webhdfs_batch_add (webhdfs_batch_t *batch,
+                                int op,
+                                const char *path,
+                                const char *arg1,
+                                const char *arg2,
+                                int64_t iarg1,
+                                int64_t iarg2)
+{
+    webhdfs_batch_item_t *item;
+    size_t size;
+
+    if (batch->nitems == batch->size) {
+        size = (batch->size > 0) ? batch->size * 2 : 64;
+        item = (webhdfs_batch_item_t *) realloc(batch->items,
+                                                size * sizeof(webhdfs_batch_item_t));
+        if (item == NULL)
+            return(-1);
+
+        batch->items = item;
+        batch->size = size;
+    }
+
+    item = &(batch->items[batch->nitems]);
+    memset(item, 0, sizeof(webhdfs_batch_item_t));
+    item->op = op;
+    item->iarg1 = iarg1;
+    item->iarg2 = iarg2;
+    item->status = -1;
+
+    item->path = __webhdfs_batch_strdup(path);
+    item->arg1 = __webhdfs_batch_strdup(arg1);
+    item->arg2 = __webhdfs_batch_strdup(arg2);
+    if (item->path == NULL ||
+        (arg1 != NULL && item->arg1 == NULL) ||
+        (arg2 != NULL && item->arg2 == NULL))
+    {
+        free(item->path);
+        free(item->arg1);
+        free(item->arg2);
+        return(-1);
+    }
+
+    return((int)(batch->nitems++));
+}
+
+int webhdfs_batch_stat (webhdfs_batch_t *batch, const char *path) {
+    return(__webhdfs_batch_add(batch, WEBHDFS_BATCH_STAT, path, NULL, NULL, 0, 0));
+}
+
+int webhdfs_batch_mkdir (webhdfs_batch_t *batch, const char *path, int permission) {
+    return(__webhdfs_batch_add(batch, WEBHDFS_BATCH_MKDIR, path, NULL, NULL, permission, 0));
+}
+
+int webhdfs_batch_chmod (webhdfs_batch_t *batch, const char *path, int permission) {
+    return(__webhdfs_batch_add(batch, WEBHDFS_BATCH_CHMOD, path, NULL, NULL, permission, 0));
+}
+
+int webhdfs_batch_chown (webhdfs_batch_t *batch,
+                         const char *path,
+                         const char *user,
+                         const char *group)
+{
+    return(__webhdfs_batch_add(batch, WEBHDFS_BATCH_CHOWN, path, user, group, 0, 0));
+}
+
+int webhdfs_batch_set_replication (webhdfs_batch_t *batch,
+                                   const char *path,
+                                   int replication)
+{
+    return(__webhdfs_batch_add(batch, WEBHDFS_BATCH_SET_REPLICATION, path,
+                               NULL, NULL, replication, 0));
+}
+
+int webhdfs_batch_set_times (webhdfs_batch_t *batch,
+                             const char *path,
+                             int64_t mtime,
+                             int64_t atime)
+{
+    return(__webhdfs_batch_add(batch, WEBHDFS_BATCH_SET_TIMES, path,
+                               NULL, NULL, mtime, atime));
+}
+
+int webhdfs_batch_rename (webhdfs_batch_t *batch,
+                          const char *oldname,
+                          const char *newname)
+{
+    return(__webhdfs_batch_add(batch, WEBHDFS_BATCH_RENAME, oldname, newname, NULL, 0, 0));
+}
+
+int webhdfs_batch_delete (webhdfs_batch_t *batch, const char *path, int recursive) {
+    return(__webhdfs_batch_add(batch, WEBHDFS_BATCH_DELETE, path, NULL, NULL, recursive, 0));
+}
+
+static void __webhdfs_batch_run (void *data, size_t index) {
+    webhdfs_batch_t *batch = (webhdfs_batch_t *)data;
+    webhdfs_batch_item_t *item = &(batch->items[batch->done + index]);
+    webhdfs_t *fs = batch->fs;
+
+    switch (item->op) {
+        case WEBHDFS_BATCH_STAT:
+            item->stat = webhdfs_stat(fs, item->path, &(item->error));
+            item->status = (item->stat == NULL);
+            break;
+        case WEBHDFS_BATCH_MKDIR:
+            item->status = webhdfs_mkdir(fs, item->path, item->iarg1);
+            break;
+        case WEBHDFS_BATCH_CHMOD:
+            item->status = webhdfs_chmod(fs, item->path, item->iarg1);
+            break;
+        case WEBHDFS_BATCH_CHOWN:
+            item->status = webhdfs_chown(fs, item->path, item->arg1, item->arg2);
+            break;
+        case WEBHDFS_BATCH_SET_REPLICATION:
+            item->status = webhdfs_set_replication(fs, item->path, item->iarg1);
+            break;
+        case WEBHDFS_BATCH_SET_TIMES:
+            item->status = webhdfs_set_times(fs, item->path, item->iarg1, item->iarg2);
+            break;
+        case WEBHDFS_BATCH_RENAME:
+            item->status = webhdfs_rename(fs, item->path, item->arg1);
+            break;
+        case WEBHDFS_BATCH_DELETE:
+            item->status = webhdfs_rmdir(fs, item->path, item->iarg1);
+            break;
+    }
+}
+
+/* Run the items queued since the last exec; returns how many failed */
+int webhdfs_batch_exec (webhdfs_batch_t *batch, unsigned int parallelism) {
+    size_t i;
+    int failed = 0;
+
+    webhdfs_parallel(batch->fs, batch->nitems - batch->done, parallelism,
+                     __webhdfs_batch_run, batch);
+
+    for (i = batch->done; i < batch->nitems; ++i)
+        failed += (batch->items[i].status != 0);
+
+    batch->done = batch->nitems;
+    return(failed);
+}
+
+size_t webhdfs_batch_size (const webhdfs_batch_t *batch) {
+    return(batch->nitems);
+}
+
+int webhdfs_batch_result (const webhdfs_batch_t *batch,
+                          size_t index,
+                          const char **error)
+{
+    const webhdfs_batch_item_t *item;
+
+    if (index >= batch->nitems)
+        return(-1);
+
+    item = &(batch->items[index]);
+    if (error != NULL)
+        *error = item->error;
+    return(item->status);
+}
+
+const webhdfs_fstat_t *webhdfs_batch_fstat (const webhdfs_batch_t *batch, size_t index) {
+    if (index >= batch->nitems)
+        return(NULL);
+    return(batch->items[index].stat);
+}
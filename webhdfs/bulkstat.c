@@ -0,0 +1,369 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <yajl/yajl_tree.h>
+
+#include "webhdfs_p.h"
+#include "webhdfs.h"
+
+/*
+ * webhdfs_stat_many(): the status of many paths at once. Paths are
+ * grouped by parent directory. A parent with WEBHDFS_STAT_LIST_MIN or
+ * more of the paths is listed once instead, and its entries are matched
+ * against the names asked for; a complete listing also proves the others
+ * missing. Listing a huge directory for a few names would cost more than
+ * it saves, so a listing stops after the first page once it has read
+ * WEBHDFS_STAT_LIST_RATIO entries per path wanted, and whatever it has
+ * not found falls back to GETFILESTATUS. Listings and single stats run
+ * concurrently through webhdfs_parallel().
+ */
+#define WEBHDFS_STAT_LIST_MIN       (4)
+#define WEBHDFS_STAT_LIST_RATIO     (16)
+
+/* Per path, until the results are packed into the caller's block */
+typedef struct webhdfs_stat_slot {
+    const char *    path;
+    int             parent_len;     /* up to the last '/', -1 to stat alone */
+    int             done;
+    int             status;
+    char *          error;
+    webhdfs_fstat_t stat;           /* strings owned */
+} webhdfs_stat_slot_t;
+
+/* A unit of work: one path, or a directory listing for several */
+typedef struct webhdfs_stat_task {
+    size_t  first;                  /* into order[] */
+    size_t  count;
+} webhdfs_stat_task_t;
+
+typedef struct webhdfs_stat_job {
+    webhdfs_t *fs;
+    webhdfs_stat_slot_t *slots;
+    webhdfs_stat_slot_t **order;    /* by parent, then name */
+    webhdfs_stat_task_t *tasks;
+    size_t *pending;                /* slots left for GETFILESTATUS */
+} webhdfs_stat_job_t;
+
+static const char *__webhdfs_stat_name (const webhdfs_stat_slot_t *slot) {
+    return(slot->path + slot->parent_len + 1);
+}
+
+static int __webhdfs_stat_parent_cmp (const webhdfs_stat_slot_t *a,
+                                      const webhdfs_stat_slot_t *b)
+{
+    int r;
+
+    if (a->parent_len < 0 || b->parent_len < 0)
+        return((a->parent_len >= 0) - (b->parent_len >= 0));
+
+    if (a->parent_len != b->parent_len)
+        return(a->parent_len - b->parent_len);
+
+    if ((r = memcmp(a->path, b->path, a->parent_len)) != 0)
+        return(r);
+    return(0);
+}
+
+static int __webhdfs_stat_order_cmp (const void *a, const void *b) {
+    const webhdfs_stat_slot_t *sa = *(webhdfs_stat_slot_t * const *)a;
+    const webhdfs_stat_slot_t *sb = *(webhdfs_stat_slot_t * const *)b;
+    int r;
+
+    if ((r = __webhdfs_stat_parent_cmp(sa, sb)) != 0)
+        return(r);
+    if (sa->parent_len < 0)
+        return(0);
+    return(strcmp(__webhdfs_stat_name(sa), __webhdfs_stat_name(sb)));
+}
+
+static void __webhdfs_stat_copy (webhdfs_stat_slot_t *slot, const webhdfs_fstat_t *stat) {
+    /* As from webhdfs_stat(): the caller has the path, so no pathSuffix */
+    slot->stat = *stat;
+    slot->stat.path = NULL;
+    slot->stat.group = (stat->group != NULL) ? strdup(stat->group) : NULL;
+    slot->stat.owner = (stat->owner != NULL) ? strdup(stat->owner) : NULL;
+    slot->stat.type = (stat->type != NULL) ? strdup(stat->type) : NULL;
+    slot->status = 0;
+    slot->done = 1;
+}
+
+static void __webhdfs_stat_one (webhdfs_t *fs, webhdfs_stat_slot_t *slot) {
+    const char *exception[] = {"exception", NULL};
+    const char *message[] = {"message", NULL};
+    webhdfs_fstat_t stat;
+    yajl_val root, node, v;
+    webhdfs_req_t req;
+
+    webhdfs_req_open(&req, fs, slot->path);
+    webhdfs_req_set_args(&req, "op=GETFILESTATUS");
+    webhdfs_req_exec(&req, WEBHDFS_REQ_GET);
+    root = webhdfs_req_json_response(&req);
+    webhdfs_req_close(&req);
+
+    slot->done = 1;
+    slot->status = EIO;
+    if ((node = webhdfs_response_exception(root)) != NULL) {
+        v = yajl_tree_get(node, exception, yajl_t_string);
+        if (v != NULL && !strcmp(YAJL_GET_STRING(v), "FileNotFoundException"))
+            slot->status = ENOENT;
+        if ((v = yajl_tree_get(node, message, yajl_t_string)) != NULL)
+            slot->error = strdup(YAJL_GET_STRING(v));
+    } else if ((node = webhdfs_response_file_status(root)) != NULL) {
+        memset(&stat, 0, sizeof(webhdfs_fstat_t));
+        webhdfs_fstat_decode(&stat, node, 0);
+        __webhdfs_stat_copy(slot, &stat);
+    }
+
+    if (root != NULL)
+        yajl_tree_free(root);
+}
+
+static int __webhdfs_stat_find_cmp (const void *key, const void *item) {
+    const webhdfs_stat_slot_t *slot = *(webhdfs_stat_slot_t * const *)item;
+    return(strcmp((const char *)key, __webhdfs_stat_name(slot)));
+}
+
+/* Resolve the task's paths from a listing of their parent */
+static void __webhdfs_stat_list (webhdfs_stat_job_t *job, const webhdfs_stat_task_t *task) {
+    webhdfs_stat_slot_t **order = &(job->order[task->first]);
+    webhdfs_stat_slot_t *first = order[0];
+    webhdfs_stat_slot_t **match;
+    const webhdfs_fstat_t *stat;
+    size_t i, nread, found;
+    webhdfs_dir_t *dir;
+    int fetch;
+    char *parent;
+
+    if (first->parent_len == 0)
+        parent = strdup("/");
+    else
+        parent = strndup(first->path, first->parent_len);
+
+    if (parent == NULL || (dir = webhdfs_dir_open(job->fs, parent)) == NULL) {
+        free(parent);
+        return;
+    }
+    free(parent);
+
+    nread = found = 0;
+    while (found < task->count) {
+        /* The first page is paid for; more only while it still pays */
+        fetch = (dir->current >= YAJL_GET_ARRAY(dir->statuses)->len);
+        if (fetch && nread >= task->count * WEBHDFS_STAT_LIST_RATIO)
+            break;
+
+        fetch = fetch && dir->remaining > 0;
+        if ((stat = webhdfs_dir_read(dir)) == NULL) {
+            /* Listed to the end (not a failed page): the rest do not exist */
+            if (!fetch) {
+                for (i = 0; i < task->count; ++i) {
+                    if (!order[i]->done) {
+                        order[i]->done = 1;
+                        order[i]->status = ENOENT;
+                    }
+                }
+            }
+            break;
+        }
+        nread++;
+
+        if (stat->path == NULL)
+            continue;
+
+        /* The same path may have been asked for more than once */
+        match = (webhdfs_stat_slot_t **) bsearch(stat->path, order, task->count,
+                                                 sizeof(webhdfs_stat_slot_t *),
+                                                 __webhdfs_stat_find_cmp);
+        if (match == NULL)
+            continue;
+        while (match > order && !__webhdfs_stat_find_cmp(stat->path, match - 1))
+            match--;
+        for (; match < order + task->count &&
+               !__webhdfs_stat_find_cmp(stat->path, match); ++match)
+        {
+            __webhdfs_stat_copy(*match, stat);
+            found++;
+        }
+    }
+
+    webhdfs_dir_close(dir);
+}
+
+static void __webhdfs_stat_task (void *data, size_t index) {
+    webhdfs_stat_job_t *job = (webhdfs_stat_job_t *)data;
+    const webhdfs_stat_task_t *task = &(job->tasks[index]);
+
+    if (task->count == 1)
+        __webhdfs_stat_one(job->fs, job->order[task->first]);
+    else
+        __webhdfs_stat_list(job, task);
+}
+
+static void __webhdfs_stat_pending (void *data, size_t index) {
+    webhdfs_stat_job_t *job = (webhdfs_stat_job_t *)data;
+    __webhdfs_stat_one(job->fs, &(job->slots[job->pending[index]]));
+}
+
+static size_t __webhdfs_stat_strlen (const char *s) {
+    return((s != NULL) ? strlen(s) + 1 : 0);
+}
+
+static char *__webhdfs_stat_pack (char **arena, const char *s) {
+    char *p = *arena;
+    size_t n;
+
+    if (s == NULL)
+        return(NULL);
+
+    n = strlen(s) + 1;
+    memcpy(p, s, n);
+    *arena += n;
+    return(p);
+}
+
+/* Move the slots into one block: results[n] followed by their strings */
+static webhdfs_stat_result_t *__webhdfs_stat_results (webhdfs_stat_slot_t *slots, size_t n) {
+    webhdfs_stat_result_t *results;
+    webhdfs_stat_slot_t *slot;
+    size_t i, size;
+    char *arena;
+
+    size = n * sizeof(webhdfs_stat_result_t);
+    for (i = 0; i < n; ++i) {
+        slot = &(slots[i]);
+        size += __webhdfs_stat_strlen(slot->error);
+        size += __webhdfs_stat_strlen(slot->stat.group);
+        size += __webhdfs_stat_strlen(slot->stat.owner);
+        size += __webhdfs_stat_strlen(slot->stat.type);
+    }
+
+    if ((results = (webhdfs_stat_result_t *) malloc(size + 1)) == NULL)
+        return(NULL);
+
+    arena = (char *)(results + n);
+    for (i = 0; i < n; ++i) {
+        slot = &(slots[i]);
+        results[i].status = slot->status;
+        results[i].stat = slot->stat;
+        results[i].error = __webhdfs_stat_pack(&arena, slot->error);
+        results[i].stat.group = __webhdfs_stat_pack(&arena, slot->stat.group);
+        results[i].stat.owner = __webhdfs_stat_pack(&arena, slot->stat.owner);
+        results[i].stat.type = __webhdfs_stat_pack(&arena, slot->stat.type);
+    }
+
+    return(results);
+}
+
+static void __webhdfs_stat_slots_free (webhdfs_stat_slot_t *slots, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        free(slots[i].error);
+        free(slots[i].stat.group);
+        free(slots[i].stat.owner);
+        free(slots[i].stat.type);
+    }
+    free(slots);
+}
+
+int webhdfs_stat_many (webhdfs_t *fs,
+                       const char * const *paths,
+                       size_t n,
+                       webhdfs_stat_result_t **results)
+{
+    webhdfs_stat_job_t job;
+    webhdfs_stat_slot_t *slot;
+    size_t i, j, ntasks, npending;
+    const char *p;
+    int failed;
+
+    *results = NULL;
+    memset(&job, 0, sizeof(webhdfs_stat_job_t));
+    job.fs = fs;
+    job.slots = (webhdfs_stat_slot_t *) calloc(n + 1, sizeof(webhdfs_stat_slot_t));
+    job.order = (webhdfs_stat_slot_t **) malloc((n + 1) * sizeof(webhdfs_stat_slot_t *));
+    job.tasks = (webhdfs_stat_task_t *) malloc((n + 1) * sizeof(webhdfs_stat_task_t));
+    job.pending = (size_t *) malloc((n + 1) * sizeof(size_t));
+    if (job.slots == NULL || job.order == NULL || job.tasks == NULL || job.pending == NULL) {
+        free(job.slots);
+        free(job.order);
+        free(job.tasks);
+        free(job.pending);
+        return(-1);
+    }
+
+    /* Only "/dir/name" can be looked up in a listing of "/dir" */
+    for (i = 0; i < n; ++i) {
+        slot = &(job.slots[i]);
+        slot->path = paths[i];
+        slot->parent_len = -1;
+        if (paths[i][0] == '/' && (p = strrchr(paths[i], '/'))[1] != '\0')
+            slot->parent_len = p - paths[i];
+        job.order[i] = slot;
+    }
+
+    qsort(job.order, n, sizeof(webhdfs_stat_slot_t *), __webhdfs_stat_order_cmp);
+
+    /* Runs of a common parent long enough to list, the rest one by one */
+    ntasks = 0;
+    for (i = 0; i < n; i = j) {
+        slot = job.order[i];
+        for (j = i + 1; j < n && slot->parent_len >= 0; ++j) {
+            if (__webhdfs_stat_parent_cmp(slot, job.order[j]))
+                break;
+        }
+        if (slot->parent_len < 0 || j - i < WEBHDFS_STAT_LIST_MIN) {
+            j = i + 1;
+            job.tasks[ntasks].first = i;
+            job.tasks[ntasks].count = 1;
+        } else {
+            job.tasks[ntasks].first = i;
+            job.tasks[ntasks].count = j - i;
+        }
+        ntasks++;
+    }
+
+    webhdfs_parallel(fs, ntasks, 0, __webhdfs_stat_task, &job);
+
+    npending = 0;
+    for (i = 0; i < n; ++i) {
+        if (!job.slots[i].done)
+            job.pending[npending++] = i;
+    }
+    webhdfs_parallel(fs, npending, 0, __webhdfs_stat_pending, &job);
+
+    failed = 0;
+    for (i = 0; i < n; ++i)
+        failed += (job.slots[i].status != 0);
+
+    *results = __webhdfs_stat_results(job.slots, n);
+    __webhdfs_stat_slots_free(job.slots, n);
+    free(job.order);
+    free(job.tasks);
+    free(job.pending);
+
+    return((*results != NULL) ? failed : -1);
+}
+
+void webhdfs_stat_many_free (webhdfs_stat_result_t *results) {
+    free(results);
+}
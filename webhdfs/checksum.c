@@ -0,0 +1,263 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <strings.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <yajl/yajl_tree.h>
+
+#include "webhdfs_p.h"
+#include "webhdfs.h"
+
+/*
+ * GETFILECHECKSUM: the namenode redirects to a datanode, which combines
+ * the block checksums the datanodes already keep. Nothing is read back
+ * to the client, so comparing two files this way costs two requests
+ * whatever their size. Checksums only compare equal between files
+ * written with the same block size and bytes per CRC; those are part of
+ * the algorithm name, so compare that too (webhdfs_file_checksum_equal).
+ */
+int webhdfs_file_checksum (webhdfs_t *fs,
+                           const char *path,
+                           webhdfs_file_checksum_t *checksum)
+{
+    const char *algorithm[] = {"algorithm", NULL};
+    const char *bytes[] = {"bytes", NULL};
+    const char *length[] = {"length", NULL};
+    webhdfs_req_t req;
+    yajl_val root, node, v;
+    int r = 1;
+
+    webhdfs_req_open(&req, fs, path);
+    webhdfs_req_set_args(&req, "op=GETFILECHECKSUM");
+    webhdfs_req_exec(&req, WEBHDFS_REQ_GET);
+    root = webhdfs_req_json_response(&req);
+    webhdfs_req_close(&req);
+
+    memset(checksum, 0, sizeof(webhdfs_file_checksum_t));
+    if (webhdfs_response_exception(root) == NULL &&
+        (node = webhdfs_response_file_checksum(root)) != NULL)
+    {
+        if ((v = yajl_tree_get(node, algorithm, yajl_t_string)) != NULL) {
+            snprintf(checksum->algorithm, sizeof(checksum->algorithm),
+                     "%s", YAJL_GET_STRING(v));
+        }
+        if ((v = yajl_tree_get(node, bytes, yajl_t_string)) != NULL) {
+            snprintf(checksum->bytes, sizeof(checksum->bytes),
+                     "%s", YAJL_GET_STRING(v));
+        }
+        if ((v = yajl_tree_get(node, length, yajl_t_number)) != NULL)
+            checksum->length = YAJL_GET_INTEGER(v);
+
+        r = (checksum->bytes[0] == '\0');
+    }
+
+    if (root != NULL)
+        yajl_tree_free(root);
+    return(r);
+}
+
+int webhdfs_file_checksum_equal (const webhdfs_file_checksum_t *a,
+                                 const webhdfs_file_checksum_t *b)
+{
+    return(a->length == b->length &&
+           !strcmp(a->algorithm, b->algorithm) &&
+           !strcasecmp(a->bytes, b->bytes));
+}
+
+/* ============================================================================
+ *  local checksum
+ *
+ * HDFS keeps a CRC32C per 512 bytes. A block's checksum is the MD5 of
+ * its CRCs (big endian), the file's is the MD5 of its blocks' MD5s. The
+ * server sends bytes per CRC, CRCs per block (0 for one block) and the
+ * MD5 as one hex string: with those, the same value is rebuilt here.
+ *
+ * The client side of HDFS hashes the whole buffer it collected the
+ * block MD5s in, not just what it wrote there: the MD5s are followed by
+ * zeros up to the buffer's capacity (32 bytes, doubled as needed). An
+ * empty file's checksum is the MD5 of 32 zero bytes.
+ */
+webhdfs_crc_t *webhdfs_crc_alloc (void) {
+    return((webhdfs_crc_t *) calloc(1, sizeof(webhdfs_crc_t)));
+}
+
+void webhdfs_crc_free (webhdfs_crc_t *crc) {
+    if (crc != NULL) {
+        free(crc->crcs);
+        free(crc);
+    }
+}
+
+static int __webhdfs_crc_reserve (webhdfs_crc_t *crc, size_t n) {
+    uint32_t *crcs;
+    size_t size;
+
+    if (crc->ncrcs + n <= crc->size)
+        return(0);
+
+    size = (crc->size > 0) ? crc->size * 2 : 1024;
+    while (size < crc->ncrcs + n)
+        size *= 2;
+
+    if ((crcs = (uint32_t *) realloc(crc->crcs, size * sizeof(uint32_t))) == NULL) {
+        crc->broken = 1;
+        return(1);
+    }
+
+    crc->crcs = crcs;
+    crc->size = size;
+    return(0);
+}
+
+int webhdfs_crc_update (webhdfs_crc_t *crc, const void *data, size_t nbytes) {
+    const unsigned char *p = (const unsigned char *)data;
+    size_t take, n;
+
+    if (crc->broken)
+        return(1);
+
+    crc->bytes += nbytes;
+
+    /* Finish the chunk left open by the last call */
+    if (crc->fill > 0) {
+        take = WEBHDFS_BYTES_PER_CRC - crc->fill;
+        if (take > nbytes)
+            take = nbytes;
+
+        crc->crc = webhdfs_crc32c(crc->crc, p, take);
+        crc->fill += take;
+        p += take;
+        nbytes -= take;
+
+        if (crc->fill < WEBHDFS_BYTES_PER_CRC)
+            return(0);
+        if (__webhdfs_crc_reserve(crc, 1))
+            return(1);
+        crc->crcs[crc->ncrcs++] = crc->crc;
+        crc->crc = 0;
+        crc->fill = 0;
+    }
+
+    if ((n = nbytes / WEBHDFS_BYTES_PER_CRC) > 0) {
+        if (__webhdfs_crc_reserve(crc, n))
+            return(1);
+        webhdfs_crc32c_chunks(p, WEBHDFS_BYTES_PER_CRC, n, crc->crcs + crc->ncrcs);
+        crc->ncrcs += n;
+        p += n * WEBHDFS_BYTES_PER_CRC;
+        nbytes -= n * WEBHDFS_BYTES_PER_CRC;
+    }
+
+    if (nbytes > 0) {
+        crc->crc = webhdfs_crc32c(0, p, nbytes);
+        crc->fill = nbytes;
+    }
+    return(0);
+}
+
+static void __webhdfs_crc_md5 (const webhdfs_crc_t *crc,
+                               uint64_t crc_per_block,
+                               unsigned char digest[16])
+{
+    static const unsigned char zeros[16];
+    unsigned char block[16];
+    unsigned char be[4];
+    webhdfs_md5_t file_md5, block_md5;
+    size_t i, n, in_block = 0;
+    size_t used, capacity = 32;
+    uint32_t v;
+
+    /* The open chunk is the last CRC of the last block */
+    n = crc->ncrcs + (crc->fill > 0);
+
+    webhdfs_md5_init(&file_md5);
+    webhdfs_md5_init(&block_md5);
+    for (i = 0; i < n; ++i) {
+        v = (i < crc->ncrcs) ? crc->crcs[i] : crc->crc;
+        be[0] = v >> 24;
+        be[1] = v >> 16;
+        be[2] = v >> 8;
+        be[3] = v;
+        webhdfs_md5_update(&block_md5, be, 4);
+
+        if (++in_block == crc_per_block || i + 1 == n) {
+            webhdfs_md5_final(&block_md5, block);
+            webhdfs_md5_update(&file_md5, block, 16);
+            webhdfs_md5_init(&block_md5);
+            in_block = 0;
+        }
+    }
+
+    used = (size_t)file_md5.bytes;
+    while (capacity < used)
+        capacity *= 2;
+    for (; used < capacity; used += 16)
+        webhdfs_md5_update(&file_md5, zeros, 16);
+    webhdfs_md5_final(&file_md5, digest);
+}
+
+static int __webhdfs_hex_decode (const char *hex, unsigned char *out, size_t n) {
+    unsigned int v;
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        if (sscanf(hex + i * 2, "%2x", &v) != 1)
+            return(1);
+        out[i] = v;
+    }
+    return(0);
+}
+
+int webhdfs_crc_verify (webhdfs_t *fs, const char *path, const webhdfs_crc_t *crc) {
+    webhdfs_file_checksum_t server;
+    unsigned char bytes[28];
+    unsigned char digest[16];
+    uint64_t crc_per_block = 0;
+    uint32_t bytes_per_crc = 0;
+    size_t len;
+    int i;
+
+    if (crc->broken || webhdfs_file_checksum(fs, path, &server))
+        return(-1);
+
+    /* bytesPerCRC (4), crcPerBlock (8), MD5 (16), all big endian */
+    if (server.length != 28 || strlen(server.bytes) != 56 ||
+        __webhdfs_hex_decode(server.bytes, bytes, 28))
+    {
+        return(-1);
+    }
+
+    for (i = 0; i < 4; ++i)
+        bytes_per_crc = (bytes_per_crc << 8) | bytes[i];
+    for (i = 4; i < 12; ++i)
+        crc_per_block = (crc_per_block << 8) | bytes[i];
+
+    /* An empty file has no CRCs of any kind: only the MD5 means anything */
+    len = strlen(server.algorithm);
+    if (crc->bytes > 0 &&
+        (bytes_per_crc != WEBHDFS_BYTES_PER_CRC || len < 6 ||
+         strcmp(server.algorithm + len - 6, "CRC32C") != 0))
+    {
+        return(-1);
+    }
+
+    __webhdfs_crc_md5(crc, crc_per_block, digest);
+    return(memcmp(digest, bytes + 12, 16) != 0);
+}
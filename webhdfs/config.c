@@ -32,8 +32,16 @@
 webhdfs_conf_t *webhdfs_conf_alloc (void) {
     webhdfs_conf_t *conf;
 
-    if ((conf = (webhdfs_conf_t *) malloc(sizeof(webhdfs_conf_t))) != NULL)
+    if ((conf = (webhdfs_conf_t *) malloc(sizeof(webhdfs_conf_t))) != NULL) {
         memset(conf, 0, sizeof(webhdfs_conf_t));
+        /* Give up on a dead host or a stalled transfer, not on a slow one */
+        conf->connect_timeout_ms = 10000;
+        conf->low_speed_limit = 1;
+        conf->low_speed_time = 60;
+        conf->retries = 3;
+        conf->retry_backoff_ms = 200;
+        conf->summary_ttl_ms = 1000;
+    }
 
     return(conf);
 }
@@ -48,6 +56,17 @@ void webhdfs_conf_free (webhdfs_conf_t *conf) {
     if (conf->token != NULL)
         free(conf->token);
 
+    if (conf->token_cache != NULL)
+        free(conf->token_cache);
+
+    if (conf->prefetch_patterns != NULL)
+        free(conf->prefetch_patterns);
+
+    while (conf->nhosts > 0)
+        free(conf->hosts[--conf->nhosts]);
+    free(conf->hosts);
+    free(conf->ports);
+
     free(conf);
 }
 
@@ -100,6 +119,32 @@ webhdfs_conf_t *webhdfs_conf_load (const char *filename,
     const char *jsonHost[] = {"hdfsHost", NULL};
     const char *jsonPort[] = {"webhdfsPort", NULL};
     const char *jsonHdfsPort[] = {"hdfsPort", NULL};
+    const char *jsonSlowRequest[] = {"slowRequestMs", NULL};
+    const char *jsonSingleFlight[] = {"singleFlight", NULL};
+    const char *jsonPrefetchSmall[] = {"prefetchSmallFile", NULL};
+    const char *jsonPrefetchTail[] = {"prefetchTail", NULL};
+    const char *jsonPrefetchPatterns[] = {"prefetchTailPatterns", NULL};
+    const char *jsonReadahead[] = {"readaheadMax", NULL};
+    const char *jsonConnectTimeout[] = {"connectTimeoutMs", NULL};
+    const char *jsonRequestTimeout[] = {"requestTimeoutMs", NULL};
+    const char *jsonLowSpeedLimit[] = {"lowSpeedLimit", NULL};
+    const char *jsonLowSpeedTime[] = {"lowSpeedTime", NULL};
+    const char *jsonRetries[] = {"retries", NULL};
+    const char *jsonRetryBackoff[] = {"retryBackoffMs", NULL};
+    const char *jsonHedgedRead[] = {"hedgedReadMinMs", NULL};
+    const char *jsonHosts[] = {"hdfsHosts", NULL};
+    const char *jsonPolicy[] = {"endpointPolicy", NULL};
+    const char *jsonDelegation[] = {"delegationToken", NULL};
+    const char *jsonTokenCache[] = {"delegationTokenCache", NULL};
+    const char *jsonMaxInflight[] = {"maxInflight", NULL};
+    const char *jsonReadRate[] = {"readBytesPerSec", NULL};
+    const char *jsonWriteRate[] = {"writeBytesPerSec", NULL};
+    const char *jsonMaxQueued[] = {"maxQueued", NULL};
+    const char *jsonWeights[] = {"classWeights", NULL};
+    const char *jsonSummaryTtl[] = {"contentSummaryTtlMs", NULL};
+    const char *classNames[] = {"interactive", "read", "prefetch", "bulk"};
+    const char *jsonWeight[] = {NULL, NULL};
+    int i;
     webhdfs_conf_t *conf;
     char buffer[1024];
     yajl_val node, v;
@@ -189,6 +234,105 @@ webhdfs_conf_t *webhdfs_conf_load (const char *filename,
         return(NULL);
     }
 
+    if ((v = yajl_tree_get(node, jsonSlowRequest, yajl_t_number)) != NULL)
+        conf->slow_request_ms = YAJL_GET_INTEGER(v);
+
+    if ((v = yajl_tree_get(node, jsonSingleFlight, yajl_t_any)) != NULL)
+        conf->single_flight = YAJL_IS_TRUE(v);
+
+    if ((v = yajl_tree_get(node, jsonPrefetchSmall, yajl_t_number)) != NULL)
+        conf->prefetch_small = YAJL_GET_INTEGER(v);
+
+    if ((v = yajl_tree_get(node, jsonPrefetchTail, yajl_t_number)) != NULL)
+        conf->prefetch_tail = YAJL_GET_INTEGER(v);
+
+    if ((v = yajl_tree_get(node, jsonPrefetchPatterns, yajl_t_string)) != NULL)
+        conf->prefetch_patterns = strdup(YAJL_GET_STRING(v));
+
+    if ((v = yajl_tree_get(node, jsonReadahead, yajl_t_number)) != NULL)
+        conf->readahead_max = YAJL_GET_INTEGER(v);
+
+    if ((v = yajl_tree_get(node, jsonConnectTimeout, yajl_t_number)) != NULL)
+        conf->connect_timeout_ms = YAJL_GET_INTEGER(v);
+
+    if ((v = yajl_tree_get(node, jsonRequestTimeout, yajl_t_number)) != NULL)
+        conf->request_timeout_ms = YAJL_GET_INTEGER(v);
+
+    if ((v = yajl_tree_get(node, jsonLowSpeedLimit, yajl_t_number)) != NULL)
+        conf->low_speed_limit = YAJL_GET_INTEGER(v);
+
+    if ((v = yajl_tree_get(node, jsonLowSpeedTime, yajl_t_number)) != NULL)
+        conf->low_speed_time = YAJL_GET_INTEGER(v);
+
+    if ((v = yajl_tree_get(node, jsonRetries, yajl_t_number)) != NULL)
+        conf->retries = YAJL_GET_INTEGER(v);
+
+    if ((v = yajl_tree_get(node, jsonRetryBackoff, yajl_t_number)) != NULL)
+        conf->retry_backoff_ms = YAJL_GET_INTEGER(v);
+
+    if ((v = yajl_tree_get(node, jsonHedgedRead, yajl_t_number)) != NULL)
+        conf->hedge_min_ms = YAJL_GET_INTEGER(v);
+
+    /* More namenodes, "host" or "host:port" (default webhdfsPort) */
+    if ((v = yajl_tree_get(node, jsonHosts, yajl_t_array)) != NULL) {
+        size_t i;
+
+        for (i = 0; i < YAJL_GET_ARRAY(v)->len; ++i) {
+            yajl_val host = YAJL_GET_ARRAY(v)->values[i];
+            char *port;
+
+            if (!YAJL_IS_STRING(host))
+                continue;
+
+            strncpy(buffer, YAJL_GET_STRING(host), sizeof(buffer) - 1);
+            buffer[sizeof(buffer) - 1] = '\0';
+            if ((port = strrchr(buffer, ':')) != NULL)
+                *port++ = '\0';
+            webhdfs_conf_add_server(conf, buffer,
+                                    port != NULL ? atoi(port) : conf->webhdfs_port);
+        }
+    }
+
+    if ((v = yajl_tree_get(node, jsonPolicy, yajl_t_string)) != NULL) {
+        if (!strcmp(YAJL_GET_STRING(v), "least-requests"))
+            conf->endpoint_policy = WEBHDFS_POLICY_LEAST_REQUESTS;
+        else if (!strcmp(YAJL_GET_STRING(v), "ewma"))
+            conf->endpoint_policy = WEBHDFS_POLICY_EWMA;
+        else if (strcmp(YAJL_GET_STRING(v), "failover"))
+            fprintf(stderr, "conf: unknown endpointPolicy %s\n", YAJL_GET_STRING(v));
+    }
+
+    if ((v = yajl_tree_get(node, jsonDelegation, yajl_t_any)) != NULL)
+        conf->delegation = YAJL_IS_TRUE(v);
+
+    if ((v = yajl_tree_get(node, jsonTokenCache, yajl_t_string)) != NULL)
+        conf->token_cache = strdup(YAJL_GET_STRING(v));
+
+    if ((v = yajl_tree_get(node, jsonMaxInflight, yajl_t_number)) != NULL)
+        conf->max_inflight = YAJL_GET_INTEGER(v);
+
+    if ((v = yajl_tree_get(node, jsonMaxQueued, yajl_t_number)) != NULL)
+        conf->max_queued = YAJL_GET_INTEGER(v);
+
+    /* "classWeights": {"interactive": 8, "read": 4, "prefetch": 1, "bulk": 2} */
+    if ((v = yajl_tree_get(node, jsonWeights, yajl_t_object)) != NULL) {
+        yajl_val w;
+        for (i = 0; i < WEBHDFS_CLASSES; ++i) {
+            jsonWeight[0] = classNames[i];
+            if ((w = yajl_tree_get(v, jsonWeight, yajl_t_number)) != NULL)
+                conf->class_weights[i] = YAJL_GET_INTEGER(w);
+        }
+    }
+
+    if ((v = yajl_tree_get(node, jsonReadRate, yajl_t_number)) != NULL)
+        conf->read_rate = YAJL_GET_INTEGER(v);
+
+    if ((v = yajl_tree_get(node, jsonWriteRate, yajl_t_number)) != NULL)
+        conf->write_rate = YAJL_GET_INTEGER(v);
+
+    if ((v = yajl_tree_get(node, jsonSummaryTtl, yajl_t_number)) != NULL)
+        conf->summary_ttl_ms = YAJL_GET_INTEGER(v);
+
     yajl_tree_free(node);
     return(conf);
 }
@@ -210,6 +354,36 @@ int webhdfs_conf_set_server (webhdfs_conf_t *conf,
     return(0);
 }
 
+/* Another namenode of the same cluster (HA), tried when the active fails */
+int webhdfs_conf_add_server (webhdfs_conf_t *conf,
+                             const char *host,
+                             int port)
+{
+    char **hosts;
+    int *ports;
+
+    if ((hosts = (char **) realloc(conf->hosts, (conf->nhosts + 1) * sizeof(char *))) == NULL)
+        return(1);
+    conf->hosts = hosts;
+
+    if ((ports = (int *) realloc(conf->ports, (conf->nhosts + 1) * sizeof(int))) == NULL)
+        return(1);
+    conf->ports = ports;
+
+    if ((conf->hosts[conf->nhosts] = strdup(host)) == NULL)
+        return(1);
+
+    conf->ports[conf->nhosts++] = port;
+    return(0);
+}
+
+int webhdfs_conf_set_endpoint_policy (webhdfs_conf_t *conf,
+                                      webhdfs_endpoint_policy_t policy)
+{
+    conf->endpoint_policy = policy;
+    return(0);
+}
+
 int webhdfs_conf_set_user (webhdfs_conf_t *conf,
                            const char *user)
 {
@@ -234,3 +408,117 @@ int webhdfs_conf_set_token (webhdfs_conf_t *conf,
     return(0);
 }
 
+int webhdfs_conf_set_delegation (webhdfs_conf_t *conf,
+                                 int enable,
+                                 const char *cache_file)
+{
+    if (conf->token_cache != NULL)
+        free(conf->token_cache);
+    conf->token_cache = NULL;
+
+    if (cache_file != NULL && (conf->token_cache = strdup(cache_file)) == NULL)
+        return(1);
+
+    conf->delegation = enable;
+    return(0);
+}
+
+int webhdfs_conf_set_admission (webhdfs_conf_t *conf,
+                                unsigned int max_inflight,
+                                unsigned int max_queued)
+{
+    conf->max_inflight = max_inflight;
+    conf->max_queued = max_queued;
+    return(0);
+}
+
+int webhdfs_conf_set_class_weight (webhdfs_conf_t *conf,
+                                   webhdfs_class_t klass,
+                                   unsigned int weight)
+{
+    if ((unsigned int)klass >= WEBHDFS_CLASSES)
+        return(1);
+
+    conf->class_weights[klass] = weight;
+    return(0);
+}
+
+int webhdfs_conf_set_rate_limit (webhdfs_conf_t *conf,
+                                 size_t read_bytes_per_sec,
+                                 size_t write_bytes_per_sec)
+{
+    conf->read_rate = read_bytes_per_sec;
+    conf->write_rate = write_bytes_per_sec;
+    return(0);
+}
+
+int webhdfs_conf_set_summary_ttl (webhdfs_conf_t *conf, unsigned int ttl_ms) {
+    conf->summary_ttl_ms = ttl_ms;
+    return(0);
+}
+
+int webhdfs_conf_set_slow_request_log (webhdfs_conf_t *conf,
+                                       unsigned int threshold_ms)
+{
+    conf->slow_request_ms = threshold_ms;
+    return(0);
+}
+
+int webhdfs_conf_set_single_flight (webhdfs_conf_t *conf, int enable) {
+    conf->single_flight = enable;
+    return(0);
+}
+
+int webhdfs_conf_set_prefetch (webhdfs_conf_t *conf,
+                               size_t small_file,
+                               size_t tail,
+                               const char *tail_patterns)
+{
+    if (conf->prefetch_patterns != NULL)
+        free(conf->prefetch_patterns);
+    conf->prefetch_patterns = NULL;
+
+    if (tail_patterns != NULL && (conf->prefetch_patterns = strdup(tail_patterns)) == NULL)
+        return(1);
+
+    conf->prefetch_small = small_file;
+    conf->prefetch_tail = tail;
+    return(0);
+}
+
+int webhdfs_conf_set_readahead (webhdfs_conf_t *conf, size_t max_window) {
+    conf->readahead_max = max_window;
+    return(0);
+}
+
+int webhdfs_conf_set_timeouts (webhdfs_conf_t *conf,
+                               unsigned int connect_ms,
+                               unsigned int request_ms)
+{
+    conf->connect_timeout_ms = connect_ms;
+    conf->request_timeout_ms = request_ms;
+    return(0);
+}
+
+int webhdfs_conf_set_low_speed (webhdfs_conf_t *conf,
+                                unsigned int bytes_per_sec,
+                                unsigned int seconds)
+{
+    conf->low_speed_limit = bytes_per_sec;
+    conf->low_speed_time = seconds;
+    return(0);
+}
+
+int webhdfs_conf_set_retries (webhdfs_conf_t *conf,
+                              unsigned int retries,
+                              unsigned int backoff_ms)
+{
+    conf->retries = retries;
+    conf->retry_backoff_ms = backoff_ms;
+    return(0);
+}
+
+int webhdfs_conf_set_hedged_reads (webhdfs_conf_t *conf, unsigned int min_ms) {
+    conf->hedge_min_ms = min_ms;
+    return(0);
+}
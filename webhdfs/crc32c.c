@@ -0,0 +1,198 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "webhdfs_p.h"
+
+/*
+ * CRC32C (Castagnoli), as HDFS keeps per bytes-per-checksum chunk.
+ * x86 CPUs with SSE4.2 have an instruction for it, 8 bytes at a time;
+ * elsewhere a slicing-by-8 table does the work. The instruction has a
+ * latency of 3 cycles but can start one per cycle, so chunks are done
+ * three at a time, interleaved, when there are enough of them. Chunks
+ * are short (512 bytes), which leaves nothing to gain from folding
+ * with carry-less multiplies.
+ */
+#define CRC32C_POLY                 (0x82f63b78U)   /* reflected */
+
+typedef uint32_t (*crc32c_func_t) (uint32_t crc, const unsigned char *p, size_t n);
+typedef void (*crc32c_chunks_func_t) (const unsigned char *p,
+                                      size_t chunk,
+                                      size_t n,
+                                      uint32_t *crcs);
+
+static pthread_once_t __crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t __crc32c_table[8][256];
+static crc32c_func_t __crc32c;
+static crc32c_chunks_func_t __crc32c_chunks;
+
+static uint64_t __load64 (const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(uint64_t));
+    return(v);
+}
+
+/* ============================================================================
+ *  portable: slicing-by-8
+ */
+static uint32_t __crc32c_sw (uint32_t crc, const unsigned char *p, size_t n) {
+    uint64_t v;
+
+    while (n > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = __crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        n--;
+    }
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (n >= 8) {
+        v = __load64(p) ^ crc;
+        crc = __crc32c_table[7][v & 0xff] ^
+              __crc32c_table[6][(v >> 8) & 0xff] ^
+              __crc32c_table[5][(v >> 16) & 0xff] ^
+              __crc32c_table[4][(v >> 24) & 0xff] ^
+              __crc32c_table[3][(v >> 32) & 0xff] ^
+              __crc32c_table[2][(v >> 40) & 0xff] ^
+              __crc32c_table[1][(v >> 48) & 0xff] ^
+              __crc32c_table[0][v >> 56];
+        p += 8;
+        n -= 8;
+    }
+#else
+    (void)v;
+#endif
+
+    while (n-- > 0)
+        crc = __crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return(crc);
+}
+
+static void __crc32c_chunks_sw (const unsigned char *p,
+                                size_t chunk,
+                                size_t n,
+                                uint32_t *crcs)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i, p += chunk)
+        crcs[i] = ~__crc32c_sw(~0U, p, chunk);
+}
+
+/* ============================================================================
+ *  x86: SSE4.2 crc32
+ */
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t __crc32c_hw (uint32_t crc, const unsigned char *p, size_t n) {
+    uint64_t c = crc;
+
+    while (n > 0 && ((uintptr_t)p & 7) != 0) {
+        c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
+        n--;
+    }
+
+    while (n >= 8) {
+        c = __builtin_ia32_crc32di(c, __load64(p));
+        p += 8;
+        n -= 8;
+    }
+
+    while (n-- > 0)
+        c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
+    return((uint32_t)c);
+}
+
+__attribute__((target("sse4.2")))
+static void __crc32c_chunks_hw (const unsigned char *p,
+                                size_t chunk,
+                                size_t n,
+                                uint32_t *crcs)
+{
+    uint64_t a, b, c;
+    size_t i, j;
+
+    /* Three independent chunks keep the crc32 unit busy */
+    for (i = 0; (chunk & 7) == 0 && i + 3 <= n; i += 3, p += 3 * chunk) {
+        a = b = c = ~0U;
+        for (j = 0; j < chunk; j += 8) {
+            a = __builtin_ia32_crc32di(a, __load64(p + j));
+            b = __builtin_ia32_crc32di(b, __load64(p + chunk + j));
+            c = __builtin_ia32_crc32di(c, __load64(p + 2 * chunk + j));
+        }
+        crcs[i] = ~(uint32_t)a;
+        crcs[i + 1] = ~(uint32_t)b;
+        crcs[i + 2] = ~(uint32_t)c;
+    }
+
+    for (; i < n; ++i, p += chunk)
+        crcs[i] = ~__crc32c_hw(~0U, p, chunk);
+}
+#endif
+
+static void __crc32c_init (void) {
+    uint32_t crc;
+    int i, j;
+
+    for (i = 0; i < 256; ++i) {
+        crc = i;
+        for (j = 0; j < 8; ++j)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        __crc32c_table[0][i] = crc;
+    }
+
+    for (i = 0; i < 256; ++i) {
+        crc = __crc32c_table[0][i];
+        for (j = 1; j < 8; ++j) {
+            crc = __crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            __crc32c_table[j][i] = crc;
+        }
+    }
+
+    __crc32c = __crc32c_sw;
+    __crc32c_chunks = __crc32c_chunks_sw;
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        __crc32c = __crc32c_hw;
+        __crc32c_chunks = __crc32c_chunks_hw;
+    }
+#endif
+}
+
+/* Continues crc (0 to start) over n more bytes */
+uint32_t webhdfs_crc32c (uint32_t crc, const void *data, size_t n) {
+    pthread_once(&__crc32c_once, __crc32c_init);
+    return(~__crc32c(~crc, (const unsigned char *)data, n));
+}
+
+/* The crc of each of n consecutive chunks of data */
+void webhdfs_crc32c_chunks (const void *data,
+                            size_t chunk,
+                            size_t n,
+                            uint32_t *crcs)
+{
+    pthread_once(&__crc32c_once, __crc32c_init);
+    __crc32c_chunks((const unsigned char *)data, chunk, n, crcs);
+}
+
+/* Which implementation runs here, for benchmarks */
+const char *webhdfs_crc32c_impl (void) {
+    pthread_once(&__crc32c_once, __crc32c_init);
+    return((__crc32c == __crc32c_sw) ? "sw" : "sse4.2");
+}
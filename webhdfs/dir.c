@@ -25,102 +25,189 @@
 #include "webhdfs_p.h"
 #include "webhdfs.h"
 
-webhdfs_dir_t *webhdfs_dir_open (webhdfs_t *fs,
-                                 const char *path)
-{
+/*
+ * Point dir at the FileStatus array of a LISTSTATUS or LISTSTATUS_BATCH
+ * response, taking ownership of node (freed on error).
+ */
+static int __webhdfs_dir_set_page (webhdfs_dir_t *dir, yajl_val node) {
+    const char *remaining[] = {"remainingEntries", NULL};
+    const char *partial[] = {"partialListing", NULL};
     const char *file_status[] = {"FileStatus", NULL};
-    webhdfs_dir_t *dir;
-    webhdfs_req_t req;
-    yajl_val node, v;
-
-    webhdfs_req_open(&req, fs, path);
-    webhdfs_req_set_args(&req, "op=LISTSTATUS");
-    webhdfs_req_exec(&req, WEBHDFS_REQ_GET);
-    node = webhdfs_req_json_response(&req);
-    webhdfs_req_close(&req);
+    yajl_val listing, v;
 
     if ((v = webhdfs_response_exception(node)) != NULL) {
         yajl_tree_free(node);
-        return(NULL);
+        return(1);
     }
 
-    if ((v = webhdfs_response_file_statuses(node)) == NULL) {
-        yajl_tree_free(node);
-        return(NULL);
+    dir->remaining = 0;
+    if ((listing = webhdfs_response_directory_listing(node)) != NULL) {
+        if ((v = yajl_tree_get(listing, remaining, yajl_t_number)) != NULL)
+            dir->remaining = YAJL_GET_INTEGER(v);
+        v = webhdfs_response_file_statuses(yajl_tree_get(listing, partial, yajl_t_object));
+    } else {
+        v = webhdfs_response_file_statuses(node);
     }
 
     if ((v = yajl_tree_get(v, file_status, yajl_t_array)) == NULL) {
         yajl_tree_free(node);
-        return(NULL);
+        return(1);
     }
 
-    if ((dir = (webhdfs_dir_t *) malloc(sizeof(webhdfs_dir_t))) == NULL) {
-        yajl_tree_free(node);
-        return(NULL);
-    }
+    if (dir->root != NULL)
+        yajl_tree_free(dir->root);
 
     dir->root = node;
     dir->statuses = v;
     dir->current = 0;
+    return(0);
+}
+
+webhdfs_dir_t *webhdfs_dir_from_response (yajl_val node) {
+    webhdfs_dir_t *dir;
+
+    if ((dir = (webhdfs_dir_t *) calloc(1, sizeof(webhdfs_dir_t))) == NULL) {
+        yajl_tree_free(node);
+        return(NULL);
+    }
+
+    if (__webhdfs_dir_set_page(dir, node)) {
+        free(dir);
+        return(NULL);
+    }
 
     return(dir);
 }
 
-const webhdfs_fstat_t *webhdfs_dir_read (webhdfs_dir_t *dir) {
-    const char *path[] = {"pathSuffix", NULL};
-    const char *replication[] = {"replication", NULL};
-    const char *permission[] = {"permission", NULL};
-    const char *length[] = {"length", NULL};
-    const char *group[] = {"group", NULL};
-    const char *owner[] = {"owner", NULL};
-    const char *type[] = {"type", NULL};
-    const char *mtime[] = {"modificationTime", NULL};
-    const char *block[] = {"blockSize", NULL};
-    const char *atime[] = {"accessTime", NULL};
-    yajl_val node, v;
-
-    if (dir->current >= YAJL_GET_ARRAY(dir->statuses)->len)
-        return(NULL);
+static yajl_val __webhdfs_dir_list (webhdfs_t *fs,
+                                    const char *path,
+                                    const char *start_after)
+{
+    webhdfs_req_t req;
+    yajl_val node;
 
-    node = YAJL_GET_ARRAY(dir->statuses)->values[dir->current];
-    dir->current++;
+    webhdfs_req_open(&req, fs, path);
+    if (__sync_fetch_and_add(&(fs->no_list_batch), 0)) {
+        webhdfs_req_set_args(&req, "op=LISTSTATUS");
+    } else {
+        webhdfs_req_set_args(&req, "op=LISTSTATUS_BATCH");
+        if (start_after != NULL)
+            webhdfs_req_set_arg_escaped(&req, "startAfter", start_after);
+    }
+    webhdfs_req_exec(&req, WEBHDFS_REQ_GET);
+    node = webhdfs_req_json_response(&req);
+    webhdfs_req_close(&req);
+
+    return(node);
+}
+
+/* Servers older than LISTSTATUS_BATCH reject it as an unknown op */
+/*
+ * A server without LISTSTATUS_BATCH fails to parse the op value:
+ * "No enum constant ...Op.LISTSTATUS_BATCH". Any other
+ * IllegalArgumentException (a bad path...) says nothing about the op.
+ */
+static int __webhdfs_dir_batch_unsupported (yajl_val node) {
+    const char *exception[] = {"exception", NULL};
+    const char *message[] = {"message", NULL};
+    const char *name, *text;
+    yajl_val v, e;
+
+    if ((e = webhdfs_response_exception(node)) == NULL)
+        return(0);
+
+    if ((v = yajl_tree_get(e, exception, yajl_t_string)) == NULL)
+        return(0);
+
+    name = YAJL_GET_STRING(v);
+    if (!strcmp(name, "UnsupportedOperationException"))
+        return(1);
+
+    if (strcmp(name, "IllegalArgumentException") ||
+        (v = yajl_tree_get(e, message, yajl_t_string)) == NULL)
+        return(0);
+
+    text = YAJL_GET_STRING(v);
+    return(strstr(text, "No enum constant") != NULL &&
+           strstr(text, ".LISTSTATUS_BATCH") != NULL);
+}
+
+webhdfs_dir_t *webhdfs_dir_open (webhdfs_t *fs,
+                                 const char *path)
+{
+    webhdfs_dir_t *dir;
+    yajl_val node;
 
-    if ((v = yajl_tree_get(node, atime, yajl_t_number)))
-        dir->stat.atime = YAJL_GET_INTEGER(v);
+    node = __webhdfs_dir_list(fs, path, NULL);
+    if (!__sync_fetch_and_add(&(fs->no_list_batch), 0) &&
+        __webhdfs_dir_batch_unsupported(node))
+    {
+        yajl_tree_free(node);
+        __sync_lock_test_and_set(&(fs->no_list_batch), 1);
+        node = __webhdfs_dir_list(fs, path, NULL);
+    }
 
-    if ((v = yajl_tree_get(node, mtime, yajl_t_number)))
-        dir->stat.mtime = YAJL_GET_INTEGER(v);
+    if ((dir = webhdfs_dir_from_response(node)) == NULL)
+        return(NULL);
 
-    if ((v = yajl_tree_get(node, length, yajl_t_number)))
-        dir->stat.length = YAJL_GET_INTEGER(v);
+    dir->fs = fs;
+    if ((dir->path = strdup(path)) == NULL) {
+        webhdfs_dir_close(dir);
+        return(NULL);
+    }
 
-    if ((v = yajl_tree_get(node, block, yajl_t_number)))
-        dir->stat.block = YAJL_GET_INTEGER(v);
+    return(dir);
+}
 
-    if ((v = yajl_tree_get(node, replication, yajl_t_number)))
-        dir->stat.replication = YAJL_GET_INTEGER(v);
+/* Current page consumed: fetch the entries after its last name */
+static int __webhdfs_dir_next_page (webhdfs_dir_t *dir) {
+    const char *path_suffix[] = {"pathSuffix", NULL};
+    size_t len = YAJL_GET_ARRAY(dir->statuses)->len;
+    char *after;
+    yajl_val v;
+    int r;
+
+    if (dir->fs == NULL || dir->remaining == 0 || len == 0)
+        return(1);
+
+    v = YAJL_GET_ARRAY(dir->statuses)->values[len - 1];
+    v = yajl_tree_get(v, path_suffix, yajl_t_string);
+    if (v == NULL || (after = strdup(YAJL_GET_STRING(v))) == NULL) {
+        dir->error = 1;
+        dir->remaining = 0;
+        return(1);
+    }
 
-    if ((v = yajl_tree_get(node, permission, yajl_t_string)))
-        dir->stat.permission = strtol(YAJL_GET_STRING(v), NULL, 8);
+    r = __webhdfs_dir_set_page(dir, __webhdfs_dir_list(dir->fs, dir->path, after));
+    free(after);
 
-    if ((v = yajl_tree_get(node, path, yajl_t_string)))
-        dir->stat.path = YAJL_GET_STRING(v);
+    /* A failed page ends the listing, short of its end */
+    if (r) {
+        dir->error = 1;
+        dir->remaining = 0;
+    }
+    return(r);
+}
 
-    if ((v = yajl_tree_get(node, group, yajl_t_string)))
-        dir->stat.group = YAJL_GET_STRING(v);
+const webhdfs_fstat_t *webhdfs_dir_read (webhdfs_dir_t *dir) {
+    yajl_val node;
 
-    if ((v = yajl_tree_get(node, owner, yajl_t_string)))
-        dir->stat.owner = YAJL_GET_STRING(v);
+    while (dir->current >= YAJL_GET_ARRAY(dir->statuses)->len) {
+        if (__webhdfs_dir_next_page(dir))
+            return(NULL);
+    }
 
-    if ((v = yajl_tree_get(node, type, yajl_t_string)))
-        dir->stat.type = YAJL_GET_STRING(v);
+    node = YAJL_GET_ARRAY(dir->statuses)->values[dir->current];
+    dir->current++;
 
+    memset(&(dir->stat), 0, sizeof(webhdfs_fstat_t));
+    webhdfs_fstat_decode(&(dir->stat), node, 0);
     return(&(dir->stat));
 }
 
 void webhdfs_dir_close (webhdfs_dir_t *dir) {
     if (dir->root != NULL)
         yajl_tree_free(dir->root);
+    free(dir->path);
     free(dir);
 }
-
@@ -0,0 +1,314 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <curl/curl.h>
+
+#include "webhdfs_p.h"
+#include "webhdfs.h"
+
+/*
+ * Endpoints are the servers of the configuration: hdfs_host first, then
+ * every webhdfs_conf_add_server().
+ *
+ * Namenodes (WEBHDFS_POLICY_FAILOVER): all requests go to fs->active. A
+ * request rejected by it (StandbyException, or the namenode could not be
+ * reached) marks it and moves fs->active to the next candidate, so the
+ * first thread to notice pays one round trip and the others start on
+ * the new one.
+ *
+ * Gateways (the other policies): each request goes to the endpoint with
+ * the fewest requests in flight, or the lowest latency EWMA weighted by
+ * them. One that refuses connections, or fails WEBHDFS_EJECT_FAILURES
+ * times in a row, is left out for WEBHDFS_EJECT_MS. File reads stick
+ * to the gateway their handle started on while it stays healthy.
+ *
+ * Either way a monitor thread probes the endpoints every few seconds,
+ * to bring back one that recovered.
+ */
+int webhdfs_endpoints_open (webhdfs_t *fs) {
+    const webhdfs_conf_t *conf = fs->conf;
+    int i;
+
+    fs->nendpoints = 1 + conf->nhosts;
+    fs->active = 0;
+    fs->monitor_running = 0;
+    fs->monitor_stop = 0;
+    pthread_mutex_init(&(fs->monitor_lock), NULL);
+    pthread_cond_init(&(fs->monitor_cond), NULL);
+
+    fs->endpoints = (webhdfs_endpoint_t *) calloc(fs->nendpoints, sizeof(webhdfs_endpoint_t));
+    if (fs->endpoints == NULL)
+        return(1);
+
+    fs->endpoints[0].host = conf->hdfs_host;
+    fs->endpoints[0].port = conf->webhdfs_port;
+    for (i = 0; i < conf->nhosts; ++i) {
+        fs->endpoints[i + 1].host = conf->hosts[i];
+        fs->endpoints[i + 1].port = conf->ports[i];
+    }
+
+    for (i = 0; i < fs->nendpoints; ++i)
+        fs->endpoints[i].state = WEBHDFS_ENDPOINT_UP;
+
+    return(0);
+}
+
+int webhdfs_endpoint_active (webhdfs_t *fs) {
+    return(__sync_fetch_and_add(&(fs->active), 0));
+}
+
+static int __webhdfs_endpoint_balanced (webhdfs_t *fs) {
+    return(fs->nendpoints > 1 && fs->conf->endpoint_policy != WEBHDFS_POLICY_FAILOVER);
+}
+
+static void __webhdfs_endpoint_eject (webhdfs_t *fs, int endpoint) {
+    webhdfs_endpoint_t *ep = &(fs->endpoints[endpoint]);
+
+    if (ep->ejected_until_us <= webhdfs_trace_now()) {
+        fprintf(stderr, "webhdfs: %s:%d is unhealthy, leaving it out for %ds\n",
+                ep->host, ep->port, WEBHDFS_EJECT_MS / 1000);
+    }
+    ep->ejected_until_us = webhdfs_trace_now() + (uint64_t)WEBHDFS_EJECT_MS * 1000U;
+}
+
+/* Where a new request goes; sticky is an endpoint to keep, if healthy */
+int webhdfs_endpoint_pick (webhdfs_t *fs, int sticky) {
+    const webhdfs_endpoint_t *ep;
+    uint64_t score, best_score = 0;
+    int best = -1, soonest = 0;
+    unsigned int start;
+    uint64_t now;
+    int i, e;
+
+    if (!__webhdfs_endpoint_balanced(fs))
+        return(webhdfs_endpoint_active(fs));
+
+    now = webhdfs_trace_now();
+    if (sticky >= 0 && sticky < fs->nendpoints && fs->endpoints[sticky].ejected_until_us <= now)
+        return(sticky);
+
+    /* Start the scan somewhere else each time, so ties spread out */
+    start = __sync_fetch_and_add(&(fs->next_pick), 1);
+    for (i = 0; i < fs->nendpoints; ++i) {
+        e = (start + i) % fs->nendpoints;
+        ep = &(fs->endpoints[e]);
+
+        if (ep->ejected_until_us < fs->endpoints[soonest].ejected_until_us)
+            soonest = e;
+        if (ep->ejected_until_us > now)
+            continue;
+
+        score = ep->outstanding;
+        if (fs->conf->endpoint_policy == WEBHDFS_POLICY_EWMA)
+            score = (ep->ewma_us + 1) * (score + 1);
+
+        if (best < 0 || score < best_score) {
+            best_score = score;
+            best = e;
+        }
+    }
+
+    /* All ejected: the one coming back first */
+    return((best >= 0) ? best : soonest);
+}
+
+void webhdfs_endpoint_begin (webhdfs_t *fs, int endpoint) {
+    __sync_fetch_and_add(&(fs->endpoints[endpoint].outstanding), 1);
+}
+
+void webhdfs_endpoint_end (webhdfs_t *fs, int endpoint, uint64_t usec, int failed) {
+    webhdfs_endpoint_t *ep = &(fs->endpoints[endpoint]);
+    uint64_t ewma;
+
+    __sync_fetch_and_sub(&(ep->outstanding), 1);
+
+    /* Racy updates only lose a sample: alpha = 1/8 */
+    ewma = ep->ewma_us;
+    ep->ewma_us = (ewma == 0) ? usec : ewma - ewma / 8 + usec / 8;
+
+    if (!failed) {
+        ep->failures = 0;
+        if (ep->state != WEBHDFS_ENDPOINT_UP)
+            ep->state = WEBHDFS_ENDPOINT_UP;
+    } else if (__sync_add_and_fetch(&(ep->failures), 1) >= WEBHDFS_EJECT_FAILURES &&
+               __webhdfs_endpoint_balanced(fs))
+    {
+        __webhdfs_endpoint_eject(fs, endpoint);
+    }
+}
+
+/*
+ * The endpoint rejected a request; returns the one to try next. A
+ * gateway is ejected and the balancer picks another. For namenodes,
+ * healthy ones come first, then standbys (one may just have taken
+ * over), then those that were down, in order after the failed one.
+ */
+int webhdfs_endpoint_failed (webhdfs_t *fs, int endpoint, int state) {
+    int best = -1, rank, best_rank = 3;
+    int i, e;
+
+    fs->endpoints[endpoint].state = state;
+    if (__webhdfs_endpoint_balanced(fs)) {
+        __webhdfs_endpoint_eject(fs, endpoint);
+        return(webhdfs_endpoint_pick(fs, -1));
+    }
+
+    for (i = 1; i <= fs->nendpoints; ++i) {
+        e = (endpoint + i) % fs->nendpoints;
+        rank = fs->endpoints[e].state;
+        if (e == endpoint)
+            rank = 3;
+        if (rank < best_rank) {
+            best_rank = rank;
+            best = e;
+        }
+    }
+
+    if (best < 0)
+        best = endpoint;
+
+    /* Another thread may have moved on already: keep its choice */
+    if (__sync_bool_compare_and_swap(&(fs->active), endpoint, best)) {
+        fprintf(stderr, "webhdfs: %s:%d %s, failing over to %s:%d\n",
+                fs->endpoints[endpoint].host, fs->endpoints[endpoint].port,
+                (state == WEBHDFS_ENDPOINT_STANDBY) ? "is standby" : "is unreachable",
+                fs->endpoints[best].host, fs->endpoints[best].port);
+    }
+
+    return(webhdfs_endpoint_active(fs));
+}
+
+/* One GETFILESTATUS / on the endpoint, straight to the network */
+static int __webhdfs_endpoint_probe (webhdfs_t *fs, int endpoint) {
+    const webhdfs_conf_t *conf = fs->conf;
+    const webhdfs_endpoint_t *ep = &(fs->endpoints[endpoint]);
+    long rcode = 0;
+    buffer_t body;
+    CURLcode err;
+    CURL *curl;
+    int state;
+
+    if ((curl = webhdfs_curl_get(fs)) == NULL)
+        return(ep->state);
+
+    buffer_open(&body);
+    buffer_append_format(&body, "%s://%s:%d/webhdfs/v1/?",
+                         conf->use_ssl ? "https" : "http", ep->host, ep->port);
+    webhdfs_token_append_auth(fs, &body);
+    buffer_append_format(&body, "op=GETFILESTATUS");
+
+    curl_easy_setopt(curl, CURLOPT_URL, body.blob);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)WEBHDFS_PROBE_TIMEOUT_MS);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)WEBHDFS_PROBE_TIMEOUT_MS);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, webhdfs_buffer_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+
+    buffer_clear(&body);
+    err = curl_easy_perform(curl);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &rcode);
+
+    if (err != CURLE_OK || rcode == 0 || rcode >= 500)
+        state = WEBHDFS_ENDPOINT_DOWN;
+    else if (webhdfs_response_is_standby((int)rcode, &body))
+        state = WEBHDFS_ENDPOINT_STANDBY;
+    else
+        state = WEBHDFS_ENDPOINT_UP;
+
+    buffer_close(&body);
+    return(state);
+}
+
+static void *__webhdfs_endpoint_monitor (void *data) {
+    webhdfs_t *fs = (webhdfs_t *)data;
+    struct timespec deadline;
+    int active, state, i;
+
+    pthread_mutex_lock(&(fs->monitor_lock));
+    while (!fs->monitor_stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += WEBHDFS_PROBE_INTERVAL_MS / 1000;
+        pthread_cond_timedwait(&(fs->monitor_cond), &(fs->monitor_lock), &deadline);
+        if (fs->monitor_stop)
+            break;
+        pthread_mutex_unlock(&(fs->monitor_lock));
+
+        active = webhdfs_endpoint_active(fs);
+        for (i = 0; i < fs->nendpoints; ++i) {
+            state = __webhdfs_endpoint_probe(fs, i);
+            fs->endpoints[i].state = state;
+
+            if (__webhdfs_endpoint_balanced(fs)) {
+                if (state == WEBHDFS_ENDPOINT_UP) {
+                    fs->endpoints[i].failures = 0;
+                    fs->endpoints[i].ejected_until_us = 0;
+                } else {
+                    __webhdfs_endpoint_eject(fs, i);
+                }
+                continue;
+            }
+
+            /* The active one is not serving: prefer one that is */
+            if (state == WEBHDFS_ENDPOINT_UP && i != active &&
+                fs->endpoints[active].state != WEBHDFS_ENDPOINT_UP &&
+                __sync_bool_compare_and_swap(&(fs->active), active, i))
+            {
+                fprintf(stderr, "webhdfs: %s:%d is back, switching to it\n",
+                        fs->endpoints[i].host, fs->endpoints[i].port);
+                active = i;
+            }
+        }
+
+        pthread_mutex_lock(&(fs->monitor_lock));
+    }
+    pthread_mutex_unlock(&(fs->monitor_lock));
+
+    return(NULL);
+}
+
+int webhdfs_endpoints_start (webhdfs_t *fs) {
+    if (fs->nendpoints < 2)
+        return(0);
+
+    if (pthread_create(&(fs->monitor), NULL, __webhdfs_endpoint_monitor, fs))
+        return(1);
+
+    fs->monitor_running = 1;
+    return(0);
+}
+
+void webhdfs_endpoints_close (webhdfs_t *fs) {
+    if (fs->monitor_running) {
+        pthread_mutex_lock(&(fs->monitor_lock));
+        fs->monitor_stop = 1;
+        pthread_cond_signal(&(fs->monitor_cond));
+        pthread_mutex_unlock(&(fs->monitor_lock));
+        pthread_join(fs->monitor, NULL);
+        fs->monitor_running = 0;
+    }
+
+    pthread_cond_destroy(&(fs->monitor_cond));
+    pthread_mutex_destroy(&(fs->monitor_lock));
+    free(fs->endpoints);
+}
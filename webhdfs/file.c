@@ -16,6 +16,7 @@
  * limitations under the License.
  */
 
+#include <fnmatch.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -46,6 +47,28 @@ static size_t __append_buffer_upload (void *ptr, size_t length, void *data) {
     return(length);
 }
 
+/*
+ * Counts what an append really sent, to keep a sized handle's length,
+ * and checksums it when the handle is verifying.
+ */
+struct counted_upload {
+    webhdfs_upload_t func;
+    void *data;
+    size_t bytes;
+    webhdfs_crc_t *crc;
+};
+
+static size_t __counted_upload (void *ptr, size_t length, void *data) {
+    struct counted_upload *cup = (struct counted_upload *)data;
+    size_t n;
+
+    n = cup->func(ptr, length, cup->data);
+    cup->bytes += n;
+    if (cup->crc != NULL)
+        webhdfs_crc_update(cup->crc, ptr, n);
+    return(n);
+}
+
 int webhdfs_file_create (webhdfs_t *fs,
                          const char *path,
                          int override,
@@ -54,17 +77,18 @@ int webhdfs_file_create (webhdfs_t *fs,
 {
     webhdfs_req_t req;
     yajl_val node, v;
+    int err;
 
     webhdfs_req_open(&req, fs, path);
     webhdfs_req_set_args(&req, "op=CREATE&overwrite=%s",
                                override ? "true" : "false");
     webhdfs_req_set_upload(&req, upload_func, upload_data);
-    webhdfs_req_exec(&req, WEBHDFS_REQ_PUT);
+    err = webhdfs_req_exec(&req, WEBHDFS_REQ_PUT);
     node = webhdfs_req_json_response(&req);
     webhdfs_req_close(&req);
 
-    /* Exception */
-    if ((v = webhdfs_response_exception(node)) != NULL) {
+    /* Exception, or an upload cut short */
+    if (err || (v = webhdfs_response_exception(node)) != NULL) {
         yajl_tree_free(node);
         return(1);
     }
@@ -73,6 +97,34 @@ int webhdfs_file_create (webhdfs_t *fs,
     return(0);
 }
 
+/*
+ * The checksum is computed as curl pulls the data, a few percent of a
+ * CPU at network speeds; only one GETFILECHECKSUM is added at the end.
+ */
+int webhdfs_file_create_verified (webhdfs_t *fs,
+                                  const char *path,
+                                  int override,
+                                  webhdfs_upload_t upload_func,
+                                  void *upload_data)
+{
+    struct counted_upload cup;
+    int r;
+
+    cup.func = upload_func;
+    cup.data = upload_data;
+    cup.bytes = 0;
+    if ((cup.crc = webhdfs_crc_alloc()) == NULL)
+        return(1);
+
+    if ((r = webhdfs_file_create(fs, path, override, __counted_upload, &cup)) == 0) {
+        if ((r = webhdfs_crc_verify(fs, path, cup.crc)) > 0)
+            fprintf(stderr, "%s: checksum mismatch after upload\n", path);
+    }
+
+    webhdfs_crc_free(cup.crc);
+    return(r);
+}
+
 webhdfs_file_t *webhdfs_file_open (webhdfs_t *fs,
                                    const char *path)
 {
@@ -83,33 +135,134 @@ webhdfs_file_t *webhdfs_file_open (webhdfs_t *fs,
 
     file->fs = fs;
     file->offset = 0U;
+    file->sized = 0;
+    file->length = 0U;
+    file->mtime = 0U;
+    file->extent_seq = 0U;
+    file->appends = 0U;
+    file->pending = 0;
+    file->ra_max = fs->conf->readahead_max;
+    file->ra_window = 0U;
+    file->ra_next = 0U;
+    file->ra_last = 0U;
+    file->endpoint = -1;
+    file->crc = NULL;
+    memset(file->extents, 0, sizeof(file->extents));
     if ((file->path = strdup(path)) == NULL) {
         free(file);
         return(NULL);
     }
 
+    if (pthread_mutex_init(&(file->lock), NULL)) {
+        free(file->path);
+        free(file);
+        return(NULL);
+    }
+
+    pthread_mutex_init(&(file->cache_lock), NULL);
+    pthread_cond_init(&(file->cache_cond), NULL);
+    pthread_mutex_init(&(file->crc_lock), NULL);
+    return(file);
+}
+
+/*
+ * Open a handle that knows the file length and mtime: from stat when the
+ * caller has it (e.g. a metadata cache), else from one GETFILESTATUS.
+ * Reads are clamped to the length and EOF is answered locally; appends
+ * through the handle extend it. Changes made by others are not seen.
+ */
+webhdfs_file_t *webhdfs_file_open_sized (webhdfs_t *fs,
+                                         const char *path,
+                                         const webhdfs_fstat_t *stat)
+{
+    webhdfs_fstat_t *fetched = NULL;
+    webhdfs_file_t *file = NULL;
+
+    if (stat == NULL) {
+        if ((fetched = webhdfs_stat(fs, path, NULL)) == NULL)
+            return(NULL);
+        stat = fetched;
+    }
+
+    /* A type, when known, must be a file */
+    if (stat->type == NULL || !strcmp(stat->type, "FILE")) {
+        if ((file = webhdfs_file_open(fs, path)) != NULL) {
+            file->length = stat->length;
+            file->mtime = stat->mtime;
+            file->sized = 1;
+        }
+    }
+
+    if (fetched != NULL)
+        webhdfs_fstat_free(fetched);
     return(file);
 }
+
+int webhdfs_file_size (webhdfs_file_t *file,
+                       size_t *length,
+                       size_t *mtime)
+{
+    if (!file->sized)
+        return(1);
+
+    if (length != NULL)
+        *length = __sync_fetch_and_add(&(file->length), 0);
+    if (mtime != NULL)
+        *mtime = file->mtime;
+    return(0);
+}
+
 int webhdfs_file_append (webhdfs_file_t *file,
                          webhdfs_upload_t upload_func,
                          void *upload_data)
 {
+    struct counted_upload cup;
     webhdfs_req_t req;
     yajl_val node, v;
+    int err;
+
+    cup.func = upload_func;
+    cup.data = upload_data;
+    cup.bytes = 0;
+
+    /* Appends continue the checksum only from where it stands */
+    pthread_mutex_lock(&(file->crc_lock));
+    if ((cup.crc = file->crc) != NULL && file->sized &&
+        file->crc->bytes != __sync_fetch_and_add(&(file->length), 0))
+    {
+        file->crc->broken = 1;
+    }
 
     webhdfs_req_open(&req, file->fs, file->path);
     webhdfs_req_set_args(&req, "op=APPEND");
-    webhdfs_req_set_upload(&req, upload_func, upload_data);
-    webhdfs_req_exec(&req, WEBHDFS_REQ_POST);
+    webhdfs_req_set_upload(&req, __counted_upload, &cup);
+    err = webhdfs_req_exec(&req, WEBHDFS_REQ_POST);
     node = webhdfs_req_json_response(&req);
     webhdfs_req_close(&req);
 
-    /* Exception */
-    if ((v = webhdfs_response_exception(node)) != NULL) {
+    /* Even a failed append may have added to the file: see extents */
+    pthread_mutex_lock(&(file->cache_lock));
+    file->appends++;
+    pthread_mutex_unlock(&(file->cache_lock));
+
+    /* The file now ends with what was sent, or holds who knows what */
+    if (cup.crc != NULL) {
+        if (err || req.rcode != 200)
+            cup.crc->broken = 1;
+        else
+            cup.crc->eof = 1;
+    }
+    pthread_mutex_unlock(&(file->crc_lock));
+
+    /* Exception, or an upload cut short */
+    if (err || (v = webhdfs_response_exception(node)) != NULL) {
         yajl_tree_free(node);
         return(1);
     }
 
+    if (file->sized && req.rcode == 200)
+        __sync_fetch_and_add(&(file->length), cup.bytes);
+
     yajl_tree_free(node);
     return(0);
 }
@@ -135,56 +288,445 @@ int webhdfs_file_append_buffer (webhdfs_file_t *file,
       return succ;
 }
 
-size_t webhdfs_file_pread (webhdfs_file_t *file,
-                           void *buffer,
-                           size_t nbyte,
-                           size_t offset)
+/*
+ * One OPEN round trip, no clamping and no cache. A transfer cut short
+ * (timeout, stall, reset) may still carry a 200: it fails, so that its
+ * partial body is never taken for the end of the file.
+ */
+static int __webhdfs_file_fetch (webhdfs_file_t *file,
+                                 void *buffer,
+                                 size_t nbyte,
+                                 size_t offset,
+                                 size_t *size)
 {
     webhdfs_req_t req;
-    yajl_val v;
-    size_t size = 0;
+    int err;
 
-    webhdfs_req_open(&req, file->fs, file->path);
+    /* Behind gateways, a handle keeps reading from the same one */
+    webhdfs_req_open_endpoint(&req, file->fs, file->path,
+                              __sync_fetch_and_add(&(file->endpoint), 0));
     webhdfs_req_set_args(&req, "op=OPEN&offset=%ld&length=%ld", offset, nbyte);
-    webhdfs_req_exec(&req, WEBHDFS_REQ_GET);
-
-    if (req.rcode == 200) {
-        size = req.buffer.size;
-        memcpy(buffer, req.buffer.blob, size);
-    } else {
-        /* Exception */
-        yajl_val node;
-        node = webhdfs_req_json_response(&req);
-        if ((v = webhdfs_response_exception(node)) != NULL) {
-            yajl_tree_free(node);
+    err = webhdfs_req_exec(&req, WEBHDFS_REQ_GET);
+
+    /* Anything else is a RemoteException body: nothing read */
+    *size = 0;
+    if (!err && req.rcode == 200) {
+        /* Readers and prefetch workers race here: any of them will do */
+        __sync_lock_test_and_set(&(file->endpoint), req.endpoint);
+        *size = req.buffer.size;
+        if (*size > nbyte)
+            *size = nbyte;
+        memcpy(buffer, req.buffer.blob, *size);
+    }
+
+    webhdfs_req_close(&req);
+    return(err || req.rcode != 200);
+}
+
+/* ============================================================================
+ *  background extents
+ *
+ * Prefetch and readahead land in a few extents per handle. pread()
+ * serves what an extent covers, waiting for it if it is still in
+ * flight; the rest goes to the network as before. Extents are immutable
+ * once done. A short one says where the file ended, which an append
+ * through the handle makes wrong: it then covers nothing, like a failed
+ * one, even if it was still in flight during the append.
+ */
+static webhdfs_extent_t *__webhdfs_extent_find (webhdfs_file_t *file,
+                                                size_t offset)
+{
+    webhdfs_extent_t *extent;
+    int i;
+
+    for (i = 0; i < WEBHDFS_FILE_EXTENTS; ++i) {
+        if ((extent = file->extents[i]) == NULL)
+            continue;
+
+        /* A failed fetch covers nothing, nor an end of file since moved */
+        if (extent->done && (extent->failed || extent->size == 0 ||
+                             (extent->size < extent->length &&
+                              extent->appends != file->appends)))
+        {
+            continue;
+        }
+
+        if (offset >= extent->offset && offset < extent->offset + extent->length)
+            return(extent);
+    }
+
+    return(NULL);
+}
+
+static void __webhdfs_extent_fetch (void *data) {
+    webhdfs_extent_t *extent = (webhdfs_extent_t *)data;
+    webhdfs_file_t *file = extent->file;
+    size_t size;
+    int failed;
+
+    failed = __webhdfs_file_fetch(file, extent->data, extent->length, extent->offset, &size);
+
+    pthread_mutex_lock(&(file->cache_lock));
+    extent->size = failed ? 0 : size;
+    extent->failed = failed;
+    extent->done = 1;
+    file->pending--;
+    pthread_cond_broadcast(&(file->cache_cond));
+    pthread_mutex_unlock(&(file->cache_lock));
+}
+
+/* Copies from the extent holding offset; returns 0 if there is none */
+static int __webhdfs_extent_read (webhdfs_file_t *file,
+                                  void *buffer,
+                                  size_t nbyte,
+                                  size_t offset,
+                                  size_t *size)
+{
+    webhdfs_extent_t *extent;
+    size_t avail;
+
+    pthread_mutex_lock(&(file->cache_lock));
+    /* Look again after every wakeup: the extent may have been evicted */
+    while ((extent = __webhdfs_extent_find(file, offset)) != NULL && !extent->done)
+        pthread_cond_wait(&(file->cache_cond), &(file->cache_lock));
+
+    if (extent == NULL) {
+        pthread_mutex_unlock(&(file->cache_lock));
+        return(0);
+    }
+
+    /* A short extent means the file ended there */
+    avail = (extent->size > offset - extent->offset) ? extent->size - (offset - extent->offset) : 0;
+    *size = (nbyte < avail) ? nbyte : avail;
+    memcpy(buffer, extent->data + (offset - extent->offset), *size);
+    pthread_mutex_unlock(&(file->cache_lock));
+    return(1);
+}
+
+int webhdfs_file_prefetch (webhdfs_file_t *file,
+                           size_t offset,
+                           size_t length)
+{
+    webhdfs_extent_t *extent;
+    webhdfs_extent_t *victim;
+    int i, slot = -1;
+
+    if (length == 0)
+        return(0);
+
+    pthread_mutex_lock(&(file->cache_lock));
+    extent = __webhdfs_extent_find(file, offset);
+    if (extent != NULL && offset + length <= extent->offset + extent->length) {
+        pthread_mutex_unlock(&(file->cache_lock));
+        return(0);
+    }
+
+    /* A free slot, else the oldest extent that is not in flight */
+    for (i = 0; i < WEBHDFS_FILE_EXTENTS; ++i) {
+        if ((victim = file->extents[i]) == NULL) {
+            slot = i;
+            break;
+        }
+
+        if (victim->done && (slot < 0 || victim->seq < file->extents[slot]->seq))
+            slot = i;
+    }
+
+    if (slot < 0 || (extent = (webhdfs_extent_t *) malloc(sizeof(webhdfs_extent_t))) == NULL) {
+        pthread_mutex_unlock(&(file->cache_lock));
+        return(1);
+    }
+
+    if ((extent->data = (char *) malloc(length)) == NULL) {
+        pthread_mutex_unlock(&(file->cache_lock));
+        free(extent);
+        return(1);
+    }
+
+    extent->file = file;
+    extent->offset = offset;
+    extent->length = length;
+    extent->size = 0;
+    extent->seq = file->extent_seq++;
+    extent->appends = file->appends;
+    extent->done = 0;
+    extent->failed = 0;
+
+    if (webhdfs_worker_submit(file->fs, __webhdfs_extent_fetch, extent)) {
+        pthread_mutex_unlock(&(file->cache_lock));
+        free(extent->data);
+        free(extent);
+        return(1);
+    }
+
+    if ((victim = file->extents[slot]) != NULL) {
+        free(victim->data);
+        free(victim);
+    }
+    file->extents[slot] = extent;
+    file->pending++;
+    pthread_mutex_unlock(&(file->cache_lock));
+    return(0);
+}
+
+static int __webhdfs_file_matches (const char *path, const char *patterns) {
+    const char *name;
+    char *list, *p, *save;
+    int match = 0;
+
+    if (patterns == NULL || (list = strdup(patterns)) == NULL)
+        return(0);
+
+    name = (name = strrchr(path, '/')) != NULL ? name + 1 : path;
+    for (p = strtok_r(list, ",", &save); p != NULL && !match; p = strtok_r(NULL, ",", &save))
+        match = !fnmatch(p, name, 0);
+
+    free(list);
+    return(match);
+}
+
+/*
+ * Apply the connection's prefetch policy to a sized handle: small files
+ * are fetched whole, files matching the tail patterns (columnar formats
+ * keep their footer there) get their last bytes. Both run in the
+ * background, so the caller's first request overlaps them.
+ */
+int webhdfs_file_prefetch_auto (webhdfs_file_t *file) {
+    const webhdfs_conf_t *conf = file->fs->conf;
+    size_t length;
+
+    if (webhdfs_file_size(file, &length, NULL) || length == 0)
+        return(0);
+
+    if (length <= conf->prefetch_small)
+        return(webhdfs_file_prefetch(file, 0, length));
+
+    if (conf->prefetch_tail > 0 && __webhdfs_file_matches(file->path, conf->prefetch_patterns)) {
+        if (conf->prefetch_tail >= length)
+            return(webhdfs_file_prefetch(file, 0, length));
+        return(webhdfs_file_prefetch(file, length - conf->prefetch_tail, conf->prefetch_tail));
+    }
+
+    return(0);
+}
+
+/* *eof is set if the server said the file ends before nbyte more bytes */
+static size_t __webhdfs_file_pread (webhdfs_file_t *file,
+                                    void *buffer,
+                                    size_t nbyte,
+                                    size_t offset,
+                                    int *eof)
+{
+    char *p = (char *)buffer;
+    size_t total = 0;
+    size_t length;
+    size_t size;
+
+    *eof = 0;
+
+    /* Known length: EOF and out-of-range reads need no round trip */
+    if (file->sized) {
+        length = __sync_fetch_and_add(&(file->length), 0);
+        if (offset >= length) {
+            *eof = 1;
             return(0);
         }
-        yajl_tree_free(node);
+        if (nbyte > length - offset)
+            nbyte = length - offset;
     }
 
-    webhdfs_req_close(&req);
+    if (nbyte == 0)
+        return(0);
+
+    /* A range may span extents; the first gap goes to the network */
+    while (nbyte > 0) {
+        if (!__webhdfs_extent_read(file, p, nbyte, offset, &size)) {
+            if (!__webhdfs_file_fetch(file, p, nbyte, offset, &size))
+                *eof = (size < nbyte);
+            return(total + size);
+        }
+
+        /* Only a complete fetch is kept: a short one ended the file */
+        if (size == 0) {
+            *eof = 1;
+            break;
+        }
+
+        total += size;
+        p += size;
+        offset += size;
+        nbyte -= size;
+    }
+
+    return(total);
+}
+
+size_t webhdfs_file_pread (webhdfs_file_t *file,
+                           void *buffer,
+                           size_t nbyte,
+                           size_t offset)
+{
+    size_t size;
+    int eof;
+
+    size = __webhdfs_file_pread(file, buffer, nbyte, offset, &eof);
+    if (__sync_fetch_and_add(&(file->crc), 0) == NULL)
+        return(size);
+
+    /* Only the next bytes in order count; a failed read is not the end */
+    pthread_mutex_lock(&(file->crc_lock));
+    if (file->crc != NULL && offset == file->crc->bytes) {
+        if (size > 0)
+            webhdfs_crc_update(file->crc, buffer, size);
+        if (eof)
+            file->crc->eof = 1;
+    }
+    pthread_mutex_unlock(&(file->crc_lock));
     return(size);
 }
 
+int webhdfs_file_set_verify (webhdfs_file_t *file, int enable) {
+    webhdfs_crc_t *crc = NULL;
+
+    if (enable && (crc = webhdfs_crc_alloc()) == NULL)
+        return(1);
+
+    pthread_mutex_lock(&(file->crc_lock));
+    webhdfs_crc_free(__sync_lock_test_and_set(&(file->crc), crc));
+    pthread_mutex_unlock(&(file->crc_lock));
+    return(0);
+}
+
+/* 0 if what went through the handle is the whole file, as the server has it */
+int webhdfs_file_verify (webhdfs_file_t *file) {
+    size_t length;
+    int r = -1;
+
+    pthread_mutex_lock(&(file->crc_lock));
+    if (file->crc != NULL) {
+        if (webhdfs_file_size(file, &length, NULL) == 0) {
+            if (file->crc->bytes == length)
+                file->crc->eof = 1;
+        }
+
+        if (file->crc->eof)
+            r = webhdfs_crc_verify(file->fs, file->path, file->crc);
+    }
+    pthread_mutex_unlock(&(file->crc_lock));
+    return(r);
+}
+
+/*
+ * Readahead for read(): once the previous read ended where this one
+ * starts, keep the next window of the file requested in the background,
+ * in chunks of a quarter window. The window doubles each time it moves,
+ * up to ra_max, and drops back to the minimum on a seek. The extent
+ * slots bound what is buffered. Called with file->lock held.
+ */
+static void __webhdfs_file_readahead (webhdfs_file_t *file, size_t nbyte) {
+    size_t offset = file->offset;
+    size_t length = 0;
+    size_t target;
+    size_t chunk;
+    size_t next;
+
+    if (file->ra_max == 0)
+        return;
+
+    if (offset != file->ra_last || file->ra_window == 0) {
+        file->ra_window = (file->ra_max < WEBHDFS_READAHEAD_MIN) ? file->ra_max : WEBHDFS_READAHEAD_MIN;
+        file->ra_next = offset;
+
+        /* Not sequential (yet): the first read after a seek goes alone */
+        if (offset != file->ra_last)
+            return;
+    }
+
+    next = (file->ra_next > offset) ? file->ra_next : offset;
+    target = offset + nbyte + file->ra_window;
+    if (webhdfs_file_size(file, &length, NULL) == 0 && target > length)
+        target = length;
+
+    chunk = file->ra_window / 4;
+    if (chunk < nbyte)
+        chunk = nbyte;
+
+    if (next >= target)
+        return;
+
+    while (next < target) {
+        if (webhdfs_file_prefetch(file, next, chunk))
+            break;
+        next += chunk;
+    }
+
+    if (next != file->ra_next) {
+        file->ra_next = next;
+        file->ra_window *= 2;
+        if (file->ra_window > file->ra_max)
+            file->ra_window = file->ra_max;
+    }
+}
+
+int webhdfs_file_set_readahead (webhdfs_file_t *file, size_t max_window) {
+    pthread_mutex_lock(&(file->lock));
+    file->ra_max = max_window;
+    file->ra_window = 0U;
+    pthread_mutex_unlock(&(file->lock));
+    return(0);
+}
+
 size_t webhdfs_file_read (webhdfs_file_t *file,
                           void *buffer,
                           size_t nbyte)
 {
     size_t rd;
 
+    /* Hold the lock across the request: concurrent readers of one handle
+     * each get the next distinct range, never the same offset twice.
+     */
+    pthread_mutex_lock(&(file->lock));
+    __webhdfs_file_readahead(file, nbyte);
     if ((rd = webhdfs_file_pread(file, buffer, nbyte, file->offset)) > 0)
         file->offset += rd;
+    file->ra_last = file->offset;
+    pthread_mutex_unlock(&(file->lock));
 
     return(rd);
 }
 
 int webhdfs_file_seek (webhdfs_file_t *file, size_t offset) {
-    /* TODO: Check file length? */
+    /* Seeking to the end is fine, past it is not */
+    if (file->sized && offset > __sync_fetch_and_add(&(file->length), 0))
+        return(1);
+
+    pthread_mutex_lock(&(file->lock));
     file->offset = offset;
+    pthread_mutex_unlock(&(file->lock));
     return(0);
 }
 
 void webhdfs_file_close (webhdfs_file_t *file) {
+    int i;
+
+    /* Workers write into the extents: let them finish first */
+    pthread_mutex_lock(&(file->cache_lock));
+    while (file->pending > 0)
+        pthread_cond_wait(&(file->cache_cond), &(file->cache_lock));
+    pthread_mutex_unlock(&(file->cache_lock));
+
+    for (i = 0; i < WEBHDFS_FILE_EXTENTS; ++i) {
+        if (file->extents[i] != NULL) {
+            free(file->extents[i]->data);
+            free(file->extents[i]);
+        }
+    }
+
+    webhdfs_crc_free(file->crc);
+    pthread_mutex_destroy(&(file->crc_lock));
+    pthread_cond_destroy(&(file->cache_cond));
+    pthread_mutex_destroy(&(file->cache_lock));
+    pthread_mutex_destroy(&(file->lock));
     free(file->path);
     free(file);
 }
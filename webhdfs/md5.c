@@ -0,0 +1,168 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "webhdfs_p.h"
+
+/*
+ * MD5 (RFC 1321), only what the HDFS file checksum needs: it hashes a
+ * few bytes per 512 of data, so this is nowhere near a hot path.
+ */
+#define MD5_F(x, y, z)              ((z) ^ ((x) & ((y) ^ (z))))
+#define MD5_G(x, y, z)              ((y) ^ ((z) & ((x) ^ (y))))
+#define MD5_H(x, y, z)              ((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z)              ((y) ^ ((x) | ~(z)))
+
+#define MD5_STEP(f, a, b, c, d, x, t, s)                            \
+    do {                                                            \
+        (a) += f((b), (c), (d)) + (x) + (t);                        \
+        (a) = ((a) << (s)) | ((a) >> (32 - (s)));                   \
+        (a) += (b);                                                 \
+    } while (0)
+
+static void __md5_block (uint32_t state[4], const unsigned char *p) {
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t x[16];
+    int i;
+
+    for (i = 0; i < 16; ++i) {
+        x[i] = (uint32_t)p[i * 4] | ((uint32_t)p[i * 4 + 1] << 8) |
+               ((uint32_t)p[i * 4 + 2] << 16) | ((uint32_t)p[i * 4 + 3] << 24);
+    }
+
+    MD5_STEP(MD5_F, a, b, c, d, x[ 0], 0xd76aa478,  7);
+    MD5_STEP(MD5_F, d, a, b, c, x[ 1], 0xe8c7b756, 12);
+    MD5_STEP(MD5_F, c, d, a, b, x[ 2], 0x242070db, 17);
+    MD5_STEP(MD5_F, b, c, d, a, x[ 3], 0xc1bdceee, 22);
+    MD5_STEP(MD5_F, a, b, c, d, x[ 4], 0xf57c0faf,  7);
+    MD5_STEP(MD5_F, d, a, b, c, x[ 5], 0x4787c62a, 12);
+    MD5_STEP(MD5_F, c, d, a, b, x[ 6], 0xa8304613, 17);
+    MD5_STEP(MD5_F, b, c, d, a, x[ 7], 0xfd469501, 22);
+    MD5_STEP(MD5_F, a, b, c, d, x[ 8], 0x698098d8,  7);
+    MD5_STEP(MD5_F, d, a, b, c, x[ 9], 0x8b44f7af, 12);
+    MD5_STEP(MD5_F, c, d, a, b, x[10], 0xffff5bb1, 17);
+    MD5_STEP(MD5_F, b, c, d, a, x[11], 0x895cd7be, 22);
+    MD5_STEP(MD5_F, a, b, c, d, x[12], 0x6b901122,  7);
+    MD5_STEP(MD5_F, d, a, b, c, x[13], 0xfd987193, 12);
+    MD5_STEP(MD5_F, c, d, a, b, x[14], 0xa679438e, 17);
+    MD5_STEP(MD5_F, b, c, d, a, x[15], 0x49b40821, 22);
+
+    MD5_STEP(MD5_G, a, b, c, d, x[ 1], 0xf61e2562,  5);
+    MD5_STEP(MD5_G, d, a, b, c, x[ 6], 0xc040b340,  9);
+    MD5_STEP(MD5_G, c, d, a, b, x[11], 0x265e5a51, 14);
+    MD5_STEP(MD5_G, b, c, d, a, x[ 0], 0xe9b6c7aa, 20);
+    MD5_STEP(MD5_G, a, b, c, d, x[ 5], 0xd62f105d,  5);
+    MD5_STEP(MD5_G, d, a, b, c, x[10], 0x02441453,  9);
+    MD5_STEP(MD5_G, c, d, a, b, x[15], 0xd8a1e681, 14);
+    MD5_STEP(MD5_G, b, c, d, a, x[ 4], 0xe7d3fbc8, 20);
+    MD5_STEP(MD5_G, a, b, c, d, x[ 9], 0x21e1cde6,  5);
+    MD5_STEP(MD5_G, d, a, b, c, x[14], 0xc33707d6,  9);
+    MD5_STEP(MD5_G, c, d, a, b, x[ 3], 0xf4d50d87, 14);
+    MD5_STEP(MD5_G, b, c, d, a, x[ 8], 0x455a14ed, 20);
+    MD5_STEP(MD5_G, a, b, c, d, x[13], 0xa9e3e905,  5);
+    MD5_STEP(MD5_G, d, a, b, c, x[ 2], 0xfcefa3f8,  9);
+    MD5_STEP(MD5_G, c, d, a, b, x[ 7], 0x676f02d9, 14);
+    MD5_STEP(MD5_G, b, c, d, a, x[12], 0x8d2a4c8a, 20);
+
+    MD5_STEP(MD5_H, a, b, c, d, x[ 5], 0xfffa3942,  4);
+    MD5_STEP(MD5_H, d, a, b, c, x[ 8], 0x8771f681, 11);
+    MD5_STEP(MD5_H, c, d, a, b, x[11], 0x6d9d6122, 16);
+    MD5_STEP(MD5_H, b, c, d, a, x[14], 0xfde5380c, 23);
+    MD5_STEP(MD5_H, a, b, c, d, x[ 1], 0xa4beea44,  4);
+    MD5_STEP(MD5_H, d, a, b, c, x[ 4], 0x4bdecfa9, 11);
+    MD5_STEP(MD5_H, c, d, a, b, x[ 7], 0xf6bb4b60, 16);
+    MD5_STEP(MD5_H, b, c, d, a, x[10], 0xbebfbc70, 23);
+    MD5_STEP(MD5_H, a, b, c, d, x[13], 0x289b7ec6,  4);
+    MD5_STEP(MD5_H, d, a, b, c, x[ 0], 0xeaa127fa, 11);
+    MD5_STEP(MD5_H, c, d, a, b, x[ 3], 0xd4ef3085, 16);
+    MD5_STEP(MD5_H, b, c, d, a, x[ 6], 0x04881d05, 23);
+    MD5_STEP(MD5_H, a, b, c, d, x[ 9], 0xd9d4d039,  4);
+    MD5_STEP(MD5_H, d, a, b, c, x[12], 0xe6db99e5, 11);
+    MD5_STEP(MD5_H, c, d, a, b, x[15], 0x1fa27cf8, 16);
+    MD5_STEP(MD5_H, b, c, d, a, x[ 2], 0xc4ac5665, 23);
+
+    MD5_STEP(MD5_I, a, b, c, d, x[ 0], 0xf4292244,  6);
+    MD5_STEP(MD5_I, d, a, b, c, x[ 7], 0x432aff97, 10);
+    MD5_STEP(MD5_I, c, d, a, b, x[14], 0xab9423a7, 15);
+    MD5_STEP(MD5_I, b, c, d, a, x[ 5], 0xfc93a039, 21);
+    MD5_STEP(MD5_I, a, b, c, d, x[12], 0x655b59c3,  6);
+    MD5_STEP(MD5_I, d, a, b, c, x[ 3], 0x8f0ccc92, 10);
+    MD5_STEP(MD5_I, c, d, a, b, x[10], 0xffeff47d, 15);
+    MD5_STEP(MD5_I, b, c, d, a, x[ 1], 0x85845dd1, 21);
+    MD5_STEP(MD5_I, a, b, c, d, x[ 8], 0x6fa87e4f,  6);
+    MD5_STEP(MD5_I, d, a, b, c, x[15], 0xfe2ce6e0, 10);
+    MD5_STEP(MD5_I, c, d, a, b, x[ 6], 0xa3014314, 15);
+    MD5_STEP(MD5_I, b, c, d, a, x[13], 0x4e0811a1, 21);
+    MD5_STEP(MD5_I, a, b, c, d, x[ 4], 0xf7537e82,  6);
+    MD5_STEP(MD5_I, d, a, b, c, x[11], 0xbd3af235, 10);
+    MD5_STEP(MD5_I, c, d, a, b, x[ 2], 0x2ad7d2bb, 15);
+    MD5_STEP(MD5_I, b, c, d, a, x[ 9], 0xeb86d391, 21);
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+void webhdfs_md5_init (webhdfs_md5_t *md5) {
+    md5->state[0] = 0x67452301;
+    md5->state[1] = 0xefcdab89;
+    md5->state[2] = 0x98badcfe;
+    md5->state[3] = 0x10325476;
+    md5->bytes = 0;
+}
+
+void webhdfs_md5_update (webhdfs_md5_t *md5, const void *data, size_t n) {
+    const unsigned char *p = (const unsigned char *)data;
+    size_t fill = md5->bytes & 63;
+    size_t take;
+
+    md5->bytes += n;
+    if (fill > 0) {
+        take = (n < 64 - fill) ? n : 64 - fill;
+        memcpy(md5->buffer + fill, p, take);
+        p += take;
+        n -= take;
+        if (fill + take < 64)
+            return;
+        __md5_block(md5->state, md5->buffer);
+    }
+
+    for (; n >= 64; p += 64, n -= 64)
+        __md5_block(md5->state, p);
+    memcpy(md5->buffer, p, n);
+}
+
+void webhdfs_md5_final (webhdfs_md5_t *md5, unsigned char digest[16]) {
+    static const unsigned char pad[64] = {0x80};
+    unsigned char bits[8];
+    uint64_t nbits = md5->bytes * 8;
+    size_t fill = md5->bytes & 63;
+    int i;
+
+    for (i = 0; i < 8; ++i)
+        bits[i] = (unsigned char)(nbits >> (i * 8));
+
+    webhdfs_md5_update(md5, pad, (fill < 56) ? 56 - fill : 120 - fill);
+    webhdfs_md5_update(md5, bits, 8);
+
+    for (i = 0; i < 16; ++i)
+        digest[i] = (unsigned char)(md5->state[i / 4] >> ((i % 4) * 8));
+}
@@ -16,9 +16,12 @@
  * limitations under the License.
  */
 
+#include <strings.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <stdio.h>
-
+#include <time.h>
 
 #include <curl/curl.h>
 #include <yajl/yajl_tree.h>
@@ -41,6 +44,24 @@ static size_t __webhdfs_req_write (void *ptr,
     if (buffer_append(&(req->buffer), ptr, n))
         return(0);
 
+    req->xfer_bytes += n;
+    if (req->deadline_us != 0)
+        req->deadline_us += webhdfs_throttle(req->fs, WEBHDFS_BUCKET_READ, n);
+    else
+        webhdfs_throttle(req->fs, WEBHDFS_BUCKET_READ, n);
+    return(n);
+}
+
+/* curl write callback appending to a buffer_t */
+size_t webhdfs_buffer_write (void *ptr,
+                             size_t size,
+                             size_t nitems,
+                             void *buffer)
+{
+    size_t n = size * nitems;
+
+    if (buffer_append((buffer_t *)buffer, ptr, n))
+        return(0);
     return(n);
 }
 
@@ -50,41 +71,185 @@ static size_t __webhdfs_req_read (void *ptr,
                                   void *stream)
 {
     webhdfs_req_t *req = (webhdfs_req_t *)stream;
+    size_t n;
+
     if (req->upload == NULL)
         return(0);
 
-    return(req->upload(ptr, size * nitems, req->upload_data));
+    n = req->upload(ptr, size * nitems, req->upload_data);
+    req->xfer_bytes += n;
+    webhdfs_throttle(req->fs, WEBHDFS_BUCKET_WRITE, n);
+    return(n);
 }
 
-int webhdfs_req_open (webhdfs_req_t *req,
-                      webhdfs_t *fs,
-                      const char *path)
+/*
+ * One curl handle per (fs, thread). A handle keeps its connection cache
+ * between requests, so reusing it gives us keep-alive to the namenode and
+ * datanodes; curl handles must never be shared between threads, though.
+ * Handles are linked on fs->curls so webhdfs_disconnect() can free them.
+ * The hedge handle and multi stack are only created for hedged reads.
+ */
+static webhdfs_curl_t *__webhdfs_curl_slot (webhdfs_t *fs) {
+    webhdfs_curl_t *handle;
+
+    if ((handle = (webhdfs_curl_t *) pthread_getspecific(fs->curl_key)) != NULL)
+        return(handle);
+
+    if ((handle = (webhdfs_curl_t *) calloc(1, sizeof(webhdfs_curl_t))) == NULL)
+        return(NULL);
+
+    if ((handle->curl = curl_easy_init()) == NULL) {
+        free(handle);
+        return(NULL);
+    }
+
+    handle->fs = fs;
+    handle->prev = NULL;
+
+    pthread_mutex_lock(&(fs->lock));
+    if ((handle->next = fs->curls) != NULL)
+        fs->curls->prev = handle;
+    fs->curls = handle;
+    pthread_mutex_unlock(&(fs->lock));
+
+    pthread_setspecific(fs->curl_key, handle);
+    return(handle);
+}
+
+void *webhdfs_curl_get (webhdfs_t *fs) {
+    webhdfs_curl_t *handle;
+
+    if ((handle = __webhdfs_curl_slot(fs)) == NULL)
+        return(NULL);
+
+    curl_easy_reset(handle->curl);
+    return(handle->curl);
+}
+
+static void __webhdfs_curl_free (webhdfs_curl_t *handle) {
+    webhdfs_t *fs = handle->fs;
+
+    pthread_mutex_lock(&(fs->lock));
+    if (handle->prev != NULL)
+        handle->prev->next = handle->next;
+    else
+        fs->curls = handle->next;
+    if (handle->next != NULL)
+        handle->next->prev = handle->prev;
+    pthread_mutex_unlock(&(fs->lock));
+
+    curl_easy_cleanup(handle->curl);
+    if (handle->hedge != NULL)
+        curl_easy_cleanup(handle->hedge);
+    if (handle->multi != NULL)
+        curl_multi_cleanup(handle->multi);
+    free(handle);
+}
+
+/* Free the calling thread's handle, for threads that exit before the fs */
+void webhdfs_curl_release (webhdfs_t *fs) {
+    webhdfs_curl_t *handle;
+
+    if ((handle = (webhdfs_curl_t *) pthread_getspecific(fs->curl_key)) == NULL)
+        return;
+
+    pthread_setspecific(fs->curl_key, NULL);
+    __webhdfs_curl_free(handle);
+}
+
+/* curl_key destructor: a thread that exits takes its handle with it */
+void webhdfs_curl_destructor (void *value) {
+    if (value != NULL)
+        __webhdfs_curl_free((webhdfs_curl_t *)value);
+}
+
+void webhdfs_curl_free_all (webhdfs_t *fs) {
+    webhdfs_curl_t *next;
+
+    pthread_mutex_lock(&(fs->lock));
+    while (fs->curls != NULL) {
+        next = fs->curls->next;
+        curl_easy_cleanup(fs->curls->curl);
+        if (fs->curls->hedge != NULL)
+            curl_easy_cleanup(fs->curls->hedge);
+        if (fs->curls->multi != NULL)
+            curl_multi_cleanup(fs->curls->multi);
+        free(fs->curls);
+        fs->curls = next;
+    }
+    pthread_mutex_unlock(&(fs->lock));
+}
+
+static int __webhdfs_req_open (webhdfs_req_t *req,
+                               webhdfs_t *fs,
+                               const char *path,
+                               int sticky,
+                               int use_token)
 {
     const webhdfs_conf_t *conf = fs->conf;
+    const webhdfs_endpoint_t *endpoint;
     int r;
 
     buffer_open(&(req->buffer));
 
+    req->fs = fs;
+    req->path = path;
+    req->op[0] = '\0';
+    req->xfer_bytes = 0;
+    req->rcode = 0;
+    req->curl_err = 0;
+    req->redirected = 0;
+    req->turned_away = 0;
+    req->admitted_on = -1;
+
     /* No upload by default */
     req->upload_data = NULL;
     req->upload = NULL;
 
-    /* Fill URL */
+    /* Fill URL, for the active namenode or the least loaded gateway */
+    req->endpoint = webhdfs_endpoint_pick(fs, sticky);
+    endpoint = &(fs->endpoints[req->endpoint]);
+
     buffer_clear(&(req->buffer));
-    r = buffer_append_format(&(req->buffer), "%s://%s:%d/webhdfs/v1/%s?",
+    r = buffer_append_format(&(req->buffer), "%s://%s:%d",
                              conf->use_ssl ? "https" : "http",
-                             conf->hdfs_host, conf->webhdfs_port,
-                             (path != NULL) ? path + 1 : "");
+                             endpoint->host, endpoint->port);
+    req->url_prefix = req->buffer.size;
+    r |= buffer_append_format(&(req->buffer), "/webhdfs/v1/%s?",
+                              (path != NULL) ? path + 1 : "");
 
-    if (conf->hdfs_user != NULL)
+    if (use_token)
+        r |= webhdfs_token_append_auth(fs, &(req->buffer));
+    else if (conf->hdfs_user != NULL)
         r |= buffer_append_format(&(req->buffer), "user.name=%s&", conf->hdfs_user);
 
-    if (conf->token != NULL)
-        r |= buffer_append_format(&(req->buffer), "delegation=%s&", conf->token);
-
     return(r);
 }
 
+int webhdfs_req_open (webhdfs_req_t *req,
+                      webhdfs_t *fs,
+                      const char *path)
+{
+    return(__webhdfs_req_open(req, fs, path, -1, 1));
+}
+
+/* As webhdfs_req_open(), as the user: delegation tokens cannot get tokens */
+int webhdfs_req_open_user (webhdfs_req_t *req,
+                           webhdfs_t *fs,
+                           const char *path)
+{
+    return(__webhdfs_req_open(req, fs, path, -1, 0));
+}
+
+/* As webhdfs_req_open(), preferring the endpoint sticky (-1 for none) */
+int webhdfs_req_open_endpoint (webhdfs_req_t *req,
+                               webhdfs_t *fs,
+                               const char *path,
+                               int sticky)
+{
+    return(__webhdfs_req_open(req, fs, path, sticky, 1));
+}
+
 void webhdfs_req_close (webhdfs_req_t *req) {
     buffer_close(&(req->buffer));
 }
@@ -96,6 +261,15 @@ int webhdfs_req_set_args (webhdfs_req_t *req,
     va_list ap;
     int r = 0;
 
+    /* Remember the op name for tracing */
+    if (!strncmp(frmt, "op=", 3)) {
+        size_t n = strcspn(frmt + 3, "&");
+        if (n >= sizeof(req->op))
+            n = sizeof(req->op) - 1;
+        memcpy(req->op, frmt + 3, n);
+        req->op[n] = '\0';
+    }
+
     va_start(ap, frmt);
     buffer_append_vformat(&(req->buffer), frmt, ap);
     va_end(ap);
@@ -103,6 +277,33 @@ int webhdfs_req_set_args (webhdfs_req_t *req,
     return(r);
 }
 
+/* Append "&name=value" with value percent-encoded (e.g. a file name) */
+int webhdfs_req_set_arg_escaped (webhdfs_req_t *req,
+                                 const char *name,
+                                 const char *value)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    const unsigned char *p;
+    char esc[3];
+    int r;
+
+    r = buffer_append_format(&(req->buffer), "&%s=", name);
+    for (p = (const unsigned char *)value; *p != '\0' && !r; ++p) {
+        if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+            (*p >= '0' && *p <= '9') || strchr("-._~", *p) != NULL)
+        {
+            r = buffer_append(&(req->buffer), p, 1);
+        } else {
+            esc[0] = '%';
+            esc[1] = hex[*p >> 4];
+            esc[2] = hex[*p & 15];
+            r = buffer_append(&(req->buffer), esc, 3);
+        }
+    }
+
+    return(r);
+}
+
 int webhdfs_req_set_upload (webhdfs_req_t *req,
                             webhdfs_upload_t func,
                             void *user_data)
@@ -112,27 +313,127 @@ int webhdfs_req_set_upload (webhdfs_req_t *req,
     return(0);
 }
 
-int webhdfs_req_exec (webhdfs_req_t *req, int type) {
-    struct curl_slist *headers = NULL;
-    CURLcode err;
-    CURL *curl;
+static void __webhdfs_req_redirect_host (char *host, size_t size, const char *url) {
+    const char *p;
+    size_t n;
 
-    if ((curl = curl_easy_init()) == NULL)
-        return(1);
+    host[0] = '\0';
+    if (url == NULL || (p = strstr(url, "://")) == NULL)
+        return;
 
-    curl_easy_setopt(curl, CURLOPT_URL, req->buffer.blob);
-#ifdef GLOG
-    DLOG(INFO) << "downloading url: " << req->buffer.blob;
-#elif DEBUG
-    printf("downloading url: %s\n", req->buffer.blob);
-#endif
-    buffer_clear(&(req->buffer));
+    p += 3;
+    if ((n = strcspn(p, "/?")) >= size)
+        n = size - 1;
+    memcpy(host, p, n);
+    host[n] = '\0';
+}
+
+static void __webhdfs_req_trace_end (webhdfs_req_t *req,
+                                     CURL *curl,
+                                     void *slot,
+                                     uint64_t begin_us,
+                                     uint64_t redirect_us)
+{
+    unsigned int slow_ms = req->fs->conf->slow_request_ms;
+    webhdfs_trace_event_t event;
+    double redirect_time;
+    long redirects = 0;
+    char *url = NULL;
+
+    memset(&event, 0, sizeof(webhdfs_trace_event_t));
+    event.begin_us = begin_us;
+    event.end_us = webhdfs_trace_now();
+    event.status = req->rcode;
+    event.bytes = req->xfer_bytes;
+
+    if (redirect_us == 0) {
+        /* Redirect followed by curl within a single perform */
+        curl_easy_getinfo(curl, CURLINFO_REDIRECT_COUNT, &redirects);
+        if (redirects > 0) {
+            curl_easy_getinfo(curl, CURLINFO_REDIRECT_TIME, &redirect_time);
+            curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+            redirect_us = begin_us + (uint64_t)(redirect_time * 1000000.0);
+        }
+    } else {
+        curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+    }
+
+    if (redirect_us > begin_us && redirect_us < event.end_us) {
+        event.namenode_us = redirect_us - begin_us;
+        event.datanode_us = event.end_us - redirect_us;
+        __webhdfs_req_redirect_host(event.redirect, sizeof(event.redirect), url);
+    } else {
+        event.namenode_us = event.end_us - begin_us;
+    }
+
+    if (slot != NULL)
+        webhdfs_trace_end(slot, &event);
+
+    if (slow_ms > 0 && (event.end_us - begin_us) >= (uint64_t)slow_ms * 1000U) {
+        strncpy(event.op, req->op, sizeof(event.op) - 1);
+        if (req->path != NULL)
+            strncpy(event.path, req->path, sizeof(event.path) - 1);
+        webhdfs_trace_slow_log(&event);
+    }
+}
+
+/* Past the deadline, less the time the read limit held us up */
+static int __webhdfs_req_progress (void *data,
+                                   curl_off_t dltotal,
+                                   curl_off_t dlnow,
+                                   curl_off_t ultotal,
+                                   curl_off_t ulnow)
+{
+    const webhdfs_req_t *req = (const webhdfs_req_t *)data;
+
+    (void)dltotal;
+    (void)dlnow;
+    (void)ultotal;
+    (void)ulnow;
+    return(webhdfs_trace_now() > req->deadline_us);
+}
+
+/* Our own deadline gives up the way curl's would */
+static CURLcode __webhdfs_req_overdue (const webhdfs_req_t *req, CURLcode err) {
+    if (err == CURLE_ABORTED_BY_CALLBACK && req->deadline_us != 0)
+        return(CURLE_OPERATION_TIMEDOUT);
+    return(err);
+}
+
+/* Options shared by every transfer: method, deadlines, redirects */
+static void __webhdfs_req_setup (webhdfs_req_t *req, CURL *curl, int type) {
+    const webhdfs_conf_t *conf = req->fs->conf;
 
     curl_easy_setopt(curl, CURLOPT_VERBOSE, 0);
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, req->upload == NULL);
 
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, __webhdfs_req_write);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, req);
+    /* Timeouts must not use signals, we are called from many threads */
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    if (conf->connect_timeout_ms > 0)
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)conf->connect_timeout_ms);
+    if (conf->low_speed_limit > 0 && conf->low_speed_time > 0) {
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, (long)conf->low_speed_limit);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)conf->low_speed_time);
+    }
+
+    /*
+     * An upload streams for as long as the caller has data. Under a read
+     * limit curl's timeout would count the throttle sleeps, so we keep
+     * the deadline ourselves and push it back by each sleep.
+     */
+    req->deadline_us = 0;
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, 0L);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+    if (conf->request_timeout_ms > 0 && req->upload == NULL) {
+        if (req->fs->buckets[WEBHDFS_BUCKET_READ].rate == 0) {
+            curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)conf->request_timeout_ms);
+        } else {
+            req->deadline_us = webhdfs_trace_now() + conf->request_timeout_ms * 1000ULL;
+            curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, __webhdfs_req_progress);
+            curl_easy_setopt(curl, CURLOPT_XFERINFODATA, req);
+            curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+        }
+    }
 
     switch (type) {
       case WEBHDFS_REQ_GET:
@@ -148,15 +449,79 @@ int webhdfs_req_exec (webhdfs_req_t *req, int type) {
         curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
         break;
     }
+}
+
+/* The namenode is done with us: let the next request have the slot */
+static void __webhdfs_req_release (webhdfs_req_t *req) {
+    if (req->admitted_on >= 0) {
+        webhdfs_admission_leave(req->fs, req->admitted_on);
+        req->admitted_on = -1;
+    }
+}
+
+static size_t __webhdfs_req_header (char *buffer, size_t size, size_t nitems, void *data) {
+    if (size * nitems > 9 && !strncasecmp(buffer, "Location:", 9))
+        __webhdfs_req_release((webhdfs_req_t *)data);
+    return(size * nitems);
+}
+
+static int __webhdfs_req_perform (webhdfs_req_t *req, int type) {
+    struct curl_slist *headers = NULL;
+    uint64_t redirect_us = 0;
+    uint64_t begin_us = 0;
+    void *trace = NULL;
+    long rcode = 0;
+    CURLcode err;
+    CURL *curl;
+
+    if ((curl = webhdfs_curl_get(req->fs)) == NULL)
+        return(1);
+
+    /* Tracing costs a flag test unless enabled */
+    if (webhdfs_trace_active() || req->fs->conf->slow_request_ms > 0) {
+        begin_us = webhdfs_trace_now();
+        if (webhdfs_trace_active())
+            trace = webhdfs_trace_begin(req, begin_us);
+    }
+
+    curl_easy_setopt(curl, CURLOPT_URL, req->buffer.blob);
+#ifdef GLOG
+    DLOG(INFO) << "downloading url: " << req->buffer.blob;
+#elif DEBUG
+    printf("downloading url: %s\n", req->buffer.blob);
+#endif
+    buffer_clear(&(req->buffer));
+
+    __webhdfs_req_setup(req, curl, type);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, __webhdfs_req_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, req);
+    if (req->admitted_on >= 0) {
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, __webhdfs_req_header);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, req);
+    }
 
     /* Upload Require two steps */
     if (req->upload != NULL) {
-        char *url;
+        char *url = NULL;
 
         if ((err = curl_easy_perform(curl)))
             fprintf(stderr, "%s\n", curl_easy_strerror(err));
 
+        /* No redirect: the namenode said no (the body tells why) */
         curl_easy_getinfo(curl, CURLINFO_REDIRECT_URL, &url);
+        if (err || url == NULL) {
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &rcode);
+            req->rcode = (int)rcode;
+            req->curl_err = err;
+            if (begin_us != 0)
+                __webhdfs_req_trace_end(req, curl, trace, begin_us, 0);
+            return(1);
+        }
+
+        req->redirected = 1;
+        __webhdfs_req_release(req);
+        if (begin_us != 0)
+            redirect_us = webhdfs_trace_now();
 #ifdef GLOG
         DLOG(INFO) << "downloading url: " << url;
 #elif DEBUG
@@ -181,18 +546,585 @@ int webhdfs_req_exec (webhdfs_req_t *req, int type) {
     }
 
     buffer_clear(&(req->buffer));
-    if ((err = curl_easy_perform(curl)))
+    if ((err = __webhdfs_req_overdue(req, curl_easy_perform(curl))))
         fprintf(stderr, "%s\n", curl_easy_strerror(err));
 
     if (headers != NULL)
         curl_slist_free_all(headers);
 
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &(req->rcode));
-    curl_easy_cleanup(curl);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &rcode);
+    req->rcode = (int)rcode;
+    req->curl_err = err;
+    if (req->upload == NULL) {
+        curl_easy_getinfo(curl, CURLINFO_REDIRECT_COUNT, &rcode);
+        req->redirected = (rcode > 0);
+    }
+
+    if (begin_us != 0)
+        __webhdfs_req_trace_end(req, curl, trace, begin_us, redirect_us);
 
     return(err != 0);
 }
 
+/* ============================================================================
+ *  hedged reads
+ *
+ * An OPEN whose first byte has not arrived after the hedge threshold
+ * (the p95 time-to-first-byte of recent reads, never below the
+ * configured floor) gets a twin asking the namenode for another replica
+ * (excludedatanodes=<host the first one was sent to>). The first of the
+ * two to get a complete HTTP response wins, the other is dropped.
+ */
+struct webhdfs_xfer {
+    webhdfs_req_t *req;
+    buffer_t buffer;
+    uint64_t first_byte_us;
+    char     location[256];     /* datanode host we were redirected to */
+};
+
+static size_t __webhdfs_xfer_write (void *ptr,
+                                    size_t size,
+                                    size_t nitems,
+                                    void *stream)
+{
+    struct webhdfs_xfer *xfer = (struct webhdfs_xfer *)stream;
+    size_t n = size * nitems;
+
+    if (xfer->first_byte_us == 0)
+        xfer->first_byte_us = webhdfs_trace_now();
+
+    if (buffer_append(&(xfer->buffer), ptr, n))
+        return(0);
+
+    /* The sleep holds up both transfers, so both deadlines move */
+    if (xfer->req->deadline_us != 0)
+        xfer->req->deadline_us += webhdfs_throttle(xfer->req->fs, WEBHDFS_BUCKET_READ, n);
+    else
+        webhdfs_throttle(xfer->req->fs, WEBHDFS_BUCKET_READ, n);
+    return(n);
+}
+
+static size_t __webhdfs_xfer_header (char *ptr,
+                                     size_t size,
+                                     size_t nitems,
+                                     void *stream)
+{
+    struct webhdfs_xfer *xfer = (struct webhdfs_xfer *)stream;
+    size_t n = size * nitems;
+    const char *p, *end;
+    size_t len;
+
+    if (n > 9 && !strncasecmp(ptr, "Location:", 9)) {
+        end = ptr + n;
+        for (p = ptr + 9; p < end && (*p == ' ' || *p == '\t'); ++p)
+            ;
+        /* The header is not NUL-terminated: no strstr() */
+        for (; end - p > 3 && memcmp(p, "://", 3) != 0; ++p)
+            ;
+        if (end - p > 3) {
+            p += 3;
+            for (len = 0; p + len < end && strchr(":/?\r\n", p[len]) == NULL; ++len)
+                ;
+            if (len < sizeof(xfer->location)) {
+                memcpy(xfer->location, p, len);
+                xfer->location[len] = '\0';
+            }
+        }
+    }
+
+    return(n);
+}
+
+static void __webhdfs_ttfb_record (webhdfs_t *fs, uint64_t usec) {
+    uint32_t sorted[WEBHDFS_TTFB_SAMPLES];
+    uint32_t v;
+    size_t i, j, n;
+
+    pthread_mutex_lock(&(fs->ttfb_lock));
+    fs->ttfb_us[fs->ttfb_count++ % WEBHDFS_TTFB_SAMPLES] = (usec > UINT32_MAX) ? UINT32_MAX : usec;
+
+    /* Refresh the p95 now and then, from a sorted copy of the window */
+    if (fs->ttfb_count >= 32 && (fs->ttfb_count % 16) == 0) {
+        n = (fs->ttfb_count < WEBHDFS_TTFB_SAMPLES) ? fs->ttfb_count : WEBHDFS_TTFB_SAMPLES;
+        memcpy(sorted, fs->ttfb_us, n * sizeof(uint32_t));
+        for (i = 1; i < n; ++i) {
+            v = sorted[i];
+            for (j = i; j > 0 && sorted[j - 1] > v; --j)
+                sorted[j] = sorted[j - 1];
+            sorted[j] = v;
+        }
+        fs->hedge_us = sorted[(n * 95) / 100];
+    }
+    pthread_mutex_unlock(&(fs->ttfb_lock));
+}
+
+static uint64_t __webhdfs_hedge_threshold (webhdfs_t *fs) {
+    uint64_t floor_us = (uint64_t)fs->conf->hedge_min_ms * 1000U;
+    uint64_t p95;
+
+    pthread_mutex_lock(&(fs->ttfb_lock));
+    p95 = fs->hedge_us;
+    pthread_mutex_unlock(&(fs->ttfb_lock));
+
+    /* Not enough samples yet: no hedging */
+    if (p95 == 0)
+        return(UINT64_MAX);
+    return((p95 > floor_us) ? p95 : floor_us);
+}
+
+static int __webhdfs_req_perform_hedged (webhdfs_req_t *req) {
+    struct webhdfs_xfer xfers[2];
+    CURLcode results[2] = {CURLE_OK, CURLE_OK};
+    int finished[2] = {0, 0};
+    webhdfs_curl_t *slot;
+    uint64_t begin_us, now, threshold;
+    void *trace = NULL;
+    CURL *curls[2];
+    buffer_t url;
+    CURLMsg *msg;
+    int started = 1;
+    int winner = -1;
+    long rcode = 0;
+    int running, n, i;
+    long wait_ms;
+
+    if ((slot = __webhdfs_curl_slot(req->fs)) == NULL)
+        return(1);
+
+    if (slot->hedge == NULL && (slot->hedge = curl_easy_init()) == NULL)
+        return(__webhdfs_req_perform(req, WEBHDFS_REQ_GET));
+    if (slot->multi == NULL && (slot->multi = curl_multi_init()) == NULL)
+        return(__webhdfs_req_perform(req, WEBHDFS_REQ_GET));
+
+    curls[0] = slot->curl;
+    curls[1] = slot->hedge;
+    threshold = __webhdfs_hedge_threshold(req->fs);
+
+    buffer_open(&url);
+    if (buffer_append(&url, req->buffer.blob, req->buffer.size)) {
+        buffer_close(&url);
+        return(1);
+    }
+
+    begin_us = webhdfs_trace_now();
+    if (webhdfs_trace_active())
+        trace = webhdfs_trace_begin(req, begin_us);
+
+    for (i = 0; i < 2; ++i) {
+        buffer_open(&(xfers[i].buffer));
+        xfers[i].req = req;
+        xfers[i].first_byte_us = 0;
+        xfers[i].location[0] = '\0';
+
+        curl_easy_reset(curls[i]);
+        __webhdfs_req_setup(req, curls[i], WEBHDFS_REQ_GET);
+        curl_easy_setopt(curls[i], CURLOPT_WRITEFUNCTION, __webhdfs_xfer_write);
+        curl_easy_setopt(curls[i], CURLOPT_WRITEDATA, &(xfers[i]));
+        curl_easy_setopt(curls[i], CURLOPT_HEADERFUNCTION, __webhdfs_xfer_header);
+        curl_easy_setopt(curls[i], CURLOPT_HEADERDATA, &(xfers[i]));
+    }
+
+    curl_easy_setopt(curls[0], CURLOPT_URL, url.blob);
+    curl_multi_add_handle(slot->multi, curls[0]);
+
+    while (winner < 0) {
+        curl_multi_perform(slot->multi, &running);
+        if (xfers[0].location[0] != '\0')
+            __webhdfs_req_release(req);
+        while ((msg = curl_multi_info_read(slot->multi, &n)) != NULL) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            i = (msg->easy_handle == curls[0]) ? 0 : 1;
+            finished[i] = 1;
+            results[i] = __webhdfs_req_overdue(req, msg->data.result);
+
+            /*
+             * An error status is no answer: the namenode fails a hedge
+             * quickly when no other replica is left, and that must not
+             * beat a primary that is still streaming.
+             */
+            rcode = 0;
+            curl_easy_getinfo(curls[i], CURLINFO_RESPONSE_CODE, &rcode);
+            if (results[i] == CURLE_OK && rcode >= 200 && rcode < 300 && winner < 0)
+                winner = i;
+        }
+
+        if (winner >= 0)
+            break;
+
+        /* Every transfer started has failed: report the first one */
+        if (finished[0] && (started == 1 || finished[1])) {
+            winner = 0;
+            break;
+        }
+
+        now = webhdfs_trace_now();
+        if (started == 1 && !finished[0] && xfers[0].first_byte_us == 0 &&
+            now - begin_us >= threshold)
+        {
+            if (xfers[0].location[0] != '\0') {
+                buffer_append_format(&url, "&excludedatanodes=");
+                buffer_append(&url, xfers[0].location, strlen(xfers[0].location));
+            }
+            curl_easy_setopt(curls[1], CURLOPT_URL, url.blob);
+            curl_multi_add_handle(slot->multi, curls[1]);
+            started = 2;
+            continue;
+        }
+
+        wait_ms = 1000;
+        if (started == 1 && threshold != UINT64_MAX && xfers[0].first_byte_us == 0)
+            wait_ms = (begin_us + threshold > now) ? (long)((begin_us + threshold - now) / 1000U) + 1 : 0;
+        curl_multi_wait(slot->multi, NULL, 0, wait_ms, NULL);
+    }
+
+    /* What the primary told us about this datanode feeds the threshold */
+    now = webhdfs_trace_now();
+    __webhdfs_ttfb_record(req->fs, (xfers[0].first_byte_us ? xfers[0].first_byte_us : now) - begin_us);
+
+    for (i = 0; i < started; ++i)
+        curl_multi_remove_handle(slot->multi, curls[i]);
+
+    if (results[winner] != CURLE_OK)
+        fprintf(stderr, "%s\n", curl_easy_strerror(results[winner]));
+
+    curl_easy_getinfo(curls[winner], CURLINFO_RESPONSE_CODE, &rcode);
+    req->rcode = (int)rcode;
+    req->curl_err = results[winner];
+    curl_easy_getinfo(curls[winner], CURLINFO_REDIRECT_COUNT, &rcode);
+    req->redirected = (rcode > 0);
+    req->xfer_bytes += xfers[winner].buffer.size;
+
+    buffer_clear(&(req->buffer));
+    if (buffer_append(&(req->buffer), xfers[winner].buffer.blob, xfers[winner].buffer.size))
+        results[winner] = CURLE_OUT_OF_MEMORY;
+
+    if (webhdfs_trace_active() || req->fs->conf->slow_request_ms > 0)
+        __webhdfs_req_trace_end(req, curls[winner], trace, begin_us, 0);
+
+    buffer_close(&(xfers[0].buffer));
+    buffer_close(&(xfers[1].buffer));
+    buffer_close(&url);
+    return(results[winner] != CURLE_OK);
+}
+
+/* ============================================================================
+ *  retries
+ */
+static __thread unsigned int __backoff_seed = 0;
+
+/* Safe to send twice: reads, and setters that converge to one state */
+static int __webhdfs_req_idempotent (const webhdfs_req_t *req, int type) {
+    static const char *puts[] = {
+        "MKDIRS", "SETPERMISSION", "SETOWNER", "SETTIMES", "SETREPLICATION", NULL,
+    };
+    int i;
+
+    if (req->upload != NULL)
+        return(0);
+
+    if (type == WEBHDFS_REQ_GET)
+        return(1);
+
+    if (type == WEBHDFS_REQ_PUT) {
+        for (i = 0; puts[i] != NULL; ++i) {
+            if (!strcmp(req->op, puts[i]))
+                return(1);
+        }
+    }
+
+    return(0);
+}
+
+/* Transport errors, timeouts and server-side failures may pass on retry */
+static int __webhdfs_req_transient (const webhdfs_req_t *req, int err) {
+    return(err || req->rcode == 500 || req->rcode == 502 ||
+           req->rcode == 503 || req->rcode == 504);
+}
+
+static void __webhdfs_req_backoff (const webhdfs_conf_t *conf, unsigned int attempt) {
+    uint64_t delay_ms = conf->retry_backoff_ms;
+
+    if (__backoff_seed == 0)
+        __backoff_seed = (unsigned int)(webhdfs_trace_now() ^ (uintptr_t)&delay_ms);
+
+    /* Exponential, capped, half of it jittered to spread the herd */
+    delay_ms <<= (attempt < 16) ? attempt : 16;
+    if (delay_ms > WEBHDFS_BACKOFF_MAX_MS)
+        delay_ms = WEBHDFS_BACKOFF_MAX_MS;
+    delay_ms = delay_ms / 2 + rand_r(&__backoff_seed) % (delay_ms / 2 + 1);
+
+    usleep(delay_ms * 1000U);
+}
+
+/*
+ * The namenode did not take the request: it is standby, or it could not
+ * be reached (before any redirect). Nothing was executed, so any op may
+ * go to another namenode, uploads included: their data only flows after
+ * the redirect. A request that was sent but got no answer may have been
+ * applied, so only a GET is safe to send again elsewhere.
+ */
+static int __webhdfs_req_rejected (const webhdfs_req_t *req, int type) {
+    if (req->redirected)
+        return(0);
+
+    if (webhdfs_response_is_standby(req->rcode, &(req->buffer)))
+        return(WEBHDFS_ENDPOINT_STANDBY);
+
+    switch (req->curl_err) {
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+            return(WEBHDFS_ENDPOINT_DOWN);
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_GOT_NOTHING:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+            if (type == WEBHDFS_REQ_GET && __webhdfs_req_idempotent(req, type))
+                return(WEBHDFS_ENDPOINT_DOWN);
+            break;
+    }
+
+    return(0);
+}
+
+/* Point url (and req) at another endpoint, keeping path and query */
+static int __webhdfs_req_retarget (webhdfs_req_t *req, buffer_t *url, int endpoint) {
+    const webhdfs_endpoint_t *ep = &(req->fs->endpoints[endpoint]);
+    buffer_t target;
+    int r;
+
+    buffer_open(&target);
+    r = buffer_append_format(&target, "%s://%s:%d",
+                             req->fs->conf->use_ssl ? "https" : "http",
+                             ep->host, ep->port);
+    r |= buffer_append(&target, url->blob + req->url_prefix, url->size - req->url_prefix);
+    if (r) {
+        buffer_close(&target);
+        return(1);
+    }
+
+    req->url_prefix = target.size - (url->size - req->url_prefix);
+    req->endpoint = endpoint;
+    buffer_close(url);
+    *url = target;
+    return(0);
+}
+
+/* Admission class: uploads are bulk, workers prefetch, reads are reads */
+static int __webhdfs_req_class (const webhdfs_req_t *req) {
+    if (req->upload != NULL || webhdfs_parallel_self())
+        return(WEBHDFS_CLASS_BULK);
+    if (webhdfs_worker_self())
+        return(WEBHDFS_CLASS_PREFETCH);
+    if (!strcmp(req->op, "OPEN"))
+        return(WEBHDFS_CLASS_READ);
+    return(WEBHDFS_CLASS_INTERACTIVE);
+}
+
+/* One attempt, holding an admission slot on its endpoint */
+static int __webhdfs_req_attempt (webhdfs_req_t *req, int type, int klass, int hedged) {
+    webhdfs_t *fs = req->fs;
+    uint64_t begin_us = 0;
+    int state, err;
+
+    if ((req->turned_away = webhdfs_admission_enter(fs, req->endpoint, klass)) != 0) {
+        req->rcode = 0;
+        buffer_clear(&(req->buffer));
+        return(1);
+    }
+
+    if (fs->conf->max_inflight > 0)
+        req->admitted_on = req->endpoint;
+
+    if (fs->nendpoints > 1) {
+        begin_us = webhdfs_trace_now();
+        webhdfs_endpoint_begin(fs, req->endpoint);
+    }
+
+    err = hedged ? __webhdfs_req_perform_hedged(req) : __webhdfs_req_perform(req, type);
+    __webhdfs_req_release(req);
+
+    if (fs->nendpoints > 1) {
+        state = __webhdfs_req_rejected(req, type);
+        webhdfs_endpoint_end(fs, req->endpoint, webhdfs_trace_now() - begin_us,
+                             state != 0 || __webhdfs_req_transient(req, err));
+    }
+    return(err);
+}
+
+static int __webhdfs_req_submit (webhdfs_req_t *req, int type) {
+    const webhdfs_conf_t *conf = req->fs->conf;
+    webhdfs_t *fs = req->fs;
+    unsigned int attempt = 0;
+    int failovers = 0;
+    int retry, hedged;
+    int state, next;
+    int klass;
+    buffer_t url;
+    int err;
+
+    hedged = (conf->hedge_min_ms > 0 && type == WEBHDFS_REQ_GET &&
+              req->upload == NULL && !strcmp(req->op, "OPEN"));
+    retry = (conf->retries > 0 && __webhdfs_req_idempotent(req, type));
+    klass = __webhdfs_req_class(req);
+
+    if (!retry && fs->nendpoints < 2)
+        return(__webhdfs_req_attempt(req, type, klass, hedged));
+
+    /* perform consumes the URL in req->buffer: keep it for another go */
+    buffer_open(&url);
+    if (buffer_append(&url, req->buffer.blob, req->buffer.size)) {
+        buffer_close(&url);
+        return(1);
+    }
+
+    for (;;) {
+        err = __webhdfs_req_attempt(req, type, klass, hedged);
+
+        if (fs->nendpoints > 1 && !req->turned_away) {
+            if ((state = __webhdfs_req_rejected(req, type)) != 0) {
+                next = webhdfs_endpoint_failed(fs, req->endpoint, state);
+
+                /* Failing over costs a round trip, not a backoff */
+                if (++failovers < fs->nendpoints) {
+                    if (__webhdfs_req_retarget(req, &url, next))
+                        break;
+                    buffer_clear(&(req->buffer));
+                    if (buffer_append(&(req->buffer), url.blob, url.size))
+                        break;
+                    continue;
+                }
+            }
+        }
+
+        if (!retry || !__webhdfs_req_transient(req, err) || attempt >= conf->retries)
+            break;
+
+        /* Every endpoint gets another chance after the backoff */
+        __webhdfs_req_backoff(conf, attempt++);
+        failovers = 0;
+        if ((next = webhdfs_endpoint_pick(fs, -1)) != req->endpoint &&
+            __webhdfs_req_retarget(req, &url, next))
+        {
+            break;
+        }
+
+        buffer_clear(&(req->buffer));
+        if (buffer_append(&(req->buffer), url.blob, url.size))
+            break;
+    }
+
+    buffer_close(&url);
+    return(err);
+}
+
+/*
+ * Single-flight: a GET whose URL (op, path, range, user, token) matches
+ * one already in flight on this fs does not go to the network; it waits
+ * for the leader and gets a copy of its response, rcode and error. Only
+ * GETs are coalesced, they are idempotent in WebHDFS. A request arriving
+ * after the leader finished starts a new flight, so nothing is cached.
+ */
+static int __webhdfs_req_exec_shared (webhdfs_req_t *req) {
+    webhdfs_t *fs = req->fs;
+    webhdfs_flight_t *flight, **p;
+    int waiters;
+    int err;
+
+    pthread_mutex_lock(&(fs->flight_lock));
+    for (flight = fs->flights; flight != NULL; flight = flight->next) {
+        if (!strcmp(flight->url, (const char *)req->buffer.blob))
+            break;
+    }
+
+    if (flight != NULL) {
+        flight->waiters++;
+        while (!flight->done)
+            pthread_cond_wait(&(fs->flight_cond), &(fs->flight_lock));
+        pthread_mutex_unlock(&(fs->flight_lock));
+
+        /* The response is read-only once done, copy it unlocked */
+        buffer_clear(&(req->buffer));
+        err = buffer_append(&(req->buffer), flight->response.blob, flight->response.size);
+        err = err || flight->err;
+        req->rcode = flight->rcode;
+
+        pthread_mutex_lock(&(fs->flight_lock));
+        if (--flight->waiters == 0) {
+            buffer_close(&(flight->response));
+            free(flight->url);
+            free(flight);
+        }
+        pthread_mutex_unlock(&(fs->flight_lock));
+        return(err);
+    }
+
+    if ((flight = (webhdfs_flight_t *) calloc(1, sizeof(webhdfs_flight_t))) == NULL ||
+        (flight->url = strdup((const char *)req->buffer.blob)) == NULL)
+    {
+        pthread_mutex_unlock(&(fs->flight_lock));
+        free(flight);
+        return(__webhdfs_req_submit(req, WEBHDFS_REQ_GET));
+    }
+
+    buffer_open(&(flight->response));
+    flight->next = fs->flights;
+    fs->flights = flight;
+    pthread_mutex_unlock(&(fs->flight_lock));
+
+    err = __webhdfs_req_submit(req, WEBHDFS_REQ_GET);
+
+    /* Unlinked, no one else can join: the waiter count is final */
+    pthread_mutex_lock(&(fs->flight_lock));
+    for (p = &(fs->flights); *p != flight; p = &((*p)->next))
+        ;
+    *p = flight->next;
+    waiters = flight->waiters;
+    pthread_mutex_unlock(&(fs->flight_lock));
+
+    if (waiters > 0) {
+        flight->rcode = req->rcode;
+        flight->err = err;
+        if (buffer_append(&(flight->response), req->buffer.blob, req->buffer.size))
+            flight->err = 1;
+    }
+
+    pthread_mutex_lock(&(fs->flight_lock));
+    flight->done = 1;
+    if (waiters > 0) {
+        pthread_cond_broadcast(&(fs->flight_cond));
+        flight = NULL;
+    }
+    pthread_mutex_unlock(&(fs->flight_lock));
+
+    if (flight != NULL) {
+        buffer_close(&(flight->response));
+        free(flight->url);
+        free(flight);
+    }
+    return(err);
+}
+
+int webhdfs_req_exec (webhdfs_req_t *req, int type) {
+    int err;
+
+    /* Every token request must get a token of its own */
+    if (type == WEBHDFS_REQ_GET && req->upload == NULL && req->fs->conf->single_flight &&
+        strcmp(req->op, "GETDELEGATIONTOKEN") != 0)
+    {
+        err = __webhdfs_req_exec_shared(req);
+    } else {
+        err = __webhdfs_req_submit(req, type);
+    }
+
+    /* Fails this one, but the next requests get a new token */
+    if (webhdfs_response_is_invalid_token(req->rcode, &(req->buffer)))
+        webhdfs_token_invalid(req->fs);
+
+    return(err);
+}
+
 yajl_val webhdfs_req_json_response (webhdfs_req_t *req) {
     char err[1024];
     yajl_val node;
@@ -16,8 +16,12 @@
  * limitations under the License.
  */
 
+#include <string.h>
+
 #include <yajl/yajl_tree.h>
 
+#include "webhdfs_p.h"
+
 yajl_val webhdfs_response_exception (yajl_val node) {
     const char *node_path[] = {"RemoteException", NULL};
     return(yajl_tree_get(node, node_path, yajl_t_any));
@@ -48,8 +52,13 @@ yajl_val webhdfs_response_file_statuses (yajl_val node) {
     return(yajl_tree_get(node, node_path, yajl_t_any));
 }
 
+yajl_val webhdfs_response_directory_listing (yajl_val node) {
+    const char *node_path[] = {"DirectoryListing", NULL};
+    return(yajl_tree_get(node, node_path, yajl_t_any));
+}
+
 yajl_val webhdfs_response_token (yajl_val node) {
-    const char *node_path[] = {"Path", NULL};
+    const char *node_path[] = {"Token", NULL};
     return(yajl_tree_get(node, node_path, yajl_t_any));
 }
 
@@ -58,8 +67,27 @@ yajl_val webhdfs_response_path (yajl_val node) {
     return(yajl_tree_get(node, node_path, yajl_t_any));
 }
 
+yajl_val webhdfs_response_snapshot_diff_report (yajl_val node) {
+    const char *node_path[] = {"SnapshotDiffReport", NULL};
+    return(yajl_tree_get(node, node_path, yajl_t_any));
+}
+
 yajl_val webhdfs_response_long (yajl_val node) {
     const char *node_path[] = {"long", NULL};
     return(yajl_tree_get(node, node_path, yajl_t_any));
 }
 
+
+/* A standby namenode rejects every op with 403 and a StandbyException */
+int webhdfs_response_is_standby (int rcode, const buffer_t *body) {
+    if (rcode != 403 || body->size == 0)
+        return(0);
+    return(strstr((const char *)body->blob, "StandbyException") != NULL);
+}
+
+/* The delegation token expired or was cancelled (SecretManager$InvalidToken) */
+int webhdfs_response_is_invalid_token (int rcode, const buffer_t *body) {
+    if ((rcode != 401 && rcode != 403) || body->size == 0)
+        return(0);
+    return(strstr((const char *)body->blob, "InvalidToken") != NULL);
+}
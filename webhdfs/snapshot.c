@@ -30,7 +30,8 @@ int webhdfs_create_snapshot (webhdfs_t *fs, const char *path, const char *name)
     yajl_val node, v;
 
     webhdfs_req_open(&req, fs, path);
-    webhdfs_req_set_args(&req, "op=CREATESNAPSHOT&snapshotname=%s", name);
+    webhdfs_req_set_args(&req, "op=CREATESNAPSHOT");
+    webhdfs_req_set_arg_escaped(&req, "snapshotname", name);
     webhdfs_req_exec(&req, WEBHDFS_REQ_PUT);
     node = webhdfs_req_json_response(&req);
     webhdfs_req_close(&req);
@@ -40,6 +41,12 @@ int webhdfs_create_snapshot (webhdfs_t *fs, const char *path, const char *name)
         return(1);
     }
 
+    /* The namenode answers with the path of the new snapshot */
+    if ((v = webhdfs_response_path(node)) != NULL) {
+        yajl_tree_free(node);
+        return(0);
+    }
+
     if ((v = webhdfs_response_boolean(node)) != NULL) {
         int failure = YAJL_IS_FALSE(v);
         yajl_tree_free(node);
@@ -55,7 +62,8 @@ int webhdfs_delete_snapshot (webhdfs_t *fs, const char *path, const char *name)
     yajl_val node, v;
 
     webhdfs_req_open(&req, fs, path);
-    webhdfs_req_set_args(&req, "op=DELETESNAPSHOT&snapshotname=%s", name);
+    webhdfs_req_set_args(&req, "op=DELETESNAPSHOT");
+    webhdfs_req_set_arg_escaped(&req, "snapshotname", name);
     webhdfs_req_exec(&req, WEBHDFS_REQ_PUT);
     node = webhdfs_req_json_response(&req);
     webhdfs_req_close(&req);
@@ -81,7 +89,9 @@ int webhdfs_rename_snapshot (webhdfs_t *fs, const char *path, const char *oldnam
     yajl_val node, v;
 
     webhdfs_req_open(&req, fs, path);
-    webhdfs_req_set_args(&req, "op=RENAMESNAPSHOT&oldsnapshotname=%s&snapshotname=%s", oldname, newname);
+    webhdfs_req_set_args(&req, "op=RENAMESNAPSHOT");
+    webhdfs_req_set_arg_escaped(&req, "oldsnapshotname", oldname);
+    webhdfs_req_set_arg_escaped(&req, "snapshotname", newname);
     webhdfs_req_exec(&req, WEBHDFS_REQ_PUT);
     node = webhdfs_req_json_response(&req);
     webhdfs_req_close(&req);
@@ -99,4 +109,83 @@ int webhdfs_rename_snapshot (webhdfs_t *fs, const char *path, const char *oldnam
 
     yajl_tree_free(node);
     return(2);
-}
\ No newline at end of file
+}
+
+/* ============================================================================
+ *  snapshot diff
+ */
+webhdfs_snapshot_diff_t *webhdfs_snapshot_diff (webhdfs_t *fs,
+                                                const char *path,
+                                                const char *from,
+                                                const char *to)
+{
+    const char *diff_list[] = {"diffList", NULL};
+    webhdfs_snapshot_diff_t *diff;
+    webhdfs_req_t req;
+    yajl_val node, v;
+
+    webhdfs_req_open(&req, fs, path);
+    webhdfs_req_set_args(&req, "op=GETSNAPSHOTDIFF");
+    webhdfs_req_set_arg_escaped(&req, "oldsnapshotname", from);
+    webhdfs_req_set_arg_escaped(&req, "snapshotname", (to != NULL) ? to : "");
+    webhdfs_req_exec(&req, WEBHDFS_REQ_GET);
+    node = webhdfs_req_json_response(&req);
+    webhdfs_req_close(&req);
+
+    if (node == NULL)
+        return(NULL);
+
+    if (webhdfs_response_exception(node) != NULL ||
+        (v = webhdfs_response_snapshot_diff_report(node)) == NULL ||
+        (v = yajl_tree_get(v, diff_list, yajl_t_array)) == NULL ||
+        (diff = (webhdfs_snapshot_diff_t *) calloc(1, sizeof(webhdfs_snapshot_diff_t))) == NULL)
+    {
+        yajl_tree_free(node);
+        return(NULL);
+    }
+
+    diff->root = node;
+    diff->list = v;
+    return(diff);
+}
+
+const webhdfs_diff_entry_t *webhdfs_snapshot_diff_read (webhdfs_snapshot_diff_t *diff) {
+    const char *source_path[] = {"sourcePath", NULL};
+    const char *target_path[] = {"targetPath", NULL};
+    const char *type[] = {"type", NULL};
+    static const char *types[] = {"CREATE", "MODIFY", "DELETE", "RENAME"};
+    yajl_val entry, v;
+    size_t i;
+
+    while (diff->current < YAJL_GET_ARRAY(diff->list)->len) {
+        entry = YAJL_GET_ARRAY(diff->list)->values[diff->current++];
+
+        if ((v = yajl_tree_get(entry, type, yajl_t_string)) == NULL)
+            continue;
+        for (i = 0; i < 4 && strcmp(YAJL_GET_STRING(v), types[i]); ++i)
+            ;
+        if (i == 4)
+            continue;
+        diff->entry.type = (webhdfs_diff_type_t)i;
+
+        if ((v = yajl_tree_get(entry, source_path, yajl_t_string)) == NULL)
+            continue;
+        diff->entry.path = YAJL_GET_STRING(v);
+
+        diff->entry.target = NULL;
+        if ((v = yajl_tree_get(entry, target_path, yajl_t_string)) != NULL)
+            diff->entry.target = YAJL_GET_STRING(v);
+        if (diff->entry.type == WEBHDFS_DIFF_RENAME && diff->entry.target == NULL)
+            continue;
+
+        return(&(diff->entry));
+    }
+    return(NULL);
+}
+
+void webhdfs_snapshot_diff_close (webhdfs_snapshot_diff_t *diff) {
+    if (diff != NULL) {
+        yajl_tree_free(diff->root);
+        free(diff);
+    }
+}
@@ -0,0 +1,137 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <yajl/yajl_tree.h>
+
+#include "webhdfs_p.h"
+#include "webhdfs.h"
+
+/*
+ * GETCONTENTSUMMARY, cached for conf->summary_ttl_ms. The namenode adds
+ * up the whole subtree for each call, and callers such as df ask the
+ * same question many times a second: a short TTL saves the namenode
+ * that work at the cost of slightly stale totals. The cache is a small
+ * direct-mapped table on the path; a collision replaces the older entry.
+ */
+static unsigned int __webhdfs_summary_hash (const char *path) {
+    unsigned int hash = 2166136261U;
+
+    while (*path != '\0')
+        hash = (hash ^ (unsigned char)*path++) * 16777619U;
+    return(hash % WEBHDFS_SUMMARY_CACHE);
+}
+
+void webhdfs_summary_close (webhdfs_t *fs) {
+    int i;
+
+    for (i = 0; i < WEBHDFS_SUMMARY_CACHE; ++i)
+        free(fs->summaries[i].path);
+}
+
+static int __webhdfs_summary_cached (webhdfs_t *fs,
+                                     const char *path,
+                                     webhdfs_content_summary_t *summary)
+{
+    webhdfs_summary_entry_t *entry = &(fs->summaries[__webhdfs_summary_hash(path)]);
+    uint64_t ttl_us = (uint64_t)fs->conf->summary_ttl_ms * 1000U;
+    int found = 0;
+
+    pthread_mutex_lock(&(fs->summary_lock));
+    if (entry->path != NULL && !strcmp(entry->path, path) &&
+        webhdfs_trace_now() - entry->fetched_us < ttl_us)
+    {
+        *summary = entry->summary;
+        found = 1;
+    }
+    pthread_mutex_unlock(&(fs->summary_lock));
+
+    return(found);
+}
+
+static void __webhdfs_summary_store (webhdfs_t *fs,
+                                     const char *path,
+                                     uint64_t fetched_us,
+                                     const webhdfs_content_summary_t *summary)
+{
+    webhdfs_summary_entry_t *entry = &(fs->summaries[__webhdfs_summary_hash(path)]);
+    char *copy;
+
+    if ((copy = strdup(path)) == NULL)
+        return;
+
+    pthread_mutex_lock(&(fs->summary_lock));
+    free(entry->path);
+    entry->path = copy;
+    entry->fetched_us = fetched_us;
+    entry->summary = *summary;
+    pthread_mutex_unlock(&(fs->summary_lock));
+}
+
+static int64_t __webhdfs_summary_get (yajl_val node, const char *name) {
+    const char *node_path[] = {name, NULL};
+    yajl_val v;
+
+    if ((v = yajl_tree_get(node, node_path, yajl_t_number)) == NULL)
+        return(-1);
+    return(YAJL_GET_INTEGER(v));
+}
+
+int webhdfs_content_summary (webhdfs_t *fs,
+                             const char *path,
+                             webhdfs_content_summary_t *summary)
+{
+    webhdfs_req_t req;
+    yajl_val root, node;
+    uint64_t begin_us;
+
+    if (fs->conf->summary_ttl_ms > 0 && __webhdfs_summary_cached(fs, path, summary))
+        return(0);
+
+    /* Stamped before asking: the answer is at least this fresh */
+    begin_us = webhdfs_trace_now();
+
+    webhdfs_req_open(&req, fs, path);
+    webhdfs_req_set_args(&req, "op=GETCONTENTSUMMARY");
+    webhdfs_req_exec(&req, WEBHDFS_REQ_GET);
+    root = webhdfs_req_json_response(&req);
+    webhdfs_req_close(&req);
+
+    if (webhdfs_response_exception(root) != NULL ||
+        (node = webhdfs_response_content_summary(root)) == NULL)
+    {
+        if (root != NULL)
+            yajl_tree_free(root);
+        return(1);
+    }
+
+    summary->length = __webhdfs_summary_get(node, "length");
+    summary->file_count = __webhdfs_summary_get(node, "fileCount");
+    summary->directory_count = __webhdfs_summary_get(node, "directoryCount");
+    summary->quota = __webhdfs_summary_get(node, "quota");
+    summary->space_consumed = __webhdfs_summary_get(node, "spaceConsumed");
+    summary->space_quota = __webhdfs_summary_get(node, "spaceQuota");
+    yajl_tree_free(root);
+
+    if (fs->conf->summary_ttl_ms > 0)
+        __webhdfs_summary_store(fs, path, begin_us, summary);
+    return(0);
+}
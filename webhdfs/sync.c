@@ -0,0 +1,863 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "webhdfs_p.h"
+#include "webhdfs.h"
+
+/*
+ * Incremental one-way sync of a tree, usually between two clusters.
+ * The source is walked with webhdfs_walk(). Directories are created on
+ * the destination as they are found. Files are collected in chunks of
+ * WEBHDFS_SYNC_CHUNK, and each chunk goes through these steps:
+ *
+ *  1. webhdfs_stat_many() on the destination paths;
+ *  2. missing, or a different length: copy;
+ *     same length and mtime: skip (unless opts->checksum);
+ *     same length, other mtime: compare the HDFS checksums of both
+ *     sides, fetched concurrently, and copy only if they differ;
+ *  3. copies run concurrently and the destination gets the source's
+ *     mtime, so the next run can skip them without checksums.
+ *
+ * One chunk is processed at a time. A walk thread that fills a chunk
+ * handles it itself while the others go on walking, and they wait if
+ * they fill another one first. The source is therefore never listed far
+ * ahead of the copies. The report callback is called from one thread
+ * at a time. A chunk's files are reported together, but chunks are
+ * processed in whatever order the walk threads get the lock, so the
+ * order of the reports is not the order of the walk.
+ */
+#define WEBHDFS_SYNC_CHUNK          (4096)
+
+enum webhdfs_sync_step {
+    WEBHDFS_SYNC_STEP_COPY,
+    WEBHDFS_SYNC_STEP_SKIP,
+    WEBHDFS_SYNC_STEP_CHECKSUM,
+    WEBHDFS_SYNC_STEP_FAILED,
+};
+
+typedef struct webhdfs_sync_file {
+    char *  src;
+    char *  dst;
+    int64_t length;
+    int64_t mtime;
+    int     step;
+    int     by_checksum;            /* step decided by the checksums */
+} webhdfs_sync_file_t;
+
+typedef struct webhdfs_sync_chunk {
+    webhdfs_sync_file_t files[WEBHDFS_SYNC_CHUNK];
+    size_t  nfiles;
+    size_t *todo;                   /* files in the current step */
+    size_t  ntodo;
+} webhdfs_sync_chunk_t;
+
+typedef struct webhdfs_sync {
+    webhdfs_t *src;
+    webhdfs_t *dst;
+    const char *src_root;
+    size_t  src_len;                /* src_root without trailing '/' */
+    const char *dst_root;
+    size_t  dst_len;
+    webhdfs_sync_opts_t opts;
+    webhdfs_sync_stats_t *stats;
+    pthread_mutex_t lock;           /* protects chunk and stats */
+    webhdfs_sync_chunk_t *chunk;    /* being filled by the walk */
+    pthread_mutex_t process_lock;   /* one chunk processed at a time */
+    webhdfs_sync_chunk_t *current;  /* being processed */
+    int     failed;
+} webhdfs_sync_t;
+
+static void __webhdfs_sync_report (webhdfs_sync_t *sync,
+                                   const char *path,
+                                   webhdfs_sync_action_t action)
+{
+    if (sync->opts.report != NULL)
+        sync->opts.report(sync->opts.data, path, action);
+}
+
+/* Destination path for a source path under src_root */
+static char *__webhdfs_sync_dst_path (webhdfs_sync_t *sync, const char *src) {
+    const char *rel = src + sync->src_len;
+    size_t n = strlen(rel);
+    char *dst;
+
+    if ((dst = (char *) malloc(sync->dst_len + n + 2)) == NULL)
+        return(NULL);
+
+    memcpy(dst, sync->dst_root, sync->dst_len);
+    memcpy(dst + sync->dst_len, rel, n + 1);
+    if (dst[0] == '\0')
+        strcpy(dst, "/");
+    return(dst);
+}
+
+static void __webhdfs_sync_checksum (void *data, size_t index) {
+    webhdfs_sync_t *sync = (webhdfs_sync_t *)data;
+    webhdfs_sync_chunk_t *chunk = sync->current;
+    webhdfs_sync_file_t *file = &(chunk->files[chunk->todo[index]]);
+    webhdfs_file_checksum_t a, b;
+
+    /* A checksum that cannot be had proves nothing: copy */
+    file->step = WEBHDFS_SYNC_STEP_COPY;
+    file->by_checksum = 1;
+    if (webhdfs_file_checksum(sync->src, file->src, &a) ||
+        webhdfs_file_checksum(sync->dst, file->dst, &b))
+    {
+        return;
+    }
+
+    if (webhdfs_file_checksum_equal(&a, &b)) {
+        file->step = WEBHDFS_SYNC_STEP_SKIP;
+        if (!sync->opts.dry_run)
+            webhdfs_set_times(sync->dst, file->dst, file->mtime, -1);
+    }
+}
+
+struct webhdfs_sync_upload {
+    webhdfs_file_t *file;
+    int64_t left;
+    int     short_read;
+};
+
+static size_t __webhdfs_sync_upload (void *ptr, size_t size, void *data) {
+    struct webhdfs_sync_upload *upload = (struct webhdfs_sync_upload *)data;
+    size_t n;
+
+    if (upload->left <= 0)
+        return(0);
+
+    if (size > (size_t)upload->left)
+        size = upload->left;
+    if ((n = webhdfs_file_read(upload->file, ptr, size)) == 0)
+        upload->short_read = 1;
+
+    upload->left -= n;
+    return(n);
+}
+
+static void __webhdfs_sync_copy (void *data, size_t index) {
+    webhdfs_sync_t *sync = (webhdfs_sync_t *)data;
+    webhdfs_sync_chunk_t *chunk = sync->current;
+    webhdfs_sync_file_t *file = &(chunk->files[chunk->todo[index]]);
+    struct webhdfs_sync_upload upload;
+    webhdfs_fstat_t stat, *check;
+
+    memset(&stat, 0, sizeof(webhdfs_fstat_t));
+    stat.length = file->length;
+    stat.mtime = file->mtime;
+
+    file->step = WEBHDFS_SYNC_STEP_FAILED;
+    if ((upload.file = webhdfs_file_open_sized(sync->src, file->src, &stat)) == NULL)
+        return;
+
+    webhdfs_file_set_readahead(upload.file, 8U << 20);
+    upload.left = file->length;
+    upload.short_read = 0;
+    if (webhdfs_file_create(sync->dst, file->dst, 1, __webhdfs_sync_upload, &upload) ||
+        upload.short_read || upload.left > 0)
+    {
+        webhdfs_file_close(upload.file);
+        return;
+    }
+    webhdfs_file_close(upload.file);
+
+    /* A transfer cut short still creates the file: check what landed */
+    if ((check = webhdfs_stat(sync->dst, file->dst, NULL)) == NULL)
+        return;
+    if ((int64_t)check->length == file->length &&
+        !webhdfs_set_times(sync->dst, file->dst, file->mtime, -1))
+    {
+        file->step = WEBHDFS_SYNC_STEP_COPY;
+    }
+    webhdfs_fstat_free(check);
+}
+
+static void __webhdfs_sync_run (webhdfs_sync_t *sync,
+                                int step,
+                                webhdfs_parallel_func_t func)
+{
+    webhdfs_sync_chunk_t *chunk = sync->current;
+    size_t i;
+
+    chunk->ntodo = 0;
+    for (i = 0; i < chunk->nfiles; ++i) {
+        if (chunk->files[i].step == step)
+            chunk->todo[chunk->ntodo++] = i;
+    }
+
+    webhdfs_parallel(sync->dst, chunk->ntodo, sync->opts.threads, func, sync);
+}
+
+/* Decide and act on every file of the chunk, then free it */
+static void __webhdfs_sync_process (webhdfs_sync_t *sync, webhdfs_sync_chunk_t *chunk) {
+    webhdfs_sync_stats_t *stats = sync->stats;
+    webhdfs_stat_result_t *results = NULL;
+    webhdfs_sync_file_t *file;
+    const char **paths;
+    size_t i;
+
+    pthread_mutex_lock(&(sync->process_lock));
+    sync->current = chunk;
+
+    paths = (const char **) malloc(chunk->nfiles * sizeof(char *) + 1);
+    chunk->todo = (size_t *) malloc(chunk->nfiles * sizeof(size_t) + 1);
+    for (i = 0; paths != NULL && i < chunk->nfiles; ++i)
+        paths[i] = chunk->files[i].dst;
+
+    if (paths == NULL || chunk->todo == NULL ||
+        webhdfs_stat_many(sync->dst, paths, chunk->nfiles, &results) < 0)
+    {
+        for (i = 0; i < chunk->nfiles; ++i)
+            chunk->files[i].step = WEBHDFS_SYNC_STEP_FAILED;
+        webhdfs_stat_many_free(results);
+        results = NULL;
+    }
+
+    for (i = 0; results != NULL && i < chunk->nfiles; ++i) {
+        file = &(chunk->files[i]);
+        if (results[i].status == ENOENT)
+            file->step = WEBHDFS_SYNC_STEP_COPY;
+        else if (results[i].status != 0 ||
+                 results[i].stat.type == NULL ||
+                 strcmp(results[i].stat.type, "FILE") != 0)
+            file->step = WEBHDFS_SYNC_STEP_FAILED;
+        else if ((int64_t)results[i].stat.length != file->length)
+            file->step = WEBHDFS_SYNC_STEP_COPY;
+        else if ((int64_t)results[i].stat.mtime == file->mtime && !sync->opts.checksum)
+            file->step = WEBHDFS_SYNC_STEP_SKIP;
+        else
+            file->step = WEBHDFS_SYNC_STEP_CHECKSUM;
+    }
+
+    if (chunk->todo != NULL) {
+        __webhdfs_sync_run(sync, WEBHDFS_SYNC_STEP_CHECKSUM, __webhdfs_sync_checksum);
+        if (!sync->opts.dry_run)
+            __webhdfs_sync_run(sync, WEBHDFS_SYNC_STEP_COPY, __webhdfs_sync_copy);
+    }
+
+    pthread_mutex_lock(&(sync->lock));
+    for (i = 0; i < chunk->nfiles; ++i) {
+        file = &(chunk->files[i]);
+        stats->checksummed += file->by_checksum;
+        switch (file->step) {
+            case WEBHDFS_SYNC_STEP_COPY:
+                stats->copied++;
+                stats->copied_bytes += file->length;
+                break;
+            case WEBHDFS_SYNC_STEP_SKIP:
+                stats->skipped++;
+                break;
+            default:
+                stats->failed++;
+                sync->failed++;
+                break;
+        }
+    }
+    pthread_mutex_unlock(&(sync->lock));
+
+    for (i = 0; i < chunk->nfiles; ++i) {
+        file = &(chunk->files[i]);
+        if (file->step == WEBHDFS_SYNC_STEP_COPY)
+            __webhdfs_sync_report(sync, file->src, WEBHDFS_SYNC_COPY);
+        else if (file->step == WEBHDFS_SYNC_STEP_SKIP)
+            __webhdfs_sync_report(sync, file->src, WEBHDFS_SYNC_SKIP);
+        else
+            __webhdfs_sync_report(sync, file->src, WEBHDFS_SYNC_FAILED);
+    }
+
+    sync->current = NULL;
+    pthread_mutex_unlock(&(sync->process_lock));
+
+    webhdfs_stat_many_free(results);
+    free(paths);
+    free(chunk->todo);
+    for (i = 0; i < chunk->nfiles; ++i) {
+        free(chunk->files[i].src);
+        free(chunk->files[i].dst);
+    }
+    free(chunk);
+}
+
+/* Queue a source file, processing the chunk it fills */
+static void __webhdfs_sync_add (webhdfs_sync_t *sync,
+                                const char *path,
+                                const webhdfs_fstat_t *stat)
+{
+    webhdfs_sync_chunk_t *chunk, *full = NULL;
+    webhdfs_sync_file_t *file;
+
+    pthread_mutex_lock(&(sync->lock));
+    sync->stats->files++;
+    if ((chunk = sync->chunk) == NULL) {
+        chunk = (webhdfs_sync_chunk_t *) calloc(1, sizeof(webhdfs_sync_chunk_t));
+        sync->chunk = chunk;
+    }
+
+    if (chunk == NULL) {
+        sync->stats->failed++;
+        sync->failed++;
+        pthread_mutex_unlock(&(sync->lock));
+        return;
+    }
+
+    file = &(chunk->files[chunk->nfiles]);
+    file->src = strdup(path);
+    file->dst = __webhdfs_sync_dst_path(sync, path);
+    file->length = stat->length;
+    file->mtime = stat->mtime;
+    if (file->src == NULL || file->dst == NULL) {
+        free(file->src);
+        free(file->dst);
+        sync->stats->failed++;
+        sync->failed++;
+    } else if (++chunk->nfiles == WEBHDFS_SYNC_CHUNK) {
+        full = chunk;
+        sync->chunk = NULL;
+    }
+    pthread_mutex_unlock(&(sync->lock));
+
+    if (full != NULL)
+        __webhdfs_sync_process(sync, full);
+}
+
+/* The last, partial chunk */
+static void __webhdfs_sync_flush (webhdfs_sync_t *sync) {
+    if (sync->chunk != NULL) {
+        if (sync->chunk->nfiles > 0)
+            __webhdfs_sync_process(sync, sync->chunk);
+        else
+            free(sync->chunk);
+        sync->chunk = NULL;
+    }
+}
+
+static int __webhdfs_sync_visit (void *data,
+                                 const char *path,
+                                 const webhdfs_fstat_t *stat,
+                                 int depth)
+{
+    webhdfs_sync_t *sync = (webhdfs_sync_t *)data;
+    char *dst;
+
+    (void)depth;
+    if (stat->type != NULL && !strcmp(stat->type, "DIRECTORY")) {
+        pthread_mutex_lock(&(sync->lock));
+        sync->stats->directories++;
+        pthread_mutex_unlock(&(sync->lock));
+
+        if (!sync->opts.dry_run && (dst = __webhdfs_sync_dst_path(sync, path)) != NULL) {
+            webhdfs_mkdir(sync->dst, dst, stat->permission);
+            free(dst);
+        }
+        return(WEBHDFS_WALK_CONTINUE);
+    }
+
+    if (stat->type != NULL && !strcmp(stat->type, "FILE"))
+        __webhdfs_sync_add(sync, path, stat);
+    return(WEBHDFS_WALK_CONTINUE);
+}
+
+/* "/a/" and "/a" are the same root; "/" is "" + "/name" */
+static size_t __webhdfs_sync_root_len (const char *root) {
+    size_t n = strlen(root);
+
+    while (n > 0 && root[n - 1] == '/')
+        n--;
+    return(n);
+}
+
+static void __webhdfs_sync_init (webhdfs_sync_t *sync,
+                                 webhdfs_t *src,
+                                 const char *src_path,
+                                 webhdfs_t *dst,
+                                 const char *dst_path,
+                                 const webhdfs_sync_opts_t *opts,
+                                 webhdfs_sync_stats_t *stats)
+{
+    memset(sync, 0, sizeof(webhdfs_sync_t));
+    sync->src = src;
+    sync->dst = dst;
+    sync->src_root = src_path;
+    sync->src_len = __webhdfs_sync_root_len(src_path);
+    sync->dst_root = dst_path;
+    sync->dst_len = __webhdfs_sync_root_len(dst_path);
+    sync->stats = stats;
+    if (opts != NULL)
+        sync->opts = *opts;
+    memset(sync->stats, 0, sizeof(webhdfs_sync_stats_t));
+
+    pthread_mutex_init(&(sync->lock), NULL);
+    pthread_mutex_init(&(sync->process_lock), NULL);
+}
+
+static void __webhdfs_sync_destroy (webhdfs_sync_t *sync) {
+    pthread_mutex_destroy(&(sync->process_lock));
+    pthread_mutex_destroy(&(sync->lock));
+}
+
+int webhdfs_sync (webhdfs_t *src,
+                  const char *src_path,
+                  webhdfs_t *dst,
+                  const char *dst_path,
+                  const webhdfs_sync_opts_t *opts,
+                  webhdfs_sync_stats_t *stats)
+{
+    webhdfs_walk_opts_t walk_opts;
+    webhdfs_sync_stats_t unused;
+    webhdfs_fstat_t *root;
+    webhdfs_sync_t sync;
+    int r;
+
+    __webhdfs_sync_init(&sync, src, src_path, dst, dst_path, opts,
+                        (stats != NULL) ? stats : &unused);
+
+    /* The walk only hands out what is below the root */
+    if (!sync.opts.dry_run && (root = webhdfs_stat(src, src_path, NULL)) != NULL) {
+        if (root->type != NULL && !strcmp(root->type, "DIRECTORY"))
+            webhdfs_mkdir(dst, dst_path, root->permission);
+        webhdfs_fstat_free(root);
+    }
+
+    memset(&walk_opts, 0, sizeof(webhdfs_walk_opts_t));
+    walk_opts.threads = sync.opts.threads;
+    walk_opts.data = &sync;
+    r = webhdfs_walk(src, src_path, __webhdfs_sync_visit, &walk_opts);
+    __webhdfs_sync_flush(&sync);
+    __webhdfs_sync_destroy(&sync);
+
+    if (r != 0)
+        return(-1);
+    return(sync.failed);
+}
+
+/* ============================================================================
+ *  snapshot sync
+ *
+ * What distcp -diff does: GETSNAPSHOTDIFF says what changed between two
+ * snapshots of the source, and only that is replayed on a destination
+ * still as it was at the first one. Deletes and renames are applied in
+ * two passes through a scratch directory, so renames into each other's
+ * place, or nested ones, come out right: every source goes into the
+ * scratch directory first, deepest first, and the renamed ones come out
+ * at their targets, shallowest first. Created and modified files then
+ * go through the usual chunks (stat, checksum, copy) from the later
+ * snapshot, which does not change under the copy. Created directories
+ * are walked. Paths of the diff are those of the earlier snapshot, so
+ * created and modified entries under a renamed directory are moved to
+ * its new name first.
+ */
+#define WEBHDFS_SYNC_SCRATCH        ".webhdfs-sync"
+
+typedef struct webhdfs_sync_change {
+    webhdfs_diff_type_t type;
+    char *  path;
+    char *  target;                 /* RENAME only */
+    size_t  depth;                  /* of target for RENAME, else of path */
+    size_t  slot;                   /* name in the scratch directory */
+} webhdfs_sync_change_t;
+
+typedef struct webhdfs_sync_changes {
+    webhdfs_sync_change_t *items;
+    size_t  nitems;
+    size_t  size;
+} webhdfs_sync_changes_t;
+
+static size_t __webhdfs_sync_depth (const char *path) {
+    size_t depth = 1;
+
+    for (; *path != '\0'; ++path)
+        depth += (*path == '/');
+    return(depth);
+}
+
+/* root + "/" + rel, rel being relative ("" is root itself) */
+static char *__webhdfs_sync_join (const char *root, size_t root_len, const char *rel) {
+    size_t n = strlen(rel);
+    char *path;
+
+    if ((path = (char *) malloc(root_len + n + 2)) == NULL)
+        return(NULL);
+
+    memcpy(path, root, root_len);
+    path[root_len] = '/';
+    memcpy(path + root_len + 1, rel, n + 1);
+    if (n == 0)
+        path[(root_len > 0) ? root_len : 1] = '\0';
+    return(path);
+}
+
+static int __webhdfs_sync_change_add (webhdfs_sync_changes_t *changes,
+                                      const webhdfs_diff_entry_t *entry)
+{
+    webhdfs_sync_change_t *items, *change;
+    size_t size;
+
+    if (changes->nitems == changes->size) {
+        size = (changes->size > 0) ? changes->size * 2 : 64;
+        if ((items = (webhdfs_sync_change_t *) realloc(changes->items,
+                                                       size * sizeof(webhdfs_sync_change_t))) == NULL)
+            return(1);
+        changes->items = items;
+        changes->size = size;
+    }
+
+    change = &(changes->items[changes->nitems]);
+    change->type = entry->type;
+    change->path = strdup(entry->path);
+    change->target = (entry->target != NULL) ? strdup(entry->target) : NULL;
+    if (change->path == NULL || (entry->target != NULL && change->target == NULL)) {
+        free(change->path);
+        free(change->target);
+        return(1);
+    }
+    change->depth = __webhdfs_sync_depth((change->target != NULL) ? change->target : change->path);
+    changes->nitems++;
+    return(0);
+}
+
+static void __webhdfs_sync_changes_free (webhdfs_sync_changes_t *changes) {
+    size_t i;
+
+    for (i = 0; i < changes->nitems; ++i) {
+        free(changes->items[i].path);
+        free(changes->items[i].target);
+    }
+    free(changes->items);
+}
+
+static int __webhdfs_sync_deepest_source (const void *a, const void *b) {
+    size_t x = __webhdfs_sync_depth(((const webhdfs_sync_change_t *)a)->path);
+    size_t y = __webhdfs_sync_depth(((const webhdfs_sync_change_t *)b)->path);
+    return((x < y) - (x > y));
+}
+
+static int __webhdfs_sync_shallowest_target (const void *a, const void *b) {
+    size_t x = ((const webhdfs_sync_change_t *)a)->depth;
+    size_t y = ((const webhdfs_sync_change_t *)b)->depth;
+    return((x > y) - (x < y));
+}
+
+static void __webhdfs_sync_failed (webhdfs_sync_t *sync, const char *path) {
+    sync->stats->failed++;
+    sync->failed++;
+    __webhdfs_sync_report(sync, path, WEBHDFS_SYNC_FAILED);
+}
+
+/* For a rename target whose parent is new: the copies fill it in later */
+static void __webhdfs_sync_mkparent (webhdfs_t *fs, const char *path) {
+    char *parent, *p;
+
+    if ((parent = strdup(path)) == NULL)
+        return;
+    if ((p = strrchr(parent, '/')) != NULL && p != parent) {
+        *p = '\0';
+        webhdfs_mkdir(fs, parent, 0755);
+    }
+    free(parent);
+}
+
+/* Deletes and renames, in the destination */
+static void __webhdfs_sync_moves (webhdfs_sync_t *sync, webhdfs_sync_changes_t *moves) {
+    webhdfs_sync_change_t *move;
+    char *scratch, *path, *item;
+    char name[32];
+    size_t i;
+    int ok;
+
+    if (moves->nitems == 0)
+        return;
+
+    scratch = __webhdfs_sync_join(sync->dst_root, sync->dst_len, WEBHDFS_SYNC_SCRATCH);
+    if (scratch == NULL || (!sync->opts.dry_run && webhdfs_mkdir(sync->dst, scratch, 0700))) {
+        for (i = 0; i < moves->nitems; ++i) {
+            moves->items[i].type = WEBHDFS_DIFF_MODIFY;
+            __webhdfs_sync_failed(sync, moves->items[i].path);
+        }
+        free(scratch);
+        return;
+    }
+
+    /* Out of the way, children before their parents */
+    qsort(moves->items, moves->nitems, sizeof(webhdfs_sync_change_t),
+          __webhdfs_sync_deepest_source);
+    for (i = 0; i < moves->nitems; ++i) {
+        move = &(moves->items[i]);
+        move->slot = i;
+        snprintf(name, sizeof(name), "%zu", i);
+        path = __webhdfs_sync_join(sync->dst_root, sync->dst_len, move->path);
+        item = (scratch != NULL) ? __webhdfs_sync_join(scratch, strlen(scratch), name) : NULL;
+
+        ok = (path != NULL && item != NULL);
+        if (ok && !sync->opts.dry_run)
+            ok = !webhdfs_rename(sync->dst, path, item);
+
+        if (!ok) {
+            __webhdfs_sync_failed(sync, (path != NULL) ? path : move->path);
+            move->type = WEBHDFS_DIFF_MODIFY;       /* nothing more to do */
+        } else if (move->type == WEBHDFS_DIFF_DELETE) {
+            sync->stats->deleted++;
+            __webhdfs_sync_report(sync, path, WEBHDFS_SYNC_DELETE);
+        }
+        free(path);
+        free(item);
+    }
+
+    /* Into place, parents before their children */
+    qsort(moves->items, moves->nitems, sizeof(webhdfs_sync_change_t),
+          __webhdfs_sync_shallowest_target);
+    for (i = 0; i < moves->nitems; ++i) {
+        move = &(moves->items[i]);
+        if (move->type != WEBHDFS_DIFF_RENAME)
+            continue;
+
+        snprintf(name, sizeof(name), "%zu", move->slot);
+        item = __webhdfs_sync_join(scratch, strlen(scratch), name);
+        path = __webhdfs_sync_join(sync->dst_root, sync->dst_len, move->target);
+
+        ok = (path != NULL && item != NULL);
+        if (ok && !sync->opts.dry_run && webhdfs_rename(sync->dst, item, path)) {
+            __webhdfs_sync_mkparent(sync->dst, path);
+            ok = !webhdfs_rename(sync->dst, item, path);
+        }
+
+        if (!ok) {
+            __webhdfs_sync_failed(sync, (path != NULL) ? path : move->target);
+            move->type = WEBHDFS_DIFF_MODIFY;
+        } else {
+            sync->stats->renamed++;
+            __webhdfs_sync_report(sync, path, WEBHDFS_SYNC_RENAME);
+        }
+        free(item);
+        free(path);
+    }
+
+    if (!sync->opts.dry_run && webhdfs_rmdir(sync->dst, scratch, 1))
+        __webhdfs_sync_failed(sync, scratch);
+    free(scratch);
+}
+
+/* A path of the earlier snapshot, as it is in the later one */
+static char *__webhdfs_sync_translate (const webhdfs_sync_changes_t *moves,
+                                       const webhdfs_sync_change_t *change)
+{
+    const webhdfs_sync_change_t *best = NULL, *move;
+    size_t i, n, best_len = 0;
+    char *path;
+
+    for (i = 0; i < moves->nitems; ++i) {
+        move = &(moves->items[i]);
+        n = strlen(move->path);
+        if (move->type != WEBHDFS_DIFF_RENAME || n < best_len ||
+            strncmp(change->path, move->path, n) != 0)
+        {
+            continue;
+        }
+
+        /* A created entry is new under the old name, not the renamed one */
+        if (change->path[n] == '/' ||
+            (change->path[n] == '\0' && change->type == WEBHDFS_DIFF_MODIFY))
+        {
+            best = move;
+            best_len = n;
+        }
+    }
+
+    if (best == NULL)
+        return(strdup(change->path));
+
+    n = strlen(best->target);
+    if ((path = (char *) malloc(n + strlen(change->path + best_len) + 1)) == NULL)
+        return(NULL);
+    memcpy(path, best->target, n);
+    strcpy(path + n, change->path + best_len);
+    return(path);
+}
+
+/* Created and modified entries, from the later snapshot */
+static void __webhdfs_sync_copies (webhdfs_sync_t *sync,
+                                   const webhdfs_sync_changes_t *moves,
+                                   const webhdfs_sync_changes_t *copies)
+{
+    webhdfs_stat_result_t *results = NULL;
+    webhdfs_walk_opts_t walk_opts;
+    webhdfs_fstat_t *stat;
+    const char **paths;
+    char *rel, *dst;
+    size_t i;
+
+    if (copies->nitems == 0)
+        return;
+
+    if ((paths = (const char **) calloc(copies->nitems, sizeof(char *))) == NULL) {
+        for (i = 0; i < copies->nitems; ++i)
+            __webhdfs_sync_failed(sync, copies->items[i].path);
+        return;
+    }
+
+    for (i = 0; i < copies->nitems; ++i) {
+        if ((rel = __webhdfs_sync_translate(moves, &(copies->items[i]))) != NULL) {
+            paths[i] = __webhdfs_sync_join(sync->src_root, sync->src_len, rel);
+            free(rel);
+        }
+    }
+
+    if (webhdfs_stat_many(sync->src, paths, copies->nitems, &results) < 0) {
+        webhdfs_stat_many_free(results);
+        results = NULL;
+    }
+
+    memset(&walk_opts, 0, sizeof(webhdfs_walk_opts_t));
+    walk_opts.threads = sync->opts.threads;
+    walk_opts.data = sync;
+    for (i = 0; i < copies->nitems; ++i) {
+        if (results == NULL || paths[i] == NULL || results[i].status != 0 ||
+            results[i].stat.type == NULL)
+        {
+            __webhdfs_sync_failed(sync, (paths[i] != NULL) ? paths[i] : copies->items[i].path);
+            continue;
+        }
+
+        stat = &(results[i].stat);
+        if (!strcmp(stat->type, "FILE")) {
+            __webhdfs_sync_add(sync, paths[i], stat);
+        } else if (!strcmp(stat->type, "DIRECTORY") &&
+                   copies->items[i].type == WEBHDFS_DIFF_CREATE)
+        {
+            /* A modified directory is one whose children changed: listed too */
+            sync->stats->directories++;
+            if (!sync->opts.dry_run && (dst = __webhdfs_sync_dst_path(sync, paths[i])) != NULL) {
+                webhdfs_mkdir(sync->dst, dst, stat->permission);
+                free(dst);
+            }
+            if (webhdfs_walk(sync->src, paths[i], __webhdfs_sync_visit, &walk_opts))
+                __webhdfs_sync_failed(sync, paths[i]);
+        }
+    }
+
+    webhdfs_stat_many_free(results);
+    for (i = 0; i < copies->nitems; ++i)
+        free((char *)paths[i]);
+    free(paths);
+}
+
+int webhdfs_snapshot_sync (webhdfs_t *src,
+                           const char *src_path,
+                           const char *from,
+                           const char *to,
+                           webhdfs_t *dst,
+                           const char *dst_path,
+                           const webhdfs_sync_opts_t *opts,
+                           webhdfs_sync_stats_t *stats)
+{
+    webhdfs_sync_changes_t moves, copies;
+    const webhdfs_diff_entry_t *entry;
+    webhdfs_snapshot_diff_t *diff;
+    webhdfs_sync_stats_t unused;
+    webhdfs_fstat_t *stat;
+    webhdfs_sync_t sync;
+    char *snapshot = NULL;
+    char *scratch;
+    int r = 0;
+
+    if (to != NULL && to[0] == '\0')
+        to = NULL;
+    if (stats != NULL)
+        memset(stats, 0, sizeof(webhdfs_sync_stats_t));
+
+    /* Anything changed on the destination would be overwritten blindly */
+    if ((diff = webhdfs_snapshot_diff(dst, dst_path, from, NULL)) == NULL)
+        return(-1);
+    entry = webhdfs_snapshot_diff_read(diff);
+    webhdfs_snapshot_diff_close(diff);
+    if (entry != NULL)
+        return(-1);
+
+    /*
+     * A scratch directory left by a crashed run may hold data: renames
+     * would land inside its numbered entries and the cleanup would
+     * delete them. Leave it for someone to look at.
+     */
+    if ((scratch = __webhdfs_sync_join(dst_path, __webhdfs_sync_root_len(dst_path),
+                                       WEBHDFS_SYNC_SCRATCH)) == NULL)
+    {
+        return(-1);
+    }
+    stat = webhdfs_stat(dst, scratch, NULL);
+    free(scratch);
+    if (stat != NULL) {
+        webhdfs_fstat_free(stat);
+        return(-1);
+    }
+
+    if ((diff = webhdfs_snapshot_diff(src, src_path, from, to)) == NULL)
+        return(-1);
+
+    memset(&moves, 0, sizeof(webhdfs_sync_changes_t));
+    memset(&copies, 0, sizeof(webhdfs_sync_changes_t));
+    while (r == 0 && (entry = webhdfs_snapshot_diff_read(diff)) != NULL) {
+        if (entry->path[0] == '\0')
+            continue;
+        if (entry->type == WEBHDFS_DIFF_DELETE || entry->type == WEBHDFS_DIFF_RENAME)
+            r = __webhdfs_sync_change_add(&moves, entry);
+        else
+            r = __webhdfs_sync_change_add(&copies, entry);
+    }
+    webhdfs_snapshot_diff_close(diff);
+
+    /* Copies come from the later snapshot, which stays put */
+    if (r == 0 && to != NULL) {
+        snapshot = (char *) malloc(strlen(src_path) + strlen(to) + 12);
+        if (snapshot != NULL)
+            sprintf(snapshot, "%.*s/.snapshot/%s", (int)__webhdfs_sync_root_len(src_path),
+                    src_path, to);
+    }
+
+    if (r != 0 || (to != NULL && snapshot == NULL)) {
+        __webhdfs_sync_changes_free(&moves);
+        __webhdfs_sync_changes_free(&copies);
+        free(snapshot);
+        return(-1);
+    }
+
+    __webhdfs_sync_init(&sync, src, (snapshot != NULL) ? snapshot : src_path,
+                        dst, dst_path, opts, (stats != NULL) ? stats : &unused);
+
+    __webhdfs_sync_moves(&sync, &moves);
+    __webhdfs_sync_copies(&sync, &moves, &copies);
+    __webhdfs_sync_flush(&sync);
+    __webhdfs_sync_destroy(&sync);
+
+    /* The base of the next run */
+    if (to != NULL && !sync.opts.dry_run && sync.failed == 0 &&
+        webhdfs_create_snapshot(dst, dst_path, to))
+    {
+        sync.stats->failed++;
+        sync.failed++;
+    }
+
+    __webhdfs_sync_changes_free(&moves);
+    __webhdfs_sync_changes_free(&copies);
+    free(snapshot);
+    return(sync.failed);
+}
@@ -0,0 +1,145 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "webhdfs_p.h"
+#include "webhdfs.h"
+
+/*
+ * Bandwidth limits: one token bucket per direction, shared by every
+ * thread of the webhdfs_t. The curl callbacks take tokens for each
+ * chunk they move. When the bucket is short they book the tokens
+ * anyway (it goes negative) and sleep until the debt is paid. While
+ * the callback sleeps curl does not touch the socket, so TCP flow
+ * control holds the other side back. Nothing spins, and callers queue
+ * in the order they booked. The bucket holds at most 1/10 s of the
+ * rate, so an idle period does not turn into a burst. The time slept
+ * is returned so the request can leave it out of its timeout.
+ */
+#define WEBHDFS_BUCKET_MIN      (16U << 10)
+
+static void __webhdfs_bucket_set (webhdfs_bucket_t *bucket, uint64_t rate) {
+    pthread_mutex_lock(&(bucket->lock));
+    bucket->rate = rate;
+    bucket->burst = rate / 10;
+    if (bucket->burst < WEBHDFS_BUCKET_MIN)
+        bucket->burst = WEBHDFS_BUCKET_MIN;
+    if (bucket->tokens > (int64_t)bucket->burst)
+        bucket->tokens = bucket->burst;
+    bucket->last_us = webhdfs_trace_now();
+    pthread_mutex_unlock(&(bucket->lock));
+}
+
+void webhdfs_throttle_open (webhdfs_t *fs) {
+    const webhdfs_conf_t *conf = fs->conf;
+    webhdfs_bucket_t *bucket;
+    int i;
+
+    for (i = 0; i < 2; ++i) {
+        bucket = &(fs->buckets[i]);
+        memset(bucket, 0, sizeof(webhdfs_bucket_t));
+        pthread_mutex_init(&(bucket->lock), NULL);
+    }
+
+    __webhdfs_bucket_set(&(fs->buckets[WEBHDFS_BUCKET_READ]), conf->read_rate);
+    __webhdfs_bucket_set(&(fs->buckets[WEBHDFS_BUCKET_WRITE]), conf->write_rate);
+}
+
+void webhdfs_throttle_close (webhdfs_t *fs) {
+    pthread_mutex_destroy(&(fs->buckets[WEBHDFS_BUCKET_READ].lock));
+    pthread_mutex_destroy(&(fs->buckets[WEBHDFS_BUCKET_WRITE].lock));
+}
+
+/* Account nbytes moved in this direction, sleeping if over the limit */
+uint64_t webhdfs_throttle (webhdfs_t *fs, int direction, size_t nbytes) {
+    webhdfs_bucket_t *bucket = &(fs->buckets[direction]);
+    uint64_t now, elapsed, credit, wait_us = 0;
+    struct timespec ts;
+
+    /* Unlimited: only count, without the lock */
+    if (bucket->rate == 0) {
+        __sync_fetch_and_add(&(bucket->bytes), nbytes);
+        return(0);
+    }
+
+    pthread_mutex_lock(&(bucket->lock));
+    now = webhdfs_trace_now();
+    if (bucket->rate > 0) {
+        /* More than a full bucket of idle time adds nothing (nor overflows) */
+        elapsed = now - bucket->last_us;
+        if (elapsed > bucket->burst * 1000000U / bucket->rate)
+            elapsed = bucket->burst * 1000000U / bucket->rate + 1;
+
+        /* Less than a byte's worth of time stays for the next caller */
+        if ((credit = elapsed * bucket->rate / 1000000U) > 0) {
+            bucket->tokens += (int64_t)credit;
+            bucket->last_us = now;
+        }
+        if (bucket->tokens > (int64_t)bucket->burst)
+            bucket->tokens = bucket->burst;
+
+        bucket->tokens -= (int64_t)nbytes;
+        if (bucket->tokens < 0) {
+            wait_us = (uint64_t)(-bucket->tokens) * 1000000U / bucket->rate;
+            bucket->wait_us += wait_us;
+            bucket->paused++;
+        }
+    }
+    pthread_mutex_unlock(&(bucket->lock));
+    __sync_fetch_and_add(&(bucket->bytes), nbytes);
+
+    if (wait_us > 0) {
+        ts.tv_sec = wait_us / 1000000U;
+        ts.tv_nsec = (wait_us % 1000000U) * 1000U;
+        while (nanosleep(&ts, &ts) != 0)
+            continue;
+    }
+    return(wait_us);
+}
+
+int webhdfs_set_rate_limit (webhdfs_t *fs,
+                            size_t read_bytes_per_sec,
+                            size_t write_bytes_per_sec)
+{
+    __webhdfs_bucket_set(&(fs->buckets[WEBHDFS_BUCKET_READ]), read_bytes_per_sec);
+    __webhdfs_bucket_set(&(fs->buckets[WEBHDFS_BUCKET_WRITE]), write_bytes_per_sec);
+    return(0);
+}
+
+void webhdfs_get_rate_stats (webhdfs_t *fs, webhdfs_rate_stats_t *stats) {
+    webhdfs_bucket_t *bucket;
+
+    bucket = &(fs->buckets[WEBHDFS_BUCKET_READ]);
+    pthread_mutex_lock(&(bucket->lock));
+    stats->read_limit = bucket->rate;
+    stats->read_bytes = __sync_fetch_and_add(&(bucket->bytes), 0);
+    stats->read_paused = bucket->paused;
+    stats->read_paused_us = bucket->wait_us;
+    pthread_mutex_unlock(&(bucket->lock));
+
+    bucket = &(fs->buckets[WEBHDFS_BUCKET_WRITE]);
+    pthread_mutex_lock(&(bucket->lock));
+    stats->write_limit = bucket->rate;
+    stats->write_bytes = __sync_fetch_and_add(&(bucket->bytes), 0);
+    stats->write_paused = bucket->paused;
+    stats->write_paused_us = bucket->wait_us;
+    pthread_mutex_unlock(&(bucket->lock));
+}
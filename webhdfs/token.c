@@ -0,0 +1,365 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/time.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "webhdfs_p.h"
+#include "webhdfs.h"
+
+/*
+ * Delegation tokens. With conf->delegation set, connect fetches a token
+ * (GETDELEGATIONTOKEN, authenticated as the user), or takes the one in
+ * conf->token_cache if it is still good, and every request then carries
+ * delegation=<token> instead of user.name. A renewer thread extends it
+ * (RENEWDELEGATIONTOKEN) when a quarter of its lifetime is left, and
+ * fetches a new one once renewals stop helping (the token reached its
+ * max lifetime) or the server no longer accepts it. The new token is
+ * swapped in under token_lock, which requests only hold to copy it:
+ * nothing waits on the network to authenticate.
+ */
+
+static uint64_t __webhdfs_token_now_ms (void) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return((uint64_t)now.tv_sec * 1000U + now.tv_usec / 1000);
+}
+
+/* Append the credentials of every request: token, or else user name */
+int webhdfs_token_append_auth (webhdfs_t *fs, buffer_t *buffer) {
+    const webhdfs_conf_t *conf = fs->conf;
+    int r = 0;
+
+    pthread_rwlock_rdlock(&(fs->token_lock));
+    if (fs->token != NULL)
+        r = buffer_append_format(buffer, "delegation=%s&", fs->token);
+    else if (conf->hdfs_user != NULL)
+        r = buffer_append_format(buffer, "user.name=%s&", conf->hdfs_user);
+    pthread_rwlock_unlock(&(fs->token_lock));
+
+    return(r);
+}
+
+static void __webhdfs_token_swap (webhdfs_t *fs,
+                                  char *token,
+                                  uint64_t expires_ms,
+                                  uint64_t lifetime_ms)
+{
+    char *old;
+
+    pthread_rwlock_wrlock(&(fs->token_lock));
+    old = fs->token;
+    fs->token = token;
+    fs->token_expires_ms = expires_ms;
+    fs->token_lifetime_ms = lifetime_ms;
+    pthread_rwlock_unlock(&(fs->token_lock));
+
+    /* Not cancelled: requests in flight may still carry it */
+    if (old != NULL && old != token)
+        free(old);
+}
+
+/* GETDELEGATIONTOKEN; returns the token string, NULL on failure */
+static char *__webhdfs_token_fetch (webhdfs_t *fs) {
+    const webhdfs_conf_t *conf = fs->conf;
+    char *token = NULL;
+    webhdfs_req_t req;
+    yajl_val node, v;
+    const char *url_string[] = {"urlString", NULL};
+
+    webhdfs_req_open_user(&req, fs, NULL);
+    webhdfs_req_set_args(&req, "op=GETDELEGATIONTOKEN");
+    if (conf->hdfs_user != NULL)
+        webhdfs_req_set_args(&req, "&renewer=%s", conf->hdfs_user);
+    webhdfs_req_exec(&req, WEBHDFS_REQ_GET);
+    node = webhdfs_req_json_response(&req);
+    webhdfs_req_close(&req);
+
+    if (webhdfs_response_exception(node) == NULL &&
+        (v = webhdfs_response_token(node)) != NULL &&
+        (v = yajl_tree_get(v, url_string, yajl_t_string)) != NULL)
+    {
+        token = strdup(YAJL_GET_STRING(v));
+    }
+
+    yajl_tree_free(node);
+    return(token);
+}
+
+/* RENEWDELEGATIONTOKEN; returns the new expiry in msec, 0 on failure */
+static uint64_t __webhdfs_token_renew (webhdfs_t *fs, const char *token) {
+    uint64_t expires_ms = 0;
+    webhdfs_req_t req;
+    yajl_val node, v;
+
+    webhdfs_req_open_user(&req, fs, NULL);
+    webhdfs_req_set_args(&req, "op=RENEWDELEGATIONTOKEN");
+    webhdfs_req_set_arg_escaped(&req, "token", token);
+    webhdfs_req_exec(&req, WEBHDFS_REQ_PUT);
+    node = webhdfs_req_json_response(&req);
+    webhdfs_req_close(&req);
+
+    if (webhdfs_response_exception(node) == NULL &&
+        (v = webhdfs_response_long(node)) != NULL && YAJL_IS_INTEGER(v))
+    {
+        expires_ms = (uint64_t)YAJL_GET_INTEGER(v);
+    }
+
+    yajl_tree_free(node);
+    return(expires_ms);
+}
+
+/*
+ * Cache file: "host:port user expires_ms lifetime_ms token". Only used
+ * for the same namenode and user, and while more than a quarter of the
+ * lifetime is left, so a restarted mount starts where it was.
+ */
+static int __webhdfs_token_load (webhdfs_t *fs) {
+    const webhdfs_conf_t *conf = fs->conf;
+    unsigned long long expires_ms, lifetime_ms;
+    char server[512], user[256], token[4096];
+    char expected[512];
+    FILE *fp;
+    int n;
+
+    if (conf->token_cache == NULL || (fp = fopen(conf->token_cache, "r")) == NULL)
+        return(1);
+
+    n = fscanf(fp, "%511s %255s %llu %llu %4095s", server, user,
+               &expires_ms, &lifetime_ms, token);
+    fclose(fp);
+
+    snprintf(expected, sizeof(expected), "%s:%d", conf->hdfs_host, conf->webhdfs_port);
+    if (n != 5 || strcmp(server, expected) ||
+        strcmp(user, (conf->hdfs_user != NULL) ? conf->hdfs_user : "-") ||
+        expires_ms < __webhdfs_token_now_ms() + lifetime_ms / 4)
+    {
+        return(1);
+    }
+
+    __webhdfs_token_swap(fs, strdup(token), expires_ms, lifetime_ms);
+    return(fs->token == NULL);
+}
+
+static void __webhdfs_token_save (webhdfs_t *fs) {
+    const webhdfs_conf_t *conf = fs->conf;
+    char tmpname[4096];
+    FILE *fp;
+    int fd;
+
+    if (conf->token_cache == NULL)
+        return;
+
+    snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", conf->token_cache);
+    if ((fd = mkstemp(tmpname)) < 0 || (fp = fdopen(fd, "w")) == NULL) {
+        perror("token cache");
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmpname);
+        }
+        return;
+    }
+
+    pthread_rwlock_rdlock(&(fs->token_lock));
+    fprintf(fp, "%s:%d %s %llu %llu %s\n", conf->hdfs_host, conf->webhdfs_port,
+            (conf->hdfs_user != NULL) ? conf->hdfs_user : "-",
+            (unsigned long long)fs->token_expires_ms,
+            (unsigned long long)fs->token_lifetime_ms, fs->token);
+    pthread_rwlock_unlock(&(fs->token_lock));
+
+    /* Replace the old one whole: a reader sees one token or the other */
+    if (fclose(fp) || rename(tmpname, conf->token_cache)) {
+        perror("token cache");
+        unlink(tmpname);
+    }
+}
+
+/* Get a token in place, new or renewed; returns 0 when one is usable */
+static int __webhdfs_token_refresh (webhdfs_t *fs, int fetch) {
+    uint64_t now, expires_ms, lifetime_ms;
+    char *token = NULL;
+
+    now = __webhdfs_token_now_ms();
+    if (!fetch) {
+        pthread_rwlock_rdlock(&(fs->token_lock));
+        if (fs->token != NULL)
+            token = strdup(fs->token);
+        lifetime_ms = fs->token_lifetime_ms;
+        pthread_rwlock_unlock(&(fs->token_lock));
+
+        /* Renewal no longer extends it by a quarter: time for a new one */
+        if (token != NULL && (expires_ms = __webhdfs_token_renew(fs, token)) > now &&
+            expires_ms - now >= lifetime_ms / 4)
+        {
+            /* A configured token: its lifetime is what we first see */
+            if (lifetime_ms == 0)
+                lifetime_ms = expires_ms - now;
+            __webhdfs_token_swap(fs, token, expires_ms, lifetime_ms);
+            __webhdfs_token_save(fs);
+            return(0);
+        }
+
+        free(token);
+    }
+
+    if ((token = __webhdfs_token_fetch(fs)) == NULL) {
+        fprintf(stderr, "webhdfs: unable to get a delegation token\n");
+        return(1);
+    }
+
+    /* A new token's expiry is only known from its first renewal */
+    if ((expires_ms = __webhdfs_token_renew(fs, token)) <= now) {
+        fprintf(stderr, "webhdfs: unable to renew the new delegation token\n");
+        free(token);
+        return(1);
+    }
+
+    lifetime_ms = expires_ms - now;
+    __webhdfs_token_swap(fs, token, expires_ms, lifetime_ms);
+    __webhdfs_token_save(fs);
+    return(0);
+}
+
+static void *__webhdfs_token_renewer (void *data) {
+    webhdfs_t *fs = (webhdfs_t *)data;
+    struct timespec deadline;
+    uint64_t wait_ms, now;
+    int fetch = 0;
+
+    pthread_mutex_lock(&(fs->renewer_lock));
+    while (!fs->renewer_stop) {
+        /* Renew with a quarter of the lifetime left, retry failures soon */
+        now = __webhdfs_token_now_ms();
+        pthread_rwlock_rdlock(&(fs->token_lock));
+        if (fs->token == NULL)
+            wait_ms = WEBHDFS_TOKEN_RETRY_MS;
+        else if (fs->token_expires_ms > now + fs->token_lifetime_ms / 4)
+            wait_ms = fs->token_expires_ms - now - fs->token_lifetime_ms / 4;
+        else
+            wait_ms = 0;
+        pthread_rwlock_unlock(&(fs->token_lock));
+
+        if (wait_ms > 0 && !fs->renew_now) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += wait_ms / 1000;
+            deadline.tv_nsec += (wait_ms % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&(fs->renewer_cond), &(fs->renewer_lock), &deadline);
+            if (fs->renewer_stop)
+                break;
+            if (!fs->renew_now && __webhdfs_token_now_ms() < now + wait_ms)
+                continue;
+        }
+
+        /* Rejected by the server: renewing will not help */
+        fetch = fs->renew_now;
+        fs->renew_now = 0;
+        pthread_mutex_unlock(&(fs->renewer_lock));
+
+        if (__webhdfs_token_refresh(fs, fetch)) {
+            /* Keep the old one while it lasts, try again later */
+            pthread_mutex_lock(&(fs->renewer_lock));
+            if (!fs->renewer_stop) {
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += WEBHDFS_TOKEN_RETRY_MS / 1000;
+                pthread_cond_timedwait(&(fs->renewer_cond), &(fs->renewer_lock), &deadline);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&(fs->renewer_lock));
+    }
+    pthread_mutex_unlock(&(fs->renewer_lock));
+
+    return(NULL);
+}
+
+int webhdfs_token_open (webhdfs_t *fs) {
+    const webhdfs_conf_t *conf = fs->conf;
+
+    fs->token = NULL;
+    fs->token_expires_ms = 0;
+    fs->token_lifetime_ms = 0;
+    fs->renewer_running = 0;
+    fs->renewer_stop = 0;
+    fs->renew_now = 0;
+
+    /* A static token, used as is unless we are to look after it */
+    if (conf->token != NULL && (fs->token = strdup(conf->token)) == NULL)
+        return(1);
+
+    return(0);
+}
+
+/* Needs the endpoints: talks to the namenode */
+int webhdfs_token_start (webhdfs_t *fs) {
+    const webhdfs_conf_t *conf = fs->conf;
+
+    if (!conf->delegation)
+        return(0);
+
+    /* Cached, else the configured one renewed, else a new one */
+    if (__webhdfs_token_load(fs) && __webhdfs_token_refresh(fs, fs->token == NULL)) {
+        if (fs->token != NULL)
+            fprintf(stderr, "webhdfs: using the configured delegation token as is\n");
+        else
+            fprintf(stderr, "webhdfs: no delegation token, authenticating as user\n");
+    }
+
+    if (pthread_create(&(fs->renewer), NULL, __webhdfs_token_renewer, fs))
+        return(1);
+
+    fs->renewer_running = 1;
+    return(0);
+}
+
+/* The server refused the token (expired, cancelled): get a new one */
+void webhdfs_token_invalid (webhdfs_t *fs) {
+    if (!fs->renewer_running)
+        return;
+
+    pthread_mutex_lock(&(fs->renewer_lock));
+    if (!fs->renew_now) {
+        fs->renew_now = 1;
+        pthread_cond_signal(&(fs->renewer_cond));
+    }
+    pthread_mutex_unlock(&(fs->renewer_lock));
+}
+
+void webhdfs_token_close (webhdfs_t *fs) {
+    if (fs->renewer_running) {
+        pthread_mutex_lock(&(fs->renewer_lock));
+        fs->renewer_stop = 1;
+        pthread_cond_signal(&(fs->renewer_cond));
+        pthread_mutex_unlock(&(fs->renewer_lock));
+        pthread_join(fs->renewer, NULL);
+        fs->renewer_running = 0;
+    }
+
+    free(fs->token);
+    fs->token = NULL;
+}
@@ -0,0 +1,272 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "webhdfs_p.h"
+#include "webhdfs.h"
+
+/*
+ * Each thread owns a ring of trace slots. Only the owner writes to its
+ * ring, so recording needs no lock: a slot is guarded by a sequence
+ * counter (odd while the owner is writing) and the dumper simply skips
+ * slots that change under it. Rings are linked into a global list that
+ * only grows; the ring of an exited thread is adopted by the next new one.
+ */
+#define TRACE_DEFAULT_EVENTS        (4096)
+
+struct trace_slot {
+    volatile uint64_t seq;
+    webhdfs_trace_event_t event;
+};
+
+struct trace_ring {
+    struct trace_ring *next;
+    struct trace_slot *slots;
+    size_t             size;
+    uint64_t           head;
+    volatile int       owned;
+    int                tid;
+};
+
+volatile int __webhdfs_trace_enabled = 0;
+
+static struct trace_ring * volatile __trace_rings = NULL;
+static volatile size_t __trace_ring_size = TRACE_DEFAULT_EVENTS;
+static volatile int __trace_next_tid = 1;
+
+static pthread_once_t __trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t __trace_key;
+static __thread struct trace_ring *__trace_ring = NULL;
+
+static void __trace_ring_release (void *data) {
+    struct trace_ring *ring = (struct trace_ring *)data;
+    __sync_lock_release(&(ring->owned));
+}
+
+static void __trace_key_init (void) {
+    pthread_key_create(&__trace_key, __trace_ring_release);
+}
+
+static struct trace_ring *__trace_ring_get (void) {
+    struct trace_ring *ring;
+
+    if (__trace_ring != NULL)
+        return(__trace_ring);
+
+    pthread_once(&__trace_once, __trace_key_init);
+
+    /* Try to adopt the ring of a thread that has gone away */
+    for (ring = __trace_rings; ring != NULL; ring = ring->next) {
+        if (!__sync_lock_test_and_set(&(ring->owned), 1))
+            break;
+    }
+
+    if (ring == NULL) {
+        if ((ring = (struct trace_ring *) malloc(sizeof(struct trace_ring))) == NULL)
+            return(NULL);
+
+        ring->size = __trace_ring_size;
+        ring->slots = (struct trace_slot *) calloc(ring->size, sizeof(struct trace_slot));
+        if (ring->slots == NULL) {
+            free(ring);
+            return(NULL);
+        }
+
+        ring->head = 0;
+        ring->owned = 1;
+        do {
+            ring->next = __trace_rings;
+        } while (!__sync_bool_compare_and_swap(&__trace_rings, ring->next, ring));
+    }
+
+    ring->tid = __sync_fetch_and_add(&__trace_next_tid, 1);
+    pthread_setspecific(__trace_key, ring);
+    __trace_ring = ring;
+    return(ring);
+}
+
+static void __trace_copy (char *dst, const char *src, size_t size) {
+    if (src == NULL) {
+        dst[0] = '\0';
+        return;
+    }
+
+    strncpy(dst, src, size - 1);
+    dst[size - 1] = '\0';
+}
+
+uint64_t webhdfs_trace_now (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t)ts.tv_sec * 1000000U + ts.tv_nsec / 1000U);
+}
+
+int webhdfs_trace_enable (size_t events_per_thread) {
+    if (events_per_thread > 0)
+        __trace_ring_size = events_per_thread;
+    __webhdfs_trace_enabled = 1;
+    return(0);
+}
+
+void webhdfs_trace_disable (void) {
+    __webhdfs_trace_enabled = 0;
+}
+
+void *webhdfs_trace_begin (const webhdfs_req_t *req, uint64_t begin_us) {
+    struct trace_ring *ring;
+    struct trace_slot *slot;
+
+    if ((ring = __trace_ring_get()) == NULL)
+        return(NULL);
+
+    slot = &(ring->slots[ring->head++ % ring->size]);
+
+    slot->seq++;
+    __sync_synchronize();
+    memset(&(slot->event), 0, sizeof(webhdfs_trace_event_t));
+    slot->event.tid = ring->tid;
+    slot->event.begin_us = begin_us;
+    __trace_copy(slot->event.op, req->op, sizeof(slot->event.op));
+    __trace_copy(slot->event.path, req->path, sizeof(slot->event.path));
+    __sync_synchronize();
+    slot->seq++;
+
+    return(slot);
+}
+
+void webhdfs_trace_end (void *handle, const webhdfs_trace_event_t *event) {
+    struct trace_slot *slot = (struct trace_slot *)handle;
+
+    slot->seq++;
+    __sync_synchronize();
+    slot->event.end_us = event->end_us;
+    slot->event.namenode_us = event->namenode_us;
+    slot->event.datanode_us = event->datanode_us;
+    slot->event.bytes = event->bytes;
+    slot->event.status = event->status;
+    memcpy(slot->event.redirect, event->redirect, sizeof(slot->event.redirect));
+    __sync_synchronize();
+    slot->seq++;
+}
+
+void webhdfs_trace_slow_log (const webhdfs_trace_event_t *event) {
+    fprintf(stderr, "slow-request: op=%s path=%s status=%d bytes=%llu "
+                    "total=%.3fms namenode=%.3fms datanode=%.3fms redirect=%s\n",
+            event->op, event->path, event->status,
+            (unsigned long long)event->bytes,
+            (event->end_us - event->begin_us) / 1000.0,
+            event->namenode_us / 1000.0, event->datanode_us / 1000.0,
+            event->redirect[0] != '\0' ? event->redirect : "-");
+}
+
+static void __trace_json_string (FILE *fp, const char *str) {
+    fputc('"', fp);
+    for (; *str != '\0'; ++str) {
+        if (*str == '"' || *str == '\\')
+            fprintf(fp, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(fp, "\\u%04x", *str);
+        else
+            fputc(*str, fp);
+    }
+    fputc('"', fp);
+}
+
+static void __trace_dump_event (FILE *fp, const webhdfs_trace_event_t *event, int pid) {
+    fprintf(fp, "{\"name\":");
+    __trace_json_string(fp, event->op[0] != '\0' ? event->op : "REQUEST");
+    fprintf(fp, ",\"cat\":\"webhdfs\",\"ph\":\"B\",\"ts\":%llu,\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"path\":",
+            (unsigned long long)event->begin_us, pid, event->tid);
+    __trace_json_string(fp, event->path);
+    fprintf(fp, "}}");
+
+    /* Still in flight: begin event only */
+    if (event->end_us == 0)
+        return;
+
+    fprintf(fp, ",\n{\"name\":\"namenode\",\"cat\":\"webhdfs\",\"ph\":\"X\","
+                "\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d}",
+            (unsigned long long)event->begin_us,
+            (unsigned long long)event->namenode_us, pid, event->tid);
+
+    if (event->datanode_us > 0) {
+        fprintf(fp, ",\n{\"name\":\"datanode\",\"cat\":\"webhdfs\",\"ph\":\"X\","
+                    "\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d}",
+                (unsigned long long)(event->end_us - event->datanode_us),
+                (unsigned long long)event->datanode_us, pid, event->tid);
+    }
+
+    fprintf(fp, ",\n{\"name\":");
+    __trace_json_string(fp, event->op[0] != '\0' ? event->op : "REQUEST");
+    fprintf(fp, ",\"cat\":\"webhdfs\",\"ph\":\"E\",\"ts\":%llu,\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"status\":%d,\"bytes\":%llu,\"redirect\":",
+            (unsigned long long)event->end_us, pid, event->tid,
+            event->status, (unsigned long long)event->bytes);
+    __trace_json_string(fp, event->redirect);
+    fprintf(fp, "}}");
+}
+
+int webhdfs_trace_dump (const char *filename) {
+    webhdfs_trace_event_t event;
+    struct trace_ring *ring;
+    int pid = getpid();
+    int first = 1;
+    FILE *fp;
+
+    if ((fp = fopen(filename, "w")) == NULL) {
+        perror("fopen() trace file");
+        return(1);
+    }
+
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for (ring = __trace_rings; ring != NULL; ring = ring->next) {
+        uint64_t head = ring->head;
+        uint64_t i = (head > ring->size) ? head - ring->size : 0;
+
+        for (; i < head; ++i) {
+            struct trace_slot *slot = &(ring->slots[i % ring->size]);
+            uint64_t seq = slot->seq;
+
+            __sync_synchronize();
+            if (seq & 1)
+                continue;
+
+            memcpy(&event, &(slot->event), sizeof(webhdfs_trace_event_t));
+            __sync_synchronize();
+            if (seq != slot->seq)
+                continue;
+
+            if (!first)
+                fprintf(fp, ",\n");
+            __trace_dump_event(fp, &event, pid);
+            first = 0;
+        }
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    fclose(fp);
+    return(0);
+}
@@ -0,0 +1,305 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "webhdfs_p.h"
+#include "webhdfs.h"
+
+/*
+ * Recursive walk. Directories still to list sit in one deque per walk
+ * thread. A thread pushes the subdirectories it finds and pops its own
+ * newest first, so it goes depth first and its deque stays short. A
+ * thread with nothing left steals the oldest directory of another: near
+ * the root, where the big subtrees are. Entries go to the visitor as
+ * they come out of each listing page.
+ *
+ * Memory: a listing holds one page. Once max_queued directories are
+ * waiting, a thread lists new subdirectories itself, depth first, rather
+ * than queueing them. Queued paths are then bounded by max_queued, and
+ * open listings by threads x depth.
+ */
+#define WEBHDFS_WALK_QUEUED         (1U << 16)
+
+typedef struct webhdfs_walk_dir {
+    char *  path;
+    int     depth;
+} webhdfs_walk_dir_t;
+
+typedef struct webhdfs_walk_deque {
+    pthread_mutex_t lock;
+    webhdfs_walk_dir_t *dirs;
+    size_t  head;                   /* oldest, where thieves take */
+    size_t  tail;                   /* newest, where the owner works */
+    size_t  size;
+} webhdfs_walk_deque_t;
+
+typedef struct webhdfs_walk {
+    webhdfs_t *fs;
+    webhdfs_walk_visitor_t visitor;
+    void *  data;
+    unsigned int max_depth;
+    size_t  max_queued;
+    unsigned int nthreads;
+    webhdfs_walk_deque_t *deques;
+    pthread_mutex_t lock;           /* with cond, for idle threads */
+    pthread_cond_t  cond;
+    size_t  pending;                /* directories queued or being listed */
+    size_t  queued;
+    int     failures;
+    int     stop;
+} webhdfs_walk_t;
+
+static int __webhdfs_walk_push (webhdfs_walk_t *walk,
+                                webhdfs_walk_deque_t *deque,
+                                const char *path,
+                                int depth)
+{
+    webhdfs_walk_dir_t *dirs;
+    size_t i, n, size;
+    char *copy;
+
+    if ((copy = strdup(path)) == NULL)
+        return(1);
+
+    pthread_mutex_lock(&(deque->lock));
+    n = deque->tail - deque->head;
+    if (n == deque->size) {
+        size = (deque->size > 0) ? deque->size * 2 : 64;
+        if ((dirs = (webhdfs_walk_dir_t *) malloc(size * sizeof(webhdfs_walk_dir_t))) == NULL) {
+            pthread_mutex_unlock(&(deque->lock));
+            free(copy);
+            return(1);
+        }
+        for (i = 0; i < n; ++i)
+            dirs[i] = deque->dirs[(deque->head + i) % deque->size];
+        free(deque->dirs);
+        deque->dirs = dirs;
+        deque->size = size;
+        deque->head = 0;
+        deque->tail = n;
+    }
+
+    deque->dirs[deque->tail % deque->size].path = copy;
+    deque->dirs[deque->tail % deque->size].depth = depth;
+    deque->tail++;
+    __sync_fetch_and_add(&(walk->pending), 1);
+    __sync_fetch_and_add(&(walk->queued), 1);
+    pthread_mutex_unlock(&(deque->lock));
+
+    pthread_mutex_lock(&(walk->lock));
+    pthread_cond_signal(&(walk->cond));
+    pthread_mutex_unlock(&(walk->lock));
+    return(0);
+}
+
+/* Newest from our own deque, or the oldest of someone else's */
+static int __webhdfs_walk_take (webhdfs_walk_t *walk,
+                                unsigned int self,
+                                webhdfs_walk_dir_t *dir)
+{
+    webhdfs_walk_deque_t *deque;
+    unsigned int i;
+
+    for (i = 0; i < walk->nthreads; ++i) {
+        deque = &(walk->deques[(self + i) % walk->nthreads]);
+
+        pthread_mutex_lock(&(deque->lock));
+        if (deque->head == deque->tail) {
+            pthread_mutex_unlock(&(deque->lock));
+            continue;
+        }
+
+        if (i == 0)
+            *dir = deque->dirs[--deque->tail % deque->size];
+        else
+            *dir = deque->dirs[deque->head++ % deque->size];
+        __sync_fetch_and_sub(&(walk->queued), 1);
+        pthread_mutex_unlock(&(deque->lock));
+        return(0);
+    }
+
+    return(1);
+}
+
+static void __webhdfs_walk_done (webhdfs_walk_t *walk) {
+    if (__sync_sub_and_fetch(&(walk->pending), 1) == 0) {
+        pthread_mutex_lock(&(walk->lock));
+        pthread_cond_broadcast(&(walk->cond));
+        pthread_mutex_unlock(&(walk->lock));
+    }
+}
+
+static void __webhdfs_walk_stop (webhdfs_walk_t *walk) {
+    pthread_mutex_lock(&(walk->lock));
+    walk->stop = 1;
+    pthread_cond_broadcast(&(walk->cond));
+    pthread_mutex_unlock(&(walk->lock));
+}
+
+/* List path, handing entries to the visitor and subdirectories out */
+static void __webhdfs_walk_list (webhdfs_walk_t *walk,
+                                 unsigned int self,
+                                 const char *path,
+                                 int depth)
+{
+    const webhdfs_fstat_t *stat;
+    webhdfs_dir_t *dir;
+    size_t len, size = 0;
+    char *child = NULL;
+    int action;
+
+    if ((dir = webhdfs_dir_open(walk->fs, path)) == NULL) {
+        __sync_fetch_and_add(&(walk->failures), 1);
+        return;
+    }
+
+    /* Children are path + '/' + name; the root's are just '/' + name */
+    len = strlen(path);
+    while (len > 0 && path[len - 1] == '/')
+        len--;
+
+    while (!walk->stop && (stat = webhdfs_dir_read(dir)) != NULL) {
+        /* A file lists as itself, with no name */
+        if (stat->path == NULL || stat->path[0] == '\0') {
+            if (walk->visitor(walk->data, path, stat, depth) == WEBHDFS_WALK_STOP)
+                __webhdfs_walk_stop(walk);
+            continue;
+        }
+
+        if (size < len + strlen(stat->path) + 2) {
+            size = len + strlen(stat->path) + 64;
+            free(child);
+            if ((child = (char *) malloc(size)) == NULL) {
+                __sync_fetch_and_add(&(walk->failures), 1);
+                break;
+            }
+        }
+        memcpy(child, path, len);
+        child[len] = '/';
+        strcpy(child + len + 1, stat->path);
+
+        action = walk->visitor(walk->data, child, stat, depth + 1);
+        if (action == WEBHDFS_WALK_STOP) {
+            __webhdfs_walk_stop(walk);
+            break;
+        }
+
+        if (action == WEBHDFS_WALK_SKIP || stat->type == NULL ||
+            strcmp(stat->type, "DIRECTORY") != 0 ||
+            (walk->max_depth > 0 && depth + 1 >= (int)walk->max_depth))
+        {
+            continue;
+        }
+
+        if (walk->queued >= walk->max_queued ||
+            __webhdfs_walk_push(walk, &(walk->deques[self]), child, depth + 1))
+        {
+            __webhdfs_walk_list(walk, self, child, depth + 1);
+        }
+    }
+
+    /* Cut short by a failed page: some entries were never seen */
+    if (dir->error)
+        __sync_fetch_and_add(&(walk->failures), 1);
+
+    free(child);
+    webhdfs_dir_close(dir);
+}
+
+static void __webhdfs_walk_thread (void *data, size_t self) {
+    webhdfs_walk_t *walk = (webhdfs_walk_t *)data;
+    webhdfs_walk_dir_t dir;
+
+    for (;;) {
+        if (!walk->stop && !__webhdfs_walk_take(walk, self, &dir)) {
+            __webhdfs_walk_list(walk, self, dir.path, dir.depth);
+            free(dir.path);
+            __webhdfs_walk_done(walk);
+            continue;
+        }
+
+        /* Nothing to take: wait for a push, or for the others to finish */
+        pthread_mutex_lock(&(walk->lock));
+        while (!walk->stop && walk->queued == 0 && walk->pending > 0)
+            pthread_cond_wait(&(walk->cond), &(walk->lock));
+        if (walk->stop || walk->pending == 0) {
+            pthread_mutex_unlock(&(walk->lock));
+            break;
+        }
+        pthread_mutex_unlock(&(walk->lock));
+    }
+}
+
+int webhdfs_walk (webhdfs_t *fs,
+                  const char *root,
+                  webhdfs_walk_visitor_t visitor,
+                  const webhdfs_walk_opts_t *opts)
+{
+    webhdfs_walk_dir_t dir;
+    webhdfs_walk_t walk;
+    unsigned int i;
+
+    memset(&walk, 0, sizeof(webhdfs_walk_t));
+    walk.fs = fs;
+    walk.visitor = visitor;
+    walk.nthreads = WEBHDFS_PARALLEL_THREADS;
+    walk.max_queued = WEBHDFS_WALK_QUEUED;
+    if (opts != NULL) {
+        walk.data = opts->data;
+        walk.max_depth = opts->max_depth;
+        if (opts->threads > 0)
+            walk.nthreads = opts->threads;
+        if (opts->max_queued > 0)
+            walk.max_queued = opts->max_queued;
+    }
+
+    if ((walk.deques = (webhdfs_walk_deque_t *) calloc(walk.nthreads,
+                                                       sizeof(webhdfs_walk_deque_t))) == NULL)
+    {
+        return(-2);
+    }
+
+    pthread_mutex_init(&(walk.lock), NULL);
+    pthread_cond_init(&(walk.cond), NULL);
+    for (i = 0; i < walk.nthreads; ++i)
+        pthread_mutex_init(&(walk.deques[i].lock), NULL);
+
+    if (__webhdfs_walk_push(&walk, &(walk.deques[0]), root, 0)) {
+        walk.failures = -2;
+    } else {
+        webhdfs_parallel(fs, walk.nthreads, walk.nthreads, __webhdfs_walk_thread, &walk);
+        if (walk.stop)
+            walk.failures = -1;
+    }
+
+    /* Left behind by a stop */
+    for (i = 0; i < walk.nthreads; ++i) {
+        while (!__webhdfs_walk_take(&walk, i, &dir))
+            free(dir.path);
+        free(walk.deques[i].dirs);
+        pthread_mutex_destroy(&(walk.deques[i].lock));
+    }
+    free(walk.deques);
+    pthread_cond_destroy(&(walk.cond));
+    pthread_mutex_destroy(&(walk.lock));
+
+    return(walk.failures);
+}
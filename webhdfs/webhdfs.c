@@ -21,30 +21,108 @@
 #include <stdio.h>
 
 #include <yajl/yajl_tree.h>
+#include <curl/curl.h>
 
 #include "webhdfs_p.h"
 #include "webhdfs.h"
 
 #define __strdup(x)         ((x != NULL && strlen(x) > 0) ? strdup(x) : NULL)
 
+static pthread_once_t __curl_once = PTHREAD_ONCE_INIT;
+
+/* curl_global_init() is not thread-safe, run it once before any handle */
+static void __curl_global_init (void) {
+    curl_global_init(CURL_GLOBAL_ALL);
+}
+
 webhdfs_t *webhdfs_connect (const webhdfs_conf_t *conf) {
     webhdfs_t *fs;
 
+    pthread_once(&__curl_once, __curl_global_init);
+
     if ((fs = (webhdfs_t *) malloc(sizeof(webhdfs_t))) == NULL)
         return(NULL);
 
     fs->conf = conf;
+    fs->curls = NULL;
+    fs->flights = NULL;
+    fs->no_list_batch = 0;
+    fs->tasks = NULL;
+    fs->tasks_tail = NULL;
+    fs->ntasks = 0;
+    fs->nworkers = 0;
+    fs->work_stop = 0;
+    fs->ttfb_count = 0;
+    fs->hedge_us = 0;
+
+    if (pthread_mutex_init(&(fs->lock), NULL)) {
+        free(fs);
+        return(NULL);
+    }
 
+    if (pthread_key_create(&(fs->curl_key), webhdfs_curl_destructor)) {
+        pthread_mutex_destroy(&(fs->lock));
+        free(fs);
+        return(NULL);
+    }
+
+    pthread_mutex_init(&(fs->flight_lock), NULL);
+    pthread_cond_init(&(fs->flight_cond), NULL);
+    pthread_mutex_init(&(fs->work_lock), NULL);
+    pthread_cond_init(&(fs->work_cond), NULL);
+    pthread_mutex_init(&(fs->ttfb_lock), NULL);
+    pthread_mutex_init(&(fs->admit_lock), NULL);
+    pthread_rwlock_init(&(fs->token_lock), NULL);
+    pthread_mutex_init(&(fs->renewer_lock), NULL);
+    pthread_cond_init(&(fs->renewer_cond), NULL);
+    pthread_mutex_init(&(fs->summary_lock), NULL);
+    memset(fs->summaries, 0, sizeof(fs->summaries));
+    fs->token = NULL;
+    fs->renewer_running = 0;
+
+    if (webhdfs_endpoints_open(fs)) {
+        webhdfs_disconnect(fs);
+        return(NULL);
+    }
+
+    webhdfs_admission_open(fs);
+    webhdfs_throttle_open(fs);
+    if (webhdfs_token_open(fs)) {
+        webhdfs_disconnect(fs);
+        return(NULL);
+    }
+
+    webhdfs_endpoints_start(fs);
+    webhdfs_token_start(fs);
     return(fs);
 }
 
 void webhdfs_disconnect (webhdfs_t *fs) {
+    /* Workers own curl handles too: join them before freeing those */
+    webhdfs_worker_stop(fs);
+    webhdfs_token_close(fs);
+    webhdfs_admission_close(fs);
+    webhdfs_throttle_close(fs);
+    webhdfs_endpoints_close(fs);
+    pthread_cond_destroy(&(fs->work_cond));
+    pthread_mutex_destroy(&(fs->work_lock));
+    pthread_mutex_destroy(&(fs->ttfb_lock));
+    pthread_cond_destroy(&(fs->renewer_cond));
+    pthread_mutex_destroy(&(fs->renewer_lock));
+    pthread_rwlock_destroy(&(fs->token_lock));
+    pthread_mutex_destroy(&(fs->admit_lock));
+    webhdfs_summary_close(fs);
+    pthread_mutex_destroy(&(fs->summary_lock));
+
+    pthread_key_delete(fs->curl_key);
+    webhdfs_curl_free_all(fs);
+    pthread_cond_destroy(&(fs->flight_cond));
+    pthread_mutex_destroy(&(fs->flight_lock));
+    pthread_mutex_destroy(&(fs->lock));
     free(fs);
 }
 
-webhdfs_fstat_t *webhdfs_stat (webhdfs_t *fs,
-                               const char *path,
-                               char **error) {
+void webhdfs_fstat_decode (webhdfs_fstat_t *stat, yajl_val node, int copy) {
     const char *pathSuffix[] = {"pathSuffix", NULL};
     const char *replication[] = {"replication", NULL};
     const char *permission[] = {"permission", NULL};
@@ -55,6 +133,43 @@ webhdfs_fstat_t *webhdfs_stat (webhdfs_t *fs,
     const char *mtime[] = {"modificationTime", NULL};
     const char *block[] = {"blockSize", NULL};
     const char *atime[] = {"accessTime", NULL};
+    yajl_val v;
+
+    if ((v = yajl_tree_get(node, atime, yajl_t_number)))
+        stat->atime = YAJL_GET_INTEGER(v);
+
+    if ((v = yajl_tree_get(node, mtime, yajl_t_number)))
+        stat->mtime = YAJL_GET_INTEGER(v);
+
+    if ((v = yajl_tree_get(node, length, yajl_t_number)))
+        stat->length = YAJL_GET_INTEGER(v);
+
+    if ((v = yajl_tree_get(node, block, yajl_t_number)))
+        stat->block = YAJL_GET_INTEGER(v);
+
+    if ((v = yajl_tree_get(node, replication, yajl_t_number)))
+        stat->replication = YAJL_GET_INTEGER(v);
+
+    if ((v = yajl_tree_get(node, permission, yajl_t_string)))
+        stat->permission = strtol(YAJL_GET_STRING(v), NULL, 8);
+
+    /* copy: strings are owned by stat, otherwise they point into the tree */
+    if ((v = yajl_tree_get(node, pathSuffix, yajl_t_string)))
+        stat->path = copy ? __strdup(YAJL_GET_STRING(v)) : YAJL_GET_STRING(v);
+
+    if ((v = yajl_tree_get(node, group, yajl_t_string)))
+        stat->group = copy ? __strdup(YAJL_GET_STRING(v)) : YAJL_GET_STRING(v);
+
+    if ((v = yajl_tree_get(node, owner, yajl_t_string)))
+        stat->owner = copy ? __strdup(YAJL_GET_STRING(v)) : YAJL_GET_STRING(v);
+
+    if ((v = yajl_tree_get(node, type, yajl_t_string)))
+        stat->type = copy ? __strdup(YAJL_GET_STRING(v)) : YAJL_GET_STRING(v);
+}
+
+webhdfs_fstat_t *webhdfs_stat (webhdfs_t *fs,
+                               const char *path,
+                               char **error) {
     yajl_val root, node, v;
     webhdfs_fstat_t *stat;
     webhdfs_req_t req;
@@ -71,7 +186,8 @@ webhdfs_fstat_t *webhdfs_stat (webhdfs_t *fs,
 //        YAJL_GET_STRING(exception);
         const char *messageNode[] = {"message", NULL};
         yajl_val message = yajl_tree_get(v, messageNode, yajl_t_string);
-        *error = __strdup(YAJL_GET_STRING(message));
+        if (error != NULL)
+            *error = __strdup(YAJL_GET_STRING(message));
 
         yajl_tree_free(root);
         return(NULL);
@@ -88,36 +204,7 @@ webhdfs_fstat_t *webhdfs_stat (webhdfs_t *fs,
     }
 
     memset(stat, 0, sizeof(webhdfs_fstat_t));
-
-    if ((v = yajl_tree_get(node, atime, yajl_t_number)))
-        stat->atime = YAJL_GET_INTEGER(v);
-
-    if ((v = yajl_tree_get(node, mtime, yajl_t_number)))
-        stat->mtime = YAJL_GET_INTEGER(v);
-
-    if ((v = yajl_tree_get(node, length, yajl_t_number)))
-        stat->length = YAJL_GET_INTEGER(v);
-
-    if ((v = yajl_tree_get(node, block, yajl_t_number)))
-        stat->block = YAJL_GET_INTEGER(v);
-
-    if ((v = yajl_tree_get(node, replication, yajl_t_number)))
-        stat->replication = YAJL_GET_INTEGER(v);
-
-    if ((v = yajl_tree_get(node, permission, yajl_t_string)))
-        stat->permission = strtol(YAJL_GET_STRING(v), NULL, 8);
-
-    if ((v = yajl_tree_get(node, pathSuffix, yajl_t_string)))
-        stat->path = __strdup(YAJL_GET_STRING(v));
-
-    if ((v = yajl_tree_get(node, group, yajl_t_string)))
-        stat->group = __strdup(YAJL_GET_STRING(v));
-
-    if ((v = yajl_tree_get(node, owner, yajl_t_string)))
-        stat->owner = __strdup(YAJL_GET_STRING(v));
-
-    if ((v = yajl_tree_get(node, type, yajl_t_string)))
-        stat->type = __strdup(YAJL_GET_STRING(v));
+    webhdfs_fstat_decode(stat, node, 1);
 
     yajl_tree_free(root);
     return(stat);
@@ -290,13 +377,13 @@ int webhdfs_set_replication (webhdfs_t *fs, const char *path, int replication) {
     return(2);
 }
 
-int webhdfs_set_times (webhdfs_t *fs, const char *path, int mtime, int atime) {
+int webhdfs_set_times (webhdfs_t *fs, const char *path, int64_t mtime, int64_t atime) {
     webhdfs_req_t req;
     yajl_val node, v;
 
     webhdfs_req_open(&req, fs, path);
-    webhdfs_req_set_args(&req, "op=SETTIMES&modificationtime=%d&accesstime=%d",
-                               mtime, atime);
+    webhdfs_req_set_args(&req, "op=SETTIMES&modificationtime=%lld&accesstime=%lld",
+                               (long long)mtime, (long long)atime);
     webhdfs_req_exec(&req, WEBHDFS_REQ_PUT);
     node = webhdfs_req_json_response(&req);
     webhdfs_req_close(&req);
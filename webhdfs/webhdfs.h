@@ -21,6 +21,7 @@
 
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -30,6 +31,9 @@ typedef struct webhdfs webhdfs_t;
 typedef struct webhdfs_dir webhdfs_dir_t;
 typedef struct webhdfs_conf webhdfs_conf_t;
 typedef struct webhdfs_file webhdfs_file_t;
+typedef struct webhdfs_batch webhdfs_batch_t;
+typedef struct webhdfs_crc webhdfs_crc_t;
+typedef struct webhdfs_snapshot_diff webhdfs_snapshot_diff_t;
 
 typedef size_t (*webhdfs_upload_t)  (void *ptr,
                                      size_t size,
@@ -48,6 +52,123 @@ typedef struct webhdfs_fstat {
     int permission;
 } webhdfs_fstat_t;
 
+/* GETCONTENTSUMMARY: totals of a subtree, quotas are -1 when unset */
+typedef struct webhdfs_content_summary {
+    int64_t length;
+    int64_t file_count;
+    int64_t directory_count;
+    int64_t quota;                  /* names (files + directories) */
+    int64_t space_consumed;         /* bytes, with replication */
+    int64_t space_quota;
+} webhdfs_content_summary_t;
+
+/* One path of webhdfs_stat_many() */
+typedef struct webhdfs_stat_result {
+    webhdfs_fstat_t stat;           /* valid if status is 0; path is NULL */
+    int status;                     /* 0, ENOENT or EIO */
+    const char *error;              /* the server's message, if any */
+} webhdfs_stat_result_t;
+
+/* What a webhdfs_walk() visitor wants done next */
+typedef enum webhdfs_walk_action {
+    WEBHDFS_WALK_CONTINUE,
+    WEBHDFS_WALK_SKIP,              /* do not descend into this directory */
+    WEBHDFS_WALK_STOP,              /* end the walk */
+} webhdfs_walk_action_t;
+
+typedef int (*webhdfs_walk_visitor_t) (void *data,
+                                       const char *path,
+                                       const webhdfs_fstat_t *stat,
+                                       int depth);
+
+typedef struct webhdfs_walk_opts {
+    unsigned int threads;           /* listings at once, 0 = default */
+    unsigned int max_depth;         /* deepest entries delivered, 0 = all */
+    size_t max_queued;              /* directories waiting, 0 = default */
+    void *data;                     /* passed to the visitor */
+} webhdfs_walk_opts_t;
+
+/* GETFILECHECKSUM, as the server sent it */
+typedef struct webhdfs_file_checksum {
+    char algorithm[48];             /* e.g. MD5-of-0MD5-of-512CRC32C */
+    char bytes[129];                /* hex */
+    int length;                     /* of the checksum, in bytes */
+} webhdfs_file_checksum_t;
+
+/* What webhdfs_sync() did with a file */
+typedef enum webhdfs_sync_action {
+    WEBHDFS_SYNC_COPY,              /* copied (or would be, on a dry run) */
+    WEBHDFS_SYNC_SKIP,              /* already up to date */
+    WEBHDFS_SYNC_FAILED,
+    WEBHDFS_SYNC_DELETE,            /* webhdfs_snapshot_sync() only */
+    WEBHDFS_SYNC_RENAME,
+} webhdfs_sync_action_t;
+
+typedef void (*webhdfs_sync_report_t) (void *data,
+                                       const char *path,
+                                       webhdfs_sync_action_t action);
+
+typedef struct webhdfs_sync_opts {
+    unsigned int threads;           /* requests at once, 0 = default */
+    int checksum;                   /* compare checksums even if mtimes match */
+    int dry_run;                    /* decide, but change nothing */
+    webhdfs_sync_report_t report;   /* per file, may be NULL */
+    void *data;                     /* passed to report */
+} webhdfs_sync_opts_t;
+
+typedef struct webhdfs_sync_stats {
+    uint64_t files;
+    uint64_t directories;
+    uint64_t copied;
+    uint64_t copied_bytes;
+    uint64_t skipped;
+    uint64_t checksummed;           /* files compared by checksum */
+    uint64_t failed;
+    uint64_t deleted;               /* webhdfs_snapshot_sync() only */
+    uint64_t renamed;
+} webhdfs_sync_stats_t;
+
+/* One change between two snapshots */
+typedef enum webhdfs_diff_type {
+    WEBHDFS_DIFF_CREATE,
+    WEBHDFS_DIFF_MODIFY,
+    WEBHDFS_DIFF_DELETE,
+    WEBHDFS_DIFF_RENAME,
+} webhdfs_diff_type_t;
+
+typedef struct webhdfs_diff_entry {
+    webhdfs_diff_type_t type;
+    const char *path;               /* relative to the snapshot root, "" is the root */
+    const char *target;             /* the new path of a RENAME, else NULL */
+} webhdfs_diff_entry_t;
+
+/* How requests are spread over the configured servers */
+typedef enum webhdfs_endpoint_policy {
+    WEBHDFS_POLICY_FAILOVER,        /* HA namenodes: all to the active one */
+    WEBHDFS_POLICY_LEAST_REQUESTS,  /* gateways: fewest requests in flight */
+    WEBHDFS_POLICY_EWMA,            /* gateways: lowest latency x load */
+} webhdfs_endpoint_policy_t;
+
+/* Bandwidth limits and what they did, see webhdfs_get_rate_stats() */
+typedef struct webhdfs_rate_stats {
+    uint64_t read_limit;            /* bytes/s, 0 = unlimited */
+    uint64_t read_bytes;
+    uint64_t read_paused;           /* times a transfer waited for the limit */
+    uint64_t read_paused_us;
+    uint64_t write_limit;
+    uint64_t write_bytes;
+    uint64_t write_paused;
+    uint64_t write_paused_us;
+} webhdfs_rate_stats_t;
+
+/* Admission classes, each with its own queue per endpoint */
+typedef enum webhdfs_class {
+    WEBHDFS_CLASS_INTERACTIVE,      /* metadata: stat, ls, mkdir, ... */
+    WEBHDFS_CLASS_READ,             /* reads of the caller */
+    WEBHDFS_CLASS_PREFETCH,         /* background prefetch and readahead */
+    WEBHDFS_CLASS_BULK,             /* writes (create, append) */
+} webhdfs_class_t;
+
 /* WebHDFS Configuration - host:port, user, token, ... */
 webhdfs_conf_t *        webhdfs_conf_alloc        (void);
 webhdfs_conf_t *        webhdfs_conf_load         (const char *filename,
@@ -58,22 +179,146 @@ int                     webhdfs_conf_set_server   (webhdfs_conf_t *conf,
                                                    const char *host,
                                                    int port,
                                                    int use_ssl);
+int                     webhdfs_conf_add_server   (webhdfs_conf_t *conf,
+                                                   const char *host,
+                                                   int port);
+int                     webhdfs_conf_set_endpoint_policy (webhdfs_conf_t *conf,
+                                                   webhdfs_endpoint_policy_t policy);
 int                     webhdfs_conf_set_user     (webhdfs_conf_t *conf,
                                                    const char *user);
 int                     webhdfs_conf_set_token    (webhdfs_conf_t *conf,
                                                    const char *token);
 
-/* WebHDFS File-System */
+/*
+ * Fetch a delegation token at connect (or reuse the one saved in
+ * cache_file, if any), renew it in the background and send it instead
+ * of the user name. A token given to webhdfs_conf_set_token() is renewed.
+ */
+int                     webhdfs_conf_set_delegation (webhdfs_conf_t *conf,
+                                                   int enable,
+                                                   const char *cache_file);
+
+int                     webhdfs_conf_set_slow_request_log (webhdfs_conf_t *conf,
+                                                   unsigned int threshold_ms);
+/*
+ * Coalesce identical GETs in flight at once (off by default). A GET may
+ * then get the answer to one sent before the caller's own last write:
+ * only turn it on where readers do not need to see their writes.
+ */
+int                     webhdfs_conf_set_single_flight (webhdfs_conf_t *conf,
+                                                   int enable);
+int                     webhdfs_conf_set_prefetch (webhdfs_conf_t *conf,
+                                                   size_t small_file,
+                                                   size_t tail,
+                                                   const char *tail_patterns);
+int                     webhdfs_conf_set_readahead (webhdfs_conf_t *conf,
+                                                   size_t max_window);
+
+/*
+ * Deadlines and retries. Defaults: 10s to connect, abort a transfer
+ * stalled for 60s, no overall limit, 3 retries of idempotent ops on
+ * transport errors and 5xx (200ms backoff, doubling, jittered).
+ * Hedged reads are off until given a threshold floor in msec.
+ */
+int                     webhdfs_conf_set_timeouts (webhdfs_conf_t *conf,
+                                                   unsigned int connect_ms,
+                                                   unsigned int request_ms);
+int                     webhdfs_conf_set_low_speed (webhdfs_conf_t *conf,
+                                                   unsigned int bytes_per_sec,
+                                                   unsigned int seconds);
+int                     webhdfs_conf_set_retries  (webhdfs_conf_t *conf,
+                                                   unsigned int retries,
+                                                   unsigned int backoff_ms);
+int                     webhdfs_conf_set_hedged_reads (webhdfs_conf_t *conf,
+                                                   unsigned int min_ms);
+
+/*
+ * Admission control, off by default: at most max_inflight requests per
+ * endpoint, the rest queued by class and admitted weighted-fair (default
+ * weights: interactive 8, read 4, prefetch 1, bulk 2). A class queue
+ * holding max_queued requests (0 = no limit) fails new ones at once.
+ */
+int                     webhdfs_conf_set_admission (webhdfs_conf_t *conf,
+                                                   unsigned int max_inflight,
+                                                   unsigned int max_queued);
+int                     webhdfs_conf_set_class_weight (webhdfs_conf_t *conf,
+                                                   webhdfs_class_t klass,
+                                                   unsigned int weight);
+
+/* How long content summaries are reused (default 1000ms, 0 = never) */
+int                     webhdfs_conf_set_summary_ttl (webhdfs_conf_t *conf,
+                                                   unsigned int ttl_ms);
+
+/* Bandwidth caps in bytes/s for all threads of a connection, 0 = none */
+int                     webhdfs_conf_set_rate_limit (webhdfs_conf_t *conf,
+                                                   size_t read_bytes_per_sec,
+                                                   size_t write_bytes_per_sec);
+
+/* Request tracing - per-thread event rings, dumped as Chrome trace JSON */
+int                     webhdfs_trace_enable      (size_t events_per_thread);
+void                    webhdfs_trace_disable     (void);
+int                     webhdfs_trace_dump        (const char *filename);
+
+/*
+ * WebHDFS File-System
+ *
+ * Concurrency: a webhdfs_t may be shared by any number of threads once
+ * webhdfs_connect() returns, and its webhdfs_conf_t must not change while
+ * it is connected. Each thread lazily gets its own curl handle, so calls
+ * from different threads never serialize on the connection and each
+ * thread keeps its own keep-alive connections. webhdfs_disconnect() must
+ * not race with calls still running on other threads. webhdfs_connect()
+ * may start background threads (token renewal, HA health checks), which
+ * a fork() does not carry over: connect after daemonizing.
+ *
+ * A webhdfs_file_t may also be shared: webhdfs_file_pread() is stateless,
+ * webhdfs_file_read() and webhdfs_file_seek() serialize on the handle's
+ * offset. A webhdfs_dir_t is a single-reader cursor and must not be shared.
+ */
 webhdfs_t *             webhdfs_connect           (const webhdfs_conf_t *conf);
 void                    webhdfs_disconnect        (webhdfs_t *fs);
 
+/* Change the bandwidth caps of a live connection, and see their effect */
+int                     webhdfs_set_rate_limit    (webhdfs_t *fs,
+                                                   size_t read_bytes_per_sec,
+                                                   size_t write_bytes_per_sec);
+void                    webhdfs_get_rate_stats    (webhdfs_t *fs,
+                                                   webhdfs_rate_stats_t *stats);
+
 int                     webhdfs_file_create       (webhdfs_t *fs,
                                                    const char *path,
                                                    int override,
                                                    webhdfs_upload_t upload_f,
                                                    void *upload_data);
+/* Create, then check the server got the bytes sent: 0, 1 or -1 as above */
+int                     webhdfs_file_create_verified (webhdfs_t *fs,
+                                                   const char *path,
+                                                   int override,
+                                                   webhdfs_upload_t upload_f,
+                                                   void *upload_data);
 webhdfs_file_t *        webhdfs_file_open         (webhdfs_t *fs,
                                                    const char *path);
+webhdfs_file_t *        webhdfs_file_open_sized   (webhdfs_t *fs,
+                                                   const char *path,
+                                                   const webhdfs_fstat_t *stat);
+int                     webhdfs_file_size         (webhdfs_file_t *file,
+                                                   size_t *length,
+                                                   size_t *mtime);
+int                     webhdfs_file_prefetch     (webhdfs_file_t *file,
+                                                   size_t offset,
+                                                   size_t length);
+int                     webhdfs_file_prefetch_auto (webhdfs_file_t *file);
+int                     webhdfs_file_set_readahead (webhdfs_file_t *file,
+                                                   size_t max_window);
+/*
+ * Checksum what the handle reads in order from the start (read(), or
+ * pread() at the next offset) and appends, then verify it once at the
+ * end of the file. Out of order reads are ignored; reads that skip data
+ * leave nothing to verify (-1).
+ */
+int                     webhdfs_file_set_verify   (webhdfs_file_t *file,
+                                                   int enable);
+int                     webhdfs_file_verify       (webhdfs_file_t *file);
 int                     webhdfs_file_append       (webhdfs_file_t *file,
                                                    webhdfs_upload_t upload_f,
                                                    void *upload_data);
@@ -101,6 +346,22 @@ webhdfs_fstat_t *      webhdfs_stat               (webhdfs_t *fs,
                                                    char **error);
 void                   webhdfs_fstat_free         (webhdfs_fstat_t *fstat);
 
+int                    webhdfs_content_summary    (webhdfs_t *fs,
+                                                   const char *path,
+                                                   webhdfs_content_summary_t *summary);
+
+/*
+ * Stat n paths concurrently. *results is one allocation holding a result
+ * per path, in the order of paths[], to be released with
+ * webhdfs_stat_many_free(). Returns the number of paths that failed, or
+ * -1 (and no results) when out of memory.
+ */
+int                    webhdfs_stat_many          (webhdfs_t *fs,
+                                                   const char * const *paths,
+                                                   size_t n,
+                                                   webhdfs_stat_result_t **results);
+void                   webhdfs_stat_many_free     (webhdfs_stat_result_t *results);
+
 int                    webhdfs_mkdir              (webhdfs_t *fs,
                                                    const char *path,
                                                    int permission);
@@ -126,13 +387,115 @@ int                    webhdfs_set_replication    (webhdfs_t *fs,
                                                    const char *path,
                                                    int replication);
 
+/* Times in msec since the epoch, -1 leaves one unchanged */
 int                    webhdfs_set_times          (webhdfs_t *fs,
                                                    const char *path,
-                                                   int mtime,
-                                                   int atime);
+                                                   int64_t mtime,
+                                                   int64_t atime);
 
 char *                 webhdfs_home_dir           (webhdfs_t *fs);
 
+/*
+ * File checksums, computed by the datanodes from the CRCs they keep:
+ * nothing is read. Two files compare equal only when written with the
+ * same block size and bytes per CRC.
+ */
+int                    webhdfs_file_checksum      (webhdfs_t *fs,
+                                                   const char *path,
+                                                   webhdfs_file_checksum_t *checksum);
+int                    webhdfs_file_checksum_equal (const webhdfs_file_checksum_t *a,
+                                                   const webhdfs_file_checksum_t *b);
+
+/*
+ * The same checksum (MD5-of-MD5-of-CRC32C) computed by the client from
+ * the bytes it moves, to check an upload or a download against the
+ * server's in one request. webhdfs_crc_verify() returns 0 if they match,
+ * 1 if they do not, -1 if they cannot be compared: the server's failed,
+ * or the cluster uses another algorithm or bytes per CRC than 512.
+ */
+webhdfs_crc_t *        webhdfs_crc_alloc          (void);
+void                   webhdfs_crc_free           (webhdfs_crc_t *crc);
+int                    webhdfs_crc_update         (webhdfs_crc_t *crc,
+                                                   const void *data,
+                                                   size_t nbytes);
+int                    webhdfs_crc_verify         (webhdfs_t *fs,
+                                                   const char *path,
+                                                   const webhdfs_crc_t *crc);
+
+/*
+ * Make dst_path on dst a copy of src_path on src (the same fs will do).
+ * Files whose length and mtime match are skipped; a matching length with
+ * another mtime is settled by comparing checksums. Copies get the mtime
+ * of their source. Files only on dst are left alone. Returns the number
+ * of files that failed, or -1 if the source could not be walked fully.
+ */
+int                    webhdfs_sync               (webhdfs_t *src,
+                                                   const char *src_path,
+                                                   webhdfs_t *dst,
+                                                   const char *dst_path,
+                                                   const webhdfs_sync_opts_t *opts,
+                                                   webhdfs_sync_stats_t *stats);
+
+/*
+ * Walk the tree under root, listing directories concurrently. The
+ * visitor gets every entry (the root's children are at depth 1) and may
+ * be called from several threads at once; stat and path are valid only
+ * during the call. Its return value is a webhdfs_walk_action_t. Returns
+ * the number of directories that could not be listed (fully), -1 if the
+ * visitor stopped the walk, or -2 if it could not start for lack of
+ * memory.
+ */
+int                    webhdfs_walk               (webhdfs_t *fs,
+                                                   const char *root,
+                                                   webhdfs_walk_visitor_t visitor,
+                                                   const webhdfs_walk_opts_t *opts);
+
+/*
+ * Batches of metadata operations. Each webhdfs_batch_<op>() queues one
+ * operation and returns its index (-1 on allocation failure);
+ * webhdfs_batch_exec() runs the queued operations on up to `parallelism'
+ * threads (0 for the default) and returns how many failed. Results are
+ * read back by index: webhdfs_batch_result() gives the status the
+ * single-operation call would have returned (-1 if not run yet), and the
+ * error message of a failed stat. A batch can be added to and run again;
+ * only the new items run. Results stay valid until webhdfs_batch_free().
+ */
+webhdfs_batch_t *      webhdfs_batch_alloc        (webhdfs_t *fs);
+void                   webhdfs_batch_free         (webhdfs_batch_t *batch);
+int                    webhdfs_batch_stat         (webhdfs_batch_t *batch,
+                                                   const char *path);
+int                    webhdfs_batch_mkdir        (webhdfs_batch_t *batch,
+                                                   const char *path,
+                                                   int permission);
+int                    webhdfs_batch_chmod        (webhdfs_batch_t *batch,
+                                                   const char *path,
+                                                   int permission);
+int                    webhdfs_batch_chown        (webhdfs_batch_t *batch,
+                                                   const char *path,
+                                                   const char *user,
+                                                   const char *group);
+int                    webhdfs_batch_set_replication (webhdfs_batch_t *batch,
+                                                   const char *path,
+                                                   int replication);
+int                    webhdfs_batch_set_times    (webhdfs_batch_t *batch,
+                                                   const char *path,
+                                                   int64_t mtime,
+                                                   int64_t atime);
+int                    webhdfs_batch_rename       (webhdfs_batch_t *batch,
+                                                   const char *oldname,
+                                                   const char *newname);
+int                    webhdfs_batch_delete       (webhdfs_batch_t *batch,
+                                                   const char *path,
+                                                   int recursive);
+int                    webhdfs_batch_exec         (webhdfs_batch_t *batch,
+                                                   unsigned int parallelism);
+size_t                 webhdfs_batch_size         (const webhdfs_batch_t *batch);
+int                    webhdfs_batch_result       (const webhdfs_batch_t *batch,
+                                                   size_t index,
+                                                   const char **error);
+const webhdfs_fstat_t *webhdfs_batch_fstat        (const webhdfs_batch_t *batch,
+                                                   size_t index);
+
 int                    webhdfs_create_snapshot    (webhdfs_t *fs,
                                                    const char *path,
                                                    const char *name);
@@ -146,6 +509,41 @@ int                    webhdfs_rename_snapshot    (webhdfs_t *fs,
                                                    const char *oldname,
                                                    const char *newname);
 
+/*
+ * GETSNAPSHOTDIFF of the snapshottable directory path, from snapshot
+ * from to snapshot to (NULL or "" for the current state). Entries are
+ * read one at a time and stay valid until the next read. Paths of
+ * created, modified and deleted entries, and rename sources, are those
+ * of the earlier snapshot: anything under a renamed directory is listed
+ * under its old name.
+ */
+webhdfs_snapshot_diff_t *webhdfs_snapshot_diff    (webhdfs_t *fs,
+                                                   const char *path,
+                                                   const char *from,
+                                                   const char *to);
+const webhdfs_diff_entry_t *webhdfs_snapshot_diff_read (webhdfs_snapshot_diff_t *diff);
+void                   webhdfs_snapshot_diff_close (webhdfs_snapshot_diff_t *diff);
+
+/*
+ * Apply the changes from snapshot from to snapshot to of src_path (the
+ * current state if to is NULL or "") to dst_path, which must hold a
+ * snapshot named from and nothing changed since. Deletes and renames
+ * are replayed; created and modified files are copied as webhdfs_sync()
+ * would, from the to snapshot. The work done depends on the size of the
+ * diff, not of the tree. On success dst_path gets a snapshot named to,
+ * ready for the next run. Returns the number of failures, or -1 if the
+ * diff could not be had, the destination changed, or a crashed run left
+ * its scratch directory (dst_path/.webhdfs-sync) behind.
+ */
+int                    webhdfs_snapshot_sync      (webhdfs_t *src,
+                                                   const char *src_path,
+                                                   const char *from,
+                                                   const char *to,
+                                                   webhdfs_t *dst,
+                                                   const char *dst_path,
+                                                   const webhdfs_sync_opts_t *opts,
+                                                   webhdfs_sync_stats_t *stats);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif /* __cplusplus */
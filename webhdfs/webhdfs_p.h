@@ -19,7 +19,9 @@
 #ifndef _WEBHDFS_PRIVATE_H_
 #define _WEBHDFS_PRIVATE_H_
 
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 
 #include <yajl/yajl_tree.h>
 
@@ -27,26 +29,230 @@
 #include "buffer.h"
 
 typedef struct webhdfs_req webhdfs_req_t;
+typedef struct webhdfs_curl webhdfs_curl_t;
+typedef struct webhdfs_flight webhdfs_flight_t;
+typedef struct webhdfs_task webhdfs_task_t;
+typedef struct webhdfs_extent webhdfs_extent_t;
+typedef struct webhdfs_endpoint webhdfs_endpoint_t;
 
+typedef void (*webhdfs_task_func_t) (void *data);
+typedef void (*webhdfs_parallel_func_t) (void *data, size_t index);
+
+#define WEBHDFS_WORKERS             (4)     /* background request threads */
+#define WEBHDFS_FILE_EXTENTS        (8)     /* background ranges per file */
+#define WEBHDFS_READAHEAD_MIN       (128 << 10)
+#define WEBHDFS_TTFB_SAMPLES        (256)   /* reads behind the hedge p95 */
+#define WEBHDFS_BACKOFF_MAX_MS      (10000)
+#define WEBHDFS_PROBE_INTERVAL_MS   (5000)  /* endpoint health checks */
+#define WEBHDFS_PROBE_TIMEOUT_MS    (2000)
+#define WEBHDFS_EJECT_MS            (10000) /* unhealthy gateway left out */
+#define WEBHDFS_EJECT_FAILURES      (3)     /* consecutive failures to eject */
+
+#define WEBHDFS_TOKEN_RETRY_MS      (30000) /* after a failed token renewal */
+
+#define WEBHDFS_CLASSES             (4)     /* webhdfs_class_t */
+#define WEBHDFS_WORKER_QUEUE_MAX    (64)    /* background tasks waiting */
+#define WEBHDFS_PARALLEL_THREADS    (16)    /* batch threads by default */
+#define WEBHDFS_SUMMARY_CACHE       (64)    /* content summaries kept */
+#define WEBHDFS_BYTES_PER_CRC       (512)   /* dfs.bytes-per-checksum default */
+
+/* Ordered by preference when failing over */
+enum webhdfs_endpoint_state {
+    WEBHDFS_ENDPOINT_UP,
+    WEBHDFS_ENDPOINT_STANDBY,
+    WEBHDFS_ENDPOINT_DOWN,
+};
+
+/* Bandwidth limit of one direction, see throttle.c */
+typedef struct webhdfs_bucket {
+    pthread_mutex_t lock;
+    uint64_t        rate;           /* bytes/s, 0 = unlimited */
+    uint64_t        burst;
+    int64_t         tokens;         /* negative: booked by sleepers */
+    uint64_t        last_us;
+    uint64_t        bytes;          /* moved, limited or not */
+    uint64_t        paused;         /* times a transfer had to wait */
+    uint64_t        wait_us;        /* ...and for how long in all */
+} webhdfs_bucket_t;
+
+enum webhdfs_bucket_dir {
+    WEBHDFS_BUCKET_READ,
+    WEBHDFS_BUCKET_WRITE,
+};
+
+/* A content summary and when it was asked for, see summary.c */
+typedef struct webhdfs_summary_entry {
+    char *   path;
+    uint64_t fetched_us;
+    webhdfs_content_summary_t summary;
+} webhdfs_summary_entry_t;
+
+typedef struct webhdfs_md5 {
+    uint32_t        state[4];
+    uint64_t        bytes;
+    unsigned char   buffer[64];
+} webhdfs_md5_t;
+
+/*
+ * A file checksum being computed from the data, see checksum.c. Block
+ * boundaries are only known at the end, so it keeps one crc per chunk
+ * (4 bytes per WEBHDFS_BYTES_PER_CRC) until then.
+ */
+struct webhdfs_crc {
+    uint32_t *      crcs;           /* of the complete chunks */
+    size_t          ncrcs;
+    size_t          size;
+    uint32_t        crc;            /* of the chunk being filled */
+    size_t          fill;
+    uint64_t        bytes;
+    int             eof;            /* a read found the end of the file */
+    int             broken;         /* data went by unseen, cannot verify */
+};
+
+/* Requests of one class waiting for an endpoint, see admission.c */
+typedef struct webhdfs_lane {
+    pthread_cond_t  cond;
+    uint64_t        tickets;        /* handed out to waiters */
+    uint64_t        granted;        /* tickets below this are admitted */
+    uint64_t        pass;           /* stride scheduling position */
+} webhdfs_lane_t;
+
+/* A namenode or gateway of the configuration, see endpoint.c */
+struct webhdfs_endpoint {
+    const char *    host;           /* owned by the conf */
+    int             port;
+    volatile int    state;
+    volatile int    outstanding;    /* requests in flight */
+    volatile int    failures;       /* consecutive */
+    volatile uint64_t ewma_us;      /* request latency */
+    volatile uint64_t ejected_until_us;
+    unsigned int    admitted;       /* requests holding a slot (admit_lock) */
+    uint64_t        vtime;          /* pass of the last admission */
+    webhdfs_lane_t  lanes[WEBHDFS_CLASSES];
+};
+
+/*
+ * A webhdfs_t is shared by all threads. Everything mutable hangs off a
+ * lock or is per-thread: each thread gets its own curl handle (and so
+ * its own keep-alive connections) through curl_key.
+ */
 struct webhdfs {
     const webhdfs_conf_t *conf;
+    pthread_key_t   curl_key;
+    pthread_mutex_t lock;           /* protects curls */
+    webhdfs_curl_t *curls;          /* every handle, freed on disconnect */
+    volatile int    no_list_batch;  /* server has no LISTSTATUS_BATCH, atomic */
+    pthread_mutex_t flight_lock;    /* protects flights */
+    pthread_cond_t  flight_cond;
+    webhdfs_flight_t *flights;      /* GETs in flight, see request.c */
+    pthread_mutex_t work_lock;      /* protects the worker pool below */
+    pthread_cond_t  work_cond;
+    webhdfs_task_t *tasks;          /* queued background work, see worker.c */
+    webhdfs_task_t *tasks_tail;
+    int             ntasks;         /* queued, up to WEBHDFS_WORKER_QUEUE_MAX */
+    pthread_t       workers[WEBHDFS_WORKERS];
+    int             nworkers;
+    int             work_stop;
+    pthread_mutex_t ttfb_lock;      /* protects the read latency samples */
+    uint32_t        ttfb_us[WEBHDFS_TTFB_SAMPLES];
+    uint64_t        ttfb_count;
+    uint64_t        hedge_us;       /* p95 of ttfb_us, 0 until enough samples */
+    webhdfs_endpoint_t *endpoints;  /* hdfs_host, then conf->hosts */
+    int             nendpoints;
+    volatile int    active;         /* endpoint every request starts on */
+    unsigned int    next_pick;      /* rotates the balancer's tie breaks */
+    pthread_t       monitor;        /* probes endpoints, if more than one */
+    int             monitor_running;
+    int             monitor_stop;
+    pthread_mutex_t monitor_lock;
+    pthread_cond_t  monitor_cond;
+    pthread_mutex_t admit_lock;     /* protects admission state of endpoints */
+    webhdfs_bucket_t buckets[2];    /* read and write limits */
+    pthread_rwlock_t token_lock;    /* protects the token fields */
+    char *          token;          /* delegation token, NULL = user.name */
+    uint64_t        token_expires_ms;
+    uint64_t        token_lifetime_ms;
+    pthread_t       renewer;        /* renews the token, see token.c */
+    int             renewer_running;
+    int             renewer_stop;
+    int             renew_now;      /* token rejected: get a new one */
+    pthread_mutex_t renewer_lock;
+    pthread_cond_t  renewer_cond;
+    pthread_mutex_t summary_lock;   /* protects summaries */
+    webhdfs_summary_entry_t summaries[WEBHDFS_SUMMARY_CACHE];
+};
+
+/* One in-flight GET; identical requests wait for it instead */
+struct webhdfs_flight {
+    webhdfs_flight_t *next;
+    char *          url;
+    int             waiters;
+    int             done;
+    int             err;
+    int             rcode;
+    buffer_t        response;
+};
+
+struct webhdfs_curl {
+    webhdfs_curl_t *next;
+    webhdfs_curl_t *prev;
+    webhdfs_t *     fs;
+    void *          curl;           /* CURL * */
+    void *          hedge;          /* CURL *, second leg of hedged reads */
+    void *          multi;          /* CURLM *, drives both legs */
 };
 
 struct webhdfs_conf {
     char *token;            /* delegation token */
+    char *token_cache;      /* file keeping fetched tokens across restarts */
+    int   delegation;       /* fetch and renew delegation tokens */
     char *doas;             /* proxy user */
     char *hdfs_user;             /* hdfs user */
     char *hdfs_host;
+    char **hosts;           /* more namenodes (HA), with their ports */
+    int  *ports;
+    int   nhosts;
     int   use_ssl;
     int   webhdfs_port;
     int   hdfs_port;
+    unsigned int slow_request_ms;   /* log requests slower than this (0 = off) */
+    int   single_flight;    /* coalesce identical in-flight GETs (default off) */
+    size_t prefetch_small;  /* fetch files up to this size whole at open */
+    size_t prefetch_tail;   /* fetch this much of the tail at open... */
+    char *prefetch_patterns;    /* ...of files matching these (comma separated) */
+    size_t readahead_max;   /* default readahead window cap (0 = off) */
+    unsigned int connect_timeout_ms;
+    unsigned int request_timeout_ms;    /* whole request, uploads excepted */
+    unsigned int low_speed_limit;   /* abort below this many bytes/s... */
+    unsigned int low_speed_time;    /* ...sustained for this many seconds */
+    unsigned int retries;           /* extra attempts for idempotent ops */
+    unsigned int retry_backoff_ms;  /* first backoff, doubles per attempt */
+    unsigned int hedge_min_ms;      /* hedged read threshold floor (0 = off) */
+    int   endpoint_policy;  /* webhdfs_endpoint_policy_t */
+    unsigned int max_inflight;      /* per endpoint (0 = no admission control) */
+    unsigned int max_queued;        /* per class and endpoint (0 = unbounded) */
+    unsigned int class_weights[WEBHDFS_CLASSES];  /* 0 = default */
+    size_t read_rate;               /* bytes/s at connect (0 = unlimited) */
+    size_t write_rate;
+    unsigned int summary_ttl_ms;    /* content summaries reused (0 = never) */
 };
 
 struct webhdfs_req {
+    webhdfs_t *fs;
+    const char *path;
+    char     op[24];            /* WebHDFS op name, taken from the args */
     webhdfs_upload_t upload;    /* Upload function used by put */
     void *   upload_data;       /* Upload user data */
     buffer_t buffer;            /* Internal buffer used for url & data */
+    uint64_t xfer_bytes;        /* Bytes moved by the transfer callbacks */
+    uint64_t deadline_us;       /* request timeout under a read limit, 0 = none */
     int      rcode;             /* Response code */
+    int      curl_err;          /* CURLcode of the last transfer */
+    int      redirected;        /* the namenode answered with a redirect */
+    int      endpoint;          /* index in fs->endpoints */
+    int      turned_away;       /* admission queue full, nothing sent */
+    int      admitted_on;       /* endpoint whose admission slot we hold, -1 */
+    size_t   url_prefix;        /* length of "scheme://host:port" in the url */
 };
 
 enum webhdfs_req_type {
@@ -56,28 +262,174 @@ enum webhdfs_req_type {
     WEBHDFS_REQ_DELETE,
 };
 
+typedef struct webhdfs_trace_event {
+    uint64_t begin_us;          /* monotonic clock */
+    uint64_t end_us;            /* 0 while the request is in flight */
+    uint64_t namenode_us;       /* time spent before the redirect */
+    uint64_t datanode_us;       /* time spent after the redirect */
+    uint64_t bytes;             /* uploaded + downloaded */
+    int      status;
+    int      tid;
+    char     op[24];
+    char     path[128];
+    char     redirect[64];      /* host:port of the redirect target */
+} webhdfs_trace_event_t;
+
+extern volatile int __webhdfs_trace_enabled;
+
+#define webhdfs_trace_active()      (__webhdfs_trace_enabled)
+
+/*
+ * A listing is read one LISTSTATUS_BATCH page at a time: only the
+ * current page is held, the next one is fetched (startAfter the last
+ * name) when it runs out. fs is NULL for a single, complete page.
+ */
 struct webhdfs_dir {
     webhdfs_fstat_t stat;
     yajl_val statuses;
     yajl_val root;
     size_t   current;
+    webhdfs_t *fs;
+    char *   path;
+    size_t   remaining;         /* entries left on the server */
+    int      error;             /* a page failed: the listing is cut short */
+};
+
+struct webhdfs_snapshot_diff {
+    webhdfs_diff_entry_t entry;
+    yajl_val list;              /* diffList, inside root */
+    yajl_val root;
+    size_t   current;
+};
+
+/* A range of a file fetched in the background, see file.c */
+struct webhdfs_extent {
+    webhdfs_file_t *file;
+    size_t   offset;
+    size_t   length;            /* requested */
+    size_t   size;              /* received, valid once done */
+    uint64_t seq;               /* insertion order, oldest is evicted */
+    uint64_t appends;           /* file->appends when it was requested */
+    int      done;
+    int      failed;            /* cut short: covers nothing */
+    char *   data;
 };
 
 struct webhdfs_file {
     webhdfs_t *fs;
     char *     path;
+    pthread_mutex_t lock;       /* protects offset for read/seek */
     size_t     offset;
+    int        sized;           /* length/mtime known (open_sized) */
+    size_t     length;          /* updated atomically by appends */
+    size_t     mtime;
+    pthread_mutex_t cache_lock; /* protects the extents below */
+    pthread_cond_t  cache_cond; /* signalled when an extent completes */
+    webhdfs_extent_t *extents[WEBHDFS_FILE_EXTENTS];
+    uint64_t   extent_seq;
+    uint64_t   appends;         /* appends through this handle, under cache_lock */
+    int        pending;         /* extents still being fetched */
+    size_t     ra_max;          /* readahead window cap (0 = off), under lock */
+    size_t     ra_window;       /* current window, grows while sequential */
+    size_t     ra_next;         /* first byte not yet requested ahead */
+    size_t     ra_last;         /* where the previous read() ended */
+    volatile int endpoint;      /* gateway reads stick to, -1 = none, atomic */
+    pthread_mutex_t crc_lock;   /* protects crc, set and tested atomically */
+    webhdfs_crc_t *crc;         /* set_verify: checksum of what went by */
 };
 
+void *   webhdfs_curl_get                 (webhdfs_t *fs);
+void     webhdfs_curl_release             (webhdfs_t *fs);
+void     webhdfs_curl_destructor          (void *value);
+void     webhdfs_curl_free_all            (webhdfs_t *fs);
+
+int      webhdfs_worker_submit            (webhdfs_t *fs,
+                                           webhdfs_task_func_t func,
+                                           void *data);
+void     webhdfs_worker_stop              (webhdfs_t *fs);
+int      webhdfs_worker_self              (void);
+
+int      webhdfs_parallel                 (webhdfs_t *fs,
+                                           size_t count,
+                                           unsigned int threads,
+                                           webhdfs_parallel_func_t func,
+                                           void *data);
+int      webhdfs_parallel_self            (void);
+
+void     webhdfs_admission_open           (webhdfs_t *fs);
+void     webhdfs_admission_close          (webhdfs_t *fs);
+int      webhdfs_admission_enter          (webhdfs_t *fs,
+                                           int endpoint,
+                                           int klass);
+void     webhdfs_admission_leave          (webhdfs_t *fs,
+                                           int endpoint);
+
+int      webhdfs_endpoints_open           (webhdfs_t *fs);
+int      webhdfs_endpoints_start          (webhdfs_t *fs);
+void     webhdfs_endpoints_close          (webhdfs_t *fs);
+int      webhdfs_endpoint_active          (webhdfs_t *fs);
+int      webhdfs_endpoint_pick            (webhdfs_t *fs,
+                                           int sticky);
+int      webhdfs_endpoint_failed          (webhdfs_t *fs,
+                                           int endpoint,
+                                           int state);
+void     webhdfs_endpoint_begin           (webhdfs_t *fs,
+                                           int endpoint);
+void     webhdfs_endpoint_end             (webhdfs_t *fs,
+                                           int endpoint,
+                                           uint64_t usec,
+                                           int failed);
+
+void     webhdfs_summary_close            (webhdfs_t *fs);
+
+uint32_t webhdfs_crc32c                   (uint32_t crc,
+                                           const void *data,
+                                           size_t n);
+void     webhdfs_crc32c_chunks            (const void *data,
+                                           size_t chunk,
+                                           size_t n,
+                                           uint32_t *crcs);
+const char *webhdfs_crc32c_impl           (void);
+
+void     webhdfs_md5_init                 (webhdfs_md5_t *md5);
+void     webhdfs_md5_update               (webhdfs_md5_t *md5,
+                                           const void *data,
+                                           size_t n);
+void     webhdfs_md5_final                (webhdfs_md5_t *md5,
+                                           unsigned char digest[16]);
+
+void     webhdfs_throttle_open            (webhdfs_t *fs);
+void     webhdfs_throttle_close           (webhdfs_t *fs);
+uint64_t webhdfs_throttle                 (webhdfs_t *fs,
+                                           int direction,
+                                           size_t nbytes);
+
+int      webhdfs_token_open               (webhdfs_t *fs);
+int      webhdfs_token_start              (webhdfs_t *fs);
+void     webhdfs_token_close              (webhdfs_t *fs);
+int      webhdfs_token_append_auth        (webhdfs_t *fs,
+                                           buffer_t *buffer);
+void     webhdfs_token_invalid            (webhdfs_t *fs);
+
 int      webhdfs_req_open                 (webhdfs_req_t *req,
                                            webhdfs_t *fs,
                                            const char *path);
+int      webhdfs_req_open_user            (webhdfs_req_t *req,
+                                           webhdfs_t *fs,
+                                           const char *path);
+int      webhdfs_req_open_endpoint        (webhdfs_req_t *req,
+                                           webhdfs_t *fs,
+                                           const char *path,
+                                           int sticky);
 void     webhdfs_req_close                (webhdfs_req_t *req);
 void     webhdfs_req_free                 (webhdfs_req_t *req);
 
 int      webhdfs_req_set_args             (webhdfs_req_t *req,
                                            const char *frmt,
                                            ...);
+int      webhdfs_req_set_arg_escaped      (webhdfs_req_t *req,
+                                           const char *name,
+                                           const char *value);
 int      webhdfs_req_set_upload           (webhdfs_req_t *req,
                                            webhdfs_upload_t func,
                                            void *user_data);
@@ -85,6 +437,22 @@ int      webhdfs_req_exec                 (webhdfs_req_t *req,
                                            int type);
 
 yajl_val webhdfs_req_json_response        (webhdfs_req_t *req);
+size_t   webhdfs_buffer_write             (void *ptr,
+                                           size_t size,
+                                           size_t nitems,
+                                           void *buffer);
+
+void     webhdfs_fstat_decode             (webhdfs_fstat_t *stat,
+                                           yajl_val node,
+                                           int copy);
+webhdfs_dir_t *webhdfs_dir_from_response  (yajl_val node);
+
+uint64_t webhdfs_trace_now                (void);
+void *   webhdfs_trace_begin              (const webhdfs_req_t *req,
+                                           uint64_t begin_us);
+void     webhdfs_trace_end                (void *slot,
+                                           const webhdfs_trace_event_t *event);
+void     webhdfs_trace_slow_log           (const webhdfs_trace_event_t *event);
 
 yajl_val webhdfs_response_exception       (yajl_val node);
 yajl_val webhdfs_response_boolean         (yajl_val node);
@@ -92,9 +460,15 @@ yajl_val webhdfs_response_content_summary (yajl_val node);
 yajl_val webhdfs_response_file_checksum   (yajl_val node);
 yajl_val webhdfs_response_file_status     (yajl_val node);
 yajl_val webhdfs_response_file_statuses   (yajl_val node);
+yajl_val webhdfs_response_directory_listing (yajl_val node);
 yajl_val webhdfs_response_token           (yajl_val node);
 yajl_val webhdfs_response_path            (yajl_val node);
+yajl_val webhdfs_response_snapshot_diff_report (yajl_val node);
 yajl_val webhdfs_response_long            (yajl_val node);
+int      webhdfs_response_is_standby      (int rcode,
+                                           const buffer_t *body);
+int      webhdfs_response_is_invalid_token (int rcode,
+                                           const buffer_t *body);
 
 
 #endif /* !_WEBHDFS_PRIVATE_H_ */
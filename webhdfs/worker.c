@@ -0,0 +1,125 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "webhdfs_p.h"
+#include "webhdfs.h"
+
+/*
+ * Background requests (prefetch, readahead) run on a small pool of
+ * threads owned by the webhdfs_t. The pool starts on the first submit
+ * and is joined by webhdfs_disconnect(). Workers are ordinary callers:
+ * each gets its own curl handle through curl_key. Their requests are
+ * admitted as WEBHDFS_CLASS_PREFETCH, and a full queue refuses more
+ * work: the caller skips that prefetch rather than queueing it behind
+ * ones that are already late.
+ */
+struct webhdfs_task {
+    webhdfs_task_t *next;
+    webhdfs_task_func_t func;
+    void *data;
+};
+
+static __thread int __webhdfs_worker_self;
+
+int webhdfs_worker_self (void) {
+    return(__webhdfs_worker_self);
+}
+
+static void *__webhdfs_worker (void *data) {
+    webhdfs_t *fs = (webhdfs_t *)data;
+    webhdfs_task_t *task;
+
+    __webhdfs_worker_self = 1;
+
+    pthread_mutex_lock(&(fs->work_lock));
+    for (;;) {
+        while (fs->tasks == NULL && !fs->work_stop)
+            pthread_cond_wait(&(fs->work_cond), &(fs->work_lock));
+
+        /* Pending tasks still run on stop: their owners wait for them */
+        if ((task = fs->tasks) == NULL)
+            break;
+
+        if ((fs->tasks = task->next) == NULL)
+            fs->tasks_tail = NULL;
+        fs->ntasks--;
+        pthread_mutex_unlock(&(fs->work_lock));
+
+        task->func(task->data);
+        free(task);
+
+        pthread_mutex_lock(&(fs->work_lock));
+    }
+    pthread_mutex_unlock(&(fs->work_lock));
+
+    return(NULL);
+}
+
+int webhdfs_worker_submit (webhdfs_t *fs,
+                           webhdfs_task_func_t func,
+                           void *data)
+{
+    webhdfs_task_t *task;
+
+    if ((task = (webhdfs_task_t *) malloc(sizeof(webhdfs_task_t))) == NULL)
+        return(1);
+
+    task->next = NULL;
+    task->func = func;
+    task->data = data;
+
+    pthread_mutex_lock(&(fs->work_lock));
+    while (fs->nworkers < WEBHDFS_WORKERS) {
+        if (pthread_create(&(fs->workers[fs->nworkers]), NULL, __webhdfs_worker, fs))
+            break;
+        fs->nworkers++;
+    }
+
+    if (fs->nworkers == 0 || fs->work_stop || fs->ntasks >= WEBHDFS_WORKER_QUEUE_MAX) {
+        pthread_mutex_unlock(&(fs->work_lock));
+        free(task);
+        return(1);
+    }
+
+    if (fs->tasks_tail != NULL)
+        fs->tasks_tail->next = task;
+    else
+        fs->tasks = task;
+    fs->tasks_tail = task;
+    fs->ntasks++;
+
+    pthread_cond_signal(&(fs->work_cond));
+    pthread_mutex_unlock(&(fs->work_lock));
+    return(0);
+}
+
+void webhdfs_worker_stop (webhdfs_t *fs) {
+    int i;
+
+    pthread_mutex_lock(&(fs->work_lock));
+    fs->work_stop = 1;
+    pthread_cond_broadcast(&(fs->work_cond));
+    pthread_mutex_unlock(&(fs->work_lock));
+
+    for (i = 0; i < fs->nworkers; ++i)
+        pthread_join(fs->workers[i], NULL);
+    fs->nworkers = 0;
+}